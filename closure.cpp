@@ -0,0 +1,95 @@
+#include "vm.hpp"
+#include "as.hpp"
+#include "stackmap.hpp"
+#include "timer.hpp"
+
+#include <vector>
+#include <iostream>
+
+static as::line lit(vm::integer value) { return vm::word(value); }
+
+// builds chains of n closures capturing (i, previous), restarting a new chain
+// every `length` iterations, then sums the last chain by calling it
+static std::vector<as::line> chains(vm::integer n, vm::integer length) {
+  const as::label loop = as::make_label("loop");
+  const as::label keep = as::make_label("keep");
+  const as::label done = as::make_label("done");
+  const as::label nil = as::make_label("nil");
+  const as::label node = as::make_label("node");
+
+  return {
+    // i, chain
+    vm::push, lit(0),
+    vm::makec, lit(1), lit(0), nil,
+
+    {loop, vm::load}, lit(0),
+    vm::push, lit(n),
+    vm::cmp<vm::ge>,
+    vm::jnz, done,
+
+    vm::push, lit(length),
+    vm::load, lit(0),
+    vm::op<vm::mod>,
+    vm::jnz, keep,
+
+    vm::makec, lit(1), lit(0), nil,
+    vm::store, lit(1),
+
+    {keep, vm::load}, lit(1),
+    vm::load, lit(0),
+    vm::makec, lit(1), lit(2), node,
+    vm::store, lit(1),
+
+    vm::push, lit(1),
+    vm::load, lit(0),
+    vm::op<vm::add>,
+    vm::store, lit(0),
+    vm::jmp, loop,
+
+    {done, vm::load}, lit(1),
+    vm::callc, lit(1),
+    vm::store, lit(0),
+    vm::ret,
+
+    // nil() = 0
+    {nil, vm::push}, lit(0),
+    vm::ret,
+
+    // node() = i + previous()
+    {node, vm::loadc}, lit(1),
+    vm::callc, lit(1),
+    vm::loadc, lit(0),
+    vm::op<vm::add>,
+    vm::ret,
+  };
+}
+
+
+int main(int, char**) {
+  static constexpr std::size_t size = 1 << 16;
+  static vm::word stack[size];
+
+  const auto listing = chains(10000000, 1000);
+  const auto prog = as::link(listing);
+  const vm::stack_map maps = stackmap::resolve(stackmap::compute(listing),
+                                               prog.data());
+
+  vm::integer result;
+  std::cout << "unmanaged: " << with_time([&] {
+    result = vm::eval(prog.data(), stack).value;
+  }) << " (" << result << ")" << std::endl;
+
+  vm::heap heap(maps);
+  const vm::heap::scope lock(heap);
+
+  std::cout << "managed: " << with_time([&] {
+    result = vm::eval(prog.data(), stack).value;
+  }) << " (" << result << ")" << std::endl;
+
+  std::cout << "allocated: " << heap.info.allocated
+            << ", promoted: " << heap.info.promoted
+            << ", minor: " << heap.info.minor
+            << ", major: " << heap.info.major << std::endl;
+
+  return 0;
+}
@@ -1,7 +1,10 @@
 #include "gc.hpp"
 
+#include "timer.hpp"
+
 #include <iostream>
 #include <vector>
+#include <algorithm>
 
 namespace foo {
 
@@ -59,7 +62,58 @@ int main(int, char**) {
 
   // empty root set
   collect();
-  
+
+  // large heap: compare full collection pause with bounded incremental steps
+  {
+    static constexpr std::size_t size = 1000000;
+
+    const auto build = [&] {
+      gc<bar> list;
+      for(std::size_t i = 0; i < size; ++i) {
+        gc<bar> head = make_gc<bar>();
+        head->derp = list;
+        list = head;
+      }
+      return list;
+    };
+
+    // keep half of the list alive
+    const auto half = [&](gc<bar> list) {
+      for(std::size_t i = 0; i < size / 2; ++i) list = list->derp;
+      return list;
+    };
+
+    std::clog.setstate(std::ios_base::failbit);
+
+    gc<bar> live = half(build());
+    roots.push_back(live);
+    const double full = with_time([&] { collect(); });
+
+    roots.clear();
+    live = half(build());
+
+    object::begin();
+    live.mark();
+
+    std::size_t steps = 0;
+    double pause = 0;
+    bool done = false;
+    while(!done) {
+      pause = std::max(pause, with_time([&] { done = object::step(10000); }));
+      ++steps;
+
+      // mutator work between steps goes through the write barrier
+      gc<bar> tmp = make_gc<bar>();
+      tmp->derp = live;
+      live = tmp;
+    }
+
+    std::clog.clear();
+    std::clog << "full collection pause: " << full << std::endl;
+    std::clog << "incremental: " << steps << " steps, max pause: " << pause
+              << std::endl;
+  }
+
   return 0;
 }
 
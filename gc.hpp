@@ -3,47 +3,200 @@
 
 #include <utility>
 #include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <new>
 
 
-// a simple mark & sweep object base
+// size-segregated free lists for small objects. chunks are never returned to
+// the system.
+class freelist {
+  static constexpr std::size_t granularity = 16;
+  static constexpr std::size_t classes = 16;
+  static constexpr std::size_t chunk = 1 << 16;
+
+  struct node {
+    node* next;
+  };
+
+  static node*& head(std::size_t index) {
+    static node* heads[classes] = {};
+    return heads[index];
+  }
+
+  static std::size_t index(std::size_t size) {
+    return (size + granularity - 1) / granularity - 1;
+  }
+
+  static void refill(std::size_t index) {
+    const std::size_t size = (index + 1) * granularity;
+    char* block = static_cast<char*>(::operator new(chunk));
+
+    node*& first = head(index);
+    for(std::size_t offset = 0; offset + size <= chunk; offset += size) {
+      node* it = reinterpret_cast<node*>(block + offset);
+      it->next = first;
+      first = it;
+    }
+  }
+
+public:
+  static void* allocate(std::size_t size) {
+    if(size > granularity * classes) return ::operator new(size);
+
+    const std::size_t i = index(size);
+    if(!head(i)) refill(i);
+
+    node* result = head(i);
+    head(i) = result->next;
+    return result;
+  }
+
+  static void deallocate(void* ptr, std::size_t size) {
+    if(size > granularity * classes) return ::operator delete(ptr);
+
+    node* it = static_cast<node*>(ptr);
+    it->next = head(index(size));
+    head(index(size)) = it;
+  }
+};
+
+
+// an incremental tri-color mark & sweep object base. white objects are not
+// (yet) reached, grey objects are reached but their children remain to be
+// traversed, black objects are done. the collector is either idle, marking or
+// sweeping: marking uses an explicit mark stack, and a snapshot-at-the-beginning
+// write barrier on gc pointer assignment keeps it correct while the mutator
+// runs between steps.
 class object {
   static object* start;
-  
-  // we hide the mark flag in the low order bits of next, since malloc generally
-  // provides sufficently aligned pointers
-  using mask_type = std::uintptr_t;
-  static constexpr mask_type mask = mask_type(-1) << 1;
 
+public:
+  enum color_type : std::uint8_t { WHITE, GREY, BLACK };
+  enum phase_type : std::uint8_t { IDLE, MARK, SWEEP };
+
+private:
   object* next;
+  color_type color;
+
+  static phase_type& phase() {
+    static phase_type value = IDLE;
+    return value;
+  }
+
+  // grey objects
+  static std::vector<object*>& stack() {
+    static std::vector<object*> value;
+    return value;
+  }
+
+  // objects remaining to be swept
+  static object*& sweeping() {
+    static object* value = nullptr;
+    return value;
+  }
+
+  // traverse at most budget grey objects, return true when done
+  static bool mark_step(std::size_t& budget) {
+    auto& stack = object::stack();
+    while(stack.size()) {
+      if(!budget) return false;
+      --budget;
+
+      object* obj = stack.back();
+      stack.pop_back();
+
+      obj->traverse();
+      obj->color = BLACK;
+    }
+
+    return true;
+  }
+
+  // sweep at most budget objects, return true when done
+  static bool sweep_step(std::size_t& budget) {
+    object*& obj = sweeping();
+    while(obj) {
+      if(!budget) return false;
+      --budget;
+
+      object* current = obj;
+      obj = current->next;
+
+      if(current->color != WHITE) {
+        // survivor: back to the live list for next cycle
+        current->color = WHITE;
+        current->next = start;
+        start = current;
+      } else {
+        delete current;
+      }
+    }
+
+    return true;
+  }
+
 public:
+  inline void mark() {
+    if(color != WHITE) return;
+    color = GREY;
+    stack().push_back(this);
+  }
+
+  inline bool marked() const { return color != WHITE; }
+
+  // objects allocated while marking are black, so they survive the cycle
+  inline object(): next(start), color(phase() == MARK ? BLACK : WHITE) {
+    start = this;
+  }
 
-  inline void mark() { reinterpret_cast<mask_type&>(next) |= ~mask; }
-  inline void clear() { reinterpret_cast<mask_type&>(next) &= mask; }
-  
-  inline bool marked() const { return mask_type(next) & ~mask; }
-  
-  inline object() : next(start) { start = this; }
-  
   virtual ~object() { }
-  
-  static void sweep() {
-    object** obj = &start;
 
-    while(*obj) {
-      // note: next is never accessed while the marked flag is set
+  static void* operator new(std::size_t size) {
+    return freelist::allocate(size);
+  }
 
-      if( (*obj)->marked() ) {
-        // clear & move on
-        (*obj)->clear();
-        obj = &(*obj)->next;
-        
-      } else {
-        // plug hole & delete
-        object* to_delete = *obj;
-        *obj = to_delete->next;
-        
-        delete to_delete;
-      } 
+  static void operator delete(void* ptr, std::size_t size) {
+    freelist::deallocate(ptr, size);
+  }
+
+  static phase_type state() { return phase(); }
+  static bool marking() { return phase() == MARK; }
+
+  // start a collection cycle: roots should be marked right after
+  static void begin() {
+    if(phase() != IDLE) return;
+    phase() = MARK;
+  }
+
+  // perform a bounded amount of work (objects traversed or swept), return
+  // true when the collection cycle is over
+  static bool step(std::size_t budget) {
+    switch(phase()) {
+    case IDLE:
+      return true;
+    case MARK:
+      if(!mark_step(budget)) return false;
+
+      // detach live list: objects allocated from now on are not swept
+      sweeping() = start;
+      start = nullptr;
+      phase() = SWEEP;
+      // fallthrough
+    case SWEEP:
+      if(!sweep_step(budget)) return false;
+
+      phase() = IDLE;
+      return true;
+    }
+
+    return true;
+  }
+
+  // finish marking and sweep everything in one go
+  static void sweep() {
+    if(phase() == IDLE) phase() = MARK;
+    while(!step(std::size_t(-1))) {
     }
   }
 
@@ -62,17 +215,25 @@ class gc_base {
 protected:
   object* obj;
   gc_base(object* obj) : obj(obj) { }
-  
+
 public:
   explicit operator bool() const { return obj; }
   bool operator==(const gc_base& other) const { return obj == other.obj; }
 
   gc_base() : obj(nullptr) { }
+  gc_base(const gc_base&) = default;
 
+  // write barrier: while marking, overwritten pointees are shaded so that
+  // everything reachable when the cycle began gets marked
+  gc_base& operator=(const gc_base& other) {
+    if(object::marking()) mark();
+    obj = other.obj;
+    return *this;
+  }
+
+  // shade pointee grey, its children are traversed by the collector
   void mark() const {
-    if(!obj || obj->marked()) return;
-    obj->mark();
-    obj->traverse();
+    if(obj) obj->mark();
   }
 
   // TODO provide a safe cast
@@ -82,7 +243,7 @@ public:
 // pointer objects
 template<class T>
 class gc : public gc_base {
-  
+
   struct block_type : object {
     T value;
 
@@ -90,7 +251,7 @@ class gc : public gc_base {
     block_type(Args&& ... args) : value( std::forward<Args>(args) ... ) {  }
 
     void traverse() { gc_mark(value); }
-    
+
   };
 
   gc(block_type* block) : gc_base(block) { }
@@ -98,20 +259,20 @@ class gc : public gc_base {
   block_type* block() const {
     return static_cast<block_type*>(obj);
   }
-  
+
 public:
 
   gc() {}
-  
+
   T* get() const {
     if(!block()) return nullptr;
     return &block()->value;
   }
 
-  
+
   T* operator->() const { return get(); }
   T& operator*() const { return *get(); }
-  
+
   template<class ... Args>
   static inline gc make(Args&& ... args) {
     return new block_type(std::forward<Args>(args)...);
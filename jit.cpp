@@ -0,0 +1,125 @@
+#include "vm.hpp"
+#include "as.hpp"
+#include "jit.hpp"
+#include "timer.hpp"
+
+#include <vector>
+#include <iostream>
+
+static as::line lit(vm::integer value) { return vm::word(value); }
+
+static std::vector<as::line> fib(vm::integer n) {
+  const as::label fib = as::make_label("fib");
+  const as::label base = as::make_label("base");
+
+  return {
+    // main
+    vm::push, lit(n),
+    vm::call, lit(1), fib,
+    vm::ret,
+
+    // fib
+    {fib, vm::load}, lit(-1),
+    vm::push, lit(2),
+    vm::cmp<vm::lt>,
+    vm::jnz, base,
+
+    vm::push, lit(1),
+    vm::load, lit(-1),
+    vm::op<vm::sub>,
+    vm::call, lit(1), fib,
+
+    vm::push, lit(2),
+    vm::load, lit(-1),
+    vm::op<vm::sub>,
+    vm::call, lit(1), fib,
+
+    vm::op<vm::add>,
+    vm::ret,
+
+    {base, vm::load}, lit(-1),
+    vm::ret,
+  };
+}
+
+
+// sum of i * i for i < n. note: about n^3 / 3, keep n <= 2e6 so that it
+// fits an integer
+static std::vector<as::line> squares(vm::integer n) {
+  const as::label loop = as::make_label("loop");
+  const as::label done = as::make_label("done");
+
+  return {
+    vm::push, lit(0),           // sum
+    vm::push, lit(0),           // i
+
+    {loop, vm::load}, lit(1),
+    vm::push, lit(n),
+    vm::cmp<vm::ge>,
+    vm::jnz, done,
+
+    vm::load, lit(1),
+    vm::load, lit(1),
+    vm::op<vm::mul>,
+    vm::load, lit(0),
+    vm::op<vm::add>,
+    vm::store, lit(0),
+
+    vm::push, lit(1),
+    vm::load, lit(1),
+    vm::op<vm::add>,
+    vm::store, lit(1),
+    vm::jmp, loop,
+
+    {done, vm::load}, lit(0),
+    vm::ret,
+  };
+}
+
+
+static void bench(const char* name, std::vector<vm::code> prog,
+                  std::vector<vm::code> warmup) {
+  static constexpr std::size_t size = 1 << 16;
+  static vm::word stack[size];
+
+  vm::integer result;
+  std::cout << name << " interpreted: " << with_time([&] {
+    result = vm::eval(prog.data(), stack).value;
+  }) << " (" << result << ")" << std::endl;
+
+  // profile a short run, compile hot spots
+  vm::profile profile;
+  {
+    const vm::profile::scope lock(profile);
+    vm::eval(warmup.data(), stack);
+  }
+
+  jit::options opts;
+  opts.threshold = 100;
+
+  // warmup/prog only differ by literals: map profile onto prog
+  vm::profile mapped;
+  for(const auto* counts: {&profile.calls, &profile.loops}) {
+    auto& target = counts == &profile.calls ? mapped.calls : mapped.loops;
+    for(const auto& it: *counts) {
+      target[prog.data() + (it.first - warmup.data())] = it.second;
+    }
+  }
+
+  jit::compiler jit(opts);
+  const std::size_t patched = jit(prog, mapped);
+
+  std::cout << name << " patched: " << patched << " (compiled: " << jit.compiled
+            << ", cached: " << jit.cached << ")" << std::endl;
+
+  std::cout << name << " native: " << with_time([&] {
+    result = vm::eval(prog.data(), stack).value;
+  }) << " (" << result << ")" << std::endl;
+}
+
+
+int main(int, char**) {
+  bench("fib", as::link(fib(32)), as::link(fib(15)));
+  bench("squares", as::link(squares(2000000)), as::link(squares(1000)));
+  return 0;
+}
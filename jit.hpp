@@ -0,0 +1,557 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include "vm.hpp"
+#include "peephole.hpp"
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// native tier for vm.hpp: hot loops and closures (as recorded by vm::profile)
+// are translated to C, compiled out of process with the system compiler into
+// shared objects cached on disk by source hash, then loaded and patched into
+// the entry code slot. generated code falls back to the interpreter for
+// anything it does not handle.
+namespace jit {
+
+// services provided to generated code
+struct runtime {
+  void (*run)(vm::frame*);
+  const vm::closure* (*makec)(vm::frame* self, const vm::code* addr,
+                              std::size_t argc, std::size_t cap);
+  const vm::code* (*impl)(const vm::closure*);
+  const vm::word* (*data)(const vm::closure*);
+
+  static const runtime& instance() {
+    static const runtime self = {
+      vm::run,
+      [](vm::frame* self, const vm::code* addr, std::size_t argc,
+         std::size_t cap) -> const vm::closure* {
+        vm::heap* managed = vm::heap::current();
+        vm::closure* result = managed
+                                ? managed->allocate(self, addr, argc, cap)
+                                : vm::closure::make(addr, argc, cap);
+
+        for(std::size_t i = 0; i < cap; ++i) {
+          result->data()[i] = *(self->sp - 1 - i);
+        }
+
+        return result;
+      },
+      [](const vm::closure* self) { return self->impl; },
+      [](const vm::closure* self) { return self->data(); }};
+
+    return self;
+  }
+};
+
+
+// C declarations mirroring vm.hpp/runtime layouts
+static const char* prelude = R"(#include <stdint.h>
+#include <stddef.h>
+
+typedef union word { int64_t value; const void* func; } word;
+struct frame;
+typedef union code { void (*op)(struct frame*); word data; } code;
+typedef struct frame {
+  const code* ip;
+  word* fp;
+  word* sp;
+  const struct frame* caller;
+} frame;
+
+struct runtime {
+  void (*run)(frame*);
+  const void* (*makec)(frame*, const code*, size_t, size_t);
+  const code* (*impl)(const void*);
+  const word* (*data)(const void*);
+};
+
+static const struct runtime* rt;
+
+void vm_jit_init(const struct runtime* self) { rt = self; }
+)";
+
+
+// decoded instruction
+struct insn {
+  enum kind_type {
+    NEXT,
+    JMP,
+    JNZ,
+    PUSH,
+    POP,
+    DUP,
+    LOAD,
+    STORE,
+    LOADC,
+    CALL,
+    CALLC,
+    MAKEC,
+    RET,
+    OP,
+    CMP,
+    LOADOP,
+    PUSHOP,
+    CJMP,
+    UNKNOWN
+  } kind;
+
+  // C operator for arithmetic/comparisons
+  const char* name;
+
+  // literal operands (specialized templates included)
+  std::vector<vm::integer> args;
+
+  // absolute jump/call target (if any)
+  std::size_t target;
+
+  // total size in code slots
+  std::size_t size;
+};
+
+
+class decoder {
+  struct info {
+    insn::kind_type kind;
+    const char* name;
+    std::size_t lits;
+    bool addr;
+  };
+
+  std::map<vm::instr, info> table;
+
+  template<vm::binary_operation binop>
+  void operation(const char* name) {
+    table[vm::op<binop>] = {insn::OP, name, 0, false};
+    table[vm::loadop<binop>] = {insn::LOADOP, name, 2, false};
+    table[vm::pushop<binop>] = {insn::PUSHOP, name, 1, false};
+  }
+
+  template<vm::binary_predicate pred>
+  void comparison(const char* name) {
+    table[vm::cmp<pred>] = {insn::CMP, name, 0, false};
+    table[vm::cjmp<pred>] = {insn::CJMP, name, 0, true};
+  }
+
+public:
+  decoder() {
+    const vm::instr next = vm::next, jmp = vm::jmp, jnz = vm::jnz,
+                    push = vm::push, pop = vm::pop, dup = vm::dup,
+                    load = vm::load, store = vm::store, loadc = vm::loadc,
+                    call = vm::call, callc = vm::callc, makec = vm::makec;
+
+    table[next] = {insn::NEXT, nullptr, 0, false};
+    table[jmp] = {insn::JMP, nullptr, 0, true};
+    table[jnz] = {insn::JNZ, nullptr, 0, true};
+    table[push] = {insn::PUSH, nullptr, 1, false};
+    table[pop] = {insn::POP, nullptr, 0, false};
+    table[dup] = {insn::DUP, nullptr, 0, false};
+    table[load] = {insn::LOAD, nullptr, 1, false};
+    table[store] = {insn::STORE, nullptr, 1, false};
+    table[loadc] = {insn::LOADC, nullptr, 1, false};
+    table[call] = {insn::CALL, nullptr, 1, true};
+    table[callc] = {insn::CALLC, nullptr, 1, false};
+    table[makec] = {insn::MAKEC, nullptr, 2, true};
+    table[vm::ret] = {insn::RET, nullptr, 0, false};
+
+    operation<vm::add>("+");
+    operation<vm::sub>("-");
+    operation<vm::mul>("*");
+    operation<vm::div>("/");
+    operation<vm::mod>("%");
+
+    comparison<vm::eq>("==");
+    comparison<vm::ne>("!=");
+    comparison<vm::le>("<=");
+    comparison<vm::lt>("<");
+    comparison<vm::ge>(">=");
+    comparison<vm::gt>(">");
+  }
+
+  insn operator()(const std::vector<vm::code>& code, std::size_t pos) const {
+    vm::instr op = code[pos].op;
+
+    // specialized templates carry some literals in their opcode
+    std::vector<vm::integer> prefix;
+    if(const auto* special = peephole::table::instance().specialization(op)) {
+      op = special->first;
+      prefix = special->second;
+    }
+
+    const auto it = table.find(op);
+    if(it == table.end()) return {insn::UNKNOWN, nullptr, {}, 0, 1};
+
+    const info& self = it->second;
+    insn result = {self.kind, self.name, prefix, 0, 1};
+
+    for(std::size_t i = prefix.size(); i < self.lits; ++i) {
+      result.args.push_back(code.at(pos + result.size++).data.value);
+    }
+
+    if(self.addr) {
+      const std::size_t slot = pos + result.size++;
+      result.target = slot + code.at(slot).data.value;
+    }
+
+    return result;
+  }
+
+  static const decoder& instance() {
+    static const decoder self;
+    return self;
+  }
+};
+
+
+// translate the code region reachable from start (within the current
+// function) into a C function. positions are emitted relative to start so that
+// the source only depends on the bytecode.
+static std::string translate(const std::vector<vm::code>& code,
+                             std::size_t start) {
+  const decoder& decode = decoder::instance();
+
+  // collect region
+  std::map<std::size_t, insn> region;
+  std::vector<std::size_t> todo = {start};
+  while(todo.size()) {
+    const std::size_t pos = todo.back();
+    todo.pop_back();
+
+    if(pos >= code.size() || region.count(pos)) continue;
+
+    const insn self = decode(code, pos);
+    if(self.kind == insn::UNKNOWN) continue;
+
+    region.emplace(pos, self);
+
+    switch(self.kind) {
+    case insn::RET:
+      break;
+    case insn::JMP:
+      todo.push_back(self.target);
+      break;
+    case insn::JNZ:
+    case insn::CJMP:
+      todo.push_back(self.target);
+      todo.push_back(pos + self.size);
+      break;
+    default:
+      todo.push_back(pos + self.size);
+    }
+  }
+
+  std::stringstream ss;
+  const auto rel = [&](std::size_t pos) {
+    return vm::integer(pos) - vm::integer(start);
+  };
+
+  const auto label = [&](std::size_t pos) {
+    const vm::integer offset = rel(pos);
+    if(offset < 0) return "Lm" + std::to_string(-offset);
+    return "L" + std::to_string(offset);
+  };
+
+  // resume interpretation at pos
+  const auto exit = [&](std::size_t pos) {
+    return "{ self->ip = base + " + std::to_string(rel(pos)) +
+           "; self->sp = sp; return; }";
+  };
+
+  // jump to pos, exiting to the interpreter when outside region
+  const auto jump = [&](std::size_t pos) {
+    if(region.count(pos)) return "goto " + label(pos) + ";";
+    return exit(pos);
+  };
+
+  const auto lit = [](vm::integer value) {
+    return "INT64_C(" + std::to_string(value) + ")";
+  };
+
+  ss << prelude << "\n";
+  ss << "void vm_jit_entry(frame* self) {\n";
+  ss << "  const code* const base = self->ip;\n";
+  ss << "  word* const fp = self->fp;\n";
+  ss << "  word* sp = self->sp;\n";
+  ss << "  goto L0;\n";
+
+  for(const auto& it: region) {
+    const std::size_t pos = it.first;
+    const insn& self = it.second;
+    const auto& args = self.args;
+
+    ss << " " << label(pos) << ":";
+
+    switch(self.kind) {
+    case insn::NEXT:
+      ss << " ;\n";
+      break;
+    case insn::JMP:
+      ss << " " << jump(self.target) << "\n";
+      break;
+    case insn::JNZ:
+      ss << " if((--sp)->value) " << jump(self.target) << "\n";
+      break;
+    case insn::PUSH:
+      ss << " (sp++)->value = " << lit(args[0]) << ";\n";
+      break;
+    case insn::POP:
+      ss << " --sp;\n";
+      break;
+    case insn::DUP:
+      ss << " sp[0] = sp[-1]; ++sp;\n";
+      break;
+    case insn::LOAD:
+      ss << " *sp++ = fp[" << args[0] << "];\n";
+      break;
+    case insn::STORE:
+      ss << " fp[" << args[0] << "] = *--sp;\n";
+      break;
+    case insn::LOADC:
+      ss << " *sp++ = rt->data(fp[-1].func)[" << args[0] << "];\n";
+      break;
+    case insn::CALL:
+    case insn::CALLC:
+      // publish frame state for stack walking
+      ss << " self->ip = base + " << rel(pos + self.size - 1)
+         << "; self->sp = sp;\n";
+      ss << "  { frame callee = {";
+      if(self.kind == insn::CALL) {
+        ss << "base + " << rel(self.target);
+      } else {
+        ss << "rt->impl(sp[-1].func)";
+      }
+      ss << ", sp, sp, self}; rt->run(&callee); sp[-" << args[0]
+         << "] = callee.sp[-1]; sp += 1 - " << args[0] << "; }\n";
+      break;
+    case insn::MAKEC:
+      ss << " self->ip = base + " << rel(pos + self.size - 1)
+         << "; self->sp = sp;\n";
+      ss << "  { const void* func = rt->makec(self, base + "
+         << rel(self.target) << ", " << args[0] << ", " << args[1]
+         << "); sp -= " << args[1] << "; (sp++)->func = func; }\n";
+      break;
+    case insn::RET:
+      // the interpreter stops on the ret slot
+      ss << " " << exit(pos) << "\n";
+      break;
+    case insn::OP:
+      ss << " { const int64_t lhs = (--sp)->value;"
+         << " const int64_t rhs = (--sp)->value;"
+         << " (sp++)->value = lhs " << self.name << " rhs; }\n";
+      break;
+    case insn::CMP:
+      ss << " { const int64_t rhs = (--sp)->value;"
+         << " const int64_t lhs = (--sp)->value;"
+         << " (sp++)->value = lhs " << self.name << " rhs; }\n";
+      break;
+    case insn::LOADOP:
+      ss << " (sp++)->value = fp[" << args[1] << "].value " << self.name
+         << " fp[" << args[0] << "].value;\n";
+      break;
+    case insn::PUSHOP:
+      ss << " sp[-1].value = " << lit(args[0]) << " " << self.name
+         << " sp[-1].value;\n";
+      break;
+    case insn::CJMP:
+      ss << " { const int64_t rhs = (--sp)->value;"
+         << " const int64_t lhs = (--sp)->value;"
+         << " if(lhs " << self.name << " rhs) " << jump(self.target) << " }\n";
+      break;
+    case insn::UNKNOWN:
+      break;
+    }
+
+    // fallthrough
+    switch(self.kind) {
+    case insn::RET:
+    case insn::JMP:
+      break;
+    default: {
+      const auto succ = std::next(region.find(pos));
+      if(succ == region.end() || succ->first != pos + self.size) {
+        ss << "  " << jump(pos + self.size) << "\n";
+      }
+    }
+    }
+  }
+
+  ss << "}\n";
+  return ss.str();
+}
+
+
+// fnv-1a
+static std::uint64_t hash(const std::string& data) {
+  std::uint64_t result = 14695981039346656037ull;
+  for(unsigned char c: data) {
+    result ^= c;
+    result *= 1099511628211ull;
+  }
+
+  return result;
+}
+
+
+struct options {
+  // minimum loop/call count for compilation
+  std::size_t threshold = 1000;
+
+  // shared object cache directory
+  std::string cache = "/tmp/vm-jit";
+
+  // system compiler
+  std::string cc = "cc -O2 -shared -fPIC";
+};
+
+
+// create directory and its parents
+static void make_directory(const std::string& path) {
+  for(std::size_t pos = path.find('/', 1); pos != std::string::npos;
+      pos = path.find('/', pos + 1)) {
+    mkdir(path.substr(0, pos).c_str(), 0755);
+  }
+
+  if(mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw std::runtime_error("cannot create jit cache: " + path);
+  }
+}
+
+
+class compiler {
+  const options opts;
+  std::map<std::uint64_t, vm::instr> loaded;
+  std::vector<void*> handles;
+
+  // shared object for given C source, compiling it if not cached already
+  std::string build(const std::string& source, std::uint64_t key) const {
+    std::stringstream name;
+    name << opts.cache << "/" << std::hex << key;
+
+    const std::string so = name.str() + ".so";
+    if(access(so.c_str(), R_OK) == 0) return so;
+
+    make_directory(opts.cache);
+
+    // write and compile process-unique temporaries, so that concurrent users
+    // never see partial files
+    const std::string unique = "." + std::to_string(getpid());
+    const std::string c = name.str() + unique + ".c";
+    const std::string tmp = so + unique;
+
+    {
+      std::ofstream out(c);
+      out << source;
+      if(!out) {
+        std::remove(c.c_str());
+        throw std::runtime_error("cannot write " + c);
+      }
+    }
+
+    const std::string cmd = opts.cc + " -o '" + tmp + "' '" + c + "'";
+    if(std::system(cmd.c_str()) != 0 || std::rename(tmp.c_str(), so.c_str())) {
+      std::remove(c.c_str());
+      std::remove(tmp.c_str());
+      throw std::runtime_error("jit compilation failed: " + cmd);
+    }
+
+    // note: sources are kept for inspection only
+    std::rename(c.c_str(), (name.str() + ".c").c_str());
+    return so;
+  }
+
+  vm::instr load(const std::string& so) {
+    void* handle = dlopen(so.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(!handle) throw std::runtime_error(dlerror());
+    handles.push_back(handle);
+
+    using init_type = void (*)(const runtime*);
+    const auto init = reinterpret_cast<init_type>(dlsym(handle, "vm_jit_init"));
+    const auto entry = reinterpret_cast<vm::instr>(dlsym(handle, "vm_jit_entry"));
+
+    if(!init || !entry) throw std::runtime_error("bad jit object: " + so);
+
+    init(&runtime::instance());
+    return entry;
+  }
+
+public:
+  // compilation statistics
+  std::size_t compiled = 0, cached = 0;
+
+  compiler(options opts = {}): opts(opts) { }
+
+  compiler(const compiler&) = delete;
+
+  ~compiler() {
+    for(void* handle: handles) dlclose(handle);
+  }
+
+  // native code for the region starting at given position
+  vm::instr operator()(const std::vector<vm::code>& code, std::size_t start) {
+    const std::string source = translate(code, start);
+    const std::uint64_t key = hash(source);
+
+    const auto it = loaded.find(key);
+    if(it != loaded.end()) return it->second;
+
+    std::stringstream name;
+    name << opts.cache << "/" << std::hex << key << ".so";
+    if(access(name.str().c_str(), R_OK) == 0) {
+      ++cached;
+    } else {
+      ++compiled;
+    }
+
+    const vm::instr result = load(build(source, key));
+    loaded.emplace(key, result);
+    return result;
+  }
+
+  // compile hot call targets and loop headers recorded in profile, and patch
+  // their entry slot. returns the number of patched slots.
+  std::size_t operator()(std::vector<vm::code>& code,
+                         const vm::profile& profile) {
+    // translate from unpatched code
+    const std::vector<vm::code> source = code;
+
+    std::set<std::size_t> hot;
+    for(const auto* counts: {&profile.calls, &profile.loops}) {
+      for(const auto& it: *counts) {
+        if(it.second < opts.threshold) continue;
+        if(it.first < code.data() || it.first >= code.data() + code.size()) {
+          continue;
+        }
+
+        hot.insert(it.first - code.data());
+      }
+    }
+
+    std::size_t result = 0;
+    for(std::size_t pos: hot) {
+      if(decoder::instance()(source, pos).kind == insn::UNKNOWN) continue;
+
+      code[pos].op = (*this)(source, pos);
+      ++result;
+    }
+
+    return result;
+  }
+};
+
+} // namespace jit
+
+#endif
@@ -0,0 +1,77 @@
+#include <gtest/gtest.h>
+
+#include "mesh_weld.hpp"
+
+// single triangle per position triple
+static obj::buffers triangles(std::vector<obj::real> positions,
+                              std::vector<obj::index> vertex) {
+  obj::buffers res;
+  res.positions = positions;
+  res.vertex = vertex;
+  res.texcoord.assign(vertex.size(), obj::none);
+  res.normal.assign(vertex.size(), obj::none);
+
+  for(std::size_t i = 3; i <= vertex.size(); i += 3) res.offsets.push_back(i);
+  return res;
+}
+
+
+TEST(mesh_weld, exact) {
+  pool pool(4);
+
+  const auto mesh = triangles({0, 0, 0,  1, 0, 0,  0, 1, 0,  1, 0, 0},
+                              {0, 1, 2,  0, 3, 2});
+
+  const auto res = mesh_weld::process(mesh, pool);
+  EXPECT_EQ(res.welded, 3);
+  EXPECT_EQ(res.size(), 2);
+  EXPECT_EQ(res.positions.size(), 3);
+}
+
+
+// x=0 and x=2 are both within epsilon of x=1, but not of each other
+TEST(mesh_weld, transitive) {
+  const auto mesh = triangles({0, 0, 0,  2, 0, 0,  1, 0, 0,  5, 5, 5},
+                              {0, 1, 2,  0, 1, 3});
+
+  mesh_weld::options opts;
+  opts.epsilon = 1.05;
+
+  for(std::size_t threads: {1, 4}) {
+    pool pool(threads);
+    const auto res = mesh_weld::process(mesh, pool, opts);
+
+    EXPECT_EQ(res.welded, 2);
+
+    // first triangle is degenerate once welded
+    ASSERT_EQ(res.size(), 2);
+    EXPECT_EQ(res.positions[res.indices[0]], res.positions[res.indices[1]]);
+    EXPECT_EQ(res.positions[res.indices[0]], res.positions[res.indices[2]]);
+  }
+}
+
+
+// a chain of positions 0.9 apart welds into one, whatever the number of
+// threads
+TEST(mesh_weld, chain) {
+  std::vector<obj::real> positions;
+  std::vector<obj::index> vertex;
+
+  const std::size_t size = 3000;
+  for(std::size_t i = 0; i < size; ++i) {
+    // note: shuffled, so that neighbors are far apart in index order
+    const std::size_t k = (i * 1237) % size;
+    positions.insert(positions.end(), {0.9 * k, 0, 0});
+    vertex.push_back(i);
+  }
+
+  const auto mesh = triangles(positions, vertex);
+
+  mesh_weld::options opts;
+  opts.epsilon = 1;
+
+  for(std::size_t threads: {1, 4}) {
+    pool pool(threads);
+    EXPECT_EQ(mesh_weld::process(mesh, pool, opts).welded, 1);
+  }
+}
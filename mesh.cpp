@@ -11,25 +11,31 @@
 #include "math.hpp"
 #include "camera.hpp"
 
-#include "obj.hpp"
-
-
-struct mesh {
-  vector<vec3> vertices;
-  vector<vec3> normals;
-  vector<vec2> texcoords;
-  vector<vec4> colors;
-};
-
-
+#include "mesh_cache.hpp"
+#include "mesh_weld.hpp"
+#include "mesh_optimize.hpp"
 
 
 struct Viewer: QOpenGLWidget {
   gl::geometry geo;
   gl::camera cam;
+
+  // welded mesh, drawn as indexed triangles when not empty
+  mesh_weld::triangles mesh;
+  gl::buffer<GL_ELEMENT_ARRAY_BUFFER> indices;
   
   void initializeGL() override {
     gl::init();
+    cam.frame.pos.z() = 2;
+
+    if(mesh.size()) {
+      geo.vertex.data(mesh.positions);
+      geo.normal.data(mesh.normals);
+      geo.color.data(mesh.normals);
+      indices.bind().data(mesh.indices, GL_STATIC_DRAW);
+      return;
+    }
+    
     static std::vector<std::array<GLfloat, 3>> positions = {
       {0, 0, 0},
       {1, 0, 0},
@@ -41,8 +47,6 @@ struct Viewer: QOpenGLWidget {
 
     geo.vertex.data(positions);
     geo.color.data(positions);
-
-    cam.frame.pos.z() = 2;
   }
 
   void resizeGL(int width, int height) override {
@@ -53,6 +57,12 @@ struct Viewer: QOpenGLWidget {
   void paintGL() override {
     const auto cam = this->cam.lock();
     const auto geo = this->geo.lock();
+
+    if(mesh.size()) {
+      indices.bind();
+      glDrawElements(GL_TRIANGLES, mesh.indices.size(), GL_UNSIGNED_INT, 0);
+      return;
+    }
     
     glDrawArrays(GL_TRIANGLES, 0, 6);
   }
@@ -101,15 +111,16 @@ int main(int argc, char** argv) {
 
   QApplication app(argc, argv);
   Viewer widget;
-  widget.show();
 
-  std::ifstream in(argv[1]);
-  if(!in) {
-    return 1;
-  }
-  
-  obj::file file;
-  in >> file;
+  pool pool;
+  const mesh_cache::mesh buffers = mesh_cache::load(argv[1], pool);
+  widget.mesh = mesh_weld::process(buffers, pool);
+
+  mesh_optimize::options opts;
+  opts.morton = true;
+  std::clog << mesh_optimize::optimize(widget.mesh, pool, opts) << std::endl;
+
+  widget.show();
 
   return app.exec();
 }
@@ -0,0 +1,463 @@
+#ifndef CPP_MESH_CACHE_HPP
+#define CPP_MESH_CACHE_HPP
+
+#include "obj.hpp"
+#include "stl.hpp"
+#include "mmap.hpp"
+#include "task.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <functional>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+// binary cache for parsed meshes: sections are laid out so that a mapped
+// cache file is used in place. caches sit next to their source file and are
+// keyed by source path, size and modification time.
+namespace mesh_cache {
+
+template<class T>
+struct span {
+  const T* first = nullptr;
+  const T* last = nullptr;
+
+  const T* begin() const { return first; }
+  const T* end() const { return last; }
+
+  std::size_t size() const { return last - first; }
+  const T& operator[](std::size_t i) const { return first[i]; }
+};
+
+
+// read-only mesh buffers (see obj::buffers), mapped from a cache file or owned
+struct mesh {
+  span<obj::real> positions;
+  span<obj::real> normals;
+  span<obj::real> texcoords;
+
+  span<std::size_t> offsets;
+
+  span<obj::index> vertex;
+  span<obj::index> texcoord;
+  span<obj::index> normal;
+
+  std::vector<obj::range> groups;
+  std::vector<obj::range> objects;
+
+  // true when loaded from cache
+  bool cached = false;
+
+  // mapped file or buffers
+  std::shared_ptr<const void> storage;
+
+  std::size_t faces() const { return offsets.size() - 1; }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// file format
+////////////////////////////////////////////////////////////////////////////////
+
+static const char magic[8] = {'m', 'e', 's', 'h', 'c', 'a', 'c', 'h'};
+static constexpr std::uint32_t version = 2;
+
+// byte order/type sizes check
+static constexpr std::uint32_t order = 0x01020304;
+
+static constexpr std::size_t alignment = 64;
+
+struct header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t order;
+
+  // source key, mtime in nanoseconds
+  std::uint64_t size;
+  std::int64_t mtime;
+
+  std::uint32_t sections;
+  std::uint32_t reserved;
+};
+
+enum kind: std::uint32_t {
+  PATH,
+  POSITIONS,
+  NORMALS,
+  TEXCOORDS,
+  OFFSETS,
+  VERTEX,
+  TEXCOORD,
+  NORMAL,
+  GROUPS,
+  OBJECTS,
+  NAMES,
+  SECTIONS
+};
+
+// section table entry: offset in bytes from file start, count in elements
+struct section {
+  std::uint32_t kind;
+  std::uint32_t element;
+  std::uint64_t offset;
+  std::uint64_t count;
+};
+
+// named range, name in NAMES section
+struct range {
+  std::uint64_t first, last;
+  std::uint64_t name, length;
+};
+
+
+// source key. note: sources rewritten within a second keep their size often
+// enough, so mtime is in nanoseconds
+struct key {
+  std::uint64_t size;
+  std::int64_t mtime;
+};
+
+static key stat(const std::string& filename) {
+  struct stat info;
+  if(::stat(filename.c_str(), &info) < 0) {
+    throw std::runtime_error("cannot stat " + filename);
+  }
+
+  return {std::uint64_t(info.st_size),
+          std::int64_t(info.st_mtim.tv_sec) * 1000000000 +
+          info.st_mtim.tv_nsec};
+}
+
+
+static std::string filename(const std::string& source) {
+  return source + ".mcache";
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// writer
+////////////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+
+struct block {
+  kind type;
+  std::size_t element;
+  const void* data;
+  std::size_t count;
+};
+
+template<class T>
+static block make_block(kind type, const T* data, std::size_t count) {
+  return {type, sizeof(T), data, count};
+}
+
+static std::size_t align(std::size_t offset) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+static void ranges(const std::vector<obj::range>& source,
+                   std::vector<range>& out, std::string& names) {
+  for(const obj::range& it: source) {
+    out.push_back({it.first, it.last, names.size(), it.name.size()});
+    names += it.name;
+  }
+}
+
+}
+
+
+// cache for buffers parsed from source, whose key was taken before parsing.
+// note: written to a process-unique temporary file then renamed, so that
+// concurrent readers and writers never see partial caches
+static void write(const std::string& source, const key& k,
+                  const obj::buffers& self) {
+  std::vector<range> groups, objects;
+  std::string names;
+  detail::ranges(self.groups, groups, names);
+  detail::ranges(self.objects, objects, names);
+
+  using detail::make_block;
+  const detail::block blocks[SECTIONS] = {
+    make_block(PATH, source.data(), source.size()),
+    make_block(POSITIONS, self.positions.data(), self.positions.size()),
+    make_block(NORMALS, self.normals.data(), self.normals.size()),
+    make_block(TEXCOORDS, self.texcoords.data(), self.texcoords.size()),
+    make_block(OFFSETS, self.offsets.data(), self.offsets.size()),
+    make_block(VERTEX, self.vertex.data(), self.vertex.size()),
+    make_block(TEXCOORD, self.texcoord.data(), self.texcoord.size()),
+    make_block(NORMAL, self.normal.data(), self.normal.size()),
+    make_block(GROUPS, groups.data(), groups.size()),
+    make_block(OBJECTS, objects.data(), objects.size()),
+    make_block(NAMES, names.data(), names.size()),
+  };
+
+  header h = {};
+  std::memcpy(h.magic, magic, sizeof(magic));
+  h.version = version;
+  h.order = order;
+  h.size = k.size;
+  h.mtime = k.mtime;
+  h.sections = SECTIONS;
+
+  section table[SECTIONS];
+  std::size_t offset = detail::align(sizeof(header) + sizeof(table));
+  for(std::size_t i = 0; i < SECTIONS; ++i) {
+    const detail::block& b = blocks[i];
+    table[i] = {b.type, std::uint32_t(b.element), offset, b.count};
+    offset = detail::align(offset + b.element * b.count);
+  }
+
+  const std::string target = filename(source);
+  const std::string tmp = target + "." + std::to_string(::getpid()) + "." +
+    std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) +
+    ".tmp";
+
+  {
+    std::ofstream out(tmp, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.write(reinterpret_cast<const char*>(table), sizeof(table));
+
+    static const char padding[alignment] = {};
+    std::size_t at = sizeof(h) + sizeof(table);
+
+    for(std::size_t i = 0; i < SECTIONS; ++i) {
+      out.write(padding, table[i].offset - at);
+      out.write(static_cast<const char*>(blocks[i].data),
+                blocks[i].element * blocks[i].count);
+      at = table[i].offset + blocks[i].element * blocks[i].count;
+    }
+
+    // note: padded to the end, so that empty trailing sections lie in the file
+    out.write(padding, offset - at);
+
+    if(!out) {
+      std::remove(tmp.c_str());
+      throw std::runtime_error("cannot write " + tmp);
+    }
+  }
+
+  if(std::rename(tmp.c_str(), target.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    throw std::runtime_error("cannot write " + target);
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// reader
+////////////////////////////////////////////////////////////////////////////////
+
+struct invalid: std::runtime_error {
+  invalid(std::string what): std::runtime_error("mesh cache: " + what) { }
+};
+
+
+// mapped cache for source, validated against current source key
+static mesh read(const std::string& source) {
+  const key k = stat(source);
+
+  auto contents = std::make_shared<const mapped_file>(filename(source));
+  const char* data = contents->begin();
+  const std::size_t size = contents->size();
+
+  header h;
+  section table[SECTIONS];
+  if(size < sizeof(h) + sizeof(table)) throw invalid("truncated");
+
+  std::memcpy(&h, data, sizeof(h));
+  std::memcpy(table, data + sizeof(h), sizeof(table));
+
+  if(std::memcmp(h.magic, magic, sizeof(magic)) != 0) throw invalid("magic");
+  if(h.version != version || h.order != order || h.sections != SECTIONS) {
+    throw invalid("version");
+  }
+
+  if(h.size != k.size || h.mtime != k.mtime) throw invalid("stale");
+
+  const std::size_t elements[SECTIONS] = {
+    sizeof(char),
+    sizeof(obj::real), sizeof(obj::real), sizeof(obj::real),
+    sizeof(std::size_t),
+    sizeof(obj::index), sizeof(obj::index), sizeof(obj::index),
+    sizeof(range), sizeof(range),
+    sizeof(char)
+  };
+
+  for(std::size_t i = 0; i < SECTIONS; ++i) {
+    const section& s = table[i];
+    if(s.kind != i || s.element != elements[i] || s.offset % alignment ||
+       s.offset > size || s.count > (size - s.offset) / s.element) {
+      throw invalid("bad section");
+    }
+  }
+
+  const auto get = [&](kind type, auto& out) {
+    using value_type = typename std::decay<decltype(*out.first)>::type;
+    out.first = reinterpret_cast<const value_type*>(data + table[type].offset);
+    out.last = out.first + table[type].count;
+  };
+
+  span<char> path;
+  get(PATH, path);
+  if(std::string(path.begin(), path.end()) != source) throw invalid("path");
+
+  mesh res;
+  get(POSITIONS, res.positions);
+  get(NORMALS, res.normals);
+  get(TEXCOORDS, res.texcoords);
+  get(OFFSETS, res.offsets);
+  get(VERTEX, res.vertex);
+  get(TEXCOORD, res.texcoord);
+  get(NORMAL, res.normal);
+
+  // consistency: faces and element indices are used unchecked downstream
+  const std::size_t elements_size = res.vertex.size();
+  if(!res.offsets.size() || res.offsets[0] != 0 ||
+     res.offsets[res.offsets.size() - 1] != elements_size ||
+     res.texcoord.size() != elements_size ||
+     res.normal.size() != elements_size) {
+    throw invalid("inconsistent");
+  }
+
+  for(std::size_t i = 1, n = res.offsets.size(); i < n; ++i) {
+    if(res.offsets[i] < res.offsets[i - 1]) throw invalid("bad offsets");
+  }
+
+  const auto indices = [&](const span<obj::index>& self, std::size_t size) {
+    for(obj::index i: self) {
+      if(i >= size && i != obj::none) throw invalid("bad indices");
+    }
+  };
+
+  indices(res.vertex, res.positions.size() / 3);
+  indices(res.texcoord, res.texcoords.size() / 2);
+  indices(res.normal, res.normals.size() / 3);
+
+  span<char> names;
+  get(NAMES, names);
+
+  const auto ranges = [&](kind type, std::vector<obj::range>& out) {
+    span<range> source;
+    get(type, source);
+
+    for(const range& it: source) {
+      if(it.name > names.size() || it.length > names.size() - it.name) {
+        throw invalid("bad name");
+      }
+
+      if(it.first > it.last || it.last > res.faces()) {
+        throw invalid("bad range");
+      }
+
+      out.push_back({std::string(names.begin() + it.name, it.length),
+                     std::size_t(it.first), std::size_t(it.last)});
+    }
+  };
+
+  ranges(GROUPS, res.groups);
+  ranges(OBJECTS, res.objects);
+
+  res.cached = true;
+  res.storage = contents;
+  return res;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// loader
+////////////////////////////////////////////////////////////////////////////////
+
+// triangles soup from stl, as obj buffers
+static obj::buffers convert(const stl::indexed& self) {
+  obj::buffers res;
+
+  res.positions.reserve(3 * self.vertices.size());
+  for(const stl::vec3& v: self.vertices) {
+    res.positions.insert(res.positions.end(), {v.x, v.y, v.z});
+  }
+
+  const std::size_t count = self.indices.size();
+  res.vertex.assign(self.indices.begin(), self.indices.end());
+  res.texcoord.assign(count, obj::none);
+  res.normal.assign(count, obj::none);
+
+  res.offsets.resize(count / 3 + 1);
+  for(std::size_t i = 0, n = res.offsets.size(); i < n; ++i) {
+    res.offsets[i] = 3 * i;
+  }
+
+  return res;
+}
+
+
+// parse source according to its extension
+static obj::buffers parse(const std::string& source, pool& pool) {
+  const std::string ext = source.size() >= 4 ?
+    source.substr(source.size() - 4) : std::string();
+
+  if(ext == ".stl" || ext == ".STL") {
+    return convert(stl::index(stl::file(source), pool));
+  }
+
+  return obj::load(source, pool);
+}
+
+
+static mesh view(std::shared_ptr<const obj::buffers> self) {
+  mesh res;
+
+  const auto get = [](const auto& source, auto& out) {
+    out.first = source.data();
+    out.last = source.data() + source.size();
+  };
+
+  get(self->positions, res.positions);
+  get(self->normals, res.normals);
+  get(self->texcoords, res.texcoords);
+  get(self->offsets, res.offsets);
+  get(self->vertex, res.vertex);
+  get(self->texcoord, res.texcoord);
+  get(self->normal, res.normal);
+
+  res.groups = self->groups;
+  res.objects = self->objects;
+
+  res.storage = self;
+  return res;
+}
+
+
+// load from cache when valid, otherwise parse source and update cache
+static mesh load(const std::string& source, pool& pool) {
+  try {
+    return read(source);
+  } catch(std::runtime_error&) {
+    // missing, stale or invalid: fall back on parsing
+  }
+
+  // note: a source modified while parsing leaves a stale cache
+  const key k = stat(source);
+  auto buffers = std::make_shared<const obj::buffers>(parse(source, pool));
+
+  try {
+    write(source, k, *buffers);
+  } catch(std::runtime_error& e) {
+    // read-only directory: still usable without cache
+    std::clog << e.what() << std::endl;
+  }
+
+  return view(buffers);
+}
+
+}
+
+#endif
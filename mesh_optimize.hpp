@@ -0,0 +1,364 @@
+#ifndef CPP_MESH_OPTIMIZE_HPP
+#define CPP_MESH_OPTIMIZE_HPP
+
+#include "mesh_weld.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+#include <array>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <iostream>
+#include <type_traits>
+
+#include <cmath>
+#include <cstdint>
+
+// index buffer optimization for indexed triangles (see mesh_weld): triangles
+// are reordered for the post-transform vertex cache (forsyth), optionally
+// along a morton curve first, then vertices are renumbered in first-use order
+// so that vertex fetches follow the index buffer.
+namespace mesh_optimize {
+
+using obj::index;
+using mesh_weld::triangles;
+
+struct options {
+  // simulated post-transform cache size
+  std::size_t cache = 32;
+
+  // sort triangles by morton code of their centroids before reordering, so
+  // that dead ends resume nearby and consumers see spatially coherent runs
+  bool morton = false;
+};
+
+
+// average cache miss ratio (transformed vertices per triangle) for a fifo
+// cache: 3 without reuse, 0.5 at best on large regular meshes
+static double acmr(const std::vector<index>& indices, std::size_t vertices,
+                   std::size_t cache=32) {
+  if(indices.empty()) return 0;
+
+  // note: vertex v is cached when inserted at most cache misses ago
+  std::vector<std::size_t> stamps(vertices);
+  std::size_t time = cache + 1, misses = 0;
+
+  for(index v: indices) {
+    if(time - stamps[v] > cache) {
+      stamps[v] = time++;
+      ++misses;
+    }
+  }
+
+  return double(misses) / (indices.size() / 3);
+}
+
+
+struct report {
+  std::size_t cache;
+  double before, after;
+
+  // seconds
+  double morton = 0, reorder = 0, renumber = 0;
+
+  friend std::ostream& operator<<(std::ostream& out, const report& self) {
+    return out << "acmr " << self.before << " -> " << self.after
+               << " (cache " << self.cache << "), morton " << self.morton
+               << "s, reorder " << self.reorder << "s, renumber "
+               << self.renumber << "s";
+  }
+};
+
+
+namespace detail {
+
+// 21 bits per axis
+static std::uint64_t spread(std::uint64_t x) {
+  x &= 0x1fffff;
+  x = (x | x << 32) & 0x001f00000000ffffull;
+  x = (x | x << 16) & 0x001f0000ff0000ffull;
+  x = (x | x << 8) & 0x100f00f00f00f00full;
+  x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+  x = (x | x << 2) & 0x1249249249249249ull;
+  return x;
+}
+
+static std::uint64_t morton(std::uint64_t x, std::uint64_t y, std::uint64_t z) {
+  return spread(x) << 2 | spread(y) << 1 | spread(z);
+}
+
+
+// triangle order along a morton curve of centroids, in the bounding box of
+// positions
+static std::vector<index> morton_order(const triangles& self, pool& pool) {
+  std::array<float, 3> lo, hi;
+  lo.fill(std::numeric_limits<float>::max());
+  hi.fill(std::numeric_limits<float>::lowest());
+
+  for(const auto& p: self.positions) {
+    for(std::size_t k = 0; k < 3; ++k) {
+      lo[k] = std::min(lo[k], p[k]);
+      hi[k] = std::max(hi[k], p[k]);
+    }
+  }
+
+  const std::size_t size = self.size();
+  std::vector<std::uint64_t> codes(size);
+
+  mesh_weld::detail::parallel(pool, size, [&](std::size_t first,
+                                              std::size_t last) {
+    for(std::size_t t = first; t < last; ++t) {
+      std::uint64_t coords[3];
+      for(std::size_t k = 0; k < 3; ++k) {
+        const float c = (self.positions[self.indices[3 * t]][k] +
+                         self.positions[self.indices[3 * t + 1]][k] +
+                         self.positions[self.indices[3 * t + 2]][k]) / 3;
+
+        // note: flat extents map to zero
+        const float extent = hi[k] - lo[k];
+        const float unit = extent > 0 ? (c - lo[k]) / extent : 0;
+        coords[k] = std::min<float>(std::max<float>(unit, 0), 1) * 0x1fffff;
+      }
+
+      codes[t] = morton(coords[0], coords[1], coords[2]);
+    }
+  });
+
+  std::vector<index> res(size);
+  for(std::size_t t = 0; t < size; ++t) res[t] = t;
+
+  std::sort(res.begin(), res.end(), [&](index lhs, index rhs) {
+    return codes[lhs] < codes[rhs] || (codes[lhs] == codes[rhs] && lhs < rhs);
+  });
+
+  return res;
+}
+
+
+// forsyth's linear-speed vertex cache optimization: triangles are emitted by
+// decreasing score, where vertex scores favor recently used vertices (lru
+// cache) and vertices with few remaining triangles. dead ends resume on the
+// first remaining triangle in input order.
+class forsyth {
+  static constexpr std::size_t max_valence = 64;
+
+  const std::size_t cache_size;
+
+  std::vector<float> cache_scores;
+  std::vector<float> valence_scores;
+
+  // triangles per vertex
+  std::vector<std::size_t> offsets;
+  std::vector<index> adjacency;
+  std::vector<std::size_t> remaining;
+
+  std::vector<float> scores;
+  std::vector<int> slots;
+
+  std::vector<float> triangle_scores;
+  std::vector<char> emitted;
+
+  float score(index v) const {
+    if(!remaining[v]) return -1;
+
+    const int at = slots[v];
+    const float cache = at < 0 ? 0 : cache_scores[at];
+
+    return cache + valence_scores[std::min(remaining[v], max_valence - 1)];
+  }
+
+public:
+  forsyth(std::size_t cache_size):
+    cache_size(std::max<std::size_t>(cache_size, 4)) {
+    // the last triangle's vertices are scored equally, then the score decays
+    cache_scores.resize(this->cache_size);
+    for(std::size_t i = 0; i < this->cache_size; ++i) {
+      cache_scores[i] = i < 3 ? 0.75f :
+        std::pow(1 - float(i - 3) / (this->cache_size - 3), 1.5f);
+    }
+
+    valence_scores.resize(max_valence);
+    for(std::size_t i = 1; i < max_valence; ++i) {
+      valence_scores[i] = 2 * std::pow(float(i), -0.5f);
+    }
+  }
+
+  // triangle order
+  std::vector<index> operator()(const std::vector<index>& indices,
+                                std::size_t vertices) {
+    const std::size_t size = indices.size() / 3;
+
+    offsets.assign(vertices + 1, 0);
+    for(index v: indices) ++offsets[v + 1];
+    for(std::size_t v = 0; v < vertices; ++v) offsets[v + 1] += offsets[v];
+
+    remaining.assign(vertices, 0);
+    adjacency.resize(indices.size());
+    for(std::size_t t = 0; t < size; ++t) {
+      for(std::size_t k = 0; k < 3; ++k) {
+        const index v = indices[3 * t + k];
+        adjacency[offsets[v] + remaining[v]++] = t;
+      }
+    }
+
+    slots.assign(vertices, -1);
+    scores.resize(vertices);
+    for(std::size_t v = 0; v < vertices; ++v) scores[v] = score(v);
+
+    triangle_scores.resize(size);
+    for(std::size_t t = 0; t < size; ++t) {
+      triangle_scores[t] = scores[indices[3 * t]] + scores[indices[3 * t + 1]] +
+        scores[indices[3 * t + 2]];
+    }
+
+    emitted.assign(size, false);
+
+    // lru cache, with room for a triangle's vertices
+    std::vector<index> cache, next;
+    cache.reserve(cache_size + 3);
+    next.reserve(cache_size + 3);
+
+    std::vector<index> res;
+    res.reserve(size);
+
+    std::size_t resume = 0;
+    std::size_t best = size;
+
+    while(res.size() < size) {
+      if(best == size) {
+        while(emitted[resume]) ++resume;
+        best = resume;
+      }
+
+      emitted[best] = true;
+      res.push_back(best);
+
+      const index* tri = indices.data() + 3 * best;
+
+      // remove triangle from its vertices
+      for(std::size_t k = 0; k < 3; ++k) {
+        const index v = tri[k];
+        index* first = adjacency.data() + offsets[v];
+        index* last = first + remaining[v];
+
+        *std::find(first, last, best) = last[-1];
+        --remaining[v];
+      }
+
+      // most recent first. note: degenerate triangles repeat vertices
+      next.clear();
+      for(std::size_t k = 0; k < 3; ++k) {
+        if(std::find(next.begin(), next.end(), tri[k]) == next.end()) {
+          next.push_back(tri[k]);
+        }
+      }
+
+      for(index v: cache) {
+        if(v != tri[0] && v != tri[1] && v != tri[2]) next.push_back(v);
+      }
+
+      cache.swap(next);
+
+      for(std::size_t i = 0; i < cache.size(); ++i) {
+        slots[cache[i]] = i < cache_size ? int(i) : -1;
+      }
+
+      // rescore cached and evicted vertices and their triangles, then pick
+      // the best of these triangles
+      for(index v: cache) {
+        const float delta = score(v) - scores[v];
+        scores[v] += delta;
+
+        for(std::size_t j = offsets[v], n = j + remaining[v]; j < n; ++j) {
+          triangle_scores[adjacency[j]] += delta;
+        }
+      }
+
+      best = size;
+      float top = -1;
+
+      for(index v: cache) {
+        for(std::size_t j = offsets[v], n = j + remaining[v]; j < n; ++j) {
+          const index t = adjacency[j];
+          if(triangle_scores[t] > top) {
+            top = triangle_scores[t];
+            best = t;
+          }
+        }
+      }
+
+      if(cache.size() > cache_size) cache.resize(cache_size);
+    }
+
+    return res;
+  }
+};
+
+}
+
+
+// triangles in the given order
+static void permute(triangles& self, const std::vector<index>& order) {
+  std::vector<index> indices(self.indices.size());
+  for(std::size_t t = 0, n = order.size(); t < n; ++t) {
+    std::copy(self.indices.begin() + 3 * order[t],
+              self.indices.begin() + 3 * order[t] + 3,
+              indices.begin() + 3 * t);
+  }
+
+  self.indices.swap(indices);
+}
+
+
+// vertices in first-use order. note: unused vertices are dropped
+static void renumber(triangles& self) {
+  std::vector<index> remap(self.positions.size(), obj::none);
+
+  index count = 0;
+  for(index& v: self.indices) {
+    if(remap[v] == obj::none) remap[v] = count++;
+    v = remap[v];
+  }
+
+  const auto apply = [&](auto& values) {
+    if(values.empty()) return;
+
+    std::remove_reference_t<decltype(values)> res(count);
+    for(std::size_t v = 0, n = remap.size(); v < n; ++v) {
+      if(remap[v] != obj::none) res[remap[v]] = values[v];
+    }
+
+    values.swap(res);
+  };
+
+  apply(self.positions);
+  apply(self.normals);
+  apply(self.texcoords);
+}
+
+
+// full pass: morton sort (optional), vertex cache reordering, renumbering
+static report optimize(triangles& self, pool& pool, const options& opts={}) {
+  report res;
+  res.cache = opts.cache;
+  res.before = acmr(self.indices, self.positions.size(), opts.cache);
+
+  res.morton = with_time([&] {
+    if(opts.morton) permute(self, detail::morton_order(self, pool));
+  });
+
+  res.reorder = with_time([&] {
+    detail::forsyth reorder(opts.cache);
+    permute(self, reorder(self.indices, self.positions.size()));
+  });
+
+  res.renumber = with_time([&] { renumber(self); });
+
+  res.after = acmr(self.indices, self.positions.size(), opts.cache);
+  return res;
+}
+
+}
+
+#endif
@@ -0,0 +1,520 @@
+#ifndef CPP_MESH_WELD_HPP
+#define CPP_MESH_WELD_HPP
+
+#include "obj.hpp"
+#include "task.hpp"
+
+#include <array>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// processing of loaded meshes (obj::buffers, mesh_cache::mesh) into gpu-ready
+// indexed triangles: positions are welded, smooth normals are generated for
+// corners without normals, and vertices are shared between triangles. every
+// step runs on the pool, and results do not depend on the number of threads.
+namespace mesh_weld {
+
+using obj::real;
+using obj::index;
+using obj::none;
+
+struct options {
+  // positions closer than epsilon are welded, transitively. zero only welds
+  // identical positions.
+  real epsilon = 0;
+};
+
+
+// indexed triangles, laid out for gl::geometry
+struct triangles {
+  std::vector<std::array<float, 3>> positions;
+  std::vector<std::array<float, 3>> normals;
+
+  // empty when the source has no texcoords
+  std::vector<std::array<float, 2>> texcoords;
+
+  // 3 per triangle
+  std::vector<index> indices;
+
+  // distinct positions once welded
+  std::size_t welded = 0;
+
+  std::size_t size() const { return indices.size() / 3; }
+};
+
+
+namespace detail {
+
+// fixed, so that results do not depend on the number of threads
+static constexpr std::size_t shards = 64;
+
+template<class T, std::size_t N>
+static std::size_t hash(const std::array<T, N>& self) {
+  std::uint64_t h = 0xcbf29ce484222325ull;
+  for(T word: self) {
+    h = (h ^ std::uint64_t(word)) * 0x100000001b3ull;
+  }
+
+  return h ^ (h >> 29);
+}
+
+
+// func(first, last) on one chunk of [0, count) per thread
+template<class Func>
+static void parallel(pool& pool, std::size_t count, const Func& func) {
+  const std::size_t n = std::max<std::size_t>(pool.size(), 1);
+  pool.split(std::size_t(0), n, [&](std::size_t c) {
+    func(count * c / n, count * (c + 1) / n);
+  }).get();
+}
+
+
+// exclusive prefix sums in place, returns the total. note: chunk sums are
+// scanned serially, one per thread.
+template<class T>
+static T prefix(std::vector<T>& values, pool& pool) {
+  const std::size_t n = std::max<std::size_t>(pool.size(), 1);
+  const std::size_t count = values.size();
+
+  std::vector<T> sums(n + 1);
+  pool.split(std::size_t(0), n, [&](std::size_t c) {
+    T sum = 0;
+    for(std::size_t i = count * c / n, m = count * (c + 1) / n; i < m; ++i) {
+      sum += values[i];
+    }
+
+    sums[c + 1] = sum;
+  }).get();
+
+  for(std::size_t c = 0; c < n; ++c) sums[c + 1] += sums[c];
+
+  pool.split(std::size_t(0), n, [&](std::size_t c) {
+    T sum = sums[c];
+    for(std::size_t i = count * c / n, m = count * (c + 1) / n; i < m; ++i) {
+      const T value = values[i];
+      values[i] = sum;
+      sum += value;
+    }
+  }).get();
+
+  return sums[n];
+}
+
+
+// items bucketed into shards, then sorted by key within shards: equal keys
+// are contiguous, in item order (see stl::index)
+struct buckets {
+  std::vector<index> items;
+  std::vector<std::size_t> bounds;
+
+  template<class Key, class Shard>
+  buckets(const std::vector<Key>& keys, const Shard& shard, pool& pool):
+    items(keys.size()),
+    bounds(shards + 1) {
+    const std::size_t count = keys.size();
+    const std::size_t chunks = std::max<std::size_t>(pool.size(), 1);
+    const auto chunk = [&](std::size_t i) { return count * i / chunks; };
+
+    // shard sizes per chunk
+    std::vector<std::size_t> counts(chunks * shards);
+    pool.split(std::size_t(0), chunks, [&](std::size_t c) {
+      for(std::size_t i = chunk(c), n = chunk(c + 1); i < n; ++i) {
+        ++counts[c * shards + shard(keys[i])];
+      }
+    }).get();
+
+    // shard-major starts
+    std::vector<std::size_t> starts(chunks * shards);
+
+    std::size_t total = 0;
+    for(std::size_t s = 0; s < shards; ++s) {
+      bounds[s] = total;
+      for(std::size_t c = 0; c < chunks; ++c) {
+        starts[c * shards + s] = total;
+        total += counts[c * shards + s];
+      }
+    }
+    bounds[shards] = total;
+
+    pool.split(std::size_t(0), chunks, [&](std::size_t c) {
+      std::size_t* at = starts.data() + c * shards;
+      for(std::size_t i = chunk(c), n = chunk(c + 1); i < n; ++i) {
+        items[at[shard(keys[i])]++] = i;
+      }
+    }).get();
+
+    pool.split(std::size_t(0), shards, [&](std::size_t s) {
+      std::sort(items.begin() + bounds[s], items.begin() + bounds[s + 1],
+                [&](index lhs, index rhs) {
+                  return keys[lhs] < keys[rhs] ||
+                    (keys[lhs] == keys[rhs] && lhs < rhs);
+                });
+    }).get();
+  }
+};
+
+
+using vec3 = std::array<real, 3>;
+
+template<class Mesh>
+static vec3 position(const Mesh& self, std::size_t i) {
+  return {self.positions[3 * i], self.positions[3 * i + 1],
+          self.positions[3 * i + 2]};
+}
+
+static vec3 cross(const vec3& a, const vec3& b) {
+  return {a[1] * b[2] - a[2] * b[1],
+          a[2] * b[0] - a[0] * b[2],
+          a[0] * b[1] - a[1] * b[0]};
+}
+
+
+// bitwise position key, with signed zeros identified
+static std::array<std::uint64_t, 3> bits(const vec3& p) {
+  std::array<std::uint64_t, 3> res;
+  for(std::size_t i = 0; i < 3; ++i) {
+    const real value = p[i] == 0 ? 0.0 : p[i];
+    std::memcpy(&res[i], &value, sizeof(real));
+  }
+
+  return res;
+}
+
+
+// grid cell of side epsilon. note: clamped, so that neighbors do not overflow
+static std::array<std::int64_t, 3> cell(const vec3& p, real epsilon) {
+  static constexpr real bound = real(std::int64_t(1) << 62);
+
+  std::array<std::int64_t, 3> res;
+  for(std::size_t i = 0; i < 3; ++i) {
+    const real value = std::floor(p[i] / epsilon);
+    res[i] = !(value > -bound) ? -bound : value < bound ? value : bound;
+  }
+
+  return res;
+}
+
+
+// identical positions: each is mapped to the first one
+template<class Mesh>
+static std::vector<index> weld_exact(const Mesh& self, pool& pool) {
+  const std::size_t count = self.positions.size() / 3;
+
+  std::vector<std::array<std::uint64_t, 3>> keys(count);
+  parallel(pool, count, [&](std::size_t first, std::size_t last) {
+    for(std::size_t i = first; i < last; ++i) keys[i] = bits(position(self, i));
+  });
+
+  const buckets b(keys, [](const std::array<std::uint64_t, 3>& key) {
+    return hash(key) % shards;
+  }, pool);
+
+  std::vector<index> res(count);
+  pool.split(std::size_t(0), shards, [&](std::size_t s) {
+    for(std::size_t j = b.bounds[s], n = b.bounds[s + 1]; j < n; ++j) {
+      const index first = j > b.bounds[s] &&
+        keys[b.items[j - 1]] == keys[b.items[j]] ? res[b.items[j - 1]] :
+        b.items[j];
+
+      res[b.items[j]] = first;
+    }
+  }).get();
+
+  return res;
+}
+
+
+// concurrent union-find over indices, roots are the smallest index of their
+// set so that results do not depend on the order of unions
+class disjoint_sets {
+  std::vector<std::atomic<index>> parent;
+
+public:
+  disjoint_sets(std::size_t count, pool& pool): parent(count) {
+    parallel(pool, count, [&](std::size_t first, std::size_t last) {
+      for(std::size_t i = first; i < last; ++i) parent[i] = i;
+    });
+  }
+
+  // note: path halving, parents only ever move closer to the root
+  index find(index i) {
+    index p = parent[i].load();
+    while(p != i) {
+      index gp = parent[p].load();
+      parent[i].compare_exchange_weak(p, gp);
+      i = p;
+      p = parent[i].load();
+    }
+
+    return i;
+  }
+
+  void unite(index a, index b) {
+    while(true) {
+      a = find(a);
+      b = find(b);
+      if(a == b) return;
+
+      // link the larger root below the smaller one
+      if(a < b) std::swap(a, b);
+      index expected = a;
+      if(parent[a].compare_exchange_strong(expected, b)) return;
+    }
+  }
+};
+
+
+// positions within epsilon of each other are connected (searched in
+// neighboring grid cells), then each is mapped to the first position of its
+// connected component
+template<class Mesh>
+static std::vector<index> weld_near(const Mesh& self, real epsilon,
+                                    pool& pool) {
+  const std::size_t count = self.positions.size() / 3;
+
+  using key_type = std::array<std::int64_t, 3>;
+  std::vector<key_type> keys(count);
+  parallel(pool, count, [&](std::size_t first, std::size_t last) {
+    for(std::size_t i = first; i < last; ++i) {
+      keys[i] = cell(position(self, i), epsilon);
+    }
+  });
+
+  const auto shard = [](const key_type& key) { return hash(key) % shards; };
+  const buckets b(keys, shard, pool);
+
+  disjoint_sets sets(count, pool);
+  parallel(pool, count, [&](std::size_t first, std::size_t last) {
+    for(std::size_t i = first; i < last; ++i) {
+      const vec3 p = position(self, i);
+
+      for(std::int64_t dx = -1; dx <= 1; ++dx) {
+        for(std::int64_t dy = -1; dy <= 1; ++dy) {
+          for(std::int64_t dz = -1; dz <= 1; ++dz) {
+            const key_type key = {keys[i][0] + dx, keys[i][1] + dy,
+                                  keys[i][2] + dz};
+
+            const std::size_t s = shard(key);
+            const auto end = b.items.begin() + b.bounds[s + 1];
+            auto it = std::lower_bound(b.items.begin() + b.bounds[s], end, key,
+                                       [&](index j, const key_type& other) {
+                                         return keys[j] < other;
+                                       });
+
+            // note: cell items are sorted, each pair is visited once from
+            // its larger index
+            for(; it != end && *it < i && keys[*it] == key; ++it) {
+              const vec3 q = position(self, *it);
+              const vec3 d = {q[0] - p[0], q[1] - p[1], q[2] - p[2]};
+              if(d[0] * d[0] + d[1] * d[1] + d[2] * d[2] <=
+                 epsilon * epsilon) {
+                sets.unite(i, *it);
+              }
+            }
+          }
+        }
+      }
+    }
+  });
+
+  std::vector<index> res(count);
+  parallel(pool, count, [&](std::size_t first, std::size_t last) {
+    for(std::size_t i = first; i < last; ++i) res[i] = sets.find(i);
+  });
+
+  return res;
+}
+
+}
+
+
+// indexed triangles from polygon faces (fans), skipping triangles with
+// missing positions
+template<class Mesh>
+static triangles process(const Mesh& self, pool& pool,
+                         const options& opts={}) {
+  using namespace detail;
+
+  const std::vector<index> root = opts.epsilon > 0 ?
+    weld_near(self, opts.epsilon, pool) : weld_exact(self, pool);
+
+  // triangles per face, then corner elements
+  const std::size_t faces = self.faces();
+
+  const auto valid = [&](std::size_t a, std::size_t b, std::size_t c) {
+    return self.vertex[a] != none && self.vertex[b] != none &&
+      self.vertex[c] != none;
+  };
+
+  std::vector<std::size_t> starts(faces);
+  parallel(pool, faces, [&](std::size_t first, std::size_t last) {
+    for(std::size_t f = first; f < last; ++f) {
+      const std::size_t begin = self.offsets[f], end = self.offsets[f + 1];
+
+      std::size_t count = 0;
+      for(std::size_t e = begin + 1; e + 1 < end; ++e) {
+        count += valid(begin, e, e + 1);
+      }
+
+      starts[f] = count;
+    }
+  });
+
+  const std::size_t size = prefix(starts, pool);
+  if(size >= none / 3) throw std::runtime_error("mesh: too many triangles");
+
+  const std::size_t corners = 3 * size;
+  std::vector<std::size_t> elements(corners);
+
+  parallel(pool, faces, [&](std::size_t first, std::size_t last) {
+    for(std::size_t f = first; f < last; ++f) {
+      const std::size_t begin = self.offsets[f], end = self.offsets[f + 1];
+
+      std::size_t* out = elements.data() + 3 * starts[f];
+      for(std::size_t e = begin + 1; e + 1 < end; ++e) {
+        if(!valid(begin, e, e + 1)) continue;
+
+        out[0] = begin;
+        out[1] = e;
+        out[2] = e + 1;
+        out += 3;
+      }
+    }
+  });
+
+  // vertices are distinct (welded position, texcoord, normal) corners. note:
+  // sharded by position, so that corners around a position are contiguous
+  using key_type = std::array<index, 3>;
+  std::vector<key_type> keys(corners);
+
+  std::atomic<bool> missing(false);
+  parallel(pool, corners, [&](std::size_t first, std::size_t last) {
+    bool local = false;
+    for(std::size_t c = first; c < last; ++c) {
+      const std::size_t e = elements[c];
+      keys[c] = {root[self.vertex[e]], self.texcoord[e], self.normal[e]};
+      local = local || self.normal[e] == none;
+    }
+
+    if(local) missing = true;
+  });
+
+  const buckets b(keys, [](const key_type& key) {
+    return hash(std::array<index, 1>{{key[0]}}) % shards;
+  }, pool);
+
+  // area-weighted normals (cross products) of welded triangles
+  std::vector<vec3> facets;
+  if(missing) {
+    facets.resize(size);
+    parallel(pool, size, [&](std::size_t first, std::size_t last) {
+      for(std::size_t t = first; t < last; ++t) {
+        const vec3 p = position(self, keys[3 * t][0]);
+        const vec3 q = position(self, keys[3 * t + 1][0]);
+        const vec3 r = position(self, keys[3 * t + 2][0]);
+
+        facets[t] = cross({q[0] - p[0], q[1] - p[1], q[2] - p[2]},
+                          {r[0] - p[0], r[1] - p[1], r[2] - p[2]});
+      }
+    });
+  }
+
+  // first corner of each vertex, and smooth normals of welded positions
+  std::vector<index> first(corners), leader(corners);
+  std::vector<vec3> smooth(missing ? self.positions.size() / 3 : 0);
+  std::vector<std::size_t> welded(shards);
+
+  pool.split(std::size_t(0), shards, [&](std::size_t s) {
+    const std::size_t begin = b.bounds[s], end = b.bounds[s + 1];
+
+    for(std::size_t j = begin; j < end; ++j) {
+      const index c = b.items[j];
+      const bool head = j == begin || keys[b.items[j - 1]] != keys[c];
+
+      first[c] = head ? c : first[b.items[j - 1]];
+      leader[c] = head;
+    }
+
+    // note: summed in corner order
+    for(std::size_t j = begin; j < end;) {
+      const index p = keys[b.items[j]][0];
+      vec3 sum = {0, 0, 0};
+
+      for(; j < end && keys[b.items[j]][0] == p; ++j) {
+        if(!missing) continue;
+
+        const vec3& n = facets[b.items[j] / 3];
+        for(std::size_t k = 0; k < 3; ++k) sum[k] += n[k];
+      }
+
+      ++welded[s];
+      if(!missing) continue;
+
+      // note: degenerate neighborhoods keep a zero normal
+      const real norm = std::sqrt(sum[0] * sum[0] + sum[1] * sum[1] +
+                                  sum[2] * sum[2]);
+      if(norm > 0) {
+        for(std::size_t k = 0; k < 3; ++k) sum[k] /= norm;
+      }
+
+      smooth[p] = sum;
+    }
+  }).get();
+
+  // vertices numbered in first-use order
+  const std::size_t vertices = prefix(leader, pool);
+
+  triangles res;
+  for(std::size_t count: welded) res.welded += count;
+
+  res.indices.resize(corners);
+  res.positions.resize(vertices);
+  res.normals.resize(vertices);
+
+  const bool textured = self.texcoords.size() > 0;
+  if(textured) res.texcoords.resize(vertices);
+
+  parallel(pool, corners, [&](std::size_t begin, std::size_t end) {
+    for(std::size_t c = begin; c < end; ++c) {
+      const index v = leader[first[c]];
+      res.indices[c] = v;
+
+      if(first[c] != c) continue;
+
+      const key_type& key = keys[c];
+
+      const vec3 p = position(self, key[0]);
+      res.positions[v] = {float(p[0]), float(p[1]), float(p[2])};
+
+      if(key[2] != none) {
+        res.normals[v] = {float(self.normals[3 * key[2]]),
+                          float(self.normals[3 * key[2] + 1]),
+                          float(self.normals[3 * key[2] + 2])};
+      } else {
+        const vec3& n = smooth[key[0]];
+        res.normals[v] = {float(n[0]), float(n[1]), float(n[2])};
+      }
+
+      if(!textured) continue;
+
+      if(key[1] != none) {
+        res.texcoords[v] = {float(self.texcoords[2 * key[1]]),
+                            float(self.texcoords[2 * key[1] + 1])};
+      } else {
+        res.texcoords[v] = {0, 0};
+      }
+    }
+  });
+
+  return res;
+}
+
+}
+
+#endif
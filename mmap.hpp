@@ -0,0 +1,67 @@
+#ifndef CPP_MMAP_HPP
+#define CPP_MMAP_HPP
+
+#include <string>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// read-only memory-mapped file
+class mapped_file {
+  const char* data = nullptr;
+  std::size_t length = 0;
+
+  static std::runtime_error failure(std::string what, std::string filename) {
+    return std::runtime_error(what + " " + filename + ": " +
+                              std::strerror(errno));
+  }
+
+public:
+  mapped_file(std::string filename) {
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0) throw failure("cannot open", filename);
+
+    struct stat info;
+    if(::fstat(fd, &info) < 0) {
+      ::close(fd);
+      throw failure("cannot stat", filename);
+    }
+
+    length = info.st_size;
+
+    // note: empty files cannot be mapped
+    if(length) {
+      void* ptr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(ptr == MAP_FAILED) {
+        ::close(fd);
+        throw failure("cannot map", filename);
+      }
+
+      // sequential access hint, errors are harmless
+      ::madvise(ptr, length, MADV_SEQUENTIAL);
+      data = static_cast<const char*>(ptr);
+    }
+
+    ::close(fd);
+  }
+
+  ~mapped_file() {
+    if(data) ::munmap(const_cast<char*>(data), length);
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  const char* begin() const { return data; }
+  const char* end() const { return data + length; }
+
+  std::size_t size() const { return length; }
+};
+
+
+#endif
@@ -1,29 +1,99 @@
-// -*- compile-command: "c++ -std=c++14 obj.cpp -o obj -lstdc++ -lm -g" -*-
-#include "obj.hpp"
+// -*- compile-command: "c++ -std=c++14 -O3 obj.cpp -o obj -lstdc++ -lm -lpthread -g" -*-
+#include "mesh_cache.hpp"
+#include "timer.hpp"
 
-#include <fstream>
 #include <iostream>
+#include <fstream>
+#include <limits>
 
 
+// counts and bounds, in constant memory
+struct summary: obj::handler {
+  std::size_t vertices = 0, normals = 0, texcoords = 0, faces = 0;
+  std::size_t groups = 0, objects = 0;
 
-int main(int argc, char** argv) {
-  obj::file f;
+  obj::vec3 min = {std::numeric_limits<obj::real>::infinity(),
+                   std::numeric_limits<obj::real>::infinity(),
+                   std::numeric_limits<obj::real>::infinity()};
+  obj::vec3 max = {-min.x, -min.y, -min.z};
+  
+  void vertex(const obj::vec3& v) {
+    ++vertices;
+    min = {std::min(min.x, v.x), std::min(min.y, v.y), std::min(min.z, v.z)};
+    max = {std::max(max.x, v.x), std::max(max.y, v.y), std::max(max.z, v.z)};
+  }
 
-  if(argc <= 1) {
-    std::cerr << "usage: " << argv[0] << " <objfile>" << std::endl;
+  void normal(const obj::vec3&) { ++normals; }
+  void texcoord(const obj::texcoord&) { ++texcoords; }
+  void face(const obj::element*, const obj::element*) { ++faces; }
+  void group(const std::string&) { ++groups; }
+  void object(const std::string&) { ++objects; }
+};
+
+
+static int stream(const std::string& filename) {
+  std::ifstream in(filename, std::ios::binary);
+  if(!in) {
+    std::cerr << "cannot open " << filename << std::endl;
     return 1;
   }
-  const std::string filename = argv[1];
+
+  summary self;
   
-  std::ifstream in(filename);
-  if(!in) {
-    std::cerr << "cannot read: " << filename << std::endl;
+  try {
+    const double time = with_time([&] { obj::stream(in, self); });
+    
+    std::cout << "streamed " << filename << ": "
+              << self.vertices << " vertices, "
+              << self.normals << " normals, "
+              << self.texcoords << " texcoords, "
+              << self.faces << " faces, "
+              << self.groups << " groups, "
+              << self.objects << " objects in "
+              << time << "s" << std::endl;
+
+    if(self.vertices) {
+      std::cout << "bounds: " << self.min.x << " " << self.min.y << " "
+                << self.min.z << " / " << self.max.x << " " << self.max.y
+                << " " << self.max.z << std::endl;
+    }
+  } catch(std::runtime_error& e) {
+    std::cerr << e.what() << std::endl;
     return 1;
   }
 
+  return 0;
+}
+
+
+int main(int argc, char** argv) {
+  if(argc <= 1) {
+    std::cerr << "usage: " << argv[0] << " [--stream] <objfile>" << std::endl;
+    return 1;
+  }
+
+  if(argc > 2 && argv[1] == std::string("--stream")) {
+    return stream(argv[2]);
+  }
+  
+  const std::string filename = argv[1];
+
+  pool pool;
+  mesh_cache::mesh buffers;
+  
   try {
-    in >> f;
-    std::cout << "read " << filename << std::endl;
+    const double time = with_time([&] {
+      buffers = mesh_cache::load(filename, pool);
+    });
+    
+    std::cout << (buffers.cached ? "mapped " : "read ") << filename << ": "
+              << buffers.positions.size() / 3 << " vertices, "
+              << buffers.normals.size() / 3 << " normals, "
+              << buffers.texcoords.size() / 2 << " texcoords, "
+              << buffers.faces() << " faces, "
+              << buffers.groups.size() << " groups, "
+              << buffers.objects.size() << " objects in "
+              << time << "s" << std::endl;
   } catch(std::runtime_error& e) {
     std::cerr << e.what() << std::endl;
     return 1;
@@ -2,6 +2,17 @@
 #define OBJ_HPP
 
 #include "parser.hpp"
+#include "mmap.hpp"
+#include "task.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <deque>
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
 
 
 namespace obj {
@@ -154,156 +165,783 @@ struct file {
 
     using namespace parser;
 
-    // const auto space = pred(std::isblank);
     const auto space = pred(std::isblank);    
 
     const auto endl = single('\n');
     const auto not_endl = pred([](int x) -> int { return x != '\n'; });
 
     const auto comment = single('#') >> skip(not_endl) >> endl;
-    const auto separator = space | comment;
-    
-    const auto g = token(keyword("g"), space);
-    const auto o = token(keyword("o"), space);
 
-    const auto v = token(keyword("v"), space);
-    const auto vn = token(keyword("vn"), space);
-    const auto vt = token(keyword("vt"), space);
-    
-    const auto f = token(keyword("f"), space);
-    const auto mtllib = token(keyword("mtllib"), space);
+    // note: keywords are followed by a blank, so that "v" does not match "vn"
+    const auto word = [=](const char* value) {
+      return token(keyword(value) >> space, space);
+    };
     
-    const auto name = token(plus(pred(std::isgraph)), space);
-    const auto newline = token(endl, space);
+    const auto v = word("v");
+    const auto vn = word("vn");
+    const auto vt = word("vt");
+    const auto f = word("f");
     
-    const auto section = [=](auto what) {
-      return what >> name >>= drop(newline);
-    };
+    const auto newline = token(endl | comment, space);
     
     const auto number = token(_double);
     
     const auto vec3 = number >>= [=](real x) {
       return number >>= [=](real y) {
-        return number >>= [=](real z) {
-          return pure(obj::vec3{x, y, z}); };
+        return number |= [=](real z) { return obj::vec3{x, y, z}; };
       };
     };
-    
-    const auto vertex_def = v >> vec3 >>= [=](obj::vec3 v) {
-      return pure(obj::vertex(v)) >>= drop(newline);
-    };
 
-    const auto normal_def = vn >> vec3 >>= [=](obj::vec3 v) {
-      return pure(obj::normal(v)) >>= drop(newline);
-    };
+    // note: appended to self as parsed
+    obj::geometry& geo = self.geometry;
 
-    const auto texcoord_def = vt >> number >>= [=](auto u) {
-      return number >>= [=](auto v) {
-        return pure(obj::texcoord{u, v}) >>= drop(newline);
+    const auto append_to = [](auto& where) {
+      return [&where](auto value) {
+        where.emplace_back(std::move(value));
+        return unit{};
       };
     };
+    
+    const auto vertex = v > (vec3 << newline) |= append_to(geo.vertices);
+    const auto normal = vn > (vec3 << newline) |= append_to(geo.normals);
 
+    const auto texcoord_def = number >>= [=](real u) {
+      return number |= [=](real v) { return obj::texcoord{u, v}; };
+    };
     
-    const auto index = token(_unsigned_long);
-    const auto slash = token(single('/'));
+    const auto texcoord = vt > (texcoord_def << newline) |= append_to(geo.texcoords);
+
+    // vertex[/[texcoord][/normal]], missing indices are -1
+    const std::size_t missing = -1;
     
-    const auto element = (index % slash) >>= [](auto indices) {
-      face::element e;
-      for(std::size_t i = 0; i < 3; ++i) {
-        e.data[i] = i <= indices.size() ? indices[i] : 0;
-      }
+    const auto index = token(_unsigned_long);
+    const auto slash = single('/');
 
-      return pure(e);
+    const auto make_element = [](std::size_t vertex, std::size_t texcoord,
+                                 std::size_t normal) {
+      face::element e;
+      e.vertex = vertex;
+      e.texcoord = texcoord;
+      e.normal = normal;
+      return e;
     };
     
+    const auto element = index >>= [=](std::size_t vertex) {
+      const auto texcoord = index | pure(missing);
+      const auto normal = (slash >> index) | pure(missing);
+
+      const auto attributes = slash >> texcoord >>= [=](std::size_t texcoord) {
+        return normal |= [=](std::size_t normal) {
+          return make_element(vertex, texcoord, normal);
+        };
+      };
+      
+      return attributes | pure(make_element(vertex, missing, missing));
+    };
+
     // TODO check there's at least three elements?
-    const auto face_def = f >> plus(element) >>= [=](auto elements) {
-      return pure(face{std::move(elements)}) >>= drop(newline);
+    const auto elements = fold(element, std::deque<face::element>(),
+                               [](auto& elements, face::element e) {
+                                 elements.push_back(e);
+                               }, 1);
+    
+    const auto face = f > (elements << newline) |= [&](auto elements) {
+      geo.faces.push_back({std::move(elements)});
+      return unit{};
     };
 
-    const auto geometry = pure(obj::geometry{}) >>= [=](obj::geometry geo) {
+    // TODO mtllib, parameters, groups, objects
+    const auto blank = pred(std::isspace) | comment;
+    const auto line = token(vertex | normal | texcoord | face, blank);
+    
+    const auto parser = skip(line) >> skip(blank) >> eos;
 
-      const auto append_to = [&](auto& where) {
-        return [&](auto value) {
-          where.emplace_back(value);
-          return pure(true);
-        };
-      };
+    const std::string contents = parser::read(in);
+    run(parser, contents);
+    return in;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// flat loader: memory-mapped files are parsed in parallel, in line-aligned
+// chunks, into contiguous structure-of-arrays buffers
+////////////////////////////////////////////////////////////////////////////////
+
+using index = std::uint32_t;
+static constexpr index none = -1;
+
+// named range of faces
+struct range {
+  std::string name;
+  std::size_t first, last;
+};
+
+
+struct buffers {
+  // xyz, xyz, uv
+  std::vector<real> positions;
+  std::vector<real> normals;
+  std::vector<real> texcoords;
+
+  // face i has elements offsets[i] to offsets[i + 1]
+  std::vector<std::size_t> offsets = {0};
+
+  // zero-based element indices, or none
+  std::vector<index> vertex;
+  std::vector<index> texcoord;
+  std::vector<index> normal;
+
+  std::vector<range> groups;
+  std::vector<range> objects;
+
+  std::size_t faces() const { return offsets.size() - 1; }
+};
+
+
+namespace detail {
+
+static inline bool digit(char c) { return unsigned(c - '0') < 10; }
+static inline bool blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+
+// decimal number without locale. the significand is exact in a double and
+// powers of ten up to 1e22 are exact, so that a single division/product rounds
+// correctly. other numbers fall back to strtod.
+static const char* parse(const char* first, const char* last, real& out) {
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  
+  const char* it = first;
+  
+  const bool negative = it != last && *it == '-';
+  if(it != last && (*it == '-' || *it == '+')) ++it;
+
+  std::uint64_t significand = 0;
+  int digits = 0, exponent = 0;
+  bool any = false;
+  
+  for(; it != last && digit(*it); ++it, any = true) {
+    if(significand || *it != '0') ++digits;
+    significand = 10 * significand + (*it - '0');
+  }
+
+  if(it != last && *it == '.') {
+    for(++it; it != last && digit(*it); ++it, any = true) {
+      if(significand || *it != '0') ++digits;
+      significand = 10 * significand + (*it - '0');
+      --exponent;
+    }
+  }
+
+  if(!any) return first;
+  
+  if(it != last && (*it == 'e' || *it == 'E')) {
+    const char* e = it + 1;
+    const bool minus = e != last && *e == '-';
+    if(e != last && (*e == '-' || *e == '+')) ++e;
+
+    if(e != last && digit(*e)) {
+      int value = 0;
+      for(; e != last && digit(*e); ++e) {
+        if(value < 10000) value = 10 * value + (*e - '0');
+      }
+      
+      exponent += minus ? -value : value;
+      it = e;
+    }
+  }
+
+  if(digits > 19 || significand > (std::uint64_t(1) << 53) ||
+     exponent < -22 || exponent > 22) {
+    // note: mapped files are not null-terminated
+    const std::string token(first, it);
+    out = std::strtod(token.c_str(), nullptr);
+    return it;
+  }
+  
+  const double value = double(significand);
+  out = exponent < 0 ? value / pow10[-exponent] : value * pow10[exponent];
+  if(negative) out = -out;
+  
+  return it;
+}
+
+
+static const char* parse(const char* first, const char* last, long& out) {
+  const char* it = first;
+
+  const bool negative = it != last && *it == '-';
+  if(it != last && (*it == '-' || *it == '+')) ++it;
+
+  if(it == last || !digit(*it)) return first;
+
+  long value = 0;
+  for(; it != last && digit(*it); ++it) {
+    value = 10 * value + (*it - '0');
+  }
+
+  out = negative ? -value : value;
+  return it;
+}
+
+
+// line-level helpers over complete lines
+struct lexer {
+  const char* first = nullptr;
+  const char* last = nullptr;
+
+  std::runtime_error error(const char* where) const {
+    return std::runtime_error("obj: parse error near: " +
+                              std::string(where, std::find(where, last, '\n')));
+  }
+  
+  const char* skip(const char* it) const {
+    while(it != last && blank(*it)) ++it;
+    return it;
+  }
+
+  const char* skip_line(const char* it) const {
+    it = std::find(it, last, '\n');
+    return it == last ? it : it + 1;
+  }
+
+  // name until end of line or comment, without surrounding blanks
+  const char* name(const char* it, std::string& out) const {
+    it = skip(it);
+    const char* end = it;
+    while(end != last && *end != '\n' && *end != '#') ++end;
+    while(end != it && blank(end[-1])) --end;
+
+    out.assign(it, end);
+    return skip_line(end);
+  }
+  
+  static bool keyword(const char* it, const char* last, const char* word) {
+    for(; *word; ++word, ++it) {
+      if(it == last || *it != *word) return false;
+    }
+
+    return it == last || blank(*it) || *it == '\n';
+  }
+};
+
+
+// parsed file chunk. relative (negative) indices are resolved against local
+// counts and fixed once chunk offsets are known.
+struct chunk: lexer {
+  std::vector<real> positions, normals, texcoords;
+
+  // elements per face
+  std::vector<index> counts;
+  std::vector<index> vertex, texcoord, normal;
+
+  // relative element indices, per attribute
+  std::vector<std::size_t> relative[3];
+
+  // largest absolute (1-based) and smallest relative (local) index per
+  // attribute, with their location: checked once chunk offsets are known
+  long highest[3] = {}, lowest[3] = {};
+  const char* above[3] = {};
+  const char* below[3] = {};
+
+  // group/object names, by local face index
+  std::vector<std::pair<std::size_t, std::string>> groups, objects;
+
+  template<std::size_t N>
+  const char* numbers(const char* it, std::vector<real>& out) {
+    for(std::size_t i = 0; i < N; ++i) {
+      real value;
+      const char* next = detail::parse(skip(it), last, value);
+      if(next == skip(it)) throw error(it);
+      
+      out.push_back(value);
+      it = next;
+    }
+
+    // note: optional extra coordinates are ignored
+    return skip_line(it);
+  }
+
+  // element attribute: absolute (1-based), relative (negative), or missing
+  const char* attribute(const char* it, std::size_t k, std::vector<index>& out,
+                        std::size_t count) {
+    long value;
+    const char* next = detail::parse(it, last, value);
+    if(next == it) {
+      out.push_back(none);
+      return it;
+    }
+
+    if(value > 0 && value <= long(none)) {
+      if(value > highest[k]) {
+        highest[k] = value;
+        above[k] = it;
+      }
       
-      const auto vertex = vertex_def >>= append_to(geo.vertices);
-      const auto normal = normal_def >>= append_to(geo.normals);
-      const auto texcoord = texcoord_def >>= append_to(geo.texcoords);
-      const auto face = face_def >>= append_to(geo.faces);
+      out.push_back(value - 1);
+    } else if(value < 0 && -value <= long(none)) {
+      if(long(count) + value < lowest[k]) {
+        lowest[k] = long(count) + value;
+        below[k] = it;
+      }
+      
+      // note: may wrap around, referring to a previous chunk
+      relative[k].push_back(out.size());
+      out.push_back(index(count + value));
+    } else {
+      throw error(it);
+    }
+    
+    return next;
+  }
+  
+  const char* face(const char* it) {
+    index count = 0;
+    
+    while(true) {
+      it = skip(it);
+      if(it == last || *it == '\n' || *it == '#') break;
 
-      // TODO mtllib, parameters
+      const char* start = it;
+      it = attribute(it, 0, vertex, positions.size() / 3);
+      if(it == start) throw error(start);
       
-      const auto line = token(vertex | normal | texcoord | face,
-                              pred(std::isspace) | comment);
-        
-      return skip(line) >> pure(std::move(geo));
+      if(it != last && *it == '/') {
+        it = attribute(it + 1, 1, texcoord, texcoords.size() / 2);
+        if(it != last && *it == '/') {
+          it = attribute(it + 1, 2, normal, normals.size() / 3);
+        } else {
+          normal.push_back(none);
+        }
+      } else {
+        texcoord.push_back(none);
+        normal.push_back(none);
+      }
+      
+      ++count;
+    }
+
+    if(count < 3) throw error(it);
+    counts.push_back(count);
+    
+    return skip_line(it);
+  }
+
+  const char* name(const char* it, std::vector<std::pair<std::size_t, std::string>>& out) {
+    out.emplace_back(counts.size(), std::string());
+    return lexer::name(it, out.back().second);
+  }
+  
+  void parse() {
+    for(const char* it = first; it != last;) {
+      it = skip(it);
+      if(it == last) break;
+
+      switch(*it) {
+      case '\n': ++it; break;
+      case 'v':
+        if(keyword(it, last, "v")) it = numbers<3>(it + 1, positions);
+        else if(keyword(it, last, "vn")) it = numbers<3>(it + 2, normals);
+        else if(keyword(it, last, "vt")) it = numbers<2>(it + 2, texcoords);
+        else it = skip_line(it);
+        break;
+      case 'f':
+        it = keyword(it, last, "f") ? face(it + 1) : skip_line(it);
+        break;
+      case 'g':
+        it = keyword(it, last, "g") ? name(it + 1, groups) : skip_line(it);
+        break;
+      case 'o':
+        it = keyword(it, last, "o") ? name(it + 1, objects) : skip_line(it);
+        break;
+      default:
+        // TODO materials, smoothing groups, lines
+        it = skip_line(it);
+      }
+    }
+  }
+};
+
+
+// name markers to face ranges
+static std::vector<range> ranges(
+    const std::vector<std::pair<std::size_t, std::string>>& markers,
+    std::size_t faces) {
+  std::vector<range> res;
+  for(std::size_t i = 0, n = markers.size(); i < n; ++i) {
+    const std::size_t last = i + 1 < n ? markers[i + 1].first : faces;
+    res.push_back({markers[i].second, markers[i].first, last});
+  }
+
+  return res;
+}
+
+}
+
+
+static buffers load(const std::string& filename, pool& pool) {
+  const mapped_file contents(filename);
+
+  // line-aligned chunks
+  const std::size_t n = std::max<std::size_t>(pool.size(), 1);
+  std::vector<detail::chunk> chunks(n);
+  
+  const char* first = contents.begin();
+  for(std::size_t i = 0; i < n; ++i) {
+    const char* last = i + 1 == n ? contents.end() :
+      std::find(std::max(first, contents.begin() + contents.size() * (i + 1) / n),
+                contents.end(), '\n');
+    if(last != contents.end()) ++last;
+    
+    chunks[i].first = first;
+    chunks[i].last = last;
+    first = last;
+  }
+
+  // note: errors are rethrown once all chunks are done
+  std::vector<std::exception_ptr> errors(n);
+  pool.split(std::size_t(0), n, [&](std::size_t i) {
+    try {
+      chunks[i].parse();
+    } catch(std::runtime_error&) {
+      errors[i] = std::current_exception();
+    }
+  }).get();
+
+  for(const auto& error: errors) {
+    if(error) std::rethrow_exception(error);
+  }
+
+  // chunk offsets into buffers
+  struct offset {
+    std::size_t positions, normals, texcoords, faces, elements;
+  };
+  
+  std::vector<offset> offsets(n + 1);
+  for(std::size_t i = 0; i < n; ++i) {
+    const detail::chunk& c = chunks[i];
+    offsets[i + 1] = {
+      offsets[i].positions + c.positions.size(),
+      offsets[i].normals + c.normals.size(),
+      offsets[i].texcoords + c.texcoords.size(),
+      offsets[i].faces + c.counts.size(),
+      offsets[i].elements + c.vertex.size()
     };
+  }
+
+  const offset& total = offsets.back();
+  if(total.positions / 3 >= none || total.normals / 3 >= none ||
+     total.texcoords / 2 >= none) {
+    throw std::runtime_error("obj: too many vertices");
+  }
+
+  // out-of-range indices
+  const std::size_t size[] = {total.positions / 3, total.texcoords / 2,
+                              total.normals / 3};
+  for(std::size_t i = 0; i < n; ++i) {
+    const detail::chunk& c = chunks[i];
+    const std::size_t shift[] = {offsets[i].positions / 3,
+                                 offsets[i].texcoords / 2,
+                                 offsets[i].normals / 3};
     
-    // static const auto group = debug("group") <<=
-    //     group_def >> [&](std::vector<char>&& name) {
-    //       return geometry >> [&](obj::geometry&& geo) {
-    //         obj::group self;
-    //         self.name = {name.begin(), name.end()};
-    //         self.geo = std::move(geo);
-    //         return pure(self);
-    //       };
-    //     };
-
-
-    // static const auto object = debug("object") <<=
-    //     object_def >> [&](std::vector<char>&& name) {
-    //       return geometry >> [&](obj::geometry&& geo) {
-    //         return *group >> [&](std::vector<obj::group>&& groups) {
-    //           obj::object self;
-    //           self.name = {name.begin(), name.end()};
-    //           self.geo = std::move(geo);
-    //           self.groups = std::move(groups);
-
-    //           return pure(self);
-    //         };
-    //       };
-    //     };
-
-
-    const auto file = geometry >>= [](auto geo) {
-      obj::file file;
-      file.geometry = std::move(geo);
-      return pure(std::move(file));
+    for(std::size_t k = 0; k < 3; ++k) {
+      if(std::size_t(c.highest[k]) > size[k]) throw c.error(c.above[k]);
+      if(long(shift[k]) + c.lowest[k] < 0) throw c.error(c.below[k]);
+    }
+  }
+
+  buffers res;
+  res.positions.resize(total.positions);
+  res.normals.resize(total.normals);
+  res.texcoords.resize(total.texcoords);
+  res.offsets.resize(total.faces + 1);
+  res.vertex.resize(total.elements);
+  res.texcoord.resize(total.elements);
+  res.normal.resize(total.elements);
+
+  // concatenate chunks
+  pool.split(std::size_t(0), n, [&](std::size_t i) {
+    const detail::chunk& c = chunks[i];
+    const offset& at = offsets[i];
+
+    std::copy(c.positions.begin(), c.positions.end(),
+              res.positions.begin() + at.positions);
+    std::copy(c.normals.begin(), c.normals.end(),
+              res.normals.begin() + at.normals);
+    std::copy(c.texcoords.begin(), c.texcoords.end(),
+              res.texcoords.begin() + at.texcoords);
+
+    std::size_t elements = at.elements;
+    for(std::size_t j = 0, m = c.counts.size(); j < m; ++j) {
+      elements += c.counts[j];
+      res.offsets[at.faces + j + 1] = elements;
+    }
+
+    index* const outputs[] = {
+      res.vertex.data() + at.elements,
+      res.texcoord.data() + at.elements,
+      res.normal.data() + at.elements
     };
     
-    // static const auto file = debug("file") <<=
-    //     geometry >> [&](obj::geometry&& geo) {
-    //       return *group >> [&](std::vector<obj::group>&& groups) {
-    //         return *object >> [&](std::vector<obj::object>&& objects) {
-    //           obj::file self;
-    //           self.geo = std::move(geo);
-    //           self.groups = std::move(groups);
-    //           self.objects = std::move(objects);
-
-    //           return pure(self);
-    //         };
-    //       };
-    //     };
-
-    // static const auto parser = file;
-
-    // if(auto result = parser(in)) {
-    //   self = std::move(result.get());
-    // } else {
-    //   throw std::runtime_error("parse error");
-    // }
-    const auto parser = file >>= drop(eos);
+    const std::vector<index>* const inputs[] = {&c.vertex, &c.texcoord, &c.normal};
+    const std::size_t shift[] = {at.positions / 3, at.texcoords / 2, at.normals / 3};
+    
+    for(std::size_t k = 0; k < 3; ++k) {
+      std::copy(inputs[k]->begin(), inputs[k]->end(), outputs[k]);
+      
+      for(std::size_t j: c.relative[k]) {
+        outputs[k][j] += shift[k];
+      }
+    }
+  }).get();
 
-    const std::string contents = parser::read(in);
-    self = run(parser, contents);
-    return in;
+  // note: few markers, no need for parallelism here
+  std::vector<std::pair<std::size_t, std::string>> groups, objects;
+  for(std::size_t i = 0; i < n; ++i) {
+    for(const auto& it: chunks[i].groups) {
+      groups.emplace_back(offsets[i].faces + it.first, it.second);
+    }
+
+    for(const auto& it: chunks[i].objects) {
+      objects.emplace_back(offsets[i].faces + it.first, it.second);
+    }
   }
+
+  res.groups = detail::ranges(groups, total.faces);
+  res.objects = detail::ranges(objects, total.faces);
+  
+  return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// streaming parser: records are handed to a handler as they are parsed, from a
+// fixed-size read buffer, so that memory use does not depend on file size
+////////////////////////////////////////////////////////////////////////////////
+
+// face element: zero-based indices, or none
+struct element {
+  index vertex, texcoord, normal;
 };
 
+
+// handlers derive from this and hide the records they are interested in
+struct handler {
+  void vertex(const vec3&) { }
+  void normal(const vec3&) { }
+  void texcoord(const obj::texcoord&) { }
+
+  // face elements, valid during the call only
+  void face(const element*, const element*) { }
+  
+  void group(const std::string&) { }
+  void object(const std::string&) { }
+};
+
+
+namespace detail {
+
+// complete lines to handler calls. relative indices are resolved against
+// running counts, absolute ones are passed as is since they may refer to
+// vertices to come. as with load, indices that cannot be represented or that
+// refer before the first vertex are errors.
+template<class Handler>
+struct records: lexer {
+  Handler& handler;
+
+  std::size_t positions = 0, normals = 0, texcoords = 0;
+
+  // current face and name, reused
+  std::vector<element> elements;
+  std::string name;
+  
+  records(Handler& handler): handler(handler) { }
+
+  template<std::size_t N>
+  const char* numbers(const char* it, real* out) const {
+    for(std::size_t i = 0; i < N; ++i) {
+      const char* start = skip(it);
+      it = detail::parse(start, last, out[i]);
+      if(it == start) throw error(start);
+    }
+
+    // note: optional extra coordinates are ignored
+    return skip_line(it);
+  }
+
+  const char* attribute(const char* it, index& out, std::size_t count) const {
+    long value;
+    const char* next = detail::parse(it, last, value);
+    if(next == it) {
+      out = none;
+      return it;
+    }
+
+    if(value > 0 && value <= long(none)) {
+      out = index(value - 1);
+    } else if(value < 0 && std::size_t(-value) <= count) {
+      out = index(count + value);
+    } else {
+      throw error(it);
+    }
+    
+    return next;
+  }
+  
+  const char* face(const char* it) {
+    elements.clear();
+    
+    while(true) {
+      it = skip(it);
+      if(it == last || *it == '\n' || *it == '#') break;
+
+      element e = {none, none, none};
+      
+      const char* start = it;
+      it = attribute(it, e.vertex, positions);
+      if(it == start) throw error(start);
+      
+      if(it != last && *it == '/') {
+        it = attribute(it + 1, e.texcoord, texcoords);
+        if(it != last && *it == '/') {
+          it = attribute(it + 1, e.normal, normals);
+        }
+      }
+
+      elements.push_back(e);
+    }
+
+    if(elements.size() < 3) throw error(it);
+    handler.face(elements.data(), elements.data() + elements.size());
+    
+    return skip_line(it);
+  }
+
+  void parse(const char* first, const char* last) {
+    this->first = first;
+    this->last = last;
+
+    real values[3];
+    
+    for(const char* it = first; it != last;) {
+      it = skip(it);
+      if(it == last) break;
+
+      switch(*it) {
+      case '\n': ++it; break;
+      case 'v':
+        if(keyword(it, last, "v")) {
+          it = numbers<3>(it + 1, values);
+          handler.vertex(vec3{values[0], values[1], values[2]});
+          ++positions;
+        } else if(keyword(it, last, "vn")) {
+          it = numbers<3>(it + 2, values);
+          handler.normal(vec3{values[0], values[1], values[2]});
+          ++normals;
+        } else if(keyword(it, last, "vt")) {
+          it = numbers<2>(it + 2, values);
+          handler.texcoord(obj::texcoord{values[0], values[1]});
+          ++texcoords;
+        } else {
+          it = skip_line(it);
+        }
+        break;
+      case 'f':
+        it = keyword(it, last, "f") ? face(it + 1) : skip_line(it);
+        break;
+      case 'g':
+        if(keyword(it, last, "g")) {
+          it = lexer::name(it + 1, name);
+          handler.group(name);
+        } else {
+          it = skip_line(it);
+        }
+        break;
+      case 'o':
+        if(keyword(it, last, "o")) {
+          it = lexer::name(it + 1, name);
+          handler.object(name);
+        } else {
+          it = skip_line(it);
+        }
+        break;
+      default:
+        it = skip_line(it);
+      }
+    }
+  }
+};
+
+
+// read(char* out, std::size_t size) returns the number of bytes read into out,
+// zero at end of file. the buffer only grows for lines longer than itself.
+template<class Handler, class Read>
+static void stream(Handler& handler, std::size_t size, const Read& read) {
+  std::vector<char> buffer(std::max<std::size_t>(size, 1));
+  records<Handler> parser(handler);
+  
+  // pending bytes: an incomplete line
+  std::size_t pending = 0;
+  
+  while(true) {
+    if(pending == buffer.size()) buffer.resize(2 * buffer.size());
+    
+    const std::size_t count = read(buffer.data() + pending,
+                                   buffer.size() - pending);
+    const char* first = buffer.data();
+    const char* last = first + pending + count;
+
+    if(!count) {
+      parser.parse(first, last);
+      return;
+    }
+
+    // complete lines only. note: pending bytes hold no newline
+    const char* end = last;
+    while(end != first + pending && end[-1] != '\n') --end;
+    if(end == first + pending) {
+      pending += count;
+      continue;
+    }
+
+    parser.parse(first, end);
+
+    pending = last - end;
+    std::copy(end, last, buffer.data());
+  }
+}
+
+}
+
+
+static constexpr std::size_t buffer_size = 1 << 16;
+
+template<class Handler>
+static void stream(std::istream& in, Handler& handler,
+                   std::size_t size=buffer_size) {
+  detail::stream(handler, size, [&](char* out, std::size_t size) {
+    in.read(out, size);
+    if(in.bad()) throw std::runtime_error("obj: read error");
+    return std::size_t(in.gcount());
+  });
+}
+
+
+template<class Handler>
+static void stream(int fd, Handler& handler, std::size_t size=buffer_size) {
+  detail::stream(handler, size, [&](char* out, std::size_t size) {
+    while(true) {
+      const ssize_t count = ::read(fd, out, size);
+      if(count >= 0) return std::size_t(count);
+      if(errno != EINTR) {
+        throw std::runtime_error(std::string("obj: read error: ") +
+                                 std::strerror(errno));
+      }
+    }
+  });
+}
+
 } // namespace obj
 
 
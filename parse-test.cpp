@@ -0,0 +1,73 @@
+#include "parse.hpp"
+
+#include <gtest/gtest.h>
+
+using namespace parser;
+
+
+// non-seekable source over a string, e.g. a pipe with buffered data
+struct unseekable: std::streambuf {
+  std::string data;
+
+  unseekable(std::string data): data(data) {
+    setg(&this->data[0], &this->data[0], &this->data[0] + this->data.size());
+  }
+};
+
+
+TEST(parse, rest) {
+  std::stringstream ss("12 y rest");
+
+  const char* res;
+  ASSERT_TRUE(parse(res, token("12"), ss));
+
+  std::string word;
+  ASSERT_TRUE(ss >> word);
+  EXPECT_EQ(word, "y");
+
+  ASSERT_TRUE(ss >> word);
+  EXPECT_EQ(word, "rest");
+}
+
+
+TEST(parse, lookahead) {
+  std::stringstream ss("12 y");
+
+  // note: reads the blank after the value
+  int res;
+  ASSERT_TRUE(parse(res, value<int>(), ss));
+  EXPECT_EQ(res, 12);
+
+  std::string word;
+  ASSERT_TRUE(ss >> word);
+  EXPECT_EQ(word, "y");
+}
+
+
+TEST(parse, failure) {
+  std::stringstream ss("12 y");
+
+  const char* res;
+  ASSERT_FALSE(parse(res, (token("12") >>= token("x")), ss));
+  ss.clear();
+
+  std::string word;
+  ASSERT_TRUE(ss >> word);
+  EXPECT_EQ(word, "12");
+}
+
+
+TEST(parse, unseekable) {
+  unseekable buf("12 y rest");
+  std::istream in(&buf);
+
+  const char* res;
+  ASSERT_FALSE(parse(res, (token("12") >>= token("x")), in));
+  in.clear();
+
+  ASSERT_TRUE(parse(res, token("12"), in));
+
+  std::string word;
+  ASSERT_TRUE(in >> word);
+  EXPECT_EQ(word, "y");
+}
@@ -3,8 +3,11 @@
 
 #include <deque>
 #include <array>
+#include <vector>
+#include <string>
 #include <type_traits>
-#include <iosfwd>
+#include <istream>
+#include <streambuf>
 
 #include <functional>
 #include <cassert>
@@ -16,7 +19,8 @@
 // a small parser combinator library, loosely based on "Monadic Parser
 // Combinators" by Hutton & Meijer.
 
-// each parser call is either:
+// parsers run on a cursor, an input stream over a buffered source. each
+// parser call is either:
 
 // 1. successful and the stream has the failbit **not** set
 
@@ -25,12 +29,214 @@
 
 namespace parser {
 
+// input stream buffering its source in chunks, so that parsers may backtrack
+// on non-seekable sources (pipes, stdin). positions are marked before parsing
+// and reset on failure; chunks before the current position are released once
+// no mark is pending.
+class cursor: public std::istream {
+public:
+    using position = std::size_t;
+    
+private:
+    class buffer: public std::streambuf {
+        struct chunk {
+            position offset;
+            std::vector<char> data;
+        };
+        
+        std::streambuf* source;
+        const std::size_t chunk_size;
+        const bool readahead;
+        
+        std::deque<chunk> chunks;
+        std::size_t current = 0;
+
+        void get_area(std::size_t index, std::size_t at) {
+            char* first = chunks[index].data.data();
+            current = index;
+            setg(first, first + at, first + chunks[index].data.size());
+        }
+
+        // append available source data (or a single char without readahead),
+        // blocking for one char at most
+        bool fill() {
+            const int c = source->sbumpc();
+            if(c == traits_type::eof()) return false;
+
+            if(chunks.empty() || chunks.back().data.size() == chunk_size) {
+                release();
+                const position offset = chunks.empty() ? 0 :
+                    chunks.back().offset + chunks.back().data.size();
+                chunks.push_back({offset, {}});
+                chunks.back().data.reserve(chunk_size);
+            }
+
+            std::vector<char>& data = chunks.back().data;
+            data.push_back(traits_type::to_char_type(c));
+            
+            const std::streamsize available = readahead ? source->in_avail() : 0;
+            if(available > 0) {
+                const std::size_t size = data.size();
+                data.resize(std::min(chunk_size, size + std::size_t(available)));
+                data.resize(size + source->sgetn(data.data() + size, data.size() - size));
+            }
+
+            return true;
+        }
+        
+    protected:
+        int_type underflow() override {
+            while(gptr() == egptr()) {
+                const std::size_t at = gptr() - eback();
+                
+                if(!chunks.empty() && at < chunks[current].data.size()) {
+                    // current chunk was appended to
+                    get_area(current, at);
+                } else if(current + 1 < chunks.size()) {
+                    get_area(current + 1, 0);
+                    release();
+                } else if(!fill()) {
+                    return traits_type::eof();
+                }
+            }
+            
+            return traits_type::to_int_type(*gptr());
+        }
+
+    public:
+        // pending marks
+        std::size_t marks = 0;
+        
+        buffer(std::streambuf* source, std::size_t chunk_size, bool readahead):
+            source(source),
+            chunk_size(chunk_size),
+            readahead(readahead) {
+            setg(nullptr, nullptr, nullptr);
+        }
+
+        position tell() const {
+            if(chunks.empty()) return 0;
+            return chunks[current].offset + (gptr() - eback());
+        }
+
+        void seek(position pos) {
+            std::size_t index = current;
+            while(index && chunks[index].offset > pos) --index;
+            while(index + 1 < chunks.size() && chunks[index + 1].offset <= pos) ++index;
+
+            assert(!chunks.empty() || !pos);
+            assert(chunks.empty() || chunks.front().offset <= pos);
+            assert(chunks.empty() || pos - chunks[index].offset <= chunks[index].data.size());
+            
+            if(!chunks.empty()) get_area(index, pos - chunks[index].offset);
+        }
+        
+        // drop chunks before the current one, unless marked
+        void release() {
+            if(marks) return;
+            
+            while(current) {
+                chunks.pop_front();
+                --current;
+            }
+
+            if(!chunks.empty()) get_area(0, gptr() - eback());
+        }
+
+        std::string slice(position first, position last) const {
+            std::string res;
+            for(const chunk& c: chunks) {
+                const position begin = std::max(first, c.offset);
+                const position end = std::min(last, c.offset + c.data.size());
+                if(begin < end) {
+                    res.append(c.data.data() + (begin - c.offset), end - begin);
+                }
+            }
+            
+            return res;
+        }
+
+        // give input read past the current position back to source (seek
+        // back when seekable, put chars back otherwise), then drop it
+        bool restore() {
+            if(chunks.empty()) return true;
+            
+            const std::size_t at = gptr() - eback();
+            const position pos = tell();
+            const position end = chunks.back().offset + chunks.back().data.size();
+
+            bool res = true;
+            if(pos < end &&
+               source->pubseekoff(-std::streamoff(end - pos), std::ios::cur,
+                                  std::ios::in) ==
+               std::streampos(std::streamoff(-1))) {
+                for(position i = end; res && i-- > pos;) {
+                    std::size_t index = chunks.size() - 1;
+                    while(chunks[index].offset > i) --index;
+                    
+                    const char c = chunks[index].data[i - chunks[index].offset];
+                    res = source->sputbackc(c) != traits_type::eof();
+                }
+            }
+
+            chunks.resize(current + 1);
+            chunks.back().data.resize(at);
+            get_area(current, at);
+            
+            return res;
+        }
+    };
+
+    buffer buf;
+    
+public:
+    // note: without readahead, source is read one char at a time so that
+    // unconsumed input can always be restored
+    cursor(std::streambuf* source, std::size_t chunk_size=4096,
+           bool readahead=true):
+        std::istream(nullptr),
+        buf(source, chunk_size, readahead) {
+        rdbuf(&buf);
+    }
+    
+    cursor(std::istream& source, std::size_t chunk_size=4096,
+           bool readahead=true):
+        cursor(source.rdbuf(), chunk_size, readahead) {
+        flags(source.flags());
+    }
+
+    // current position, retained until released
+    position mark() {
+        ++buf.marks;
+        return buf.tell();
+    }
+
+    // back to a marked position
+    void reset(position pos) { buf.seek(pos); }
+
+    // release last mark
+    void release() {
+        assert(buf.marks);
+        if(!--buf.marks) buf.release();
+    }
+
+    position tell() const { return buf.tell(); }
+
+    // give unconsumed input back to the source. returns false when the source
+    // refuses it
+    bool restore() { return buf.restore(); }
+
+    // retained input between two positions
+    std::string slice(position first, position last) const {
+        return buf.slice(first, last);
+    }
+};
+
+
 namespace {
 
 template<class Parser>
-using result_type = typename detail::require_maybe<
-    typename std::result_of<Parser(std::istream&)>::type
-    >::type;
+using result_type = typename std::result_of<Parser(cursor&)>::type;
 
 template<class Parser>
 using value_type = typename result_type<Parser>::value_type;
@@ -38,24 +244,23 @@ using value_type = typename result_type<Parser>::value_type;
 
 // RAII for saving/restoring/discarding stream state
 class stream_state {
-    std::istream* stream;
+    cursor* stream;
 public:
     const std::ios::iostate state;
-    const std::ios::pos_type pos;
+    const cursor::position pos;
     
-    inline stream_state(std::istream& stream)
+    inline stream_state(cursor& stream)
         : stream(&stream),
           state(stream.rdstate()),
-          pos(stream.good() ? stream.tellg() :  std::ios::pos_type() ){
+          pos(stream.mark()) {
 
     }
 
     inline ~stream_state() {
         if(!stream) return;
         stream->clear(state);
-        if(stream->good()) {
-            stream->seekg(pos);
-        }
+        stream->reset(pos);
+        stream->release();
     }
 
     inline stream_state(stream_state&& other)
@@ -65,7 +270,10 @@ public:
         other.stream = nullptr;
     }
 
-    inline void discard() { stream = nullptr; }
+    inline void discard() {
+        if(stream) stream->release();
+        stream = nullptr;
+    }
 };
 
 
@@ -74,7 +282,7 @@ public:
 
 // type erasure
 template<class T>
-using any = std::function< maybe<T> (std::istream& ) >;
+using any = std::function< maybe<T> (cursor& ) >;
 
 
 // reference
@@ -82,7 +290,7 @@ template<class Parser>
 struct ref_type {
     const Parser& parser;
 
-    result_type<Parser> operator()(std::istream& in) const {
+    result_type<Parser> operator()(cursor& in) const {
         return parser(in);
     }
 };
@@ -99,7 +307,7 @@ struct bind_type {
 
     using func_result_type = typename std::result_of<Func(value_type<Parser>)>::type;
     
-    result_type<func_result_type> operator()(std::istream& in) const {
+    result_type<func_result_type> operator()(cursor& in) const {
         stream_state backup(in);
         assert(!in.fail());
         
@@ -124,7 +332,7 @@ template<class T>
 struct pure_type {
     const T value;
 
-    maybe<T> operator()(std::istream& ) const { return value; }
+    maybe<T> operator()(cursor& ) const { return value; }
 };
 
 template<class T>
@@ -135,7 +343,7 @@ static pure_type< typename std::decay<T>::type> pure(T&& value = {}) {
 // monadic zero
 template<class T>
 struct fail {
-    maybe<T> operator()(std::istream& ) const { return {}; }
+    maybe<T> operator()(cursor& ) const { return {}; }
 };
 
 // functor map
@@ -145,7 +353,7 @@ struct map_type {
     const Func func;
 
     using type = typename std::result_of<Func(value_type<Parser>)>::type;
-    maybe<type> operator()(std::istream& in) const {
+    maybe<type> operator()(cursor& in) const {
         return map(parser(in), func);
     }
     
@@ -180,7 +388,7 @@ struct sequence_type {
 
     }
     
-    result_type<RHS> operator()(std::istream& in) const {
+    result_type<RHS> operator()(cursor& in) const {
         return impl(in);
     }
     
@@ -228,7 +436,7 @@ struct coproduct_type {
     static_assert(std::is_same< result_type<LHS>, result_type<RHS> >::value,
                   "parser value types must agree");
     
-    result_type<LHS> operator()(std::istream& in) const {
+    result_type<LHS> operator()(cursor& in) const {
         stream_state backup(in);
         if(auto res = lhs(in)) {
             backup.discard();
@@ -255,7 +463,7 @@ struct kleene_type {
     const Parser parser;
 
     using type = std::deque< value_type<Parser> >;
-    maybe<type> operator()(std::istream& in) const {
+    maybe<type> operator()(cursor& in) const {
         type res;
         while(auto value = parser(in)) {
             res.emplace_back(std::move(value.get()));
@@ -276,7 +484,7 @@ struct plus_type {
     const Parser parser;
 
     using type = std::deque< value_type<Parser> >;
-    maybe<type> operator()(std::istream& in) const {
+    maybe<type> operator()(cursor& in) const {
       const auto impl = ref(parser) >> [&](value_type<Parser>&& first) {
         return *ref(parser) >> [&](std::deque<value_type<Parser>>&& rest) {
           rest.emplace_front(std::move(first));
@@ -302,7 +510,7 @@ struct repeat_type {
     const Parser parser;
 
     using type = std::array<value_type<Parser>, N>;
-    maybe<type> operator()(std::istream& in) const {
+    maybe<type> operator()(cursor& in) const {
         stream_state backup(in);
         type res;
 
@@ -314,6 +522,7 @@ struct repeat_type {
             }
         }
 
+        backup.discard();
         return res;
     }
 };
@@ -326,7 +535,7 @@ template<class T, class Exception = std::runtime_error>
 struct error : Exception {
     using Exception::Exception;
     
-    maybe<T> operator()(std::istream&) const {
+    maybe<T> operator()(cursor&) const {
         throw *this;
     }
 };
@@ -339,7 +548,7 @@ struct list {
     const Separator separator;
 
     using type = std::deque<value_type<Parser>>;
-    maybe<type> operator()(std::istream& in) const {
+    maybe<type> operator()(cursor& in) const {
       const auto impl = ref(parser)
         >> [&](value_type<Parser>&& first) {
              return *(ref(separator) >> then(ref(parser)))
@@ -363,7 +572,7 @@ static list<Parser, Separator> operator%(const Parser& parser,
 struct stream_format {
     std::istream* in;
     const std::istream::fmtflags fmt;
-    inline stream_format(std::istream& in)
+    inline stream_format(cursor& in)
         : in(&in), fmt(in.flags()) { }
 
     inline ~stream_format() {
@@ -376,9 +585,10 @@ template<class Parser>
 struct noskip_type {
     const Parser parser;
 
-    result_type<Parser> operator()(std::istream& in) const {
+    result_type<Parser> operator()(cursor& in) const {
         const stream_format backup(in);
-        return parser(in >> std::noskipws);
+        in >> std::noskipws;
+        return parser(in);
     }
 };
 
@@ -397,7 +607,7 @@ struct token {
     inline token(const char* value) : expected(value) { }
     const char* const expected;
 
-    inline maybe<const char*> operator()(std::istream& in) const {
+    inline maybe<const char*> operator()(cursor& in) const {
         stream_state backup(in);
         const auto fmt = in.flags();
 
@@ -424,7 +634,7 @@ struct token {
 // parse a value using standard stream input
 template<class T>
 struct value {
-    maybe<T> operator()(std::istream& in) const {
+    maybe<T> operator()(cursor& in) const {
       stream_state backup(in);
       T res;
 
@@ -439,7 +649,7 @@ struct value {
 
 // parse true if the next read would yield eof
 struct eof {
-    inline maybe<bool> operator()(std::istream& in) const {
+    inline maybe<bool> operator()(cursor& in) const {
         stream_state backup(in);
         char c;
         if( !(in >> c) && in.eof() ) return true;
@@ -454,7 +664,7 @@ template<class Parser>
 struct option_type {
     const Parser parser;
 
-    result_type<Parser> operator()(std::istream& in) const {
+    result_type<Parser> operator()(cursor& in) const {
         if(auto res = parser(in)) {
             return res;
         }
@@ -471,7 +681,7 @@ static option_type<Parser> operator~(const Parser& parser) { return {parser}; }
 template<int (*f) (int)>
 struct chr {
     
-    maybe<char> operator()(std::istream& in) const {
+    maybe<char> operator()(cursor& in) const {
         stream_state backup(in);
         char c;
         if((in >> c) && f(c)) {
@@ -490,7 +700,7 @@ struct debug_type {
     const Parser parser;
     const char* const trace;
     
-    result_type<Parser> operator()(std::istream& in) const;
+    result_type<Parser> operator()(cursor& in) const;
 };
 
 
@@ -513,32 +723,10 @@ std::size_t debug::depth = 0;
 }
 
 
-static std::string istream_slice(std::istream& in,
-                                 std::istream::streampos first,
-                                 std::istream::streampos last) {
-  if(first == -1) return {};
-
-  in.seekg(first);
-  
-  if(last == -1) {
-    std::stringstream ss;
-    in >> ss.rdbuf();
-    return ss.str();
-  }
-
-  const std::size_t size = last - first;
-  std::string buffer;
-  buffer.resize(size);
-
-  in.read(&buffer[0], size);
-  return buffer;
-}
-  
 template<class Parser>
-inline result_type<Parser> debug_type<Parser>::operator()(std::istream& in) const {
+inline result_type<Parser> debug_type<Parser>::operator()(cursor& in) const {
     const std::size_t depth = debug::depth++;
-    const std::istream::streampos prev = in.eof() ?
-      std::istream::streampos(-1) : in.tellg();
+    const cursor::position prev = in.mark();
     
     const auto indent = [depth] () -> std::ostream& {
         assert(debug::stream);
@@ -557,15 +745,12 @@ inline result_type<Parser> debug_type<Parser>::operator()(std::istream& in) cons
     assert(!in.fail());
     
     if(debug::stream) {
-      const stream_state backup(in);
       if(res) {
-        const std::istream::streampos curr = in.eof() ?
-          std::istream::streampos(-1) : in.tellg();
-        
         indent() << "<< " << trace
-                 << " success \"" << istream_slice(in, prev, curr)
+                 << " success \"" << in.slice(prev, in.tell())
                  << "\"" << std::endl;
         } else {
+            const stream_state backup(in);
             std::string next;
             in >> next;
             indent() << "<< " << trace
@@ -573,6 +758,7 @@ inline result_type<Parser> debug_type<Parser>::operator()(std::istream& in) cons
         }
     }
 
+    in.release();
     --debug::depth;
 
     return res;
@@ -582,16 +768,21 @@ inline result_type<Parser> debug_type<Parser>::operator()(std::istream& in) cons
 
 
 
-// adaptor to standard c++ parsing api
+// adaptor to standard c++ parsing api: the source is left right after parsed
+// input, or unchanged on failure
 template<class Parser>
 static std::istream& parse(value_type<Parser>& self, const Parser& parser,
                            std::istream& in) {
-    if(auto res = parser(in)) {
+    cursor input(in, 4096, false);
+    if(auto res = parser(input)) {
         self = std::move(res.get());
     } else {
         in.setstate(std::ios::failbit);
     }
 
+    // note: lookahead past parsed input goes back to the source
+    if(!input.restore()) in.setstate(std::ios::badbit);
+    
     return in;
 }
 
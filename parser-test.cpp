@@ -7,7 +7,16 @@ using namespace parser;
 template<class Parser>
 static void assert_parse(Parser parser, std::string input) {
   range in{input.data(), input.data() + input.size()};
-  ASSERT_TRUE(parser(in)) << input;
+  state s;
+  ASSERT_TRUE(parser(in, s, [](auto&&) { return true; })) << input;
+}
+
+
+template<class Parser>
+static void assert_fail(Parser parser, std::string input) {
+  range in{input.data(), input.data() + input.size()};
+  state s;
+  ASSERT_FALSE(parser(in, s, [](auto&&) { return true; })) << input;
 }
 
 
@@ -15,3 +24,149 @@ TEST(parser, keyword) {
   assert_parse(keyword("foo"), "foo");
   assert_parse(keyword("foo"), "foo ");  
 }
+
+
+TEST(parser, fold) {
+  const auto digit = pred([](char c) { return c >= '0' && c <= '9'; });
+  const auto number = fold(digit, 0, [](int& acc, char c) {
+    acc = 10 * acc + (c - '0');
+  }, 1);
+
+  const std::string input = "1234";
+  EXPECT_EQ(run(number, input), 1234);
+
+  assert_fail(number, "x");
+}
+
+
+TEST(parser, choice) {
+  const auto parser = (keyword("ab") >> pure(1)) | (keyword("ac") >> pure(2));
+
+  const std::string input = "ac";
+  EXPECT_EQ(run(parser, input), 2);
+}
+
+
+TEST(parser, cut) {
+  // committed after "a": the second alternative is not tried
+  const auto parser = (keyword("a") > keyword("b")) | keyword("ac");
+
+  assert_parse(parser, "ab");
+  assert_fail(parser, "ac");
+}
+
+
+TEST(parser, fix) {
+  // balanced parentheses, counting pairs
+  const auto parser = fix<int>([](const rule<int>& self) {
+    return fold(single('(') >> self << single(')'), 0,
+                [](int& acc, int inner) { acc += inner + 1; });
+  });
+
+  const std::string input = "(()())()";
+  EXPECT_EQ(run(parser << eos, input), 4);
+}
+
+
+TEST(parser, memo) {
+  // shared prefix: the memoized prefix is only parsed once
+  std::size_t calls = 0;
+  const auto prefix = memo(keyword("ab") |= [&](unit) { return ++calls; });
+  const auto parser = (prefix >> single('x')) | (prefix >> single('y'));
+
+  const std::string input = "aby";
+  EXPECT_EQ(run(parser, input), 'y');
+  EXPECT_EQ(calls, 1);
+}
+
+
+// memoized parsers never share entries, even when one is built after another
+// was freed
+TEST(parser, memo_ids) {
+  const auto any = pred([](char) { return true; });
+
+  packrat table;
+  const std::string input = "ab";
+  {
+    const auto first = memo(any |= [](char c) { return std::string(1, c); });
+    EXPECT_EQ(run(first, input, table), "a");
+  }
+
+  const auto second = memo(any |= [](char c) { return long(c); });
+  EXPECT_EQ(run(second, input, table), long('a'));
+}
+
+
+TEST(parser, left_recursion) {
+  // expr := expr '-' digit | digit, left-associative
+  const auto digit = pred([](char c) { return c >= '0' && c <= '9'; }) |=
+    [](char c) { return long(c - '0'); };
+
+  const auto expr = fix<long>([=](const rule<long>& self) {
+    const auto sub = self >>= [=](long lhs) {
+      return single('-') >> digit |= [=](long rhs) { return lhs - rhs; };
+    };
+
+    return memo(sub | digit);
+  });
+
+  const std::string input = "9-2-3-1";
+  EXPECT_EQ(run(expr << eos, input), 3);
+
+  // tiny table: entries are dropped while parsing
+  packrat table(1);
+  EXPECT_EQ(run(expr << eos, input, table), 3);
+}
+
+
+TEST(parser, span) {
+  // runs longer than a vector block, with a tail
+  const std::string spaces(70, ' ');
+  const std::string input = spaces + "\t\n" + "x";
+
+  const auto skipped = skip(pred(std::isspace)) >> cursor;
+  EXPECT_EQ(run(skipped << single('x'), input), input.data() + 72);
+
+  const auto digits = span(scan::digit(), 1);
+  const std::string number = std::string(40, '7') + "x";
+  EXPECT_EQ(run(digits << single('x'), number).size(), 40u);
+  assert_fail(digits, "x");
+
+  // string contents up to a quote or backslash
+  const auto plain = span(scan::complement(scan::quote()), 1);
+  const std::string quoted = std::string(33, 'a') + "\\\"";
+  EXPECT_EQ(run(plain << single('\\') << single('"'), quoted).size(), 33u);
+}
+
+
+TEST(parser, integers) {
+  const auto run = [](auto parser, std::string input) {
+    return parser::run(parser, input);
+  };
+
+  EXPECT_EQ(run(_long, "  -42x"), -42);
+  EXPECT_EQ(run(_long, "+1234567890123"), 1234567890123);
+  EXPECT_EQ(run(_long, "0000000000000000000000012"), 12);
+  EXPECT_EQ(run(_long, "9223372036854775807"), 9223372036854775807l);
+  EXPECT_EQ(run(_long, "-9223372036854775808"),
+            std::numeric_limits<long>::min());
+  EXPECT_EQ(run(_unsigned_long, "18446744073709551615"),
+            18446744073709551615ul);
+
+  assert_fail(_long, "9223372036854775808");
+  assert_fail(_long, "-9223372036854775809");
+  assert_fail(_unsigned_long, "18446744073709551616");
+  assert_fail(_unsigned_long, "-1");
+  assert_fail(_long, "-");
+  assert_fail(_long, "x");
+
+  // digits stop at the end of the range
+  const std::string input = "12345678901234";
+  range in{input.data(), input.data() + 9};
+  state s;
+
+  long res = 0;
+  ASSERT_TRUE(_long(in, s, [&](long value) { res = value; return true; }));
+  EXPECT_EQ(res, 123456789);
+  EXPECT_EQ(in.first, input.data() + 9);
+}
@@ -1,16 +1,24 @@
 #ifndef PARSER_HPP
 #define PARSER_HPP
 
-#include "either.hpp"
 #include "unit.hpp"
-
-#include <deque>
-#include <functional>
+#include "scan.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <cassert>
+#include <cctype>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <new>
 
 #include <sstream>
 
@@ -64,379 +72,1236 @@ static void peek(range self, std::ostream& out, std::size_t count=42) {
 }
   
 
-// successful parse  
-template<class T>
-struct success: range {
-  using value_type = T;
-  T value;
-  success(T value, range rest): range(rest), value(std::move(value)) {}
-};
+class packrat;
 
+// parse state
+struct state {
+  // furthest failure, for error reporting
+  const char* furthest = nullptr;
 
-template<class T>
-static success<T> make_success(T value, range rest) {
-  return {std::move(value), rest};
-}
+  // set by a failure past a cut: alternatives and repetitions give up
+  bool committed = false;
+
+  // memo table for memoized parsers, if any
+  packrat* table = nullptr;
 
-// parse error  
-struct error: range {
-  error(range at): range(at) {}
+  bool fail(const char* at) {
+    if(!furthest || at > furthest) furthest = at;
+    return false;
+  }
 };
 
 
-// parse result  
-template<class T>
-using result = either<error, success<T>>;
+// parsers are function objects deriving from parser::base with a value_type,
+// called as:
+//
+//   template<class Cont> bool operator()(range& in, state& s, const Cont& cont) const
+//
+// on success, in is advanced past the match and cont(value) is returned. on
+// failure, false is returned and in is left unspecified. values are handed to
+// continuations instead of being returned, so that value types need no default
+// constructor and nothing is copied or allocated in between.
+struct base { };
 
+// parser value type
+template<class Parser>
+using value = typename Parser::value_type;
 
-// parser value type  
 template<class Parser>
-using value =
-    typename std::result_of<Parser(range)>::type::value_type::value_type;
+using enable_parser =
+    typename std::enable_if<std::is_base_of<base, Parser>::value>::type;
+
 
+namespace detail {
 
-// type-erased parser
+// uninitialized storage, for values that outlive their continuation
 template<class T>
-using monad = std::function<result<T>(range in)>;
+class slot {
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  bool full = false;
+public:
+  slot() = default;
+  slot(const slot&) = delete;
+
+  ~slot() { reset(); }
+
+  template<class U>
+  void emplace(U&& value) {
+    reset();
+    new (&storage) T(std::forward<U>(value));
+    full = true;
+  }
+
+  void reset() {
+    if(full) get().~T();
+    full = false;
+  }
+
+  T& get() { return *reinterpret_cast<T*>(&storage); }
+  explicit operator bool() const { return full; }
+};
+
+
+// continuation accepting anything
+struct accept {
+  template<class T>
+  bool operator()(T&&) const { return true; }
+};
+
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // combinators
 
 // monad unit
 template<class T>
-static auto pure(T value) {
-  return [value = std::move(value)](range in) -> result<T> {
-    return make_success(value, in);
-  };
+struct pure_type: base {
+  using value_type = T;
+  const T value;
+
+  pure_type(T value): value(std::move(value)) { }
+
+  template<class Cont>
+  bool operator()(range&, state&, const Cont& cont) const {
+    return cont(T(value));
+  }
 };
 
+template<class T>
+static pure_type<T> pure(T value) {
+  return {std::move(value)};
+}
+
+
 // functor map
-template<class Parser, class Func, class=value<Parser>>
-static auto map(Parser parser, Func func) {
-  return [parser = std::move(parser), func = std::move(func)](range in) {
-    using value_type = typename std::result_of<Func(value<Parser>)>::type;
-    using result_type = result<value_type>;
-    return map(parser(in), [&](success<value<Parser>>&& self) {
-      return make_success(func(std::move(self.value)), self);
+template<class Parser, class Func>
+struct map_type: base {
+  using value_type = typename std::decay<
+    typename std::result_of<const Func&(value<Parser>&&)>::type>::type;
+
+  const Parser parser;
+  const Func func;
+
+  map_type(Parser parser, Func func):
+    parser(std::move(parser)),
+    func(std::move(func)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    return parser(in, s, [&](auto&& value) {
+      return cont(func(std::forward<decltype(value)>(value)));
     });
-  };
+  }
 };
 
-template<class Parser, class Func, class=value<Parser>>
+template<class Parser, class Func, class=enable_parser<Parser>>
+static map_type<Parser, Func> map(Parser parser, Func func) {
+  return {std::move(parser), std::move(func)};
+}
+
+template<class Parser, class Func, class=enable_parser<Parser>>
 static auto operator|=(Parser parser, Func func) {
-  return map(parser, func);
-};
+  return map(std::move(parser), std::move(func));
+}
 
 
-// monad bind
-template<class Parser, class Func, class=value<Parser>>
-static auto bind(Parser parser, Func func) {
-  return [parser = std::move(parser), func = std::move(func)](range in) {
-    using parser_type = typename std::result_of<Func(value<Parser>)>::type;
-    using value_type = value<parser_type>;
-    using result_type = result<value_type>;
-    return parser(in) >>= [&](success<value<Parser>>&& self) -> result_type {
-      const range in = self;
-      if(auto res = func(std::move(self.value))(in)) {
-        return res;
-      }
-      return error(in);
-    };
-  };
+// monad bind. note: the continuation parser is built on each parse, prefer
+// map/fold/sequences when possible
+template<class Parser, class Func>
+struct bind_type: base {
+  using parser_type = typename std::result_of<const Func&(value<Parser>&&)>::type;
+  using value_type = value<parser_type>;
+
+  const Parser parser;
+  const Func func;
+
+  bind_type(Parser parser, Func func):
+    parser(std::move(parser)),
+    func(std::move(func)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    return parser(in, s, [&](auto&& value) {
+      const parser_type next = func(std::forward<decltype(value)>(value));
+      return next(in, s, cont);
+    });
+  }
 };
 
-template<class Parser, class Func, class=value<Parser>>
+template<class Parser, class Func, class=enable_parser<Parser>>
+static bind_type<Parser, Func> bind(Parser parser, Func func) {
+  return {std::move(parser), std::move(func)};
+}
+
+template<class Parser, class Func, class=enable_parser<Parser>>
 static auto operator>>=(Parser parser, Func func) {
-  return bind(parser, func);
+  return bind(std::move(parser), std::move(func));
+}
+
+
+// sequence parser, keeping rhs value
+template<class LHS, class RHS>
+struct then_type: base {
+  using value_type = value<RHS>;
+
+  const LHS lhs;
+  const RHS rhs;
+
+  then_type(LHS lhs, RHS rhs): lhs(std::move(lhs)), rhs(std::move(rhs)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    return lhs(in, s, [&](auto&&) { return rhs(in, s, cont); });
+  }
 };
 
-// sequence parser  
-template<class LHS, class RHS, class=value<LHS>, class=value<RHS>>
-static auto operator>>(LHS lhs, RHS rhs) {
-  return lhs >>= [rhs = std::move(rhs)](auto) { return rhs; };
+template<class LHS, class RHS, class=enable_parser<LHS>, class=enable_parser<RHS>>
+static then_type<LHS, RHS> operator>>(LHS lhs, RHS rhs) {
+  return {std::move(lhs), std::move(rhs)};
+}
+
+
+// sequence parser, keeping lhs value
+template<class LHS, class RHS>
+struct before_type: base {
+  using value_type = value<LHS>;
+
+  const LHS lhs;
+  const RHS rhs;
+
+  before_type(LHS lhs, RHS rhs): lhs(std::move(lhs)), rhs(std::move(rhs)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    return lhs(in, s, [&](auto&& value) {
+      return rhs(in, s, [&](auto&&) {
+        return cont(std::forward<decltype(value)>(value));
+      });
+    });
+  }
 };
 
-// guarded continuation  
-template<class Pred>
-static auto guard(Pred pred) {
-  return [pred = std::move(pred)](auto value) {
-    using value_type = decltype(value);
+template<class LHS, class RHS, class=enable_parser<LHS>, class=enable_parser<RHS>>
+static before_type<LHS, RHS> operator<<(LHS lhs, RHS rhs) {
+  return {std::move(lhs), std::move(rhs)};
+}
 
-    return [pred, value = std::move(value)](range in) -> result<value_type> {
-      if(pred(value)) {
-        return make_success(value, in);
+
+// cut: once lhs matched, rhs must match. otherwise the parse fails as a whole
+// without trying alternatives, keeping rhs value.
+template<class LHS, class RHS>
+struct cut_type: base {
+  using value_type = value<RHS>;
+
+  const LHS lhs;
+  const RHS rhs;
+
+  cut_type(LHS lhs, RHS rhs): lhs(std::move(lhs)), rhs(std::move(rhs)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    return lhs(in, s, [&](auto&&) {
+      bool matched = false;
+      if(rhs(in, s, [&](auto&& value) {
+            matched = true;
+            return cont(std::forward<decltype(value)>(value));
+          })) {
+        return true;
       }
-      return error(in);
-    };
-  };
+
+      // note: failures in cont are not ours
+      if(!matched) s.committed = true;
+      return false;
+    });
+  }
 };
 
-// drop continuation  
-template<class Parser>
-static auto drop(Parser parser) {
-  return [parser = std::move(parser)](auto value) {
-    return parser >> pure(std::move(value));
-  };
+template<class LHS, class RHS, class=enable_parser<LHS>, class=enable_parser<RHS>>
+static cut_type<LHS, RHS> operator>(LHS lhs, RHS rhs) {
+  return {std::move(lhs), std::move(rhs)};
 }
 
-// reference parser  
-template<class Parser>
-static auto ref(const Parser& parser) {
-  return [&](range in) -> result<value<Parser>> { return parser(in); };
+
+// coproduct parser (alternative). note: rhs is only called if lhs fails, and
+// not at all once lhs matched (ordered choice)
+template<class LHS, class RHS>
+struct coproduct_type: base {
+  static_assert(std::is_same<value<LHS>, value<RHS>>::value,
+                "alternatives must have the same value type");
+  using value_type = value<LHS>;
+
+  const LHS lhs;
+  const RHS rhs;
+
+  coproduct_type(LHS lhs, RHS rhs): lhs(std::move(lhs)), rhs(std::move(rhs)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    const range start = in;
+
+    bool matched = false;
+    if(lhs(in, s, [&](auto&& value) {
+          matched = true;
+          return cont(std::forward<decltype(value)>(value));
+        })) {
+      return true;
+    }
+
+    if(matched || s.committed) return false;
+
+    in = start;
+    return rhs(in, s, cont);
+  }
+};
+
+template<class LHS, class RHS>
+static coproduct_type<LHS, RHS> coproduct(LHS lhs, RHS rhs) {
+  return {std::move(lhs), std::move(rhs)};
 }
 
-// kleen star parser (zero-or-more). note: always succeeds  
-template<class Parser>
-static auto kleene(Parser parser) {
-  return [parser = std::move(parser)](range in) -> result<std::deque<value<Parser>>> {
-    std::deque<value<Parser>> values;
-    while(auto result = parser(in)) {
-      values.emplace_back(std::move(result.get()->value));
-      in = *result.get();
+template<class LHS, class RHS, class=enable_parser<LHS>, class=enable_parser<RHS>>
+static coproduct_type<LHS, RHS> operator|(LHS lhs, RHS rhs) {
+  return coproduct(std::move(lhs), std::move(rhs));
+}
+
+
+// repetition, folding values into an accumulator as func(acc, value) with at
+// least min matches. note: stops on empty matches.
+template<class Parser, class T, class Func>
+struct fold_type: base {
+  using value_type = T;
+
+  const Parser parser;
+  const T init;
+  const Func func;
+  const std::size_t min;
+
+  fold_type(Parser parser, T init, Func func, std::size_t min):
+    parser(std::move(parser)),
+    init(std::move(init)),
+    func(std::move(func)),
+    min(min) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    T acc = init;
+
+    std::size_t count = 0;
+    while(true) {
+      const range start = in;
+      if(!parser(in, s, [&](auto&& value) {
+            func(acc, std::forward<decltype(value)>(value));
+            return true;
+          })) {
+        if(s.committed) return false;
+        in = start;
+        break;
+      }
+
+      ++count;
+      if(in.first == start.first) break;
     }
 
-    return make_success(std::move(values), in);
-  };
+    if(count < min) return false;
+    return cont(std::move(acc));
+  }
 };
 
-// one-or-more parser
-template<class Parser>
-static auto plus(Parser parser) {
-  return parser >>= [parser](auto first) {
-    return kleene(parser) >>= [first](auto rest) {
-      rest.emplace_front(std::move(first));
-      return pure(rest);
-    };
-  };
+template<class Parser, class T, class Func, class=enable_parser<Parser>>
+static fold_type<Parser, T, Func> fold(Parser parser, T init, Func func,
+                                       std::size_t min=0) {
+  return {std::move(parser), std::move(init), std::move(func), min};
+}
+
+
+namespace detail {
+
+struct push_back {
+  template<class Container, class T>
+  void operator()(Container& self, T&& value) const {
+    self.emplace_back(std::forward<T>(value));
+  }
 };
 
+struct ignore {
+  template<class T>
+  void operator()(unit, T&&) const { }
+};
 
-// coproduct parser (alternative). note: rhs is only called if lhs fails
-template<class LHS, class RHS>
-static auto coproduct(LHS lhs, RHS rhs) {
-  return [lhs = std::move(lhs), rhs = std::move(rhs)](range in) {
-    if(auto res = lhs(in)) {
-      return res;
-    } else
-      return rhs(in);
-  };
+}
+
+
+// kleene star parser (zero-or-more). note: always succeeds
+template<class Parser, class=enable_parser<Parser>>
+static auto kleene(Parser parser) {
+  return fold(std::move(parser), std::vector<value<Parser>>(),
+              detail::push_back());
 };
 
+// one-or-more parser
+template<class Parser, class=enable_parser<Parser>>
+static auto plus(Parser parser) {
+  return fold(std::move(parser), std::vector<value<Parser>>(),
+              detail::push_back(), 1);
+};
 
-template<class LHS, class RHS, class=value<LHS>, class=value<RHS>>
-static auto operator|(LHS lhs, RHS rhs) {
-  return coproduct(std::move(lhs), std::move(rhs));
+// skip parser: parse zero-or-more without collecting
+template<class Parser, class=enable_parser<Parser>>
+static auto skip(Parser parser) {
+  return fold(std::move(parser), unit{}, detail::ignore());
 }
 
-// non-empty list with separator  
+
+// non-empty list with separator
 template<class Parser, class Separator>
-static auto list(Parser parser, Separator separator) {
-  return parser >>= [=](auto first) {
-    return kleene(separator >> parser) >>=
-           [first = std::move(first)](auto rest) {
-             rest.emplace_front(first);
-             return pure(rest);
-           };
-  };
+struct list_type: base {
+  using value_type = std::vector<value<Parser>>;
+
+  const Parser parser;
+  const Separator separator;
+
+  list_type(Parser parser, Separator separator):
+    parser(std::move(parser)),
+    separator(std::move(separator)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    value_type values;
+    const auto push = [&](auto&& value) {
+      values.emplace_back(std::forward<decltype(value)>(value));
+      return true;
+    };
+
+    if(!parser(in, s, push)) return false;
+
+    while(true) {
+      const range start = in;
+      if(!separator(in, s, detail::accept()) || !parser(in, s, push)) {
+        if(s.committed) return false;
+        in = start;
+        break;
+      }
+    }
+
+    return cont(std::move(values));
+  }
 };
 
+template<class Parser, class Separator>
+static list_type<Parser, Separator> list(Parser parser, Separator separator) {
+  return {std::move(parser), std::move(separator)};
+};
 
-template<class Parser, class Separator, class=value<Parser>, class=value<Separator>>
-static auto operator%(Parser parser, Separator separator) {
+template<class Parser, class Separator, class=enable_parser<Parser>,
+         class=enable_parser<Separator>>
+static list_type<Parser, Separator> operator%(Parser parser, Separator separator) {
   return list(std::move(parser), std::move(separator));
 }
 
 
-// skip parser: parse zero-or-more without collecting  
+// tokenizer: skip before parsing
+template<class Parser, class Skipper>
+static auto token(Parser parser, Skipper skipper) {
+  return skip(std::move(skipper)) >> std::move(parser);
+}
+
+
+// matched range, without value
 template<class Parser>
-static auto skip(Parser parser) {
-  return [parser = std::move(parser)](range in) -> result<unit> {
-    while(auto res = parser(in)) {
-      in = *res.get();
-    }
-    return make_success(unit{}, in);
+struct capture_type: base {
+  using value_type = range;
+  const Parser parser;
+
+  capture_type(Parser parser): parser(std::move(parser)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    const char* first = in.first;
+    return parser(in, s, [&](auto&&) {
+      return cont(range{first, in.first});
+    });
+  }
+};
+
+template<class Parser, class=enable_parser<Parser>>
+static capture_type<Parser> capture(Parser parser) {
+  return {std::move(parser)};
+}
+
+
+// value with matched range
+template<class Parser>
+struct located_type: base {
+  using value_type = std::pair<value<Parser>, range>;
+  const Parser parser;
+
+  located_type(Parser parser): parser(std::move(parser)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    const char* first = in.first;
+    return parser(in, s, [&](auto&& value) {
+      return cont(value_type(std::forward<decltype(value)>(value),
+                             range{first, in.first}));
+    });
+  }
+};
+
+template<class Parser, class=enable_parser<Parser>>
+static located_type<Parser> located(Parser parser) {
+  return {std::move(parser)};
+}
+
+
+// guarded continuation
+template<class T, class Pred>
+struct guard_type: base {
+  using value_type = T;
+
+  const Pred pred;
+  const T value;
+
+  guard_type(Pred pred, T value): pred(std::move(pred)), value(std::move(value)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    if(pred(value)) return cont(T(value));
+    return s.fail(in.first);
+  }
+};
+
+template<class Pred>
+static auto guard(Pred pred) {
+  return [pred = std::move(pred)](auto value) {
+    return guard_type<decltype(value), Pred>(pred, std::move(value));
+  };
+};
+
+
+// drop continuation
+template<class Parser>
+static auto drop(Parser parser) {
+  return [parser = std::move(parser)](auto value) {
+    return parser >> pure(std::move(value));
   };
 }
 
-// tokenizer: skip before parsing
-template<class Parser, class Skipper>
-static auto token(Parser parser, Skipper skipper) {
-  return skip(skipper) >> parser;
+
+// reference parser, for parsers that outlive it
+template<class Parser>
+struct ref_type: base {
+  using value_type = value<Parser>;
+  const Parser* parser;
+
+  ref_type(const Parser& parser): parser(&parser) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    return (*parser)(in, s, cont);
+  }
+};
+
+template<class Parser>
+static ref_type<Parser> ref(const Parser& parser) {
+  return {parser};
 }
 
-// debugparser
+
+// debug parser
 template<class Parser>
-static auto debug(std::string name, Parser parser,
-                  std::ostream& out = std::clog) {
-  return [name = std::move(name), parser = std::move(parser), &out](range in) {
-    out << "> " << name << ": \"";
-    peek(in, out);
-    out << "\"\n";
-    
-    auto res = parser(in);
-    if(res) {
-      out << "< " << name << " ok: \"";
-      peek(*res.get(), out);
-      out << "\"\n";
-    } else {
-      std::clog << "< " << name << " failed\n";
-    }
+struct debug_type: base {
+  using value_type = value<Parser>;
+
+  const std::string name;
+  const Parser parser;
+  std::ostream* out;
+
+  debug_type(std::string name, Parser parser, std::ostream& out):
+    name(std::move(name)),
+    parser(std::move(parser)),
+    out(&out) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    *out << "> " << name << ": \"";
+    peek(in, *out);
+    *out << "\"\n";
+
+    bool matched = false;
+    const bool res = parser(in, s, [&](auto&& value) {
+      matched = true;
 
+      *out << "< " << name << " ok: \"";
+      peek(in, *out);
+      *out << "\"\n";
+
+      return cont(std::forward<decltype(value)>(value));
+    });
+
+    if(!matched) *out << "< " << name << " failed\n";
     return res;
-  };
+  }
+};
+
+template<class Parser>
+static debug_type<Parser> debug(std::string name, Parser parser,
+                                std::ostream& out = std::clog) {
+  return {std::move(name), std::move(parser), out};
 }
 
+
 // longest parse: runs both parsers and keep the longest match. note: lhs result
 // is returned in case of a draw.
 template<class LHS, class RHS>
-static auto longest(LHS lhs, RHS rhs) {
-  return [lhs = std::move(lhs), rhs = std::move(rhs)](range in) {
-    auto as_lhs = lhs(in);
-    auto as_rhs = rhs(in);
-
-    if(!as_rhs)
-      return as_lhs;
-    if(!as_lhs)
-      return as_rhs;
-
-    if(as_lhs.get()->first >= as_rhs.get()->first) {
-      return as_lhs;
-    } else {
-      return as_rhs;
+struct longest_type: base {
+  static_assert(std::is_same<value<LHS>, value<RHS>>::value,
+                "alternatives must have the same value type");
+  using value_type = value<LHS>;
+
+  const LHS lhs;
+  const RHS rhs;
+
+  longest_type(LHS lhs, RHS rhs): lhs(std::move(lhs)), rhs(std::move(rhs)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    detail::slot<value_type> as_lhs, as_rhs;
+
+    range lhs_in = in;
+    lhs(lhs_in, s, [&](auto&& value) {
+      as_lhs.emplace(std::forward<decltype(value)>(value));
+      return true;
+    });
+
+    if(s.committed) return false;
+
+    range rhs_in = in;
+    rhs(rhs_in, s, [&](auto&& value) {
+      as_rhs.emplace(std::forward<decltype(value)>(value));
+      return true;
+    });
+
+    if(s.committed) return false;
+
+    if(as_lhs && (!as_rhs || lhs_in.first >= rhs_in.first)) {
+      in = lhs_in;
+      return cont(std::move(as_lhs.get()));
+    }
+
+    if(as_rhs) {
+      in = rhs_in;
+      return cont(std::move(as_rhs.get()));
+    }
+
+    return false;
+  }
+};
+
+template<class LHS, class RHS>
+static longest_type<LHS, RHS> longest(LHS lhs, RHS rhs) {
+  return {std::move(lhs), std::move(rhs)};
+};
+
+
+// type-erased parser, for recursive grammars and separate compilation. calls
+// go through a virtual call and a continuation reference: nothing is allocated
+// while parsing.
+template<class T>
+class rule: public base {
+  struct cont_ref {
+    const void* self;
+    bool (*call)(const void* self, T&& value);
+  };
+
+  struct impl {
+    virtual ~impl() { }
+    virtual bool parse(range& in, state& s, cont_ref cont) const = 0;
+  };
+
+  template<class Parser>
+  struct model: impl {
+    const Parser parser;
+    model(Parser parser): parser(std::move(parser)) { }
+
+    bool parse(range& in, state& s, cont_ref cont) const override {
+      return parser(in, s, [&](auto&& value) {
+        return cont.call(cont.self, T(std::forward<decltype(value)>(value)));
+      });
+    }
+  };
+
+  // late-bound parser, for fixpoints
+  struct forward: impl {
+    std::shared_ptr<const impl> target;
+
+    bool parse(range& in, state& s, cont_ref cont) const override {
+      return target->parse(in, s, cont);
     }
   };
+
+  std::shared_ptr<const impl> owner;
+  const impl* ptr;
+
+  // non-owning
+  rule(const impl* ptr): ptr(ptr) { }
+
+public:
+  using value_type = T;
+
+  template<class Parser, class=enable_parser<Parser>,
+           class=typename std::enable_if<!std::is_same<Parser, rule>::value>::type>
+  rule(Parser parser):
+    owner(std::make_shared<model<Parser>>(std::move(parser))),
+    ptr(owner.get()) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    return ptr->parse(in, s, {&cont, [](const void* self, T&& value) {
+          return (*static_cast<const Cont*>(self))(std::move(value));
+        }});
+  }
+
+  // recursive parser def(self), where self refers to the result
+  template<class Def>
+  static rule fix(const Def& def) {
+    const auto res = std::make_shared<forward>();
+
+    const rule self(res.get());
+    res->target = rule(def(self)).owner;
+
+    rule result(res.get());
+    result.owner = res;
+    return result;
+  }
 };
 
+
 // fixpoint (result type needs to be given because c++)
 template<class T, class Def>
-struct fixpoint {
-  const Def def;
-  
-  result<T> operator()(parser::range in) const {
-    return def(*this)(in);
+static rule<T> fix(Def def) {
+  return rule<T>::fix(def);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// packrat parsing
+
+// memo table for memoized parsers, keyed by parser and position. bounded:
+// once capacity entries are stored, all entries are dropped and the value
+// arena is reused.
+class packrat {
+public:
+  // memoized parser ids, never reused (0: empty entry). note: member
+  // functions are inline, so that all translation units share the counter
+  static std::size_t fresh() {
+    static std::atomic<std::size_t> next(1);
+    return next++;
   }
+
+  // left-recursive parse in progress: the current seed
+  struct head {
+    std::size_t id;
+    const char* at;
+
+    // seed value (null on failure) and end
+    const void* value;
+    const char* end;
+
+    // whether the seed was used, i.e. the parser is left-recursive
+    bool used;
+  };
+
+  struct entry {
+    std::size_t id;
+    const char* at;
+    const void* value;
+    const char* end;
+  };
+
+private:
+  const std::size_t capacity;
+
+  // open addressing, linear probing
+  std::vector<entry> entries;
+  std::size_t count = 0;
+
+  // value arena: chunks and their sizes
+  static constexpr std::size_t chunk_size = 1 << 16;
+  std::vector<std::pair<std::unique_ptr<char[]>, std::size_t>> chunks;
+  std::size_t chunk = 0;
+  std::size_t used = 0;
+
+  using destructor_type = void (*)(void*);
+  std::vector<std::pair<void*, destructor_type>> values;
+
+  std::vector<head*> heads;
+
+  std::size_t hash(std::size_t id, const char* at) const {
+    const std::size_t h = id * 0x9e3779b97f4a7c15ull ^
+      reinterpret_cast<std::size_t>(at);
+    return (h ^ (h >> 29)) & (entries.size() - 1);
+  }
+
+  void* allocate(std::size_t size, std::size_t align) {
+    for(; chunk < chunks.size(); ++chunk, used = 0) {
+      const std::size_t start = (used + align - 1) / align * align;
+      if(start + size <= chunks[chunk].second) {
+        used = start + size;
+        return chunks[chunk].first.get() + start;
+      }
+    }
+
+    const std::size_t length = size > chunk_size ? size : chunk_size;
+    chunks.emplace_back(std::unique_ptr<char[]>(new char[length]), length);
+    
+    used = size;
+    return chunks[chunk].first.get();
+  }
+
+public:
+  packrat(std::size_t capacity=1 << 16): capacity(capacity) { }
+
+  packrat(const packrat&) = delete;
+
+  ~packrat() { clear(); }
+
+  void clear() {
+    for(auto& it: values) it.second(it.first);
+    values.clear();
+
+    std::fill(entries.begin(), entries.end(), entry{});
+    count = 0;
+
+    chunk = 0;
+    used = 0;
+  }
+
+  const entry* find(std::size_t id, const char* at) const {
+    if(entries.empty()) return nullptr;
+
+    for(std::size_t i = hash(id, at);; i = (i + 1) & (entries.size() - 1)) {
+      const entry& e = entries[i];
+      if(!e.id) return nullptr;
+      if(e.id == id && e.at == at) return &e;
+    }
+  }
+
+  // copy value (null on failure) into the table
+  template<class T>
+  void store(std::size_t id, const char* at, const T* value, const char* end) {
+    // note: results at a position where a left-recursive parse is in progress
+    // may depend on its seed
+    for(head* h: heads) {
+      if(h->at == at) return;
+    }
+
+    if(count >= capacity) clear();
+
+    if(entries.empty()) {
+      std::size_t size = 1;
+      while(size < 2 * capacity) size *= 2;
+      entries.resize(size);
+    }
+
+    void* copy = nullptr;
+    if(value) {
+      copy = new (allocate(sizeof(T), alignof(T))) T(*value);
+      values.emplace_back(copy, [](void* self) { static_cast<T*>(self)->~T(); });
+    }
+
+    std::size_t i = hash(id, at);
+    while(entries[i].id) i = (i + 1) & (entries.size() - 1);
+
+    entries[i] = {id, at, copy, end};
+    ++count;
+  }
+
+  head* find_head(std::size_t id, const char* at) const {
+    for(head* h: heads) {
+      if(h->id == id && h->at == at) return h;
+    }
+
+    return nullptr;
+  }
+
+  void push(head* h) { heads.push_back(h); }
+  void pop() { heads.pop_back(); }
 };
 
-template<class T, class Def>
-static fixpoint<T, Def> fix(Def def) {
-  return {def};
+
+// memoized parser. left-recursive parsers are grown from a failed seed until
+// their match stops growing, so that they must be memoized (as well as every
+// parser in a left-recursive cycle). note: parsers run without memoization
+// when the state has no table.
+template<class Parser>
+struct memo_type: base {
+  using value_type = value<Parser>;
+
+  const Parser parser;
+
+  // shared by copies
+  const std::size_t id;
+
+  memo_type(Parser parser):
+    parser(std::move(parser)),
+    id(packrat::fresh()) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    packrat* table = s.table;
+    if(!table) return parser(in, s, cont);
+
+    const char* at = in.first;
+
+    const auto reuse = [&](const void* value, const char* end) {
+      if(!value) return s.fail(at);
+
+      in.first = end;
+      return cont(value_type(*static_cast<const value_type*>(value)));
+    };
+
+    if(packrat::head* h = table->find_head(id, at)) {
+      h->used = true;
+      return reuse(h->value, h->end);
+    }
+
+    if(const packrat::entry* e = table->find(id, at)) {
+      return reuse(e->value, e->end);
+    }
+
+    detail::slot<value_type> seed;
+    packrat::head h = {id, at, nullptr, at, false};
+
+    table->push(&h);
+    while(true) {
+      range next = in;
+
+      detail::slot<value_type> value;
+      const bool ok = parser(next, s, [&](auto&& result) {
+        value.emplace(std::forward<decltype(result)>(result));
+        return true;
+      });
+
+      if(s.committed) {
+        table->pop();
+        return false;
+      }
+
+      if(!ok || (h.value && next.first <= h.end)) break;
+
+      seed.emplace(std::move(value.get()));
+      h.value = &seed.get();
+      h.end = next.first;
+
+      if(!h.used) break;
+    }
+    table->pop();
+
+    table->store(id, at, seed ? &seed.get() : nullptr, h.end);
+
+    if(!seed) return s.fail(at);
+
+    in.first = h.end;
+    return cont(std::move(seed.get()));
+  }
+};
+
+template<class Parser, class=enable_parser<Parser>>
+static memo_type<Parser> memo(Parser parser) {
+  return {std::move(parser)};
 }
-  
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // concrete parsers
 
-static result<const char*> cursor(range in) {
-  return make_success(in.first, in);
+struct cursor_type: base {
+  using value_type = const char*;
+
+  template<class Cont>
+  bool operator()(range& in, state&, const Cont& cont) const {
+    // note: a copy, as continuations may keep it while in advances
+    const char* at = in.first;
+    return cont(at);
+  }
 };
 
-// char parser  
-static result<char> character(range in) {
-  if(!in) {
-    return error(in);
+static const cursor_type cursor{};
+
+
+// parse char matching a predicate
+template<class Pred>
+struct pred_type: base {
+  using value_type = char;
+  const Pred pred;
+
+  pred_type(Pred pred): pred(std::move(pred)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    if(!in || !pred(*in.first)) return s.fail(in.first);
+    return cont(*in.first++);
   }
-  
-  return make_success(in.get(), in.next());
 };
 
-// parse char matching a predicate  
 template<class Pred>
-static auto pred(Pred pred) {
-  return character >>= guard(pred);
+static pred_type<Pred> pred(Pred pred) {
+  return {std::move(pred)};
 }
 
-static auto pred(int (*pred)(int)) { return character >>= guard(pred); }
-  
-// parse a given char  
-static auto single(char c) {
-  return pred([c](char x) { return x == c; });
+static pred_type<int (*)(int)> pred(int (*pred)(int)) { return {pred}; }
+
+
+// char parser
+struct any {
+  bool operator()(char) const { return true; }
+};
+
+static const pred_type<any> character{any()};
+
+
+// parse a given char
+struct equal {
+  const char c;
+  bool operator()(char x) const { return x == c; }
+};
+
+static pred_type<equal> single(char c) {
+  return {equal{c}};
+}
+
+
+// run of chars in a class (see scan.hpp), scanned in bulk, with at least min
+// chars. value is the matched range.
+template<class Class>
+struct span_type: base {
+  using value_type = range;
+
+  const Class self;
+  const std::size_t min;
+
+  span_type(Class self, std::size_t min): self(std::move(self)), min(min) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    const char* first = in.first;
+    in.first = scan::skip(in.first, in.last, self);
+
+    if(std::size_t(in.first - first) < min) return s.fail(in.first);
+    return cont(range(first, in.first));
+  }
+};
+
+template<class Class>
+static span_type<Class> span(Class self, std::size_t min=0) {
+  return {std::move(self), min};
 }
 
-// parse a fixed keyword 
-static auto keyword(std::string value) {
-  return [value = std::move(value)](range in) -> result<unit> {
-    if(in.size() < value.size()) {
-      return error(in);
+
+// skip parser for ctype predicates: whitespace, blanks and digits are scanned
+// in bulk (see scan.hpp), other predicates char by char
+struct skip_pred_type: base {
+  using value_type = unit;
+  using scan_type = const char* (*)(const char*, const char*);
+
+  const pred_type<int (*)(int)> parser;
+  const scan_type scan;
+
+  static scan_type scanner(int (*pred)(int)) {
+    using ctype = int (*)(int);
+
+    if(pred == static_cast<ctype>(std::isspace)) return scan::skip_space;
+    if(pred == static_cast<ctype>(std::isblank)) return scan::skip_blank;
+    if(pred == static_cast<ctype>(std::isdigit)) return scan::skip_digits;
+
+    return nullptr;
+  }
+
+  skip_pred_type(pred_type<int (*)(int)> parser):
+    parser(parser),
+    scan(scanner(parser.pred)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state&, const Cont& cont) const {
+    if(scan) {
+      in.first = scan(in.first, in.last);
+    } else {
+      while(in && parser.pred(*in.first)) ++in.first;
     }
 
-    if(value.compare(0, value.size(), in.first, value.size()) == 0) {
-      return make_success(unit{}, range{in.first + value.size(), in.last});
+    return cont(unit{});
+  }
+};
+
+static skip_pred_type skip(pred_type<int (*)(int)> parser) {
+  return {parser};
+}
+
+
+// parse a fixed keyword. note: value must outlive the parser (e.g. literals)
+struct keyword_type: base {
+  using value_type = unit;
+
+  const char* value;
+  const std::size_t size;
+
+  keyword_type(const char* value): value(value), size(std::strlen(value)) { }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    if(in.size() < size || std::memcmp(in.first, value, size) != 0) {
+      return s.fail(in.first);
     }
 
-    return error(in);
-  };
+    in.first += size;
+    return cont(unit{});
+  }
+};
+
+static keyword_type keyword(const char* value) {
+  return {value};
 }
 
+
 // parse numbers. note: leading whitespaces (as per std::isspace) are consumed
-static result<double> _double(range in) {
-  if(!in)
-    return error(in);
-  char* end;
-  const double res = std::strtod(in.first, &end);
-  if(end == in.first)
-    return error(in);
-  return make_success(res, range{end, in.last});
-}
-
-static result<float> _float(range in) {
-  if(!in)
-    return error(in);
-  char* end;
-  const float res = std::strtof(in.first, &end);
-  if(end == in.first)
-    return error(in);
-  return make_success(res, range{end, in.last});
-}
-
-static result<long> _long(range in) {
-  if(!in)
-    return error(in);
-  char* end;
-  const long res = std::strtol(in.first, &end, 10);
-  if(end == in.first)
-    return error(in);
-  return make_success(res, range{end, in.last});
-}
-
-static result<unsigned long> _unsigned_long(range in) {
-  if(!in)
-    return error(in);
-  char* end;
-  const unsigned long res = std::strtoul(in.first, &end, 10);
-  if(end == in.first)
-    return error(in);
-  return make_success(res, range{end, in.last});
-}
-
-// convenience tokenizer  
+template<class T>
+struct number_type: base {
+  using value_type = T;
+
+  // note: floating point numbers are converted by the c library, which may
+  // read past the end of the range up to the first char that is not part of
+  // a number
+  static const char* convert(const char* first, const char*, double& out) {
+    char* end;
+    out = std::strtod(first, &end);
+    return end == first ? nullptr : end;
+  }
+
+  static const char* convert(const char* first, const char*, float& out) {
+    char* end;
+    out = std::strtof(first, &end);
+    return end == first ? nullptr : end;
+  }
+
+  // decimal digits up to max, or nullptr (no digits or overflow)
+  static const char* magnitude(const char* first, const char* last,
+                               std::uint64_t max, std::uint64_t& value) {
+    const char* it = first;
+    while(it != last && *it == '0') ++it;
+
+    // note: 19 digits cannot overflow
+    value = 0;
+    const char* end = scan::digits(it, last - it > 19 ? it + 19 : last, value);
+    if(end == first) return nullptr;
+
+    if(end != last && scan::digit()(*end)) {
+      const std::uint64_t digit = *end++ - '0';
+      if(value > (max - digit) / 10) return nullptr;
+      value = 10 * value + digit;
+
+      if(end != last && scan::digit()(*end)) return nullptr;
+    }
+
+    return value > max ? nullptr : end;
+  }
+
+  static const char* convert(const char* first, const char* last, long& out) {
+    const bool minus = first != last && *first == '-';
+    if(first != last && (*first == '-' || *first == '+')) ++first;
+
+    const std::uint64_t max = std::numeric_limits<long>::max();
+
+    std::uint64_t value;
+    const char* end = magnitude(first, last, max + minus, value);
+    if(!end) return nullptr;
+
+    // note: the magnitude of the minimum is not a long
+    out = !minus ? long(value) : value ? -long(value - 1) - 1 : 0;
+    return end;
+  }
+
+  static const char* convert(const char* first, const char* last,
+                             unsigned long& out) {
+    if(first != last && *first == '+') ++first;
+
+    std::uint64_t value;
+    const char* end =
+      magnitude(first, last, std::numeric_limits<unsigned long>::max(), value);
+    if(!end) return nullptr;
+
+    out = value;
+    return end;
+  }
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    if(!in) return s.fail(in.first);
+
+    T res;
+    const char* end = convert(scan::skip_space(in.first, in.last), in.last, res);
+    if(!end) return s.fail(in.first);
+
+    in.first = end;
+    return cont(T(res));
+  }
+};
+
+static const number_type<double> _double{};
+static const number_type<float> _float{};
+static const number_type<long> _long{};
+static const number_type<unsigned long> _unsigned_long{};
+
+
+// convenience tokenizer
 template<class Parser>
 static auto token(Parser parser) {
-  return skip(pred(std::isspace)) >> parser;
+  return skip(pred(std::isspace)) >> std::move(parser);
 }
 
-// end of stream parser  
-static result<unit> eos(range in) {
-  if(in.first == in.last) {
-    return make_success(unit{}, in);
+
+// end of stream parser
+struct eos_type: base {
+  using value_type = unit;
+
+  template<class Cont>
+  bool operator()(range& in, state& s, const Cont& cont) const {
+    if(in) return s.fail(in.first);
+    return cont(unit{});
   }
+};
+
+static const eos_type eos{};
 
-  return error(in);
-}
 
 ////////////////////////////////////////////////////////////////////////////////
 template<class Parser>
-static value<Parser> run(Parser parser, range in) {
+static value<Parser> run(const Parser& parser, range in, packrat& table) {
+  state s;
+  s.table = &table;
+  
+  detail::slot<value<Parser>> res;
+
+  if(parser(in, s, [&](auto&& value) {
+        res.emplace(std::forward<decltype(value)>(value));
+        return true;
+      })) {
+    return std::move(res.get());
+  }
+
   // TODO report line/col
-  return match(
-      parser(in),
-      [=](error err) -> value<Parser> {
-        std::stringstream ss;
-        ss << "parse error near \"";
-        peek(err, ss);
-        ss << "\"";
-        throw std::runtime_error(ss.str());
-      },
-      [](success<value<Parser>>& ok) { return std::move(ok.value); });
+  std::stringstream ss;
+  ss << "parse error near \"";
+  peek({s.furthest ? s.furthest : in.first, in.last}, ss);
+  ss << "\"";
+  throw std::runtime_error(ss.str());
+}
+
+template<class Parser>
+static value<Parser> run(const Parser& parser, range in) {
+  // note: no allocation until memoized parsers are used
+  packrat table;
+  return run(parser, in, table);
 }
 
 static std::string read(std::istream& in) {
@@ -0,0 +1,334 @@
+#ifndef PEEPHOLE_HPP
+#define PEEPHOLE_HPP
+
+#include "vm.hpp"
+#include "as.hpp"
+
+#include <map>
+#include <vector>
+#include <utility>
+
+// profile-driven peephole optimizer for as listings: removes no-ops, fuses
+// common instruction sequences into superinstructions and rewrites generic
+// instructions with literal operands into their specialized templates
+namespace peephole {
+
+// generic opcodes
+static const vm::instr load = vm::load;
+static const vm::instr push = vm::push;
+static const vm::instr jnz = vm::jnz;
+static const vm::instr next = vm::next;
+
+
+// decoded instruction: opcode, optional label and operands
+struct insn {
+  vm::instr op;
+  as::label addr;
+  std::vector<as::line> args;
+};
+
+
+// specialized instruction templates, keyed by generic opcode + leading literals
+class table {
+public:
+  using key_type = std::pair<vm::instr, std::vector<vm::integer>>;
+
+private:
+  std::map<key_type, vm::instr> special;
+  std::map<vm::instr, key_type> generic;
+
+  // superinstructions
+  std::map<vm::instr, vm::instr> loadop, pushop, cjmp;
+
+  void add(vm::instr op, std::vector<vm::integer> prefix, vm::instr impl) {
+    const key_type key{op, std::move(prefix)};
+    special.emplace(key, impl);
+    generic.emplace(impl, key);
+  }
+
+  template<vm::binary_operation binop>
+  void operation() {
+    loadop.emplace(vm::op<binop>, vm::loadop<binop>);
+    pushop.emplace(vm::op<binop>, vm::pushop<binop>);
+  }
+
+  template<vm::binary_predicate pred>
+  void comparison() {
+    cjmp.emplace(vm::cmp<pred>, vm::cjmp<pred>);
+  }
+
+  template<std::size_t... index>
+  void unary(std::index_sequence<index...>) {
+    const int expand[] = {
+      (add(vm::load, {index}, vm::load<index>),
+       add(vm::loadc, {index}, vm::loadc<index>),
+       add(vm::call, {index}, vm::call<index>),
+       add(vm::callc, {index}, vm::callc<index>),
+       0)...};
+    (void)expand;
+  }
+
+  template<std::size_t argc, std::size_t... cap>
+  void closure(std::index_sequence<cap...>) {
+    const int expand[] = {
+      (add(vm::makec, {argc, cap}, vm::makec<argc, cap>), 0)...};
+    (void)expand;
+  }
+
+  template<std::size_t... argc>
+  void makec(std::index_sequence<argc...> seq) {
+    const int expand[] = {(closure<argc>(seq), 0)...};
+    (void)expand;
+  }
+
+public:
+  static constexpr std::size_t arity = 4;
+
+  table() {
+    unary(std::make_index_sequence<arity>());
+    makec(std::make_index_sequence<arity>());
+
+    operation<vm::add>();
+    operation<vm::sub>();
+    operation<vm::mul>();
+    operation<vm::div>();
+    operation<vm::mod>();
+
+    comparison<vm::eq>();
+    comparison<vm::ne>();
+    comparison<vm::le>();
+    comparison<vm::lt>();
+    comparison<vm::ge>();
+    comparison<vm::gt>();
+  }
+
+  // generic opcode for a specialized one (or itself)
+  vm::instr canonical(vm::instr op) const {
+    const auto it = generic.find(op);
+    if(it == generic.end()) return op;
+    return it->second.first;
+  }
+
+  // generic opcode and leading literals of a specialized one (if any)
+  const key_type* specialization(vm::instr op) const {
+    const auto it = generic.find(op);
+    if(it == generic.end()) return nullptr;
+    return &it->second;
+  }
+
+  // rewrite a specialized instruction into its generic form
+  insn decode(insn self) const {
+    const auto it = generic.find(self.op);
+    if(it == generic.end()) return self;
+
+    std::vector<as::line> args;
+    for(vm::integer lit: it->second.second) {
+      args.emplace_back(vm::word(lit));
+    }
+
+    args.insert(args.end(), self.args.begin(), self.args.end());
+    return {it->second.first, self.addr, std::move(args)};
+  }
+
+  // rewrite a generic instruction with literal operands into its specialized
+  // form, when available
+  insn encode(insn self) const {
+    std::vector<vm::integer> prefix;
+    for(std::size_t i = 0; i < self.args.size(); ++i) {
+      if(self.args[i].kind != as::line::DATA) break;
+      prefix.emplace_back(self.args[i].value.data.value);
+
+      const auto it = special.find({self.op, prefix});
+      if(it != special.end()) {
+        return {it->second,
+                self.addr,
+                {self.args.begin() + i + 1, self.args.end()}};
+      }
+    }
+
+    return self;
+  }
+
+  static vm::instr find(const std::map<vm::instr, vm::instr>& map,
+                        vm::instr op) {
+    const auto it = map.find(op);
+    if(it == map.end()) return nullptr;
+    return it->second;
+  }
+
+  vm::instr fuse_loadop(vm::instr op) const { return find(loadop, op); }
+  vm::instr fuse_pushop(vm::instr op) const { return find(pushop, op); }
+  vm::instr fuse_cjmp(vm::instr op) const { return find(cjmp, op); }
+
+  static const table& instance() {
+    static const table self;
+    return self;
+  }
+};
+
+
+// split listing into instructions: operands are the non-instruction lines
+// following an instruction
+static std::vector<insn> decode(const std::vector<as::line>& listing) {
+  std::vector<insn> result;
+
+  for(const as::line& it: listing) {
+    if(it.kind == as::line::INSTR) {
+      result.push_back({it.value.instr.op, it.value.instr.addr, {}});
+    } else if(result.empty()) {
+      throw std::runtime_error("operand without instruction");
+    } else {
+      result.back().args.emplace_back(it);
+    }
+  }
+
+  for(insn& it: result) {
+    it = table::instance().decode(std::move(it));
+  }
+
+  return result;
+}
+
+
+static std::vector<as::line> encode(const std::vector<insn>& code) {
+  std::vector<as::line> result;
+
+  for(const insn& it: code) {
+    const insn self = table::instance().encode(it);
+    if(self.addr) {
+      result.emplace_back(self.addr, self.op);
+    } else {
+      result.emplace_back(self.op);
+    }
+
+    result.insert(result.end(), self.args.begin(), self.args.end());
+  }
+
+  return result;
+}
+
+
+// optimization statistics
+struct stats {
+  std::size_t removed = 0;
+  std::size_t fused = 0;
+  std::size_t specialized = 0;
+};
+
+
+struct options {
+  // profile guiding fusion: when present, only sequences whose instruction
+  // pairs were executed at least threshold times are fused
+  const vm::profile* profile = nullptr;
+  std::size_t threshold = 1;
+};
+
+
+class optimizer {
+  const table& ops = table::instance();
+  const options opts;
+
+  // pair counts, keyed by generic opcodes
+  std::map<vm::profile::pair_type, std::size_t> pairs;
+
+  bool hot(vm::instr first, vm::instr second) const {
+    if(!opts.profile) return true;
+
+    const auto it = pairs.find({first, second});
+    return it != pairs.end() && it->second >= opts.threshold;
+  }
+
+  static bool literal(const insn& self) {
+    return self.args.size() == 1 && self.args[0].kind == as::line::DATA;
+  }
+
+  // fused instruction at position i (if any), with the number of instructions
+  // it replaces
+  std::pair<insn, std::size_t> fuse(const std::vector<insn>& code,
+                                    std::size_t i) const {
+    const insn& first = code[i];
+    const insn* second = i + 1 < code.size() ? &code[i + 1] : nullptr;
+    const insn* third = i + 2 < code.size() ? &code[i + 2] : nullptr;
+
+    // no jumps into fused sequences
+    if(second && second->addr) second = nullptr;
+    if(!second || (third && third->addr)) third = nullptr;
+
+    // load [first]; load [second]; op<binop>
+    if(third && first.op == load && second->op == load && literal(first) &&
+       literal(*second) && hot(load, load) && hot(load, third->op)) {
+      if(const vm::instr fused = ops.fuse_loadop(third->op)) {
+        return {{fused, first.addr, {first.args[0], second->args[0]}}, 3};
+      }
+    }
+
+    // push [word]; op<binop>
+    if(second && first.op == push && literal(first) &&
+       hot(push, second->op)) {
+      if(const vm::instr fused = ops.fuse_pushop(second->op)) {
+        return {{fused, first.addr, first.args}, 2};
+      }
+    }
+
+    // cmp<pred>; jnz [offset]
+    if(second && second->op == jnz && hot(first.op, jnz)) {
+      if(const vm::instr fused = ops.fuse_cjmp(first.op)) {
+        return {{fused, first.addr, second->args}, 2};
+      }
+    }
+
+    return {first, 1};
+  }
+
+public:
+  stats info;
+
+  optimizer(options opts = {}): opts(opts) {
+    if(!opts.profile) return;
+
+    for(const auto& it: opts.profile->pairs) {
+      pairs[{ops.canonical(it.first.first), ops.canonical(it.first.second)}] +=
+        it.second;
+    }
+  }
+
+  std::vector<insn> operator()(std::vector<insn> code) {
+    // remove no-ops, moving their label to the next instruction
+    std::vector<insn> clean;
+    for(std::size_t i = 0; i < code.size(); ++i) {
+      insn& it = code[i];
+      if(it.op == next && it.args.empty() && i + 1 < code.size() &&
+         !(it.addr && code[i + 1].addr)) {
+        if(it.addr) code[i + 1].addr = it.addr;
+        ++info.removed;
+        continue;
+      }
+
+      clean.emplace_back(std::move(it));
+    }
+
+    // fuse superinstructions
+    std::vector<insn> result;
+    for(std::size_t i = 0; i < clean.size();) {
+      auto fused = fuse(clean, i);
+      if(fused.second > 1) ++info.fused;
+
+      result.emplace_back(std::move(fused.first));
+      i += fused.second;
+    }
+
+    for(const insn& it: result) {
+      if(ops.encode(it).op != it.op) ++info.specialized;
+    }
+
+    return result;
+  }
+
+  std::vector<as::line> operator()(const std::vector<as::line>& listing) {
+    return encode((*this)(decode(listing)));
+  }
+};
+
+} // namespace peephole
+
+#endif
@@ -0,0 +1,185 @@
+#include "vm.hpp"
+#include "as.hpp"
+#include "regvm.hpp"
+#include "timer.hpp"
+
+#include <vector>
+#include <map>
+
+#include <iostream>
+
+static as::line lit(vm::integer value) { return vm::word(value); }
+
+static std::vector<as::line> fib(vm::integer n) {
+  const as::label fib = as::make_label("fib");
+  const as::label base = as::make_label("base");
+
+  return {
+    // main
+    vm::push, lit(n),
+    vm::call, lit(1), fib,
+    vm::ret,
+
+    // fib
+    {fib, vm::load}, lit(-1),
+    vm::push, lit(2),
+    vm::cmp<vm::lt>,
+    vm::jnz, base,
+
+    vm::push, lit(1),
+    vm::load, lit(-1),
+    vm::op<vm::sub>,
+    vm::call, lit(1), fib,
+
+    vm::push, lit(2),
+    vm::load, lit(-1),
+    vm::op<vm::sub>,
+    vm::call, lit(1), fib,
+
+    vm::op<vm::add>,
+    vm::ret,
+
+    {base, vm::load}, lit(-1),
+    vm::ret,
+  };
+}
+
+
+// rough memory traffic model: stack/register file words read or written per
+// instruction (code fetches excluded, frame bookkeeping included)
+template<class Instr>
+using traffic_type = std::map<Instr, std::size_t>;
+
+static traffic_type<vm::instr> stack_traffic() {
+  return {{vm::push, 1},
+          {vm::pop, 0},
+          {vm::dup, 2},
+          {vm::load, 2},
+          {vm::loadc, 3},
+          {vm::op<vm::add>, 3},
+          {vm::op<vm::sub>, 3},
+          {vm::cmp<vm::lt>, 3},
+          {vm::jnz, 1},
+          {vm::jmp, 0},
+          // caller/callee frame on the native stack + result
+          {vm::call, 8},
+          {vm::callc, 9},
+          {vm::makec, 2}};
+}
+
+static traffic_type<regvm::instr> register_traffic() {
+  return {{regvm::enter, 0},
+          {regvm::mov, 2},
+          {regvm::movi, 1},
+          {regvm::loadc, 3},
+          {regvm::op<vm::add>, 3},
+          {regvm::op<vm::sub>, 3},
+          {regvm::cmp<vm::lt>, 3},
+          {regvm::jnz, 1},
+          {regvm::jmp, 0},
+          // saved frame + result
+          {regvm::call, 3},
+          {regvm::callc, 4},
+          {regvm::ret, 5},
+          {regvm::makec, 2}};
+}
+
+template<class Instr>
+static std::pair<std::size_t, std::size_t>
+summary(const std::map<Instr, std::size_t>& counts,
+        const traffic_type<Instr>& traffic) {
+  std::size_t instructions = 0, words = 0;
+  for(const auto& it: counts) {
+    instructions += it.second;
+
+    const auto cost = traffic.find(it.first);
+    if(cost != traffic.end()) words += it.second * cost->second;
+  }
+
+  return {instructions, words};
+}
+
+
+int main(int, char**) {
+  static constexpr std::size_t size = 1 << 16;
+  static vm::word stack[size];
+
+  const vm::integer n = 30;
+  const auto listing = fib(n);
+
+  regvm::stats info;
+  const auto reg = regvm::compile(listing, &info);
+  const auto prog = as::link(listing);
+
+  std::cout << "static instructions: " << info.input << " -> " << info.output
+            << std::endl;
+
+  // timings
+  vm::integer result;
+  std::cout << "stack: " << with_time([&] {
+    result = vm::eval(prog.data(), stack).value;
+  }) << " (" << result << ")" << std::endl;
+
+  std::cout << "register: " << with_time([&] {
+    result = regvm::eval(reg.data()).value;
+  }) << " (" << result << ")" << std::endl;
+
+  // dynamic counts on a smaller input
+  {
+    const auto prog = as::link(fib(20));
+    const auto reg = regvm::compile(fib(20));
+
+    vm::profile stack_profile;
+    {
+      const vm::profile::scope lock(stack_profile);
+      vm::eval(prog.data(), stack);
+    }
+
+    regvm::profile register_profile;
+    regvm::machine init(reg.data());
+    register_profile.run(&init);
+
+    const auto stack = summary(stack_profile.counts, stack_traffic());
+    const auto regs = summary(register_profile.counts, register_traffic());
+
+    std::cout << "executed instructions: " << stack.first << " -> "
+              << regs.first << std::endl;
+    std::cout << "memory traffic (words): " << stack.second << " -> "
+              << regs.second << std::endl;
+  }
+
+  // deep recursion does not grow the native stack
+  {
+    const as::label count = as::make_label("count");
+    const as::label done = as::make_label("done");
+
+    // count(n) = n == 0 ? 0 : 1 + count(n - 1)
+    const std::vector<as::line> listing = {
+      vm::push, lit(1000000),
+      vm::call, lit(1), count,
+      vm::ret,
+
+      {count, vm::push}, lit(0),
+      vm::load, lit(-1),
+      vm::cmp<vm::eq>,
+      vm::jnz, done,
+
+      vm::push, lit(1),
+      vm::load, lit(-1),
+      vm::op<vm::sub>,
+      vm::call, lit(1), count,
+      vm::push, lit(1),
+      vm::op<vm::add>,
+      vm::ret,
+
+      {done, vm::push}, lit(0),
+      vm::ret,
+    };
+
+    const auto reg = regvm::compile(listing);
+    std::cout << "deep recursion: " << regvm::eval(reg.data()).value
+              << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,684 @@
+#ifndef REGVM_HPP
+#define REGVM_HPP
+
+#include "vm.hpp"
+#include "peephole.hpp"
+
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+// register-based variant of vm.hpp: instructions name their operands as
+// registers relative to the current frame pointer instead of going through the
+// stack. frames are kept on an explicit, heap-allocated frame stack so calls
+// never re-enter run.
+namespace regvm {
+
+using vm::integer;
+using vm::word;
+using vm::closure;
+
+struct machine;
+
+using instr = void (*)(machine*);
+
+union code {
+  instr op;
+  word data;
+
+  code(instr op): op(op) { }
+  code(word data): data(data) { }
+};
+
+
+// saved caller state
+struct frame {
+  const code* ip;
+  std::size_t fp;
+  std::size_t dst;
+};
+
+
+struct machine {
+  const code* ip;
+  word* fp;
+  word result;
+
+  std::vector<word> stack;
+  std::vector<frame> frames;
+
+  machine(const code* ip, std::size_t size = 1024):
+    ip(ip),
+    stack(size) {
+    fp = stack.data();
+  }
+
+  std::size_t base() const { return fp - stack.data(); }
+
+  // make sure registers [fp, fp + size) are allocated
+  void reserve(std::size_t size) {
+    const std::size_t base = this->base();
+    if(stack.size() < base + size) {
+      stack.resize(std::max(base + size, 2 * stack.size()));
+      fp = stack.data() + base;
+    }
+  }
+};
+
+
+// fetch next instruction as data
+static integer fetch_lit(machine* self) { return (++self->ip)->data.value; }
+
+// fetch next instruction as register
+static word& fetch_reg(machine* self) { return self->fp[fetch_lit(self)]; }
+
+// fetch next instruction as code pointer
+static const code* fetch_addr(machine* self) {
+  const integer offset = fetch_lit(self);
+  return self->ip + offset;
+}
+
+// closures share vm::closure: the entry point of register code is stored in
+// place of the stack code (both are word-sized unions)
+static const vm::code* entry(const code* addr) {
+  return reinterpret_cast<const vm::code*>(addr);
+}
+
+static const code* entry(const closure* func) {
+  return reinterpret_cast<const code*>(func->impl);
+}
+
+
+static void next(machine* self) { ++self->ip; }
+
+// enter [size]
+static void enter(machine* self) {
+  self->reserve(fetch_lit(self));
+  next(self);
+}
+
+// mov [dst, src]
+static void mov(machine* self) {
+  word& dst = fetch_reg(self);
+  dst = fetch_reg(self);
+  next(self);
+}
+
+// movi [dst, word]
+static void movi(machine* self) {
+  word& dst = fetch_reg(self);
+  dst = fetch_lit(self);
+  next(self);
+}
+
+// jmp [offset]
+static void jmp(machine* self) { self->ip = fetch_addr(self); }
+
+// jnz [src, offset]
+static void jnz(machine* self) {
+  if(fetch_reg(self).value) {
+    jmp(self);
+  } else {
+    next(self);
+    next(self);
+  }
+}
+
+// cmp [dst, lhs, rhs]
+template<vm::binary_predicate pred>
+static void cmp(machine* self) {
+  word& dst = fetch_reg(self);
+  const integer lhs = fetch_reg(self).value;
+  const integer rhs = fetch_reg(self).value;
+
+  dst = pred(lhs, rhs);
+  next(self);
+}
+
+// op [dst, lhs, rhs]
+template<vm::binary_operation binop>
+static void op(machine* self) {
+  word& dst = fetch_reg(self);
+  const integer lhs = fetch_reg(self).value;
+  const integer rhs = fetch_reg(self).value;
+
+  dst = binop(lhs, rhs);
+  next(self);
+}
+
+
+static void call(machine* self, std::size_t argc, std::size_t base,
+                 const code* addr) {
+  // the callee frame starts at register base, arguments right below it. the
+  // result replaces the first argument.
+  const std::size_t fp = self->base();
+  self->frames.push_back({self->ip + 1, fp, fp + base - argc});
+
+  // note: callees start with enter [size], whose frame is reserved before fp
+  // moves past the end of the stack
+  assert(addr->op == enter);
+  self->reserve(base + addr[1].data.value);
+  
+  self->fp += base;
+  self->ip = addr;
+}
+
+// call [argc, base, offset]
+static void call(machine* self) {
+  const integer argc = fetch_lit(self);
+  const integer base = fetch_lit(self);
+  const code* addr = fetch_addr(self);
+
+  call(self, argc, base, addr);
+}
+
+// callc [argc, base]: closure in register base - 1
+static void callc(machine* self) {
+  const integer argc = fetch_lit(self);
+  const integer base = fetch_lit(self);
+
+  call(self, argc, base, entry(self->fp[base - 1].func));
+}
+
+// ret [src]
+static void ret(machine* self) {
+  const word result = fetch_reg(self);
+
+  if(self->frames.empty()) {
+    self->result = result;
+    self->ip = nullptr;
+    return;
+  }
+
+  const frame caller = self->frames.back();
+  self->frames.pop_back();
+
+  self->stack[caller.dst] = result;
+  self->fp = self->stack.data() + caller.fp;
+  self->ip = caller.ip;
+}
+
+// loadc [dst, index]
+static void loadc(machine* self) {
+  word& dst = fetch_reg(self);
+  const integer index = fetch_lit(self);
+
+  dst = self->fp[-1].func->data()[index];
+  next(self);
+}
+
+// makec [argc, cap, top, offset]: captures registers top - 1, ..., top - cap
+// into a closure stored in register top - cap
+static void makec(machine* self) {
+  const integer argc = fetch_lit(self);
+  const integer cap = fetch_lit(self);
+  const integer top = fetch_lit(self);
+  const code* addr = fetch_addr(self);
+
+  // note: register frames have no stack maps, closures are unmanaged
+  closure* result = closure::make(entry(addr), argc, cap);
+
+  word* data = result->data();
+  for(integer i = 0; i < cap; ++i) {
+    data[i] = self->fp[top - 1 - i];
+  }
+
+  self->fp[top - cap] = result;
+  next(self);
+}
+
+
+static void run(machine* self) {
+  while(self->ip) {
+    (*self->ip->op)(self);
+  }
+}
+
+// executed instruction counts
+struct profile {
+  std::map<instr, std::size_t> counts;
+
+  void run(machine* self) {
+    while(self->ip) {
+      const instr op = self->ip->op;
+      ++counts[op];
+      (*op)(self);
+    }
+  }
+};
+
+
+// toplevel eval
+static word eval(const code* prog) {
+  machine init(prog);
+  run(&init);
+  return init.result;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// stack bytecode -> register bytecode
+
+// translation statistics: (static) instruction counts
+struct stats {
+  std::size_t input = 0;
+  std::size_t output = 0;
+};
+
+
+class compiler {
+  using insn = peephole::insn;
+  std::vector<insn> source;
+  std::map<as::label, std::size_t> labels;
+
+  // generic stack opcodes
+  const vm::instr next = vm::next, jmp = vm::jmp, jnz = vm::jnz,
+                  push = vm::push, pop = vm::pop, dup = vm::dup,
+                  load = vm::load, store = vm::store, loadc = vm::loadc,
+                  call = vm::call, callc = vm::callc, makec = vm::makec,
+                  ret = vm::ret;
+
+  // stack -> register arithmetic
+  std::map<vm::instr, instr> ops, cmps;
+
+  template<vm::binary_operation binop>
+  void operation() {
+    ops.emplace(vm::op<binop>, op<binop>);
+  }
+
+  template<vm::binary_predicate pred>
+  void comparison() {
+    cmps.emplace(vm::cmp<pred>, cmp<pred>);
+  }
+
+  // stack depth before each instruction (-1 when unreachable)
+  std::vector<integer> depth;
+
+  // function entry points with their frame size
+  std::map<std::size_t, integer> entries;
+
+  // state of a virtual stack slot
+  struct slot {
+    enum { REG, ALIAS, CONST } kind;
+    integer value;
+  };
+
+  std::vector<slot> stack;
+
+  // output
+  std::vector<code> result;
+  std::vector<std::size_t> position;
+  std::vector<std::pair<std::size_t, std::size_t>> patch;
+
+  std::size_t target(const as::line& addr) const {
+    if(addr.kind != as::line::ADDR) {
+      throw std::runtime_error("expected address operand");
+    }
+
+    const auto it = labels.find(addr.value.addr);
+    if(it == labels.end()) throw std::runtime_error("unknown label");
+    return it->second;
+  }
+
+  static integer literal(const insn& self, std::size_t i) {
+    if(i >= self.args.size() || self.args[i].kind != as::line::DATA) {
+      throw std::runtime_error("expected literal operand");
+    }
+
+    return self.args[i].value.data.value;
+  }
+
+  // stack effect and successors
+  struct effect {
+    integer pop, push;
+    bool fallthrough;
+    integer jump;
+  };
+
+  effect analyze(const insn& self) const {
+    const vm::instr op = self.op;
+    if(op == next) return {0, 0, true, -1};
+    if(op == jmp) return {0, 0, false, integer(target(self.args.at(0)))};
+    if(op == jnz) return {1, 0, true, integer(target(self.args.at(0)))};
+    if(op == push || op == load || op == loadc) return {0, 1, true, -1};
+    if(op == pop || op == store) return {1, 0, true, -1};
+    if(op == dup) return {1, 2, true, -1};
+    if(op == call || op == callc) return {literal(self, 0), 1, true, -1};
+    if(op == makec) return {literal(self, 1), 1, true, -1};
+    if(op == ret) return {1, 0, false, -1};
+    if(ops.count(op) || cmps.count(op)) return {2, 1, true, -1};
+
+    throw std::runtime_error("unsupported instruction");
+  }
+
+  // compute stack depths and frame sizes for the function starting at start
+  void analyze(std::size_t start) {
+    std::vector<std::size_t> todo = {start};
+    std::vector<bool> visited(source.size());
+
+    integer& size = entries[start];
+    depth[start] = 0;
+
+    while(todo.size()) {
+      const std::size_t i = todo.back();
+      todo.pop_back();
+
+      if(visited[i]) continue;
+      visited[i] = true;
+
+      const effect info = analyze(source[i]);
+      const integer after = depth[i] - info.pop + info.push;
+      if(depth[i] < info.pop) throw std::runtime_error("stack underflow");
+
+      size = std::max(size, std::max(depth[i], after));
+
+      const auto succ = [&](std::size_t j) {
+        if(j >= source.size()) throw std::runtime_error("falling off code");
+        if(depth[j] >= 0 && depth[j] != after) {
+          throw std::runtime_error("inconsistent stack depth");
+        }
+
+        depth[j] = after;
+        todo.push_back(j);
+      };
+
+      if(info.fallthrough) succ(i + 1);
+      if(info.jump >= 0) succ(info.jump);
+
+      // callees
+      if(source[i].op == call) enter(target(source[i].args.at(1)));
+      if(source[i].op == makec) enter(target(source[i].args.at(2)));
+    }
+  }
+
+  void enter(std::size_t start) {
+    if(!entries.count(start)) analyze(start);
+  }
+
+  void emit(instr op) {
+    result.emplace_back(op);
+    ++info.output;
+  }
+
+  void emit(integer lit) { result.emplace_back(word(lit)); }
+
+  void emit_addr(std::size_t target) {
+    patch.emplace_back(result.size(), target);
+    result.emplace_back(word(integer(0)));
+  }
+
+  // register holding slot k, materializing constants
+  integer reg(integer k) {
+    if(stack[k].kind == slot::ALIAS) return stack[k].value;
+
+    materialize(k);
+    return k;
+  }
+
+  void materialize(integer k) {
+    slot& self = stack[k];
+    switch(self.kind) {
+    case slot::REG:
+      return;
+    case slot::ALIAS:
+      emit(mov);
+      break;
+    case slot::CONST:
+      emit(movi);
+      break;
+    }
+
+    emit(k);
+    emit(self.value);
+    self = {slot::REG, k};
+  }
+
+  void materialize(integer first, integer last) {
+    for(integer k = std::max(first, integer(0)); k < last; ++k) {
+      materialize(k);
+    }
+  }
+
+  void flush() { materialize(0, stack.size()); }
+
+  // push a copy of register (or slot) i
+  void copy(integer i) {
+    if(i >= integer(stack.size())) throw std::runtime_error("load out of frame");
+    
+    if(i < 0 || stack[i].kind == slot::REG) {
+      stack.push_back({slot::ALIAS, i});
+    } else {
+      stack.push_back(stack[i]);
+    }
+  }
+
+  void compile(std::size_t i) {
+    const insn& self = source[i];
+    const vm::instr op = self.op;
+    const integer d = stack.size();
+
+    if(op == next) return;
+
+    if(op == push) {
+      stack.push_back({slot::CONST, literal(self, 0)});
+      return;
+    }
+
+    if(op == load) return copy(literal(self, 0));
+    if(op == dup) return copy(d - 1);
+
+    if(op == pop) {
+      stack.pop_back();
+      return;
+    }
+
+    if(op == store) {
+      const integer dst = literal(self, 0);
+      if(dst >= d) throw std::runtime_error("store out of frame");
+
+      // slots aliasing the overwritten register keep the old value
+      for(integer k = 0; k < d - 1; ++k) {
+        if(stack[k].kind == slot::ALIAS && stack[k].value == dst) {
+          materialize(k);
+        }
+      }
+
+      const slot src = stack[d - 1];
+      if(src.kind == slot::CONST) {
+        emit(movi);
+        emit(dst);
+        emit(src.value);
+      } else {
+        emit(mov);
+        emit(dst);
+        emit(reg(d - 1));
+      }
+
+      stack.pop_back();
+      if(dst >= 0 && dst < d - 1) stack[dst] = {slot::REG, dst};
+      return;
+    }
+
+    if(op == loadc) {
+      emit(regvm::loadc);
+      emit(d);
+      emit(literal(self, 0));
+      stack.push_back({slot::REG, d});
+      return;
+    }
+
+    const auto arith = ops.find(op);
+    if(arith != ops.end()) {
+      // lhs on top
+      const integer lhs = reg(d - 1), rhs = reg(d - 2);
+      emit(arith->second);
+      emit(d - 2);
+      emit(lhs);
+      emit(rhs);
+      stack.resize(d - 2);
+      stack.push_back({slot::REG, d - 2});
+      return;
+    }
+
+    const auto pred = cmps.find(op);
+    if(pred != cmps.end()) {
+      // rhs on top
+      const integer rhs = reg(d - 1), lhs = reg(d - 2);
+      emit(pred->second);
+      emit(d - 2);
+      emit(lhs);
+      emit(rhs);
+      stack.resize(d - 2);
+      stack.push_back({slot::REG, d - 2});
+      return;
+    }
+
+    if(op == jmp) {
+      flush();
+      emit(regvm::jmp);
+      emit_addr(target(self.args[0]));
+      return;
+    }
+
+    if(op == jnz) {
+      const integer cond = reg(d - 1);
+      stack.pop_back();
+      flush();
+      emit(regvm::jnz);
+      emit(cond);
+      emit_addr(target(self.args[0]));
+      return;
+    }
+
+    if(op == call || op == callc) {
+      // callee only sees its arguments (and closure)
+      const integer argc = literal(self, 0);
+      materialize(d - argc - (op == callc), d);
+
+      if(op == call) {
+        emit(regvm::call);
+      } else {
+        emit(regvm::callc);
+      }
+
+
+      emit(argc);
+      emit(d);
+      if(op == call) emit_addr(target(self.args[1]));
+
+      stack.resize(d - argc);
+      stack.push_back({slot::REG, d - argc});
+      return;
+    }
+
+    if(op == makec) {
+      const integer cap = literal(self, 1);
+      materialize(d - cap, d);
+
+      emit(regvm::makec);
+      emit(literal(self, 0));
+      emit(cap);
+      emit(d);
+      emit_addr(target(self.args[2]));
+
+      stack.resize(d - cap);
+      stack.push_back({slot::REG, d - cap});
+      return;
+    }
+
+    if(op == ret) {
+      const integer src = reg(d - 1);
+      emit(regvm::ret);
+      emit(src);
+      return;
+    }
+
+    throw std::runtime_error("unsupported instruction");
+  }
+
+public:
+  stats info;
+
+  compiler(const std::vector<as::line>& listing):
+    source(peephole::decode(listing)),
+    depth(source.size(), -1) {
+    operation<vm::add>();
+    operation<vm::sub>();
+    operation<vm::mul>();
+    operation<vm::div>();
+    operation<vm::mod>();
+
+    comparison<vm::eq>();
+    comparison<vm::ne>();
+    comparison<vm::le>();
+    comparison<vm::lt>();
+    comparison<vm::ge>();
+    comparison<vm::gt>();
+
+    for(std::size_t i = 0; i < source.size(); ++i) {
+      if(source[i].addr) labels.emplace(source[i].addr, i);
+    }
+  }
+
+  std::vector<code> operator()() {
+    if(source.empty()) return {};
+    enter(0);
+
+    // jump targets: the virtual stack must be flushed when reaching them
+    std::vector<bool> targets(source.size());
+    for(const insn& it: source) {
+      for(const as::line& arg: it.args) {
+        if(arg.kind == as::line::ADDR) targets[target(arg)] = true;
+      }
+    }
+
+    bool live = false;
+    for(std::size_t i = 0; i < source.size(); ++i) {
+      if(depth[i] < 0) {
+        position.push_back(result.size());
+        live = false;
+        continue;
+      }
+
+      if(live && targets[i]) flush();
+      if(!live || targets[i]) {
+        stack.assign(depth[i], slot{slot::REG, 0});
+        for(integer k = 0; k < depth[i]; ++k) stack[k].value = k;
+      }
+
+      position.push_back(result.size());
+
+      const auto entry = entries.find(i);
+      if(entry != entries.end()) {
+        emit(regvm::enter);
+        emit(entry->second);
+      }
+
+      compile(i);
+      if(source[i].op != next) ++info.input;
+
+      live = analyze(source[i]).fallthrough;
+    }
+
+    for(const auto& it: patch) {
+      result[it.first] = word(integer(position[it.second]) - integer(it.first));
+    }
+
+    return std::move(result);
+  }
+};
+
+
+// convenience
+static std::vector<code> compile(const std::vector<as::line>& listing,
+                                 stats* info = nullptr) {
+  compiler self(listing);
+  std::vector<code> result = self();
+  if(info) *info = self.info;
+  return result;
+}
+
+} // namespace regvm
+
+#endif
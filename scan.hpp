@@ -0,0 +1,358 @@
+#ifndef CPP_SCAN_HPP
+#define CPP_SCAN_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+// vectorized character scanning for parsers: blocks of 16 (sse2) or 32 (avx2)
+// chars are classified at once, with a scalar fallback for the tail and for
+// other targets. define SCAN_SCALAR to disable vector code.
+#if !defined(SCAN_SCALAR) && defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_VECTOR 32
+#elif !defined(SCAN_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_VECTOR 16
+#endif
+
+namespace scan {
+
+namespace detail {
+
+#if SCAN_VECTOR == 32
+struct vector {
+  using type = __m256i;
+  static constexpr std::size_t width = 32;
+
+  static type load(const char* at) {
+    return _mm256_loadu_si256(reinterpret_cast<const type*>(at));
+  }
+
+  static type splat(char c) { return _mm256_set1_epi8(c); }
+  static type zero() { return _mm256_setzero_si256(); }
+
+  static type either(type lhs, type rhs) { return _mm256_or_si256(lhs, rhs); }
+  static type equal(type lhs, type rhs) { return _mm256_cmpeq_epi8(lhs, rhs); }
+
+  static type invert(type self) {
+    return _mm256_xor_si256(self, _mm256_set1_epi8(-1));
+  }
+
+  // unsigned lo <= c <= hi
+  static type within(type self, char lo, char hi) {
+    const type offset = _mm256_sub_epi8(self, splat(lo));
+    return equal(_mm256_min_epu8(offset, splat(hi - lo)), offset);
+  }
+
+  static std::uint32_t bits(type self) { return _mm256_movemask_epi8(self); }
+};
+#elif SCAN_VECTOR == 16
+struct vector {
+  using type = __m128i;
+  static constexpr std::size_t width = 16;
+
+  static type load(const char* at) {
+    return _mm_loadu_si128(reinterpret_cast<const type*>(at));
+  }
+
+  static type splat(char c) { return _mm_set1_epi8(c); }
+  static type zero() { return _mm_setzero_si128(); }
+
+  static type either(type lhs, type rhs) { return _mm_or_si128(lhs, rhs); }
+  static type equal(type lhs, type rhs) { return _mm_cmpeq_epi8(lhs, rhs); }
+
+  static type invert(type self) {
+    return _mm_xor_si128(self, _mm_set1_epi8(-1));
+  }
+
+  // unsigned lo <= c <= hi
+  static type within(type self, char lo, char hi) {
+    const type offset = _mm_sub_epi8(self, splat(lo));
+    return equal(_mm_min_epu8(offset, splat(hi - lo)), offset);
+  }
+
+  static std::uint32_t bits(type self) { return _mm_movemask_epi8(self); }
+};
+#endif
+
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// character classes: function objects classifying single chars, and blocks of
+// chars as vector masks when available
+////////////////////////////////////////////////////////////////////////////////
+
+// std::isspace in the "C" locale
+struct space {
+  bool operator()(char c) const {
+    return c == ' ' || static_cast<unsigned char>(c - '\t') < 5;
+  }
+
+#ifdef SCAN_VECTOR
+  detail::vector::type operator()(detail::vector::type block) const {
+    using detail::vector;
+    return vector::either(vector::equal(block, vector::splat(' ')),
+                          vector::within(block, '\t', '\r'));
+  }
+#endif
+};
+
+
+// std::isblank in the "C" locale
+struct blank {
+  bool operator()(char c) const { return c == ' ' || c == '\t'; }
+
+#ifdef SCAN_VECTOR
+  detail::vector::type operator()(detail::vector::type block) const {
+    using detail::vector;
+    return vector::either(vector::equal(block, vector::splat(' ')),
+                          vector::equal(block, vector::splat('\t')));
+  }
+#endif
+};
+
+
+struct digit {
+  bool operator()(char c) const {
+    return static_cast<unsigned char>(c - '0') < 10;
+  }
+
+#ifdef SCAN_VECTOR
+  detail::vector::type operator()(detail::vector::type block) const {
+    return detail::vector::within(block, '0', '9');
+  }
+#endif
+};
+
+
+// string delimiters: quote or backslash
+struct quote {
+  bool operator()(char c) const { return c == '"' || c == '\\'; }
+
+#ifdef SCAN_VECTOR
+  detail::vector::type operator()(detail::vector::type block) const {
+    using detail::vector;
+    return vector::either(vector::equal(block, vector::splat('"')),
+                          vector::equal(block, vector::splat('\\')));
+  }
+#endif
+};
+
+
+// arbitrary char set, as a bit table and as a union of char ranges. sets of a
+// few ranges (e.g. std::isspace, std::isalnum, short lists of chars) are
+// classified as vectors, other sets use the table.
+class set {
+  static constexpr std::size_t max_ranges = 8;
+
+  std::uint64_t table[4] = {};
+
+  unsigned char lo[max_ranges];
+  unsigned char hi[max_ranges];
+  std::size_t ranges = 0;
+
+  void insert(unsigned char c) {
+    table[c >> 6] |= std::uint64_t(1) << (c & 63);
+  }
+
+  // ranges from table, if there are few enough
+  void build() {
+    for(unsigned c = 0; c < 256; ++c) {
+      if(!(*this)(c)) continue;
+
+      if(ranges && hi[ranges - 1] + 1u == c) {
+        hi[ranges - 1] = c;
+        continue;
+      }
+
+      if(ranges == max_ranges) {
+        ranges = max_ranges + 1;
+        return;
+      }
+
+      lo[ranges] = hi[ranges] = c;
+      ++ranges;
+    }
+  }
+
+public:
+  // any of chars
+  explicit set(const char* chars) {
+    for(; *chars; ++chars) insert(*chars);
+    build();
+  }
+
+  // chars satisfying pred, as per the current locale
+  explicit set(int (*pred)(int)) {
+    for(unsigned c = 0; c < 256; ++c) {
+      if(pred(c)) insert(c);
+    }
+
+    build();
+  }
+
+  bool operator()(char c) const {
+    const unsigned char u = c;
+    return table[u >> 6] >> (u & 63) & 1;
+  }
+
+  bool vectorized() const { return ranges <= max_ranges; }
+
+#ifdef SCAN_VECTOR
+  detail::vector::type operator()(detail::vector::type block) const {
+    using detail::vector;
+
+    vector::type res = vector::zero();
+    for(std::size_t i = 0; i < ranges; ++i) {
+      res = vector::either(res, lo[i] == hi[i] ?
+                           vector::equal(block, vector::splat(lo[i])) :
+                           vector::within(block, lo[i], hi[i]));
+    }
+
+    return res;
+  }
+#endif
+};
+
+
+// chars not in class
+template<class Class>
+struct complement_type {
+  const Class self;
+
+  bool operator()(char c) const { return !self(c); }
+
+#ifdef SCAN_VECTOR
+  detail::vector::type operator()(detail::vector::type block) const {
+    return detail::vector::invert(self(block));
+  }
+#endif
+};
+
+template<class Class>
+static complement_type<Class> complement(Class self) {
+  return {std::move(self)};
+}
+
+
+#ifdef SCAN_VECTOR
+namespace detail {
+
+template<class Class>
+static bool vectorized(const Class&) { return true; }
+
+static inline bool vectorized(const set& self) { return self.vectorized(); }
+
+template<class Class>
+static bool vectorized(const complement_type<Class>& self) {
+  return vectorized(self.self);
+}
+
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+// scanning
+////////////////////////////////////////////////////////////////////////////////
+
+// first position in [first, last) not in class
+template<class Class>
+static const char* skip(const char* first, const char* last,
+                        const Class& self) {
+  // note: short runs are common (single blanks), scalar code is faster there
+  for(std::size_t i = 0; i < 4; ++i, ++first) {
+    if(first == last || !self(*first)) return first;
+  }
+
+#ifdef SCAN_VECTOR
+  using detail::vector;
+
+  if(detail::vectorized(self)) {
+    const std::uint32_t full = vector::width == 32 ? ~0u : 0xffffu;
+
+    for(; std::size_t(last - first) >= vector::width;
+        first += vector::width) {
+      const std::uint32_t mask =
+        ~vector::bits(self(vector::load(first))) & full;
+      if(mask) return first + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  while(first != last && self(*first)) ++first;
+  return first;
+}
+
+
+// first position in [first, last) in class
+template<class Class>
+static const char* find(const char* first, const char* last,
+                        const Class& self) {
+  return skip(first, last, complement(self));
+}
+
+
+// skip whitespace (std::isspace in the "C" locale)
+static inline const char* skip_space(const char* first, const char* last) {
+  return skip(first, last, space());
+}
+
+// skip blanks (std::isblank in the "C" locale)
+static inline const char* skip_blank(const char* first, const char* last) {
+  return skip(first, last, blank());
+}
+
+// end of string contents: next quote or backslash
+static inline const char* find_quote(const char* first, const char* last) {
+  return find(first, last, quote());
+}
+
+// end of a run of decimal digits
+static inline const char* skip_digits(const char* first, const char* last) {
+  return skip(first, last, digit());
+}
+
+
+// parse a run of decimal digits as value = 10 * value + digit, eight digits at
+// a time when possible (swar). note: value wraps around on overflow, callers
+// check the number of digits.
+static inline const char* digits(const char* first, const char* last,
+                                 std::uint64_t& value) {
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while(last - first >= 8) {
+    std::uint64_t chunk;
+    std::memcpy(&chunk, first, sizeof(chunk));
+
+    // all eight chars are digits: high nibble 3, and still 3 once 6 is added
+    const std::uint64_t high = 0xf0f0f0f0f0f0f0f0ull;
+    if(((chunk & high) | (((chunk + 0x0606060606060606ull) & high) >> 4)) !=
+       0x3333333333333333ull) {
+      break;
+    }
+
+    // pairs, then quads, then eight digits (first char is most significant)
+    chunk -= 0x3030303030303030ull;
+    chunk = chunk * 10 + (chunk >> 8);
+    chunk = (((chunk & 0x000000ff000000ffull) * (100 + (1000000ull << 32))) +
+             (((chunk >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32))))
+      >> 32;
+
+    value = 100000000 * value + chunk;
+    first += 8;
+  }
+#endif
+
+  for(; first != last && digit()(*first); ++first) {
+    value = 10 * value + (*first - '0');
+  }
+
+  return first;
+}
+
+}
+
+#endif
@@ -5,6 +5,7 @@
 #include "common.hpp"
 
 #include <map>
+#include <set>
 #include <functional>
 
 namespace ast {
@@ -365,6 +366,85 @@ expr check(const sexpr& e) {
   return res;
 }
 
+
+toplevel check_toplevel(const sexpr& e) {
+  const auto self = e.cast<sexpr::list>();
+  const auto head = self && *self ? (*self)->head.cast<symbol>() : nullptr;
+  
+  if(head && *head == symbol("def")) {
+    if(auto result = check_def((*self)->tail)) {
+      return result.right().value;
+    } else {
+      throw syntax_error(e, result.left());
+    }
+  }
+
+  return check(e);
+}
+
+
+static void free_vars(const expr& self, std::set<symbol> bound,
+                      std::set<symbol>& out);
+
+// note: annotations are checked in the enclosing scope
+static void free_vars(list<arg> args, std::set<symbol>& bound,
+                      std::set<symbol>& out) {
+  for(const arg& it: args) {
+    if(auto annot = it.cast<ast::annot>()) free_vars(annot->type, bound, out);
+  }
+
+  for(const arg& it: args) bound.insert(it.name());
+}
+
+
+static void free_vars(const expr& self, std::set<symbol> bound,
+                      std::set<symbol>& out) {
+  match(self,
+        [&](var self) {
+          if(!bound.count(self.name)) out.insert(self.name);
+        },
+        [&](abs self) {
+          free_vars(self.args, bound, out);
+          free_vars(self.body, bound, out);
+        },
+        [&](app self) {
+          free_vars(self.func, bound, out);
+          for(const expr& it: self.args) free_vars(it, bound, out);
+        },
+        [&](let self) {
+          for(const def& it: self.defs) bound.insert(it.name);
+          for(const def& it: self.defs) free_vars(it.value, bound, out);
+          free_vars(self.body, bound, out);
+        },
+        [&](cond self) {
+          free_vars(self.pred, bound, out);
+          free_vars(self.conseq, bound, out);
+          free_vars(self.alt, bound, out);
+        },
+        [&](record self) {
+          for(const def& it: self.attrs) free_vars(it.value, bound, out);
+        },
+        [&](attr self) { free_vars(self.arg, bound, out); },
+        [&](module self) {
+          free_vars(self.sig.args, bound, out);
+          for(const def& it: self.defs) free_vars(it.value, bound, out);
+        },
+        [&](pattern self) {
+          free_vars(self.arg, bound, out);
+          for(const choice& it: self.choices) {
+            std::set<symbol> inner = bound;
+            inner.insert(it.arg.name());
+            free_vars(it.value, inner, out);
+          }
+        },
+        [](auto) { });
+}
+
+
+void free_vars(const expr& self, std::set<symbol>& out) {
+  free_vars(self, {}, out);
+}
+
 }
 
 
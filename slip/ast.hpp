@@ -7,6 +7,7 @@
 #include "list.hpp"
 
 #include <string>
+#include <set>
 
 struct sexpr;
 
@@ -210,6 +211,9 @@ struct expr: fix<Expr, expr> {
 
 expr check(const sexpr&);
 
+// free variables
+void free_vars(const expr& self, std::set<symbol>& out);
+
 using annot = Annot<expr>;
 using arg = Arg<expr>;
 using abs = Abs<expr>;
@@ -227,6 +231,13 @@ using attr = Attr<expr>;
 using pattern = Pattern<expr>;
 using choice = Choice<expr>;
 
+// top-level form: (def `sym` `expr`) or expression
+struct toplevel: variant<def, expr> {
+  using toplevel::variant::variant;
+};
+
+toplevel check_toplevel(const sexpr&);
+
 }
 
 
@@ -0,0 +1,93 @@
+#include "sexpr.hpp"
+#include "ast.hpp"
+#include "type.hpp"
+
+#include "lua.hpp"
+#include "bytecode.hpp"
+
+#include "timer.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <functional>
+#include <tuple>
+#include <vector>
+
+// execution benchmark: bytecode vs lua backends on generated programs
+
+// direct recursive calls
+static std::string fib(std::size_t n) {
+  std::stringstream ss;
+  ss << "(let ((fib (fn (n) (if (eq n 0) 0 (if (eq n 1) 1 "
+     << "(add (fib (sub n 1)) (fib (sub n 2)))))))) (fib " << n << "))";
+  return ss.str();
+}
+
+
+// same, through closure calls
+static std::string fib_closure(std::size_t n) {
+  std::stringstream ss;
+  ss << "(let ((apply (fn (f x) (f x))) "
+     << "(fib (fn (n) (if (eq n 0) 0 (if (eq n 1) 1 "
+     << "(add (apply fib (sub n 1)) (apply fib (sub n 2)))))))) (fib " << n << "))";
+  return ss.str();
+}
+
+
+// closure allocation
+static std::string adders(std::size_t n) {
+  std::stringstream ss;
+  ss << "(let ((make (fn (i) (fn (x) (add x i)))) "
+     << "(loop (fn (i acc) (if (eq i 0) acc (loop (sub i 1) ((make i) acc))))))"
+     << " (loop " << n << " 0))";
+  return ss.str();
+}
+
+
+int main(int argc, char** argv) {
+  const std::size_t scale = argc > 1 ? std::stoul(argv[1]) : 1;
+
+  using generator_type = std::function<std::string(std::size_t)>;
+  const std::tuple<const char*, generator_type, std::size_t> generators[] = {
+    std::make_tuple("fib", fib, 25),
+    std::make_tuple("fib closure", fib_closure, 25),
+    std::make_tuple("adders", adders, 10000),
+  };
+
+  const auto lua = lua::make_environment();
+  const auto vm = bytecode::make_environment();
+
+  for(const auto& gen: generators) {
+    const std::size_t n = std::get<2>(gen) * scale;
+
+    // note: source must outlive expressions
+    const std::string source = std::get<1>(gen)(n);
+    std::vector<sexpr> exprs;
+    sexpr::read(source, [&](sexpr s) { exprs.push_back(s); });
+    const ast::expr e = ast::check(exprs.at(0));
+
+    hamt::array<type::mono> types;
+    type::infer(type::make_context(), e, &types);
+
+    std::string bytecode_result, lua_result;
+    const double bytecode_time = with_time([&] {
+      bytecode_result = bytecode::run(vm, e, types);
+    });
+
+    const double lua_time = with_time([&] {
+      lua_result = lua::run(lua, e, types);
+    });
+
+    std::cout << std::get<0>(gen) << " " << n << ": "
+              << bytecode_time << "s (bytecode), "
+              << lua_time << "s (lua)" << std::endl;
+
+    if(bytecode_result != lua_result) {
+      std::cerr << "result mismatch: " << bytecode_result << " vs. "
+                << lua_result << std::endl;
+      return 1;
+    }
+  }
+
+  return 0;
+}
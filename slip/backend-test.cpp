@@ -0,0 +1,120 @@
+#include "sexpr.hpp"
+#include "ast.hpp"
+#include "type.hpp"
+
+#include "native.hpp"
+#include "bytecode.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+
+// program expressions, with top-level definitions inferred in ctx and
+// registered with both backends
+struct program {
+  std::string source;
+
+  std::shared_ptr<type::context> ctx = type::make_context();
+  std::shared_ptr<native::environment> lib;
+  std::shared_ptr<bytecode::environment> vm = bytecode::make_environment();
+
+  std::vector<ast::expr> exprs;
+  std::vector<hamt::array<type::mono>> types;
+
+  program(std::string source):
+    source(source),
+    lib(native::make_environment(directory())) {
+    sexpr::read(this->source, [&](sexpr s) {
+      match(ast::check_toplevel(s),
+            [&](ast::def self) {
+              const std::vector<ast::def> defs = {self};
+              type::infer(ctx, defs);
+
+              native::define(lib, defs);
+              bytecode::define(vm, defs);
+            },
+            [&](ast::expr self) {
+              hamt::array<type::mono> types;
+              type::infer(ctx, self, &types);
+
+              exprs.push_back(self);
+              this->types.push_back(types);
+            });
+    });
+  }
+
+  static std::string directory() {
+    const char* tmp = std::getenv("TMPDIR");
+    return std::string(tmp ? tmp : "/tmp") + "/slip-backend-test";
+  }
+};
+
+
+TEST(backend, builtins) {
+  const program p("(add 5 3) (sub 5 3) (eq 1 1)");
+
+  EXPECT_EQ(native::run(p.lib, p.exprs[0], p.types[0]), "8");
+  EXPECT_EQ(bytecode::run(p.vm, p.exprs[1], p.types[1]), "2");
+  EXPECT_EQ(bytecode::run(p.vm, p.exprs[2], p.types[2]), "true");
+}
+
+
+// cold expressions are left to other backends until they have run enough,
+// and native arithmetic wraps around like lua integers
+TEST(backend, native_threshold) {
+  const program p("(mul 9223372036854775807 2) (sub -9223372036854775808 1)");
+
+  const std::string directory = program::directory() + "-threshold";
+  std::system(("rm -rf '" + directory + "'").c_str());
+
+  const auto lib = native::make_environment(directory, 2);
+  EXPECT_THROW(native::run(lib, p.exprs[0], p.types[0]), native::unsupported);
+  EXPECT_EQ(native::run(lib, p.exprs[0], p.types[0]), "-2");
+
+  // built libraries are used right away
+  const auto cold = native::make_environment(directory, 0);
+  EXPECT_EQ(native::run(cold, p.exprs[0], p.types[0]), "-2");
+  EXPECT_THROW(native::run(cold, p.exprs[1], p.types[1]), native::unsupported);
+
+  EXPECT_EQ(native::run(p.lib, p.exprs[1], p.types[1]), "9223372036854775807");
+}
+
+
+// top-level definitions shadow builtins: backends must not compile calls to
+// them as operators
+TEST(backend, shadowed_builtin) {
+  const program p("(def add (fn (x y) (sub x y))) (add 5 3)");
+
+  EXPECT_THROW(native::run(p.lib, p.exprs[0], p.types[0]),
+               native::unsupported);
+
+  EXPECT_THROW(bytecode::run(p.vm, p.exprs[0], p.types[0]),
+               bytecode::unsupported);
+}
+
+
+// numbers print like lua ones
+TEST(backend, native_numbers) {
+  const program p("1.0 (record (a -2.0) (b 0.5) (c 1e100))");
+
+  EXPECT_EQ(native::run(p.lib, p.exprs[0], p.types[0]), "1.0");
+  EXPECT_EQ(native::run(p.lib, p.exprs[1], p.types[1]),
+            "{a = -2.0, b = 0.5, c = 1e+100}");
+}
+
+
+// deep recursion exceeds the vm stack: calls report it instead of crashing
+TEST(backend, stack_overflow) {
+  static const std::string recursive =
+    "(let ((app (fn (g x) (g x)))"
+    "      (f (fn (n) (if (eq n 0) 0 (add 1 (app f (sub n 1)))))))"
+    "  (f ";
+
+  const program p(recursive + "3000000))" + recursive + "3000))");
+
+  EXPECT_THROW(bytecode::run(p.vm, p.exprs[0], p.types[0]),
+               bytecode::unsupported);
+
+  // environment is still usable
+  EXPECT_EQ(bytecode::run(p.vm, p.exprs[1], p.types[1]), "3000");
+}
@@ -0,0 +1,118 @@
+#include "sexpr.hpp"
+#include "ast.hpp"
+#include "type.hpp"
+
+#include "timer.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <functional>
+#include <vector>
+
+// type inference benchmark on generated programs
+
+// (let ((x0 1)) (let ((x1 (add x0 1))) ... xn))
+static std::string let_chain(std::size_t n) {
+  std::stringstream ss;
+  for(std::size_t i = 0; i < n; ++i) {
+    ss << "(let ((x" << i << " ";
+    if(i) ss << "(add x" << i - 1 << " 1)";
+    else ss << "1";
+    ss << ")) ";
+  }
+
+  ss << "x" << n - 1 << std::string(n, ')');
+  return ss.str();
+}
+
+
+// (let ((f0 (fn (x) x))) (let ((f1 (fn (x) (f0 x)))) ... fn))
+static std::string poly_chain(std::size_t n) {
+  std::stringstream ss;
+  for(std::size_t i = 0; i < n; ++i) {
+    ss << "(let ((f" << i << " (fn (x) ";
+    if(i) ss << "(f" << i - 1 << " x)";
+    else ss << "x";
+    ss << "))) ";
+  }
+
+  ss << "f" << n - 1 << std::string(n, ')');
+  return ss.str();
+}
+
+
+// (record (a0 0) (a1 1) ...)
+static std::string big_record(std::size_t n) {
+  std::stringstream ss;
+  ss << "(record";
+  for(std::size_t i = 0; i < n; ++i) {
+    ss << " (a" << i << " " << i << ")";
+  }
+
+  ss << ")";
+  return ss.str();
+}
+
+
+// (fn (r) (record (b0 (add r.a0 1)) ...))
+static std::string projections(std::size_t n) {
+  std::stringstream ss;
+  ss << "(fn (r) (record";
+  for(std::size_t i = 0; i < n; ++i) {
+    ss << " (b" << i << " (add r.a" << i << " 1))";
+  }
+
+  ss << "))";
+  return ss.str();
+}
+
+
+int main(int argc, char** argv) {
+  const std::size_t scale = argc > 1 ? std::stoul(argv[1]) : 1;
+
+  using generator_type = std::function<std::string(std::size_t)>;
+  const std::pair<const char*, generator_type> generators[] = {
+    {"let chain", let_chain},
+    {"poly chain", poly_chain},
+    {"record", big_record},
+    {"projections", projections},
+  };
+
+  const auto parser = sexpr::parse() << parser::eos;
+
+  // parsing: combinators vs reader
+  for(const auto& gen: generators) {
+    const std::string source = gen.second(400 * scale);
+    const double combinators = with_time([&] {
+      parser::run(parser, source);
+    });
+
+    const double reader = with_time([&] {
+      sexpr::read(source, [](sexpr) { });
+    });
+
+    std::cout << "parse " << gen.first << " " << 400 * scale << ": "
+              << combinators << "s (combinators), " << reader << "s (reader)"
+              << std::endl;
+  }
+  
+  for(const auto& gen: generators) {
+    for(std::size_t n: {100, 200, 400}) {
+      // note: source must outlive expressions
+      const std::string source = gen.second(n * scale);
+      std::vector<sexpr> exprs;
+      sexpr::read(source, [&](sexpr s) { exprs.push_back(s); });
+      const ast::expr e = ast::check(exprs.at(0));
+
+      const auto ctx = type::make_context();
+      const double time = with_time([&] {
+        type::infer(ctx, e);
+      });
+
+      std::cout << gen.first << " " << n * scale << ": " << time << "s"
+                << std::endl;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,522 @@
+#include "bytecode.hpp"
+
+#include "ast.hpp"
+#include "type.hpp"
+
+#include "vm.hpp"
+#include "as.hpp"
+#include "peephole.hpp"
+#include "stackmap.hpp"
+
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+namespace bytecode {
+
+struct environment {
+  // note: calls are checked against the stack size and a maximum call depth,
+  // since vm calls recurse on the native stack
+  static constexpr std::size_t size = 1 << 20;
+  static constexpr std::size_t depth = 1 << 14;
+  std::unique_ptr<vm::word[]> stack;
+
+  // top-level definitions
+  std::set<symbol> globals;
+
+  environment(): stack(new vm::word[size]) { }
+};
+
+
+std::shared_ptr<environment> make_environment() {
+  return std::make_shared<environment>();
+}
+
+
+using vm::integer;
+
+static as::line lit(integer value) { return vm::word(value); }
+
+
+// lexically bound values live in frame slots, arguments or closure captures
+// depending on the function being compiled
+struct location {
+  bool capture;
+  integer index;
+};
+
+
+// code for a vm function
+struct frame {
+  std::vector<as::line> code;
+  std::map<std::size_t, location> locations;
+
+  // stack depth, relative to frame pointer, and its maximum
+  integer depth = 0;
+  integer peak = 0;
+
+  void emit(std::initializer_list<as::line> lines, integer delta) {
+    code.insert(code.end(), lines);
+    depth += delta;
+    peak = std::max(peak, depth);
+  }
+
+  void load(std::size_t id) {
+    const auto it = locations.find(id);
+    if(it == locations.end()) throw std::runtime_error("unbound value");
+
+    if(it->second.capture) {
+      emit({vm::loadc, lit(it->second.index)}, 1);
+    } else {
+      emit({vm::load, lit(it->second.index)}, 1);
+    }
+  }
+};
+
+
+struct value {
+  std::size_t id;
+};
+
+// functions are lifted to vm functions, called directly with their arguments
+// followed by the values they refer to. as values, they become curried
+// closures: stage i captures these values and the first i arguments.
+struct function {
+  as::label label;
+  std::size_t arity;
+  std::vector<std::size_t> extra;
+};
+
+struct binding: variant<value, function> {
+  using binding::variant::variant;
+};
+
+
+// program being compiled
+struct unit {
+  std::size_t values = 0;
+  std::size_t labels = 0;
+
+  // lifted functions and closure stages, after main code
+  std::vector<as::line> code;
+
+  // maximum frame depth
+  integer peak = 0;
+
+  // closure stages, by function
+  std::map<as::label, std::vector<as::label>> stages;
+
+  std::size_t fresh() { return values++; }
+
+  as::label label(std::string prefix) {
+    return as::make_label(prefix + "#" + std::to_string(labels++));
+  }
+
+  void append(const frame& self) {
+    code.insert(code.end(), self.code.begin(), self.code.end());
+    peak = std::max(peak, self.peak);
+  }
+};
+
+
+struct context {
+  std::map<symbol, binding> scope;
+  std::shared_ptr<struct unit> unit;
+  std::shared_ptr<struct frame> frame;
+  std::shared_ptr<const environment> env;
+
+  void bind(symbol name, binding value) {
+    scope.erase(name);
+    scope.emplace(name, value);
+  }
+};
+
+
+// closure stage code, generated on first use
+static as::label stage(unit& u, const function& func, std::size_t index) {
+  auto& labels = u.stages[func.label];
+  if(labels.size()) return labels.at(index);
+
+  for(std::size_t i = 0; i < func.arity; ++i) {
+    labels.push_back(u.label(func.label));
+  }
+
+  const integer n = func.arity;
+  const integer m = func.extra.size();
+
+  for(integer i = 0; i < n; ++i) {
+    // note: closure is at -1, argument at -2
+    const integer cap = m + i;
+
+    frame self;
+    self.emit({as::line(labels[i], vm::next)}, 0);
+
+    if(i + 1 < n) {
+      // capture argument last
+      self.emit({vm::load, lit(-2)}, 1);
+      for(integer k = cap; k-- > 0;) self.emit({vm::loadc, lit(k)}, 1);
+      self.emit({vm::makec, lit(1), lit(cap + 1), labels[i + 1]}, -cap);
+    } else {
+      // call function with arguments, then values, pushed in reverse
+      for(integer k = m; k-- > 0;) self.emit({vm::loadc, lit(k)}, 1);
+      self.emit({vm::load, lit(-2)}, 1);
+      for(integer k = i; k-- > 0;) self.emit({vm::loadc, lit(m + k)}, 1);
+      self.emit({vm::call, lit(n + m), func.label}, 1 - (n + m));
+    }
+
+    self.emit({vm::ret}, 0);
+    u.append(self);
+  }
+
+  return labels.at(index);
+}
+
+
+// values referred to by names, including the ones needed by functions
+static void extra(const context& ctx, const std::set<symbol>& refs,
+                  std::set<std::size_t>& out) {
+  for(symbol name: refs) {
+    const auto it = ctx.scope.find(name);
+    if(it == ctx.scope.end()) continue;
+
+    match(it->second,
+          [&](value self) { out.insert(self.id); },
+          [&](function self) { out.insert(self.extra.begin(), self.extra.end()); });
+  }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// expressions push exactly one word
+
+template<class T>
+static void compile(const context&, const T&) {
+  throw unsupported("expression: " + std::string(typeid(T).name()));
+}
+
+static void compile(const context& ctx, const ast::expr& self);
+
+
+// closure for function applied to its first arguments
+static void closure(const context& ctx, const function& func,
+                    const std::vector<ast::expr>& args) {
+  const integer cap = func.extra.size() + args.size();
+  if(cap >= 64) throw unsupported("too many captures");
+
+  const as::label label = stage(*ctx.unit, func, args.size());
+
+  // captures pushed in reverse
+  for(std::size_t i = args.size(); i-- > 0;) compile(ctx, args[i]);
+  for(std::size_t i = func.extra.size(); i-- > 0;) {
+    ctx.frame->load(func.extra[i]);
+  }
+
+  ctx.frame->emit({vm::makec, lit(1), lit(cap), label}, 1 - cap);
+}
+
+
+static void call(const context& ctx, const function& func,
+                 const std::vector<ast::expr>& args) {
+  const std::size_t n = func.arity;
+  if(args.size() < n) return closure(ctx, func, args);
+
+  // remaining arguments are applied to the result, one at a time
+  for(std::size_t i = args.size(); i-- > n;) compile(ctx, args[i]);
+
+  for(std::size_t i = func.extra.size(); i-- > 0;) {
+    ctx.frame->load(func.extra[i]);
+  }
+
+  for(std::size_t i = n; i-- > 0;) compile(ctx, args[i]);
+
+  const integer argc = n + func.extra.size();
+  ctx.frame->emit({vm::call, lit(argc), func.label}, 1 - argc);
+
+  for(std::size_t i = n; i < args.size(); ++i) {
+    ctx.frame->emit({vm::callc, lit(2)}, -1);
+  }
+}
+
+
+static void lift(const context& ctx, const function& func, const ast::abs& abs) {
+  if(!func.arity) throw unsupported("nullary function");
+
+  context body = ctx;
+  body.frame = std::make_shared<frame>();
+
+  integer index = -1;
+  for(const ast::arg& arg: abs.args) {
+    const std::size_t id = ctx.unit->fresh();
+    body.bind(arg.name(), value{id});
+    body.frame->locations.emplace(id, location{false, index--});
+  }
+
+  for(std::size_t id: func.extra) {
+    body.frame->locations.emplace(id, location{false, index--});
+  }
+
+  body.frame->emit({as::line(func.label, vm::next)}, 0);
+  compile(body, abs.body);
+  body.frame->emit({vm::ret}, 0);
+
+  ctx.unit->append(*body.frame);
+}
+
+
+static void compile(const context& ctx, ast::lit self) {
+  const integer value = match(self,
+                              [](bool self) -> integer { return self; },
+                              [](long self) -> integer { return self; },
+                              [](auto) -> integer {
+                                throw unsupported("literal");
+                              });
+
+  ctx.frame->emit({vm::push, lit(value)}, 1);
+}
+
+
+static void compile(const context& ctx, ast::var self) {
+  const auto it = ctx.scope.find(self.name);
+  if(it == ctx.scope.end()) {
+    throw unsupported("global: " + std::string(self.name.repr));
+  }
+
+  match(it->second,
+        [&](value self) { ctx.frame->load(self.id); },
+        [&](function self) { closure(ctx, self, {}); });
+}
+
+
+static void compile(const context& ctx, ast::abs self) {
+  std::set<symbol> refs;
+  ast::free_vars(self, refs);
+
+  std::set<std::size_t> values;
+  extra(ctx, refs, values);
+
+  const function func = {ctx.unit->label("fn"), size(self.args),
+                         {values.begin(), values.end()}};
+  lift(ctx, func, self);
+  closure(ctx, func, {});
+}
+
+
+static void compile(const context& ctx, ast::app self) {
+  // note: operands are pushed in reverse for arithmetic
+  static const std::map<std::string, std::pair<vm::instr, bool>> operators = {
+    {"add", {vm::op<vm::add>, true}},
+    {"sub", {vm::op<vm::sub>, true}},
+    {"mul", {vm::op<vm::mul>, true}},
+    {"eq", {vm::cmp<vm::eq>, false}},
+  };
+
+  std::vector<ast::expr> args;
+  for(const ast::expr& arg: self.args) args.push_back(arg);
+
+  if(args.empty()) throw unsupported("nullary call");
+
+  if(const ast::var* var = self.func.cast<ast::var>()) {
+    const auto it = ctx.scope.find(var->name);
+
+    // builtins, unless shadowed by a top-level definition
+    if(it == ctx.scope.end()) {
+      if(ctx.env->globals.count(var->name)) {
+        throw unsupported("global: " + std::string(var->name.repr));
+      }
+
+      const auto op = operators.find(var->name.repr);
+      if(op != operators.end() && args.size() == 2) {
+        const bool reverse = op->second.second;
+        compile(ctx, args[reverse ? 1 : 0]);
+        compile(ctx, args[reverse ? 0 : 1]);
+        ctx.frame->emit({op->second.first}, -1);
+        return;
+      }
+    }
+
+    // lifted functions
+    if(it != ctx.scope.end()) {
+      if(const function* func = it->second.cast<function>()) {
+        return call(ctx, *func, args);
+      }
+    }
+  }
+
+  // closures are curried
+  for(std::size_t i = args.size(); i-- > 0;) compile(ctx, args[i]);
+  compile(ctx, self.func);
+
+  for(std::size_t i = 0; i < args.size(); ++i) {
+    ctx.frame->emit({vm::callc, lit(2)}, -1);
+  }
+}
+
+
+static void compile(const context& ctx, ast::cond self) {
+  const as::label conseq = ctx.unit->label("then");
+  const as::label end = ctx.unit->label("end");
+
+  compile(ctx, self.pred);
+  ctx.frame->emit({vm::jnz, conseq}, -1);
+
+  compile(ctx, self.alt);
+  ctx.frame->emit({vm::jmp, end}, -1);
+
+  ctx.frame->emit({as::line(conseq, vm::next)}, 0);
+  compile(ctx, self.conseq);
+  ctx.frame->emit({as::line(end, vm::next)}, 0);
+}
+
+
+static void compile(const context& ctx, ast::let self) {
+  context inner = ctx;
+
+  // values are stored in consecutive frame slots
+  const integer base = ctx.frame->depth;
+
+  std::vector<ast::def> values, functions;
+  for(const ast::def& def: self.defs) {
+    if(def.value.cast<ast::abs>()) {
+      functions.push_back(def);
+      continue;
+    }
+
+    const std::size_t id = ctx.unit->fresh();
+    inner.bind(def.name, value{id});
+    ctx.frame->locations.emplace(id, location{false, base + integer(values.size())});
+    values.push_back(def);
+  }
+
+  // functions: extra arguments are the values they refer to, and the ones
+  // needed by the functions they call (until fixpoint for recursive ones)
+  std::map<symbol, std::set<symbol>> refs;
+  std::map<symbol, std::set<std::size_t>> extras;
+
+  for(const ast::def& def: functions) {
+    ast::free_vars(def.value, refs[def.name]);
+    extras[def.name];
+  }
+
+  for(bool changed = true; changed;) {
+    changed = false;
+    for(const ast::def& def: functions) {
+      std::set<std::size_t>& self = extras.at(def.name);
+      const std::size_t size = self.size();
+
+      std::set<symbol> outer;
+      for(symbol name: refs.at(def.name)) {
+        const auto local = extras.find(name);
+        if(local != extras.end()) {
+          self.insert(local->second.begin(), local->second.end());
+        } else {
+          outer.insert(name);
+        }
+      }
+
+      extra(inner, outer, self);
+      changed |= self.size() != size;
+    }
+  }
+
+  for(const ast::def& def: functions) {
+    const std::set<std::size_t>& values = extras.at(def.name);
+    inner.bind(def.name, function{ctx.unit->label(def.name.repr),
+                                  size(def.value.get<ast::abs>().args),
+                                  {values.begin(), values.end()}});
+  }
+
+  for(const ast::def& def: functions) {
+    lift(inner, inner.scope.at(def.name).get<function>(),
+         def.value.get<ast::abs>());
+  }
+
+  for(const ast::def& def: values) {
+    compile(inner, def.value);
+  }
+
+  compile(inner, self.body);
+
+  // drop values, keeping result
+  if(values.size()) {
+    ctx.frame->emit({vm::store, lit(base)}, -1);
+    for(std::size_t i = 1; i < values.size(); ++i) {
+      ctx.frame->emit({vm::pop}, -1);
+    }
+  }
+}
+
+
+static void compile(const context& ctx, const ast::expr& self) {
+  match(self, [&](const auto& self) {
+    compile(ctx, self);
+  });
+}
+
+
+std::string run(std::shared_ptr<environment> env,
+                const ast::expr& self,
+                const hamt::array<type::mono>& types) {
+  const type::mono* result = types.find(self.id());
+  if(!result || (*result != type::integer && *result != type::boolean)) {
+    throw unsupported("result type");
+  }
+
+  context ctx;
+  ctx.unit = std::make_shared<unit>();
+  ctx.frame = std::make_shared<frame>();
+  ctx.env = env;
+
+  compile(ctx, self);
+  ctx.frame->emit({vm::ret}, 0);
+
+  std::vector<as::line> listing = ctx.frame->code;
+  listing.insert(listing.end(), ctx.unit->code.begin(), ctx.unit->code.end());
+
+  peephole::optimizer optimize;
+  const std::vector<as::line> code = optimize(listing);
+  const std::vector<vm::code> prog = as::link(code);
+
+  // closures are collected when stack maps can be computed, i.e. when no
+  // slot holds both integers and closures (otherwise they are leaked)
+  std::unique_ptr<vm::stack_map> maps;
+  std::unique_ptr<vm::heap> heap;
+  try {
+    maps.reset(new vm::stack_map(stackmap::resolve(stackmap::compute(code),
+                                                   prog.data())));
+    heap.reset(new vm::heap(*maps));
+  } catch(std::runtime_error&) { }
+
+  // calls must leave room for the deepest frame
+  const integer peak = std::max(ctx.frame->peak, ctx.unit->peak);
+  if(peak >= integer(environment::size)) throw unsupported("frame size");
+
+  vm::limits limits{env->stack.get() + environment::size - peak,
+                    environment::depth};
+  const vm::limits::scope bounds(limits);
+
+  const integer value = [&] {
+    try {
+      if(!heap) return vm::eval(prog.data(), env->stack.get()).value;
+
+      const vm::heap::scope lock(*heap);
+      return vm::eval(prog.data(), env->stack.get()).value;
+    } catch(vm::overflow&) {
+      // note: other backends may still run it
+      throw unsupported("stack overflow");
+    }
+  }();
+
+  if(*result == type::boolean) return value ? "true" : "false";
+  return std::to_string(value);
+}
+
+
+void define(std::shared_ptr<environment> env,
+            const std::vector<ast::def>& defs) {
+  for(const ast::def& def: defs) {
+    env->globals.insert(def.name);
+  }
+}
+
+}
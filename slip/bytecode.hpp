@@ -0,0 +1,45 @@
+#ifndef SLIP_BYTECODE_HPP
+#define SLIP_BYTECODE_HPP
+
+#include "hamt.hpp"
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+namespace type {
+struct mono;
+};
+
+namespace ast {
+struct expr;
+
+template<class E>
+struct Def;
+}
+
+// bytecode backend: integer code runs on the stack vm (see vm.hpp)
+namespace bytecode {
+
+// expression cannot be compiled to bytecode: use another backend
+struct unsupported: std::runtime_error {
+  unsupported(std::string what): std::runtime_error("bytecode: " + what) { }
+};
+
+struct environment;
+
+std::shared_ptr<environment> make_environment();
+
+std::string run(std::shared_ptr<environment> env,
+                const ast::expr& self,
+                const hamt::array<type::mono>& types);
+
+// top-level definitions are run by other backends: expressions referring to
+// them are unsupported, even where their names shadow builtins
+void define(std::shared_ptr<environment> env,
+            const std::vector<ast::Def<ast::expr>>& defs);
+
+}
+
+
+#endif
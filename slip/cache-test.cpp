@@ -0,0 +1,106 @@
+#include "sexpr.hpp"
+#include "ast.hpp"
+#include "type.hpp"
+#include "cache.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+// note: source must outlive definitions
+static std::vector<ast::def> definitions(const std::string& source) {
+  std::vector<ast::def> res;
+  sexpr::read(source, [&](sexpr s) {
+    res.push_back(ast::check_toplevel(s).get<ast::def>());
+  });
+
+  return res;
+}
+
+
+static std::string filename() {
+  const char* tmp = std::getenv("TMPDIR");
+  return std::string(tmp ? tmp : "/tmp") + "/slip-cache-test";
+}
+
+
+static std::string contents(std::string filename) {
+  std::ifstream in(filename);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  return ss.str();
+}
+
+
+static std::vector<std::string> show(const std::vector<type::poly>& schemes) {
+  std::vector<std::string> res;
+  for(const type::poly& p: schemes) res.push_back(p.show());
+  return res;
+}
+
+
+static const std::string group =
+  "(def even (fn (n) (if (eq n 0) true (odd (sub n 1)))))"
+  "(def odd (fn (n) (if (eq n 0) false (even (sub n 1)))))";
+
+
+// definition groups are cached, and the context extended on cache hits
+TEST(cache, definitions) {
+  std::remove(filename().c_str());
+
+  const auto defs = definitions(group);
+  std::vector<std::string> expected;
+
+  {
+    type::cache cache(filename());
+    const auto ctx = type::make_context();
+    expected = show(cache.infer(ctx, defs));
+    ASSERT_TRUE(type::lookup(*ctx, "even"));
+  }
+
+  // tamper with the cached schemes to tell hits from misses
+  std::string data = contents(filename());
+  for(std::size_t pos; (pos = data.find(" bool ")) != std::string::npos;) {
+    data.replace(pos, 6, " str ");
+  }
+
+  std::ofstream(filename()) << data;
+
+  type::cache cache(filename());
+  const auto ctx = type::make_context();
+  const auto schemes = show(cache.infer(ctx, defs));
+
+  ASSERT_EQ(schemes.size(), 2);
+  EXPECT_NE(schemes, expected);
+  EXPECT_EQ(schemes[0], "int -> str");
+
+  const type::poly* odd = type::lookup(*ctx, "odd");
+  ASSERT_TRUE(odd);
+  EXPECT_EQ(odd->show(), schemes[1]);
+}
+
+
+// changing a dependency invalidates the groups using it
+TEST(cache, dependencies) {
+  std::remove(filename().c_str());
+
+  type::cache cache(filename());
+
+  static const std::string user = "(def g (fn (x) (f x)))";
+  static const std::string ints_source = "(def f (fn (x) (add x 1)))";
+  static const std::string bools_source = "(def f (fn (x) (eq x 0)))";
+
+  const auto defs = definitions(user);
+
+  const auto ints = type::make_context();
+  type::infer(ints, definitions(ints_source));
+
+  const auto bools = type::make_context();
+  type::infer(bools, definitions(bools_source));
+
+  EXPECT_EQ(cache.infer(ints, defs)[0].show(), "int -> int");
+  EXPECT_EQ(cache.infer(bools, defs)[0].show(), "int -> bool");
+}
@@ -0,0 +1,533 @@
+#include "cache.hpp"
+
+#include "ast.hpp"
+#include "sexpr.hpp"
+
+#include <set>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+
+#include <unistd.h>
+
+namespace type {
+
+struct cache::entry {
+  // one per definition, or a single one for expressions
+  std::vector<poly> schemes;
+
+  // expression types, by preorder index
+  std::vector<std::pair<std::size_t, mono>> types;
+};
+
+
+static const char* const header = "slip-cache 2";
+
+
+// fnv-1a
+struct digest {
+  std::uint64_t value = 0xcbf29ce484222325ull;
+
+  digest& operator<<(const std::string& data) {
+    for(unsigned char c: data) {
+      value = (value ^ c) * 0x100000001b3ull;
+    }
+
+    // separator
+    value = (value ^ 0xff) * 0x100000001b3ull;
+    return *this;
+  }
+};
+
+
+// all symbols in sexpr: a superset of its free variables
+static void symbols(const sexpr& self, std::set<std::string>& out) {
+  match(self,
+        [&](symbol self) { out.insert(self.repr); },
+        [&](attrib self) { symbols(self.arg, out); },
+        [&](sexpr::list self) {
+          for(const sexpr& it: self) symbols(it, out);
+        },
+        [](auto) { });
+}
+
+
+// top-level expressions and their sub-expressions, in a deterministic order
+template<class Func>
+static void preorder(const ast::expr& self, const Func& func);
+
+template<class Func>
+static void preorder(const ast::arg& self, const Func& func) {
+  if(auto annot = self.cast<ast::annot>()) preorder(annot->type, func);
+}
+
+template<class Func>
+static void preorder(const list<ast::def>& defs, const Func& func) {
+  for(const ast::def& def: defs) preorder(def.value, func);
+}
+
+template<class Func>
+static void preorder(const ast::expr& self, const Func& func) {
+  func(self);
+  match(self,
+        [&](ast::abs self) {
+          for(const ast::arg& arg: self.args) preorder(arg, func);
+          preorder(self.body, func);
+        },
+        [&](ast::app self) {
+          preorder(self.func, func);
+          for(const ast::expr& arg: self.args) preorder(arg, func);
+        },
+        [&](ast::let self) {
+          preorder(self.defs, func);
+          preorder(self.body, func);
+        },
+        [&](ast::cond self) {
+          preorder(self.pred, func);
+          preorder(self.conseq, func);
+          preorder(self.alt, func);
+        },
+        [&](ast::record self) { preorder(self.attrs, func); },
+        [&](ast::attr self) { preorder(self.arg, func); },
+        [&](ast::pattern self) {
+          preorder(self.arg, func);
+          for(const ast::choice& choice: self.choices) {
+            preorder(choice.arg, func);
+            preorder(choice.value, func);
+          }
+        },
+        [&](ast::module self) {
+          for(const ast::arg& arg: self.sig.args) preorder(arg, func);
+          preorder(self.defs, func);
+        },
+        [](auto) { });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// serialization: prefix notation, one token per node. type applications are
+// numbered as they are written, so that shared ones are written only once.
+////////////////////////////////////////////////////////////////////////////////
+
+class writer {
+  std::ostream& out;
+  std::map<var, std::size_t> vars;
+  std::map<std::size_t, std::size_t> apps;
+
+public:
+  writer(std::ostream& out): out(out) { }
+
+  void operator()(kind self) {
+    match(self,
+          [&](kind_constant self) { out << ' ' << self->name; },
+          [&](ctor self) {
+            out << " >";
+            (*this)(self.from);
+            (*this)(self.to);
+          });
+  }
+
+  void operator()(var self) {
+    const auto it = vars.emplace(self, vars.size()).first;
+    out << " v " << it->second;
+    (*this)(self->kind);
+  }
+
+  void operator()(mono self) {
+    match(self,
+          [&](type_constant self) {
+            out << " c " << self->name;
+            (*this)(self->kind);
+          },
+          [&](var self) { (*this)(self); },
+          [&](app app) {
+            const auto it = apps.find(self.id());
+            if(it != apps.end()) {
+              out << " r " << it->second;
+              return;
+            }
+            
+            out << " a";
+            (*this)(app.ctor);
+            (*this)(app.arg);
+            apps.emplace(self.id(), apps.size());
+          });
+  }
+
+  void operator()(poly self) {
+    match(self,
+          [&](mono self) {
+            out << " m";
+            (*this)(self);
+          },
+          [&](forall self) {
+            out << " f";
+            (*this)(self.arg);
+            (*this)(self.body);
+          });
+  }
+};
+
+
+class reader {
+  std::istream& in;
+  std::map<std::size_t, var> vars;
+  std::vector<mono> apps;
+
+  // type constants from context
+  const std::map<std::string, mono>& constants;
+
+  std::string token() {
+    std::string res;
+    if(!(in >> res)) throw std::runtime_error("unexpected end of cache entry");
+    return res;
+  }
+
+  struct kind kind() {
+    const std::string self = token();
+    if(self == ">") {
+      const struct kind from = kind();
+      return from >>= kind();
+    }
+
+    for(struct kind it: {term, row, tag}) {
+      if(self == it.get<kind_constant>()->name.repr) return it;
+    }
+
+    throw std::runtime_error("unknown kind: " + self);
+  }
+
+  var variable() {
+    std::size_t index;
+    if(!(in >> index)) throw std::runtime_error("bad type variable");
+
+    const struct kind k = kind();
+    const auto it = vars.find(index);
+    if(it != vars.end()) return it->second;
+
+    const var res(std::size_t(0), k);
+    vars.emplace(index, res);
+    return res;
+  }
+
+  mono constant() {
+    const symbol name(token());
+    const struct kind k = kind();
+
+    const auto it = constants.find(name.repr);
+    if(it != constants.end() && it->second.kind() == k) return it->second;
+
+    return type::constant(name, k);
+  }
+
+public:
+  reader(std::istream& in, const std::map<std::string, mono>& constants):
+    in(in), constants(constants) { }
+
+  mono monotype() {
+    const std::string self = token();
+    if(self == "c") return constant();
+    if(self == "v") return variable();
+    if(self == "a") {
+      const mono ctor = monotype();
+      apps.emplace_back(ctor(monotype()));
+      return apps.back();
+    }
+
+    if(self == "r") {
+      std::size_t index;
+      if(!(in >> index) || index >= apps.size()) {
+        throw std::runtime_error("bad type reference");
+      }
+
+      return apps[index];
+    }
+
+    throw std::runtime_error("bad type: " + self);
+  }
+
+  poly polytype() {
+    const std::string self = token();
+    if(self == "m") return monotype();
+    if(self == "f") {
+      if(token() != "v") throw std::runtime_error("bad type variable");
+      const var arg = variable();
+      return forall{arg, polytype()};
+    }
+
+    throw std::runtime_error("bad type scheme: " + self);
+  }
+};
+
+
+// type constants reachable from a type. note: constants are kept as monotypes
+// since identity is by storage
+static void constants(mono self, std::map<std::string, mono>& out) {
+  match(self,
+        [&](type_constant c) { out.emplace(c->name.repr, self); },
+        [&](app self) {
+          constants(self.ctor, out);
+          constants(self.arg, out);
+        },
+        [](var) { });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+cache::cache(std::string filename): filename(filename) {
+  if(filename.empty()) return;
+
+  std::ifstream in(filename);
+  std::string line;
+  if(!std::getline(in, line) || line != header) return;
+
+  // entry: key, scheme and type counts, then schemes and types on their own
+  // lines
+  while(std::getline(in, line)) {
+    std::stringstream ss(line);
+
+    key_type key;
+    std::size_t schemes, count;
+    if(!(ss >> std::hex >> key >> std::dec >> schemes >> count)) return;
+
+    // note: stored data starts with counts
+    std::string data = std::to_string(schemes) + ' ' +
+      std::to_string(count) + '\n';
+    for(std::size_t i = 0; i < schemes + count; ++i) {
+      if(!std::getline(in, line)) return;
+      data += line + '\n';
+    }
+
+    stored.emplace(key, std::move(data));
+  }
+}
+
+
+cache::~cache() {
+  try {
+    save();
+  } catch(std::exception&) {
+    // note: cache is best-effort
+  }
+}
+
+
+void cache::save() const {
+  if(filename.empty()) return;
+
+  // note: process-unique, so that concurrent runs never write the same file
+  const std::string tmp = filename + "." + std::to_string(::getpid()) + ".tmp";
+  {
+    std::ofstream out(tmp);
+    if(!out) return;
+
+    out << header << '\n';
+    for(const auto& it: entries) {
+      writer write(out);
+
+      out << std::hex << it.first << std::dec << ' '
+          << it.second->schemes.size() << ' '
+          << it.second->types.size() << '\n';
+
+      for(const poly& p: it.second->schemes) {
+        write(p);
+        out << '\n';
+      }
+
+      for(const auto& ty: it.second->types) {
+        out << ty.first;
+        write(ty.second);
+        out << '\n';
+      }
+    }
+
+    if(!out) {
+      std::remove(tmp.c_str());
+      return;
+    }
+  }
+
+  if(std::rename(tmp.c_str(), filename.c_str()) != 0) {
+    std::remove(tmp.c_str());
+  }
+}
+
+
+// digest of sources and of the schemes of all symbols they contain that are
+// found in context, so that changing a dependency invalidates its users. known
+// receives the type constants these schemes refer to.
+static std::uint64_t key(const context& ctx, const std::vector<ast::expr>& roots,
+                         digest hash, std::map<std::string, mono>& known) {
+  std::set<std::string> names;
+  for(const ast::expr& e: roots) {
+    symbols(*e.source, names);
+    hash << std::string(e.source->source.first, e.source->source.last);
+  }
+
+  for(const std::string& name: names) {
+    if(const poly* p = lookup(ctx, symbol(name))) {
+      hash << name << p->show();
+      constants(p->body(), known);
+    }
+  }
+
+  return hash.value;
+}
+
+
+// sub-expressions of roots, in preorder
+static std::vector<ast::expr> nodes(const std::vector<ast::expr>& roots) {
+  std::vector<ast::expr> res;
+  for(const ast::expr& e: roots) {
+    preorder(e, [&](const ast::expr& self) { res.push_back(self); });
+  }
+
+  return res;
+}
+
+
+std::shared_ptr<const cache::entry>
+cache::find(key_type key, std::size_t size,
+            const std::map<std::string, mono>& known) {
+  const std::lock_guard<std::mutex> lock(mutex);
+  
+  const auto it = entries.find(key);
+  if(it != entries.end()) return it->second;
+
+  const auto stored = this->stored.find(key);
+  if(stored == this->stored.end()) return {};
+
+  std::stringstream ss(stored->second);
+  this->stored.erase(stored);
+  
+  reader read(ss, known);
+
+  try {
+    std::size_t schemes, count;
+    if(!(ss >> schemes >> count) || schemes != size) {
+      throw std::runtime_error("bad cache entry");
+    }
+
+    auto res = std::make_shared<entry>();
+    for(std::size_t i = 0; i < schemes; ++i) {
+      res->schemes.push_back(read.polytype());
+    }
+    
+    for(std::size_t i = 0; i < count; ++i) {
+      std::size_t index;
+      if(!(ss >> index)) throw std::runtime_error("bad cache entry");
+      res->types.emplace_back(index, read.monotype());
+    }
+
+    entries.emplace(key, res);
+    return res;
+  } catch(std::runtime_error&) {
+    // stale entry: check again
+    return {};
+  }
+}
+
+
+void cache::insert(key_type key, std::shared_ptr<const entry> value) {
+  const std::lock_guard<std::mutex> lock(mutex);
+  entries.emplace(key, std::move(value));
+}
+
+
+// cached expression types for roots
+static void restore(const std::vector<std::pair<std::size_t, mono>>& cached,
+                    const std::vector<ast::expr>& roots,
+                    hamt::array<mono>* types) {
+  if(!types) return;
+  
+  const std::vector<ast::expr> nodes = type::nodes(roots);
+  for(const auto& ty: cached) {
+    if(ty.first >= nodes.size()) break;
+    *types = types->set(nodes[ty.first].id(), mono(ty.second));
+  }
+}
+
+
+// expression types for roots, to be cached
+static std::vector<std::pair<std::size_t, mono>>
+decorations(const std::vector<ast::expr>& roots,
+            const hamt::array<mono>& decorated) {
+  std::vector<std::pair<std::size_t, mono>> res;
+
+  std::size_t index = 0;
+  for(const ast::expr& self: nodes(roots)) {
+    if(const mono* ty = decorated.find(self.id())) {
+      res.emplace_back(index, *ty);
+    }
+
+    ++index;
+  }
+
+  return res;
+}
+
+
+poly cache::infer(std::shared_ptr<context> ctx, const ast::expr& e,
+                  hamt::array<mono>* types) {
+  const std::vector<ast::expr> roots = {e};
+  
+  std::map<std::string, mono> known;
+  const key_type key = type::key(*ctx, roots, {}, known);
+
+  // note: the lock is not held during inference
+  if(const auto cached = find(key, 1, known)) {
+    restore(cached->types, roots, types);
+    return cached->schemes[0];
+  }
+
+  hamt::array<mono> decorated;
+  const poly res = type::infer(ctx, e, &decorated);
+
+  insert(key, std::make_shared<entry>(entry{{res},
+                                            decorations(roots, decorated)}));
+
+  if(types) *types = decorated;
+  return res;
+}
+
+
+std::vector<poly> cache::infer(std::shared_ptr<context> ctx,
+                               const std::vector<ast::def>& defs,
+                               hamt::array<mono>* types) {
+  // note: names are part of the key, group dependencies are found in ctx
+  digest hash;
+  hash << "def";
+  
+  std::vector<ast::expr> roots;
+  for(const ast::def& def: defs) {
+    hash << def.name.repr;
+    roots.push_back(def.value);
+  }
+
+  std::map<std::string, mono> known;
+  const key_type key = type::key(*ctx, roots, hash, known);
+
+  if(const auto cached = find(key, defs.size(), known)) {
+    restore(cached->types, roots, types);
+
+    std::map<symbol, poly> schemes;
+    for(std::size_t i = 0, n = defs.size(); i < n; ++i) {
+      schemes.emplace(defs[i].name, cached->schemes[i]);
+    }
+
+    define(*ctx, schemes);
+    return cached->schemes;
+  }
+
+  hamt::array<mono> decorated;
+  const std::vector<poly> res = type::infer(ctx, defs, &decorated);
+
+  insert(key, std::make_shared<entry>(entry{res,
+                                            decorations(roots, decorated)}));
+
+  if(types) *types = decorated;
+  return res;
+}
+
+}
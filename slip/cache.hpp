@@ -0,0 +1,54 @@
+#ifndef SLIP_CACHE_HPP
+#define SLIP_CACHE_HPP
+
+#include "type.hpp"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+namespace type {
+
+// inferred type schemes (and expression types) for top-level expressions and
+// definition groups, keyed by a content hash of their source and of the type
+// schemes they refer to in context. entries are loaded from file on
+// construction and the ones used during the session are written back on
+// destruction. inference may run concurrently.
+class cache {
+  struct entry;
+  using key_type = std::uint64_t;
+
+  std::string filename;
+
+  // entries read from file, decoded on first use
+  std::map<key_type, std::string> stored;
+  std::map<key_type, std::shared_ptr<const entry>> entries;
+  std::mutex mutex;
+
+  std::shared_ptr<const entry> find(key_type key, std::size_t size,
+                                    const std::map<std::string, mono>& known);
+  void insert(key_type key, std::shared_ptr<const entry> value);
+
+public:
+  cache(std::string filename={});
+  ~cache();
+
+  cache(const cache&) = delete;
+
+  poly infer(std::shared_ptr<context> ctx, const ast::expr& e,
+             hamt::array<mono>* types=nullptr);
+
+  // mutually recursive definitions: ctx is extended with their type schemes
+  std::vector<poly> infer(std::shared_ptr<context> ctx,
+                          const std::vector<ast::Def<ast::expr>>& defs,
+                          hamt::array<mono>* types=nullptr);
+
+  void save() const;
+};
+
+}
+
+#endif
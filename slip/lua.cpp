@@ -3,9 +3,19 @@
 
 #include <sstream>
 #include <iostream>
+#include <fstream>
+#include <map>
+#include <set>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <limits>
 
 #include "sexpr.hpp"
 
+#include <unistd.h>
+#include <sys/stat.h>
+
 extern "C" {
 #include <lua.h>
 #include <lualib.h>
@@ -14,14 +24,34 @@ extern "C" {
 
 namespace lua {
 
+static const char* const header = "slip-luac 2";
+
+
 struct environment {
   lua_State* state;
 
-  environment(): state(luaL_newstate()) {
-    luaL_openlibs(state);
+  // compiled chunks, keyed by source hash: chunks read from file (loaded on
+  // first use), chunks used during the session (written back on destruction)
+  // and loaded functions, as registry references
+  using key_type = std::uint64_t;
+
+  // note: lua does not verify bytecode, so chunks keep their source to rule
+  // out hash collisions
+  struct entry {
+    std::string source;
+    std::string bytecode;
+  };
+  
+  std::string filename;
+  std::map<key_type, entry> stored;
+  std::map<key_type, entry> used;
+  std::map<key_type, int> chunks;
 
-    const int error = luaL_dofile(state, find("prelude.lua").c_str());
-    check(error);
+  environment(std::string filename={}): state(luaL_newstate()),
+                                        filename(filename) {
+    luaL_openlibs(state);
+    prelude();
+    read();
   }
 
   void check(int error) const {
@@ -36,20 +66,160 @@ struct environment {
   std::string find(std::string filename) const {
     return SLIP_DIR + std::string("/") + filename;
   }
-      
-  void run(std::string code) {
-    const int error = luaL_dostring(state, code.c_str());
+
+  void prelude() {
+#ifdef SLIP_PRELUDE
+    // precompiled at build time. note: falls back to source when bytecode
+    // does not match the lua runtime
+    if(luaL_loadfilex(state, SLIP_PRELUDE, "b") == LUA_OK) {
+      check(lua_pcall(state, 0, 0, 0));
+      return;
+    }
+
+    lua_pop(state, 1);
+#endif
+    
+    const int error = luaL_dofile(state, find("prelude.lua").c_str());
     check(error);
   }
   
+  // fnv-1a
+  static key_type digest(const std::string& code) {
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    for(unsigned char c: code) {
+      h = (h ^ c) * 0x100000001b3ull;
+    }
+
+    return h;
+  }
+
+  static int writer(lua_State*, const void* data, std::size_t size, void* out) {
+    static_cast<std::string*>(out)->append(static_cast<const char*>(data), size);
+    return 0;
+  }
+
+  // keep function on top of the stack for later runs
+  void remember(key_type key) {
+    lua_pushvalue(state, -1);
+    chunks.emplace(key, luaL_ref(state, LUA_REGISTRYINDEX));
+  }
+  
+  // push compiled chunk for code
+  void load(const std::string& code) {
+    const key_type key = digest(code);
+
+    const auto it = chunks.find(key);
+    if(it != chunks.end()) {
+      lua_rawgeti(state, LUA_REGISTRYINDEX, it->second);
+      return;
+    }
+
+    const auto stored = this->stored.find(key);
+    if(stored != this->stored.end()) {
+      const entry data = std::move(stored->second);
+      this->stored.erase(stored);
+
+      if(data.source == code) {
+        const std::string& bytecode = data.bytecode;
+        if(luaL_loadbufferx(state, bytecode.data(), bytecode.size(),
+                            "chunk", "b") == LUA_OK) {
+          used.emplace(key, data);
+          return remember(key);
+        }
+
+        // stale bytecode: compile again
+        lua_pop(state, 1);
+      }
+    }
+    
+    check(luaL_loadbufferx(state, code.data(), code.size(), "chunk", "t"));
+
+    entry data{code, {}};
+    lua_dump(state, writer, &data.bytecode, 0);
+    used.emplace(key, std::move(data));
+    
+    remember(key);
+  }
+  
+  void run(const std::string& code) {
+    load(code);
+    check(lua_pcall(state, 0, 1, 0));
+  }
+
+  // bytecode runs unchecked: only trust our own files, unless anyone may
+  // write them
+  static bool trusted(const std::string& filename) {
+    struct stat info;
+    return ::stat(filename.c_str(), &info) == 0 &&
+      info.st_uid == ::geteuid() && !(info.st_mode & S_IWOTH);
+  }
+  
+  // entry: key, source and bytecode sizes on a line, then source and bytecode
+  void read() {
+    if(filename.empty() || !trusted(filename)) return;
+
+    std::ifstream in(filename, std::ios::binary);
+    std::string line;
+    if(!std::getline(in, line) || line != header) return;
+
+    while(std::getline(in, line)) {
+      std::stringstream ss(line);
+
+      key_type key;
+      std::size_t source, bytecode;
+      if(!(ss >> std::hex >> key >> std::dec >> source >> bytecode)) return;
+
+      entry data{std::string(source, 0), std::string(bytecode, 0)};
+      if(!in.read(&data.source[0], source) ||
+         !in.read(&data.bytecode[0], bytecode)) return;
+
+      stored.emplace(key, std::move(data));
+    }
+  }
+  
+  void save() const {
+    if(filename.empty()) return;
+
+    // note: process-unique, so that concurrent runs never write the same file
+    const std::string tmp = filename + "." + std::to_string(::getpid()) + ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary);
+      if(!out) return;
+
+      out << header << '\n';
+      for(const auto& it: used) {
+        const entry& data = it.second;
+        out << std::hex << it.first << std::dec << ' '
+            << data.source.size() << ' ' << data.bytecode.size() << '\n';
+        out.write(data.source.data(), data.source.size());
+        out.write(data.bytecode.data(), data.bytecode.size());
+      }
+      
+      if(!out) {
+        std::remove(tmp.c_str());
+        return;
+      }
+    }
+    
+    if(std::rename(tmp.c_str(), filename.c_str()) != 0) {
+      std::remove(tmp.c_str());
+    }
+  }
+  
   ~environment() {
+    try {
+      save();
+    } catch(std::exception&) {
+      // note: cache is best-effort
+    }
+    
     lua_close(state);
   }
 };
 
 
-std::shared_ptr<environment> make_environment() {
-  return std::make_shared<environment>();
+std::shared_ptr<environment> make_environment(std::string filename) {
+  return std::make_shared<environment>(filename);
 }
 
 struct ret;
@@ -165,6 +335,14 @@ public:
 
 struct context {
   hamt::array<type::mono> types;
+
+  // note: generated names are numbered per chunk so that identical code hashes
+  // the same across runs
+  std::shared_ptr<std::size_t> count = std::make_shared<std::size_t>(0);
+  
+  symbol unique(const char* prefix) const {
+    return symbol(prefix + std::to_string((*count)++));
+  }
 };
 
 
@@ -226,17 +404,17 @@ static expr compile(context ctx, ast::app self) {
 
     // name func + given args
     const auto given_args = map(self.args, [=](ast::expr arg) {
-      return def{symbol::unique("__tmp"), compile(ctx, arg)};
+      return def{ctx.unique("__tmp"), compile(ctx, arg)};
     });
 
-    const def f = {symbol::unique("__func"), compile(ctx, self.func)};
+    const def f = {ctx.unique("__func"), compile(ctx, self.func)};
     
     const list<def> defs = f %= given_args;
     
     // name remaining args
     list<symbol> rest_args;
     for(std::size_t i = 0; i < rest; ++i) {
-      rest_args = symbol::unique("__arg") %= rest_args;
+      rest_args = ctx.unique("__arg") %= rest_args;
     }
     
     const list<expr> call_args =
@@ -247,9 +425,13 @@ static expr compile(context ctx, ast::app self) {
     const list<term> body = ret{call{var{f.name}, call_args}} %= list<term>();
     const list<term> init = ret{func{rest_args, body}} %= list<term>();
     
-    return thunk{foldr(defs, init, [](term head, list<term> tail) {
+    const list<term> decls = map(defs, [](def self) -> term {
+      return local{self.name};
+    });
+    
+    return thunk{concat(decls, foldr(defs, init, [](term head, list<term> tail) {
       return head %= tail;
-    })};
+    }))};
   } else {
     // over-saturated call: cannot happen yet, but will become possible once
     // proper tuple types are used for functions args.
@@ -342,11 +524,54 @@ static void format(T self, state& ss) {
                            std::string(typeid(T).name()));
 }
 
+// lua 5.3 literals: floats keep their subtype and all their digits, and
+// strings are escaped
+static std::string literal(long self) {
+  // note: the lexer reads the magnitude first, which overflows for the minimum
+  if(self == std::numeric_limits<long>::min()) return "math.mininteger";
+  return std::to_string(self);
+}
+
+static std::string literal(double self) {
+  if(std::isnan(self)) return "(0/0)";
+  if(std::isinf(self)) return self > 0 ? "(1/0)" : "(-1/0)";
+
+  std::stringstream ss;
+  ss.precision(std::numeric_limits<double>::max_digits10);
+  ss << self;
+
+  std::string res = ss.str();
+  if(res.find_first_of(".e") == std::string::npos) res += ".0";
+  return res;
+}
+
+static std::string literal(const std::string& self) {
+  std::string res = "\"";
+  for(unsigned char c: self) {
+    switch(c) {
+    case '"': res += "\\\""; break;
+    case '\\': res += "\\\\"; break;
+    case '\n': res += "\\n"; break;
+    case '\r': res += "\\r"; break;
+    default:
+      if(c < 0x20 || c == 0x7f) {
+        // note: always 3 digits, so that following digits are not consumed
+        char buffer[5];
+        std::snprintf(buffer, sizeof(buffer), "\\%03d", c);
+        res += buffer;
+      } else {
+        res += c;
+      }
+    }
+  }
+
+  return res + '"';
+}
+
 static void format(lit self, state& ss) {
   return match(self,
                [&](bool self) { ss << (self ? "true" : "false"); },
-               [&](std::string self) { ss << '"' << self << '"'; },   
-               [&](auto self) { ss << self; });               
+               [&](auto self) { ss << literal(self); });
 }
 
 static void format(var self, state& ss) {
@@ -480,8 +705,180 @@ static void format(term self, state& ss) {
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// TODO optimization
+// chunk-level bindings: globals and constant tables are bound once as chunk
+// locals, so that nested functions reuse them as upvalues instead of global
+// lookups and table constructions on each call
+
+struct chunk {
+  std::vector<def> locals;
+  term body;
+};
+
+
+static void format(chunk self, state& ss) {
+  for(const def& it: self.locals) {
+    format(it, ss << "local ");
+    ss.newline();
+  }
+
+  format(self.body, ss);
+}
+
+
+// names bound in code
+static void binders(expr self, std::set<symbol>& out);
+static void binders(term self, std::set<symbol>& out);
+
+static void binders(list<term> self, std::set<symbol>& out) {
+  for(term it: self) binders(it, out);
+}
+
+static void binders(expr self, std::set<symbol>& out) {
+  match(self,
+        [&](call self) {
+          binders(self.func, out);
+          for(expr it: self.args) binders(it, out);
+        },
+        [&](func self) {
+          for(symbol it: self.args) out.insert(it);
+          binders(self.body, out);
+        },
+        [&](thunk self) { binders(self.body, out); },
+        [&](table self) {
+          for(def it: self.attrs) binders(it.value, out);
+        },
+        [&](getattr self) { binders(self.arg, out); },
+        [](auto) { });
+}
+
+static void binders(term self, std::set<symbol>& out) {
+  match(self,
+        [&](ret self) { binders(self.value, out); },
+        [&](local self) { out.insert(self.name); },
+        [&](def self) {
+          out.insert(self.name);
+          binders(self.value, out);
+        },
+        [&](call self) { binders(expr(self), out); },
+        [&](cond self) {
+          binders(self.pred, out);
+          binders(self.conseq, out);
+          binders(self.alt, out);
+        });
+}
+
+
+// tables of literals
+static bool constant(expr self) {
+  return match(self,
+               [](lit) { return true; },
+               [](nil) { return true; },
+               [](table self) {
+                 for(def it: self.attrs) {
+                   if(!constant(it.value)) return false;
+                 }
+                 return true;
+               },
+               [](auto) { return false; });
+}
+
+
+class hoist {
+  // note: lua allows 200 locals per function
+  static constexpr std::size_t max_locals = 128;
+
+  const context ctx;
+  const std::set<symbol> bound;
 
+  std::set<symbol> globals;
+  std::map<std::string, symbol> tables;
+  std::vector<def> locals;
+
+  bool full() const { return locals.size() >= max_locals; }
+
+public:
+  hoist(context ctx, term self): ctx(ctx), bound([&] {
+    std::set<symbol> res;
+    binders(self, res);
+    return res;
+  }()) { }
+
+  chunk operator()(term self) {
+    const term body = rewrite(self);
+    return {locals, body};
+  }
+
+private:
+  list<term> rewrite(list<term> self) {
+    return map(self, [&](term it) { return rewrite(it); });
+  }
+
+  list<expr> rewrite(list<expr> self) {
+    return map(self, [&](expr it) { return rewrite(it); });
+  }
+
+  call rewrite(call self) {
+    const expr func = rewrite(self.func);
+    return {func, rewrite(self.args)};
+  }
+
+  term rewrite(term self) {
+    return match(self,
+                 [&](ret self) -> term { return ret{rewrite(self.value)}; },
+                 [&](def self) -> term {
+                   return def{self.name, rewrite(self.value)};
+                 },
+                 [&](call self) -> term { return rewrite(self); },
+                 [&](cond self) -> term {
+                   const expr pred = rewrite(self.pred);
+                   const list<term> conseq = rewrite(self.conseq);
+                   return cond{pred, conseq, rewrite(self.alt)};
+                 },
+                 [&](local self) -> term { return self; });
+  }
+
+  expr rewrite(expr self) {
+    return match(self,
+                 [&](var self) -> expr {
+                   if(!bound.count(self.name) && !globals.count(self.name) &&
+                      !full()) {
+                     globals.insert(self.name);
+                     locals.push_back(def{self.name, self});
+                   }
+                   return self;
+                 },
+                 [&](call self) -> expr { return rewrite(self); },
+                 [&](func self) -> expr {
+                   return func{self.args, rewrite(self.body)};
+                 },
+                 [&](thunk self) -> expr { return thunk{rewrite(self.body)}; },
+                 [&](table self) -> expr {
+                   if(!constant(self)) {
+                     return table{map(self.attrs, [&](def it) {
+                       return def{it.name, rewrite(it.value)};
+                     })};
+                   }
+
+                   // identical constant tables are shared
+                   std::stringstream buffer;
+                   state ss(buffer);
+                   format(self, ss);
+
+                   const auto it = tables.find(buffer.str());
+                   if(it != tables.end()) return var{it->second};
+                   if(full()) return self;
+                   
+                   const symbol name = ctx.unique("__const");
+                   tables.emplace(buffer.str(), name);
+                   locals.push_back(def{name, self});
+                   return var{name};
+                 },
+                 [&](getattr self) -> expr {
+                   return getattr{rewrite(self.arg), self.name};
+                 },
+                 [](auto self) -> expr { return self; });
+  }
+};
 
 
 std::string run(std::shared_ptr<environment> env,
@@ -494,7 +891,7 @@ std::string run(std::shared_ptr<environment> env,
   ctx.types = types;
   
   const term code = ret{compile(ctx, self)};
-  format(code, ss);
+  format(hoist(ctx, code)(code), ss);
 
   // debug
   std::clog << buffer.str() << std::endl;
@@ -506,4 +903,28 @@ std::string run(std::shared_ptr<environment> env,
   return result;
 }
 
+
+void define(std::shared_ptr<environment> env,
+            const std::vector<ast::def>& defs,
+            const hamt::array<type::mono>& types) {
+  std::stringstream buffer;
+  state ss(buffer);
+
+  context ctx;
+  ctx.types = types;
+
+  // note: mutually recursive definitions are bound in the same chunk, so that
+  // they are not hoisted as chunk locals before being defined
+  list<term> body;
+  for(auto it = defs.rbegin(); it != defs.rend(); ++it) {
+    body = term(def{it->name, compile(ctx, it->value)}) %= body;
+  }
+  
+  const term code = ret{thunk{body}};
+  format(hoist(ctx, code)(code), ss);
+
+  env->run(buffer.str());
+  lua_pop(env->state, 1);
+}
+
 } // namespace lua
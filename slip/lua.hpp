@@ -3,22 +3,35 @@
 
 #include "hamt.hpp"
 
+#include <string>
+#include <vector>
+
 namespace type {
 struct mono;
 };
 
 namespace ast {
 struct expr;
+
+template<class E>
+struct Def;
 }
 
 namespace lua {
 struct environment;
-std::shared_ptr<environment> make_environment();
+
+// compiled chunks are cached in filename, if any
+std::shared_ptr<environment> make_environment(std::string filename={});
 
 std::string run(std::shared_ptr<environment> env,
                 const ast::expr& self,
                 const hamt::array<type::mono>& types);
 
+// bind mutually recursive definitions as globals
+void define(std::shared_ptr<environment> env,
+            const std::vector<ast::Def<ast::expr>>& defs,
+            const hamt::array<type::mono>& types);
+
 }
 
 
@@ -1,12 +1,21 @@
 #include "sexpr.hpp"
 #include "ast.hpp"
 #include "type.hpp"
+#include "cache.hpp"
+#include "program.hpp"
 
 #include "repl.hpp"
 #include "lua.hpp"
+#include "native.hpp"
+#include "bytecode.hpp"
+
+#include "mmap.hpp"
+#include "task.hpp"
 
 #include <iostream>
-#include <fstream>
+#include <cstdlib>
+
+#include <sys/stat.h>
 
 template<class Cont>
 static void with_show_errors(Cont cont, std::ostream& err=std::cerr) try {
@@ -17,40 +26,68 @@ static void with_show_errors(Cont cont, std::ostream& err=std::cerr) try {
 };
 
 
-static auto program() {
-  using namespace parser;
-  const auto space = skip(pred(std::isspace));
-  return parser::list(sexpr::parse(), space) >>= drop(space >> eos);
-}
+// note: backends are tried in order, lua runs anything. native code is only
+// compiled for hot expressions (see main)
+static const auto evaluate = [](auto lib, auto vm, auto env) {
+  return [=](const ast::expr& e, const hamt::array<type::mono>& types) {
+    try {
+      return native::run(lib, e, types);
+    } catch(native::unsupported&) { }
 
+    try {
+      return bytecode::run(vm, e, types);
+    } catch(bytecode::unsupported&) { }
+          
+    return lua::run(env, e, types);
+  };
+};
+
+
+// note: definitions only run on lua, other backends must not mistake their
+// names for builtins
+static const auto define = [](auto lib, auto vm, auto env) {
+  return [=](const std::vector<ast::def>& defs,
+             const hamt::array<type::mono>& types) {
+    native::define(lib, defs);
+    bytecode::define(vm, defs);
+    lua::define(env, defs, types);
+  };
+};
 
-static const auto process = [](auto ctx, auto env) {
+
+static const auto process = [](auto ctx, auto eval, auto define, auto env,
+                               auto cache) {
   return [=](sexpr s) {
-      const auto e = ast::check(s);
-      hamt::array<type::mono> types;
-      const auto p = type::infer(ctx, e, &types);
-      std::cout << " :: " << p.show();
-      if(env) {
-        const auto v = lua::run(env, e, types);
-        std::cout << " = " << v;
-      }
-      
-      std::cout << '\n';
+    match(ast::check_toplevel(s),
+          [&](ast::def self) {
+            const std::vector<ast::def> defs = {self};
+            
+            hamt::array<type::mono> types;
+            const auto p = cache->infer(ctx, defs, &types);
+            std::cout << self.name << " :: " << p[0].show() << '\n';
+            
+            if(env) define(defs, types);
+          },
+          [&](ast::expr self) {
+            hamt::array<type::mono> types;
+            const auto p = cache->infer(ctx, self, &types);
+            std::cout << " :: " << p.show();
+            if(env) std::cout << " = " << eval(self, types);
+            std::cout << '\n';
+          });
   };
 };
 
 
 static const auto with_repl = [](auto process) {
-  const auto parser = sexpr::parse() >>= drop(parser::eos);
   const auto history = ".slip";
 
   repl([&](std::string input) {
     try {
       return with_show_errors([&] {
-        const auto s = parser::run(parser, input);
-        process(s);
+        sexpr::read(input, process);
       });
-    } catch(std::runtime_error&) {
+    } catch(std::exception&) {
       
     }
   }, "> ", history);
@@ -59,33 +96,107 @@ static const auto with_repl = [](auto process) {
 };
 
 
-static const auto with_load = [](std::string filename, auto process) -> int {
+// note: the whole file is type-checked before evaluation, independent forms
+// concurrently
+static const auto with_load = [](std::string filename, auto ctx, auto eval,
+                                 auto define, auto env, auto cache) -> int {
   try {
     with_show_errors([&] {
-      if(std::ifstream ifs{filename}) {
-        const std::string contents = parser::read(ifs);
-        for(auto s: parser::run(program(), contents)) {
-          process(s);
-        }
+      const mapped_file contents(filename);
+      
+      std::vector<program::form> forms;
+      sexpr::read({contents.begin(), contents.end()}, [&](sexpr s) {
+        forms.push_back({ast::check_toplevel(s)});
+      });
+
+      const auto groups = program::groups(forms);
+      {
+        pool pool;
+        program::infer(ctx, forms, groups, pool, cache);
+      }
+
+      // definitions are bound first, dependencies first
+      if(env) {
+        for(const program::group& self: groups) {
+          const program::form& first = forms[self.forms.front()];
+          if(first.error || !first.source.cast<ast::def>()) continue;
 
-        return;
+          define(program::definitions(forms, self), first.types);
+        }
       }
 
-      throw std::runtime_error("cannot read file: " + filename);
+      for(const program::form& self: forms) {
+        if(self.error) std::rethrow_exception(self.error);
+        
+        match(self.source,
+              [&](ast::def def) {
+                std::cout << def.name << " :: " << self.scheme->show() << '\n';
+              },
+              [&](ast::expr e) {
+                std::cout << " :: " << self.scheme->show();
+                if(env) std::cout << " = " << eval(e, self.types);
+                std::cout << '\n';
+              });
+      }
     });
 
     return 0;
-  } catch(std::runtime_error& e) {
+  } catch(std::exception& e) {
     return 1;
   }
 };
-  
+
+
+// per-user cache directory, if any
+static std::string cache_directory() {
+  const char* xdg = std::getenv("XDG_CACHE_HOME");
+  if(xdg && xdg[0] == '/') return std::string(xdg) + "/slip";
+
+  const char* home = std::getenv("HOME");
+  if(home && home[0]) return std::string(home) + "/.cache/slip";
+
+  return {};
+}
+
+
+static bool regular_file(const char* path) {
+  struct stat info;
+  return ::stat(path, &info) == 0 && S_ISREG(info.st_mode);
+}
+
+
 int main(int argc, char** argv) {
-  const auto p = process(type::make_context(),
-                         lua::make_environment());
+  if(argc > 2 || (argc == 2 && !regular_file(argv[1]))) {
+    std::cerr << "usage: " << argv[0] << " [file]" << std::endl;
+    return 1;
+  }
+
+  // note: inferred types, compiled chunks and libraries are cached across runs
+  // next to files. the repl only keeps native libraries, in the user cache
+  const std::string filename = argc > 1 ? argv[1] : "";
+
+  const std::string cache = argc > 1 ? filename + ".cache" : "";
+  const std::string chunks = argc > 1 ? filename + ".luac" : "";
+  const std::string libraries = argc > 1 ? filename + ".native" :
+    cache_directory();
+  
+  // note: expressions are compiled to native code from their SLIP_NATIVE-th
+  // run (default 3, 0: never)
+  const char* native = std::getenv("SLIP_NATIVE");
+  const std::size_t threshold = native ? std::strtoul(native, nullptr, 10) : 3;
+  
+  const auto ctx = type::make_context();
+  const auto env = lua::make_environment(chunks);
+  const auto lib = native::make_environment(libraries, threshold);
+  const auto vm = bytecode::make_environment();
+
+  const auto eval = evaluate(lib, vm, env);
+  const auto defs = define(lib, vm, env);
+  const auto types = std::make_shared<type::cache>(cache);
+  
   if(argc > 1) {
-    return with_load(argv[1], p);
+    return with_load(filename, ctx, eval, defs, env, types);
   } else {
-    return with_repl(p);
+    return with_repl(process(ctx, eval, defs, env, types));
   }
 }
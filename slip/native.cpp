@@ -0,0 +1,681 @@
+#include "native.hpp"
+
+#include "ast.hpp"
+#include "type.hpp"
+
+#include <map>
+#include <set>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <limits>
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace native {
+
+struct environment {
+  using key_type = std::uint64_t;
+  using entry_type = void (*)(FILE*);
+
+  std::string directory;
+  std::string compiler;
+
+  // runs before compilation (0: never compile)
+  std::size_t threshold;
+
+  // loaded libraries and runs of cold chunks, keyed by source hash
+  std::map<key_type, std::pair<void*, entry_type>> chunks;
+  std::map<key_type, std::size_t> runs;
+
+  // top-level definitions
+  std::set<symbol> globals;
+
+  environment(std::string directory, std::size_t threshold):
+    directory(directory),
+    compiler(std::getenv("CC") ? std::getenv("CC") : "cc"),
+    threshold(threshold) { }
+
+  environment(const environment&) = delete;
+
+  // fnv-1a
+  static key_type digest(const std::string& code) {
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    for(unsigned char c: code) {
+      h = (h ^ c) * 0x100000001b3ull;
+    }
+
+    return h;
+  }
+
+  static std::string shell(std::string path) {
+    return "'" + path + "'";
+  }
+
+  // an up-to-date library exists
+  static bool built(const std::string& code, std::string source,
+                    std::string library) {
+    struct stat info;
+    if(::stat(library.c_str(), &info) != 0) return false;
+
+    std::ifstream in(source);
+    const std::string old{std::istreambuf_iterator<char>(in),
+                          std::istreambuf_iterator<char>()};
+    return old == code;
+  }
+
+  // note: fails harmlessly when directories exist
+  static void make_directory(const std::string& path) {
+    for(std::size_t pos = path.find('/', 1); pos != std::string::npos;
+        pos = path.find('/', pos + 1)) {
+      ::mkdir(path.substr(0, pos).c_str(), 0755);
+    }
+
+    ::mkdir(path.c_str(), 0755);
+  }
+
+  void build(const std::string& code, std::string source, std::string library) {
+    if(directory.empty()) throw unsupported("no cache directory");
+    make_directory(directory);
+
+    // note: write to process-unique temporaries so that processes building
+    // the same chunk never compile or load partial files
+    const std::string unique = "." + std::to_string(::getpid());
+    const std::string tmp_source = source + unique + ".c";
+    const std::string tmp = library + unique + ".tmp";
+
+    {
+      std::ofstream out(tmp_source);
+      out << code;
+      if(!out) throw unsupported("cannot write " + tmp_source);
+    }
+
+    // note: diagnostics are for generated code, not for users
+    const std::string command = compiler + " -std=gnu99 -O2 -w -shared -fPIC -o " +
+      shell(tmp) + " " + shell(tmp_source);
+
+    if(std::system(command.c_str()) != 0) {
+      std::remove(tmp_source.c_str());
+      std::remove(tmp.c_str());
+      throw unsupported("compilation failed: " + command);
+    }
+
+    std::rename(tmp.c_str(), library.c_str());
+    std::rename(tmp_source.c_str(), source.c_str());
+  }
+
+  entry_type load(const std::string& code) {
+    const key_type key = digest(code);
+
+    const auto it = chunks.find(key);
+    if(it != chunks.end()) return it->second.second;
+
+    std::stringstream ss;
+    ss << directory << "/" << std::hex << key;
+
+    const std::string source = ss.str() + ".c";
+    const std::string library = ss.str() + ".so";
+
+    // note: compiling costs more than running cold code on other backends
+    if(!built(code, source, library)) {
+      if(!threshold || ++runs[key] < threshold) throw unsupported("cold code");
+      build(code, source, library);
+      runs.erase(key);
+    }
+
+    void* handle = ::dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(!handle) throw unsupported(::dlerror());
+
+    const auto entry = reinterpret_cast<entry_type>(::dlsym(handle, "slip_main"));
+    if(!entry) {
+      ::dlclose(handle);
+      throw unsupported("no entry point in " + library);
+    }
+
+    chunks.emplace(key, std::make_pair(handle, entry));
+    return entry;
+  }
+
+  ~environment() {
+    for(const auto& it: chunks) {
+      ::dlclose(it.second.first);
+    }
+  }
+};
+
+
+std::shared_ptr<environment> make_environment(std::string directory,
+                                              std::size_t threshold) {
+  return std::make_shared<environment>(directory, threshold);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// generated translation unit
+class unit {
+  std::size_t count = 0;
+
+  // record structs, by field list
+  std::map<std::string, std::string> structs;
+
+public:
+  std::stringstream types, decls, defs;
+
+  // c identifier for name
+  static std::string mangle(const std::string& name) {
+    std::stringstream ss;
+    for(unsigned char c: name) {
+      if(std::isalnum(c)) ss << c;
+      else if(c == '_') ss << "__";
+      else ss << '_' << std::hex << std::setw(2) << std::setfill('0') << int(c);
+    }
+
+    return ss.str();
+  }
+
+  std::string fresh(const char* prefix, symbol name) {
+    return prefix + std::to_string(count++) + "_" + mangle(name.repr);
+  }
+
+  std::string record(const std::string& fields) {
+    const auto it = structs.find(fields);
+    if(it != structs.end()) return it->second;
+
+    const std::string name = "struct r" + std::to_string(structs.size());
+    types << name << " {" << fields << "};\n\n";
+
+    structs.emplace(fields, name);
+    return name;
+  }
+};
+
+
+// lexically bound values are c variables, let-bound functions are lifted to c
+// functions that also take the values they refer to as extra arguments
+struct value {
+  std::string name;
+  type::mono type;
+};
+
+struct function {
+  std::string name;
+  std::size_t arity;
+
+  // extra arguments, by c name
+  std::map<std::string, type::mono> extra;
+};
+
+struct binding: variant<value, function> {
+  using binding::variant::variant;
+};
+
+
+struct context {
+  hamt::array<type::mono> types;
+  std::map<symbol, binding> scope;
+  std::shared_ptr<class unit> unit;
+  std::shared_ptr<const environment> env;
+
+  type::mono type(const ast::expr& self) const {
+    if(const type::mono* res = types.find(self.id())) return *res;
+    throw unsupported("untyped expression");
+  }
+
+  void bind(symbol name, binding value) {
+    scope.erase(name);
+    scope.emplace(name, value);
+  }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// types: int, num, bool and str are unboxed, closed records become structs
+
+// record fields, by label
+static void fields(type::mono row, std::map<std::string, type::mono>& out) {
+  if(row == type::constant("empty", type::row)) return;
+
+  const auto fail = [&](auto) {
+    throw unsupported("open record type: " + row.show());
+  };
+
+  match(row,
+        [&](type::app outer) {
+          match(outer.ctor,
+                [&](type::app inner) {
+                  match(inner.ctor,
+                        [&](type::type_constant label) {
+                          out.emplace(label->name.repr, inner.arg);
+                        },
+                        fail);
+                },
+                fail);
+          fields(outer.arg, out);
+        },
+        fail);
+}
+
+
+static std::string ctype(unit& u, type::mono self);
+
+static std::string ctype(unit& u, const std::map<std::string, type::mono>& fields) {
+  std::string res;
+  for(const auto& it: fields) {
+    res += " " + ctype(u, it.second) + " f_" + unit::mangle(it.first) + ";";
+  }
+
+  return u.record(res + " ");
+}
+
+
+static std::string ctype(unit& u, type::mono self) {
+  if(self == type::integer) return "long";
+  if(self == type::number) return "double";
+  if(self == type::boolean) return "int";
+  if(self == type::string) return "const char*";
+
+  if(const type::app* app = self.cast<type::app>()) {
+    if(app->ctor == type::record) {
+      std::map<std::string, type::mono> fs;
+      fields(app->arg, fs);
+      return ctype(u, fs);
+    }
+  }
+
+  throw unsupported("type: " + self.show());
+}
+
+
+// argument types of a n-ary function type, returns result type
+static type::mono signature(type::mono self, std::size_t n,
+                            std::vector<type::mono>& args) {
+  if(!n) return self;
+
+  if(const type::app* outer = self.cast<type::app>()) {
+    if(const type::app* inner = outer->ctor.cast<type::app>()) {
+      if(inner->ctor == type::func) {
+        args.push_back(inner->arg);
+        return signature(outer->arg, n - 1, args);
+      }
+    }
+  }
+
+  throw unsupported("function type: " + self.show());
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// expressions compile to c expressions (with gnu statement expressions for
+// local definitions)
+
+template<class T>
+static std::string compile(const context&, const T&) {
+  throw unsupported("expression: " + std::string(typeid(T).name()));
+}
+
+static std::string compile(const context& ctx, const ast::expr& self);
+
+
+static std::string quote(const std::string& self) {
+  std::stringstream ss;
+  ss << '"';
+  for(unsigned char c: self) {
+    if(c == '"' || c == '\\') ss << '\\' << c;
+    else if(std::isprint(c)) ss << c;
+    else ss << '\\' << std::oct << std::setw(3) << std::setfill('0') << int(c);
+  }
+
+  ss << '"';
+  return ss.str();
+}
+
+
+static std::string compile(const context&, ast::lit self) {
+  return match(self,
+               [](bool self) -> std::string { return self ? "1" : "0"; },
+               [](long self) -> std::string {
+                 // note: the minimum is not a valid c literal
+                 if(self == std::numeric_limits<long>::min()) {
+                   return "(-" + std::to_string(-(self + 1)) + "L - 1)";
+                 }
+
+                 return "(" + std::to_string(self) + "L)";
+               },
+               [](double self) {
+                 // note: exact
+                 std::stringstream ss;
+                 ss << "(" << std::hexfloat << self << ")";
+                 return ss.str();
+               },
+               [](std::string self) { return quote(self); });
+}
+
+
+static std::string compile(const context& ctx, ast::var self) {
+  const auto it = ctx.scope.find(self.name);
+  if(it == ctx.scope.end()) {
+    throw unsupported("global: " + std::string(self.name.repr));
+  }
+
+  return match(it->second,
+               [](value self) { return self.name; },
+               [&](function) -> std::string {
+                 throw unsupported("function value: " +
+                                   std::string(self.name.repr));
+               });
+}
+
+
+static std::string compile(const context& ctx, ast::app self) {
+  // note: arithmetic wraps around like lua integers, instead of overflowing
+  static const std::map<std::string, std::pair<std::string, bool>> operators = {
+    {"add", {"+", true}},
+    {"sub", {"-", true}},
+    {"mul", {"*", true}},
+    {"eq", {"==", false}},
+  };
+
+  std::vector<std::string> args;
+  for(const ast::expr& arg: self.args) {
+    args.push_back(compile(ctx, arg));
+  }
+
+  if(const ast::var* var = self.func.cast<ast::var>()) {
+    const auto it = ctx.scope.find(var->name);
+
+    // builtins, unless shadowed by a top-level definition
+    if(it == ctx.scope.end()) {
+      if(ctx.env->globals.count(var->name)) {
+        throw unsupported("global: " + std::string(var->name.repr));
+      }
+
+      const auto op = operators.find(var->name.repr);
+      if(op != operators.end() && args.size() == 2) {
+        const std::string& infix = op->second.first;
+        if(!op->second.second) {
+          return "(" + args[0] + " " + infix + " " + args[1] + ")";
+        }
+
+        return "((long)((unsigned long)" + args[0] + " " + infix +
+          " (unsigned long)" + args[1] + "))";
+      }
+    }
+
+    // lifted functions
+    if(it != ctx.scope.end()) {
+      if(const function* func = it->second.cast<function>()) {
+        if(func->arity != args.size()) {
+          throw unsupported("partial application: " +
+                            std::string(var->name.repr));
+        }
+
+        for(const auto& extra: func->extra) {
+          args.push_back(extra.first);
+        }
+
+        std::string res = func->name + "(";
+        for(std::size_t i = 0; i < args.size(); ++i) {
+          if(i) res += ", ";
+          res += args[i];
+        }
+
+        return res + ")";
+      }
+    }
+  }
+
+  throw unsupported("call");
+}
+
+
+static std::string compile(const context& ctx, ast::cond self) {
+  return "(" + compile(ctx, self.pred) + " ? " + compile(ctx, self.conseq) +
+    " : " + compile(ctx, self.alt) + ")";
+}
+
+
+// lift function to a c function
+static void lift(const context& ctx, const function& func, const ast::def& def) {
+  const ast::abs& abs = def.value.get<ast::abs>();
+
+  std::vector<type::mono> types;
+  const type::mono result = signature(ctx.type(def.value), func.arity, types);
+
+  context body = ctx;
+  std::string params;
+
+  std::size_t i = 0;
+  for(const ast::arg& arg: abs.args) {
+    const std::string name = ctx.unit->fresh("v", arg.name());
+    if(i) params += ", ";
+    params += ctype(*ctx.unit, types[i++]) + " " + name;
+    body.bind(arg.name(), value{name, types[i - 1]});
+  }
+
+  for(const auto& extra: func.extra) {
+    if(i++) params += ", ";
+    params += ctype(*ctx.unit, extra.second) + " " + extra.first;
+  }
+
+  const std::string proto = "static " + ctype(*ctx.unit, result) + " " +
+    func.name + "(" + params + ")";
+
+  const std::string code = compile(body, abs.body);
+  ctx.unit->decls << proto << ";\n";
+  ctx.unit->defs << proto << " {\n  return " << code << ";\n}\n\n";
+}
+
+
+static std::string compile(const context& ctx, ast::let self) {
+  context inner = ctx;
+
+  // values
+  std::vector<ast::def> values, functions;
+  for(const ast::def& def: self.defs) {
+    if(def.value.cast<ast::abs>()) {
+      functions.push_back(def);
+    } else {
+      values.push_back(def);
+      inner.bind(def.name, value{ctx.unit->fresh("v", def.name),
+                                 ctx.type(def.value)});
+    }
+  }
+
+  // functions: extra arguments are the values they refer to, and the ones
+  // needed by the functions they call (until fixpoint for recursive ones)
+  std::map<symbol, std::set<symbol>> refs;
+  std::map<symbol, std::map<std::string, type::mono>> extra;
+
+  for(const ast::def& def: functions) {
+    ast::free_vars(def.value, refs[def.name]);
+    extra[def.name];
+  }
+
+  for(bool changed = true; changed;) {
+    changed = false;
+    for(const ast::def& def: functions) {
+      auto& self = extra.at(def.name);
+      const auto add = [&](const std::map<std::string, type::mono>& values) {
+        for(const auto& it: values) {
+          changed |= self.emplace(it.first, it.second).second;
+        }
+      };
+
+      for(symbol name: refs[def.name]) {
+        const auto local = extra.find(name);
+        if(local != extra.end()) {
+          add(local->second);
+          continue;
+        }
+
+        const auto it = inner.scope.find(name);
+        if(it == inner.scope.end()) continue;
+
+        match(it->second,
+              [&](value self) { add({{self.name, self.type}}); },
+              [&](function self) { add(self.extra); });
+      }
+    }
+  }
+
+  for(const ast::def& def: functions) {
+    inner.bind(def.name, function{ctx.unit->fresh("f", def.name),
+                                  size(def.value.get<ast::abs>().args),
+                                  extra.at(def.name)});
+  }
+
+  for(const ast::def& def: functions) {
+    lift(inner, inner.scope.at(def.name).get<function>(), def);
+  }
+
+  if(values.empty()) return compile(inner, self.body);
+
+  std::stringstream ss;
+  ss << "({ ";
+  for(const ast::def& def: values) {
+    const value& self = inner.scope.at(def.name).get<value>();
+    ss << ctype(*ctx.unit, self.type) << " " << self.name << "; ";
+  }
+
+  for(const ast::def& def: values) {
+    ss << inner.scope.at(def.name).get<value>().name << " = "
+       << compile(inner, def.value) << "; ";
+  }
+
+  ss << compile(inner, self.body) << "; })";
+  return ss.str();
+}
+
+
+static std::string compile(const context& ctx, ast::record self) {
+  std::map<std::string, type::mono> fields;
+  for(const ast::def& attr: self.attrs) {
+    fields.emplace(attr.name.repr, ctx.type(attr.value));
+  }
+
+  std::string res = "((" + ctype(*ctx.unit, fields) + "){";
+
+  unsigned sep = 0;
+  for(const ast::def& attr: self.attrs) {
+    if(sep++) res += ", ";
+    res += ".f_" + unit::mangle(attr.name.repr) + " = " + compile(ctx, attr.value);
+  }
+
+  return res + "})";
+}
+
+
+static std::string compile(const context& ctx, ast::attr self) {
+  return "(" + compile(ctx, self.arg) + ").f_" + unit::mangle(self.name.repr);
+}
+
+
+static std::string compile(const context& ctx, const ast::expr& self) {
+  return match(self, [&](const auto& self) {
+    return compile(ctx, self);
+  });
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// result printing, lua-like
+
+// note: like lua, floats that look like integers get a decimal point
+static const char* const runtime =
+  "static void print_number(FILE* out, double self) {\n"
+  "  char buffer[32];\n"
+  "  snprintf(buffer, sizeof(buffer), \"%.14g\", self);\n"
+  "  fputs(buffer, out);\n"
+  "  if(!buffer[strspn(buffer, \"-0123456789\")]) fputs(\".0\", out);\n"
+  "}\n\n";
+
+static void print(unit& u, type::mono type, std::string self, std::ostream& out) {
+  if(type == type::integer) {
+    out << "  fprintf(out, \"%ld\", " << self << ");\n";
+  } else if(type == type::number) {
+    out << "  print_number(out, " << self << ");\n";
+  } else if(type == type::boolean) {
+    out << "  fputs(" << self << " ? \"true\" : \"false\", out);\n";
+  } else if(type == type::string) {
+    out << "  fputs(" << self << ", out);\n";
+  } else {
+    // note: checks type
+    ctype(u, type);
+
+    std::map<std::string, type::mono> fs;
+    fields(type.get<type::app>().arg, fs);
+
+    out << "  fputs(\"{\", out);\n";
+
+    unsigned sep = 0;
+    for(const auto& it: fs) {
+      out << "  fputs(" << quote((sep++ ? ", " : "") + it.first + " = ")
+          << ", out);\n";
+      print(u, it.second, self + ".f_" + unit::mangle(it.first), out);
+    }
+
+    out << "  fputs(\"}\", out);\n";
+  }
+}
+
+
+std::string run(std::shared_ptr<environment> env,
+                const ast::expr& self,
+                const hamt::array<type::mono>& types) {
+  context ctx;
+  ctx.types = types;
+  ctx.unit = std::make_shared<unit>();
+  ctx.env = env;
+
+  const type::mono type = ctx.type(self);
+  const std::string result = ctype(*ctx.unit, type);
+  const std::string code = compile(ctx, self);
+
+  std::stringstream main;
+  main << "void slip_main(FILE* out) {\n"
+       << "  const " << result << " self = " << code << ";\n";
+  print(*ctx.unit, type, "self", main);
+  main << "}\n";
+
+  std::stringstream source;
+  source << "#include <stdio.h>\n#include <string.h>\n\n"
+         << runtime
+         << ctx.unit->types.str()
+         << ctx.unit->decls.str() << "\n"
+         << ctx.unit->defs.str()
+         << main.str();
+
+  const auto entry = env->load(source.str());
+
+  char* data = nullptr;
+  std::size_t size = 0;
+
+  FILE* out = ::open_memstream(&data, &size);
+  if(!out) throw std::runtime_error("cannot open memory stream");
+
+  entry(out);
+  std::fclose(out);
+
+  const std::string res(data, size);
+  std::free(data);
+
+  return res;
+}
+
+
+void define(std::shared_ptr<environment> env,
+            const std::vector<ast::def>& defs) {
+  for(const ast::def& def: defs) {
+    env->globals.insert(def.name);
+  }
+}
+
+}
@@ -0,0 +1,51 @@
+#ifndef SLIP_NATIVE_HPP
+#define SLIP_NATIVE_HPP
+
+#include "hamt.hpp"
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+namespace type {
+struct mono;
+};
+
+namespace ast {
+struct expr;
+
+template<class E>
+struct Def;
+}
+
+// native backend: monomorphic code is compiled to c with the system compiler
+// and loaded as a shared library
+namespace native {
+
+// expression cannot be compiled to c: use another backend
+struct unsupported: std::runtime_error {
+  unsupported(std::string what): std::runtime_error("native: " + what) { }
+};
+
+struct environment;
+
+// generated sources and libraries are cached in directory, created on first
+// compilation (empty: never compile). expressions are compiled on their
+// threshold-th run, and are unsupported before that unless already built (0:
+// never compile)
+std::shared_ptr<environment> make_environment(std::string directory,
+                                              std::size_t threshold = 1);
+
+std::string run(std::shared_ptr<environment> env,
+                const ast::expr& self,
+                const hamt::array<type::mono>& types);
+
+// top-level definitions are run by other backends: expressions referring to
+// them are unsupported, even where their names shadow builtins
+void define(std::shared_ptr<environment> env,
+            const std::vector<ast::Def<ast::expr>>& defs);
+
+}
+
+
+#endif
@@ -0,0 +1,283 @@
+#include "program.hpp"
+#include "cache.hpp"
+#include "common.hpp"
+
+#include "graph.hpp"
+#include "task.hpp"
+
+#include <map>
+#include <set>
+#include <deque>
+#include <algorithm>
+
+namespace program {
+
+////////////////////////////////////////////////////////////////////////////////
+// dependency graph
+////////////////////////////////////////////////////////////////////////////////
+
+// note: graph.hpp chains adjacent vertices through their references, so
+// references are edges instead of vertices: each vertex has a root edge, and
+// may have any number of incoming edges
+struct edge {
+  std::size_t target;
+  edge* next;
+};
+
+struct vertex {
+  edge* first = nullptr;
+  bool marked = false;
+};
+
+struct dependencies {
+  std::vector<vertex> vertices;
+  std::deque<edge> edges;
+
+  // traversal order
+  std::vector<edge*> roots;
+
+  dependencies(std::size_t size): vertices(size) {
+    for(std::size_t i = 0; i < size; ++i) {
+      edges.push_back({i, nullptr});
+      roots.push_back(&edges.back());
+    }
+  }
+
+  edge* root(std::size_t index) { return &edges[index]; }
+
+  void connect(std::size_t source, std::size_t target) {
+    edges.push_back({target, vertices[source].first});
+    vertices[source].first = &edges.back();
+  }
+};
+
+}
+
+
+namespace graph {
+
+template<>
+struct traits<program::dependencies> {
+  using graph_type = program::dependencies;
+  using ref_type = program::edge*;
+
+  template<class F>
+  static void iter(graph_type& g, const F& f) {
+    for(ref_type v: g.roots) f(v);
+  }
+
+  static ref_type& first(graph_type& g, const ref_type& v) {
+    return g.vertices[v->target].first;
+  }
+
+  static ref_type& next(graph_type&, const ref_type& v) { return v->next; }
+
+  static void marked(graph_type& g, const ref_type& v, bool value) {
+    g.vertices[v->target].marked = value;
+  }
+
+  static bool marked(graph_type& g, const ref_type& v) {
+    return g.vertices[v->target].marked;
+  }
+};
+
+}
+
+
+namespace program {
+
+// strongly connected components (kosaraju), in reverse topological order:
+// components only depend on the ones before them
+static std::vector<std::vector<std::size_t>> components(dependencies& g,
+                                                        dependencies& transpose) {
+  // visit transpose by decreasing finishing time in g
+  std::vector<edge*> roots;
+  graph::dfs_postfix(g, [&](edge* v) {
+    roots.push_back(transpose.root(v->target));
+  });
+
+  transpose.roots.assign(roots.rbegin(), roots.rend());
+
+  // each traversal from a root is a component
+  std::vector<std::vector<std::size_t>> res;
+  std::size_t depth = 0;
+
+  graph::dfs(transpose, [&](edge* v) {
+    if(!depth++) res.emplace_back();
+    res.back().push_back(v->target);
+  }, [&](edge*) { --depth; });
+
+  // note: components are found in topological order
+  std::reverse(res.begin(), res.end());
+  return res;
+}
+
+
+static symbol name(const form& self) {
+  return self.source.get<ast::def>().name;
+}
+
+
+std::vector<group> groups(std::vector<form>& forms) {
+  std::map<symbol, std::size_t> names;
+  for(std::size_t i = 0, n = forms.size(); i < n; ++i) {
+    if(auto def = forms[i].source.cast<ast::def>()) {
+      if(!names.emplace(def->name, i).second) {
+        forms[i].error = std::make_exception_ptr(
+            std::runtime_error("duplicate definition: " + quote(def->name)));
+      }
+    }
+  }
+
+  // forms depend on the definitions they refer to
+  dependencies g(forms.size()), transpose(forms.size());
+  for(std::size_t i = 0, n = forms.size(); i < n; ++i) {
+    if(forms[i].error) continue;
+
+    std::set<symbol> refs;
+    match(forms[i].source,
+          [&](ast::def self) { ast::free_vars(self.value, refs); },
+          [&](ast::expr self) { ast::free_vars(self, refs); });
+
+    for(symbol ref: refs) {
+      const auto it = names.find(ref);
+      if(it == names.end()) continue;
+
+      g.connect(i, it->second);
+      transpose.connect(it->second, i);
+    }
+  }
+
+  std::vector<group> res;
+  std::vector<std::size_t> owner(forms.size());
+
+  for(auto& forms: components(g, transpose)) {
+    std::sort(forms.begin(), forms.end());
+    for(std::size_t i: forms) owner[i] = res.size();
+
+    res.push_back({std::move(forms), {}});
+  }
+
+  for(group& self: res) {
+    std::set<std::size_t> deps;
+    for(std::size_t i: self.forms) {
+      graph::iter(g, g.root(i), [&](edge* v) {
+        deps.insert(owner[v->target]);
+      });
+    }
+
+    deps.erase(owner[self.forms.front()]);
+    self.deps.assign(deps.begin(), deps.end());
+  }
+
+  return res;
+}
+
+
+std::vector<ast::def> definitions(const std::vector<form>& forms,
+                                  const group& self) {
+  std::vector<ast::def> res;
+  for(std::size_t i: self.forms) {
+    if(auto def = forms[i].source.cast<ast::def>()) res.push_back(*def);
+  }
+
+  return res;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// inference
+////////////////////////////////////////////////////////////////////////////////
+
+static void infer(std::shared_ptr<type::context> ctx,
+                  std::vector<form>& forms,
+                  const std::vector<group>& groups,
+                  std::size_t index,
+                  std::shared_ptr<type::cache> cache) {
+  const group& self = groups[index];
+  if(forms[self.forms.front()].error) return;
+
+  try {
+    // note: dependencies have been inferred by now
+    std::map<symbol, type::poly> defs;
+    for(std::size_t dep: self.deps) {
+      for(std::size_t i: groups[dep].forms) {
+        if(forms[i].error) {
+          throw std::runtime_error("ill-typed dependency: " +
+                                   quote(name(forms[i])));
+        }
+
+        defs.emplace(name(forms[i]), *forms[i].scheme);
+      }
+    }
+
+    const auto scope = type::extend(*ctx, defs);
+    hamt::array<type::mono> types;
+
+    match(forms[self.forms.front()].source,
+          [&](ast::def) {
+            const auto members = definitions(forms, self);
+            const auto schemes = cache ? cache->infer(scope, members, &types) :
+              type::infer(scope, members, &types);
+
+            for(std::size_t i = 0, n = schemes.size(); i < n; ++i) {
+              form& it = forms[self.forms[i]];
+              it.scheme = std::make_shared<const type::poly>(schemes[i]);
+              it.types = types;
+            }
+          },
+          [&](ast::expr e) {
+            form& it = forms[self.forms.front()];
+            it.scheme = std::make_shared<const type::poly>(
+                cache ? cache->infer(scope, e, &types) :
+                type::infer(scope, e, &types));
+            it.types = types;
+          });
+  } catch(std::exception&) {
+    for(std::size_t i: self.forms) {
+      forms[i].error = std::current_exception();
+    }
+  }
+}
+
+
+void infer(std::shared_ptr<type::context> ctx,
+           std::vector<form>& forms,
+           const std::vector<group>& groups,
+           pool& pool,
+           std::shared_ptr<type::cache> cache) {
+  const std::size_t size = groups.size();
+
+  std::vector<std::vector<std::size_t>> users(size);
+  std::vector<std::atomic<std::size_t>> pending(size);
+
+  for(std::size_t i = 0; i < size; ++i) {
+    pending[i] = groups[i].deps.size();
+    for(std::size_t dep: groups[i].deps) users[dep].push_back(i);
+  }
+
+  // groups are scheduled once their last dependency is inferred
+  std::promise<void> promise;
+  std::atomic<std::size_t> count(size);
+
+  std::function<void(std::size_t)> schedule = [&](std::size_t i) {
+    pool.async([&, i] {
+      infer(ctx, forms, groups, i, cache);
+
+      for(std::size_t user: users[i]) {
+        if(--pending[user] == 0) schedule(user);
+      }
+
+      // last one fills the promise
+      if(--count == 0) promise.set_value();
+    });
+  };
+
+  for(std::size_t i = 0; i < size; ++i) {
+    if(groups[i].deps.empty()) schedule(i);
+  }
+
+  if(size) promise.get_future().get();
+}
+
+}
@@ -0,0 +1,58 @@
+#ifndef SLIP_PROGRAM_HPP
+#define SLIP_PROGRAM_HPP
+
+#include "ast.hpp"
+#include "type.hpp"
+#include "hamt.hpp"
+
+#include <vector>
+#include <memory>
+#include <exception>
+
+class pool;
+
+namespace type {
+class cache;
+}
+
+// whole programs: top-level definitions may refer to each other regardless of
+// their order
+namespace program {
+
+// top-level form, with its inferred type scheme and expression types, or
+// inference error
+struct form {
+  ast::toplevel source;
+
+  std::shared_ptr<const type::poly> scheme = {};
+  hamt::array<type::mono> types = {};
+  std::exception_ptr error = {};
+};
+
+// strongly connected component of the dependency graph between forms
+struct group {
+  // indices into forms, in source order
+  std::vector<std::size_t> forms;
+
+  // indices of the groups this one depends on
+  std::vector<std::size_t> deps;
+};
+
+// all form groups, dependencies first
+std::vector<group> groups(std::vector<form>& forms);
+
+// infer groups on pool, each as soon as the groups it depends on are
+// inferred. note: ctx is left unchanged
+void infer(std::shared_ptr<type::context> ctx,
+           std::vector<form>& forms,
+           const std::vector<group>& groups,
+           pool& pool,
+           std::shared_ptr<type::cache> cache={});
+
+// definitions in group
+std::vector<ast::def> definitions(const std::vector<form>& forms,
+                                  const group& self);
+
+}
+
+#endif
@@ -1,24 +1,33 @@
 #include "sexpr.hpp"
+#include "scan.hpp"
 
-parser::monad<sexpr> sexpr::parse() {
+#include <array>
+#include <vector>
+#include <sstream>
+#include <cctype>
+#include <cstring>
+
+parser::rule<sexpr> sexpr::parse() {
   using namespace parser;
 
   const auto lparen = token(single('('));
   const auto rparen = token(single(')'));
 
   const auto quote = single('"');
-  const auto not_quote = pred([](char x) { return x != '"'; });
 
   const auto backslash = single('\\');
 
-  const auto escaped = backslash >> character;
+  // note: plain chars are scanned in bulk up to the next quote or backslash
+  const auto escaped = backslash >> capture(character);
+  const auto plain = span(scan::complement(scan::quote()), 1);
 
-  const auto chars = kleene(escaped | not_quote) >>= [](auto chars) {
-    std::string value(chars.begin(), chars.end());
-    return pure(sexpr(std::move(value)));
-  };
+  const auto chars = fold(escaped | plain, std::string(),
+                          [](std::string& value, range chars) {
+                            value.append(chars.first, chars.size());
+                          })
+    |= [](std::string value) { return sexpr(std::move(value)); };
 
-  const auto string = token(quote) >> chars >>= drop(quote);
+  const auto string = token(quote) > (chars << quote);
 
   const auto cast = [](auto value) { return sexpr(value); };
 
@@ -29,57 +38,42 @@ parser::monad<sexpr> sexpr::parse() {
   const auto first = pred(std::isalpha);
   const auto next = pred(std::isalnum);
 
-  const auto sym = first >>= [=](char first) {
-    return kleene(next) >>= [=](auto nexts) {
-      nexts.emplace_front(first);
-      std::string repr(nexts.begin(), nexts.end());
-      symbol s(repr.c_str());
-      return pure(s);
-    };
+  const auto sym = capture(first >> skip(next)) |= [](range repr) {
+    return symbol(repr.first, repr.size());
   };
 
   const auto atom = number | string | (sym |= cast);
 
   const auto list = [=](auto parser) {
-    auto inner = ((parser % space) | pure(std::deque<sexpr>{})) |=
+    auto inner = ((parser % space) | pure(std::vector<sexpr>{})) |=
         [](auto items) {
           // TODO use move iterator
           return sexpr(make_list(items.begin(), items.end()));
         };
 
-    return lparen >> inner >>= drop(rparen);
+    return lparen > (inner << rparen);
   };
 
   const auto dot = token(single('.'));
 
-  const auto peek = [](auto parser) {
-    return [parser](range in) -> parser::result<bool> {
-      return make_success(bool(parser(in)), in);
-    };
-  };
-
   const auto with_source = [](auto expr) {
-    return cursor >>= [=](const char* first) {
-      return expr >>= [=](sexpr s) {
-        return cursor >>= [=](const char* last) {
-          sexpr r = s;
-          r.source = {first, last};
-          return pure(r);
-        };
-      };
+    return located(expr) |= [](std::pair<sexpr, range> self) {
+      sexpr r = std::move(self.first);
+      r.source = self.second;
+      return r;
     };
   };
   
   
-  const auto expr = parser::fix<sexpr>([=](auto& self) {
+  const auto expr = parser::fix<sexpr>([=](const rule<sexpr>& self) {
     return with_source((atom | list(self)) >>= [=](sexpr e) {
-      return ((dot >> (sym % dot)) >>=
+      return ((dot >> (sym % dot)) |=
               [=](auto attrs) {
-                return pure(foldl(e,
-                                  make_list(attrs.begin(), attrs.end()),
-                                  [](sexpr e, symbol name) -> sexpr {
-                                    return attrib{e, name};
-                                  }));
+                return foldl(e,
+                             make_list(attrs.begin(), attrs.end()),
+                             [](sexpr e, symbol name) -> sexpr {
+                               return attrib{e, name};
+                             });
               }) | pure(e);
     });
   });
@@ -87,3 +81,265 @@ parser::monad<sexpr> sexpr::parse() {
   return expr;
 
 }
+
+
+////////////////////////////////////////////////////////////////////////////////
+// hand-written reader: a table-driven lexer and a recursive-descent builder,
+// producing the same trees as sexpr::parse in a single pass
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+enum class_type : unsigned char {
+  OTHER, SPACE, LPAREN, RPAREN, QUOTE, DOT, DIGIT, SIGN, ALPHA
+};
+
+static const std::array<class_type, 256> classes = [] {
+  std::array<class_type, 256> res;
+  for(std::size_t i = 0; i < res.size(); ++i) {
+    const int c = i;
+    res[i] = std::isspace(c) ? SPACE : std::isdigit(c) ? DIGIT :
+      std::isalpha(c) ? ALPHA : OTHER;
+  }
+
+  res['('] = LPAREN;
+  res[')'] = RPAREN;
+  res['"'] = QUOTE;
+  res['.'] = DOT;
+  res['+'] = SIGN;
+  res['-'] = SIGN;
+  return res;
+}();
+
+static class_type classify(char c) {
+  return classes[static_cast<unsigned char>(c)];
+}
+
+
+class reader {
+  const parser::range source;
+  const char* it;
+
+  // items of lists being read
+  std::vector<sexpr> stack;
+
+  class_type peek(const char* at) const {
+    return at < source.last ? classify(*at) : OTHER;
+  }
+
+  [[noreturn]] void error(const char* at, std::string what) const {
+    std::size_t line = 1, column = 1;
+    for(const char* c = source.first; c != at; ++c) {
+      if(*c == '\n') {
+        ++line;
+        column = 1;
+      } else {
+        ++column;
+      }
+    }
+
+    std::stringstream ss;
+    ss << "parse error at " << line << ":" << column << ": " << what
+       << " near \"";
+    parser::peek({at, source.last}, ss);
+    ss << "\"";
+    throw std::runtime_error(ss.str());
+  }
+
+  void skip() {
+    it = scan::skip_space(it, source.last);
+  }
+
+  // atoms must be followed by a delimiter
+  void delimiter() const {
+    switch(peek(it)) {
+    case ALPHA: case DIGIT: case QUOTE: case SIGN:
+      error(it, "unexpected character");
+    default:
+      break;
+    }
+  }
+
+  bool starts_number(const char* at) const {
+    switch(peek(at)) {
+    case DIGIT: return true;
+    case DOT: return peek(at + 1) == DIGIT;
+    case SIGN:
+      return peek(at + 1) == DIGIT ||
+        (peek(at + 1) == DOT && peek(at + 2) == DIGIT);
+    default: return false;
+    }
+  }
+
+  sexpr number() {
+    const char* last = it;
+    bool real = false;
+
+    if(peek(last) == SIGN) ++last;
+    while(peek(last) == DIGIT) ++last;
+
+    if(peek(last) == DOT) {
+      real = true;
+      ++last;
+      while(peek(last) == DIGIT) ++last;
+    }
+
+    if(last < source.last && (*last == 'e' || *last == 'E')) {
+      const char* exp = last + 1;
+      if(peek(exp) == SIGN) ++exp;
+      if(peek(exp) == DIGIT) {
+        real = true;
+        last = exp;
+        while(peek(last) == DIGIT) ++last;
+      }
+    }
+
+    // note: literal is known to be well-formed, convert once. source may be
+    // a mapped file without terminating null, so the token is copied
+    char buffer[64];
+    std::string large;
+
+    const std::size_t size = last - it;
+    const char* token = buffer;
+
+    if(size < sizeof(buffer)) {
+      std::memcpy(buffer, it, size);
+      buffer[size] = 0;
+    } else {
+      large.assign(it, last);
+      token = large.c_str();
+    }
+
+    char* end;
+    const sexpr res = real ? sexpr(std::strtod(token, &end)) :
+      sexpr(std::strtol(token, &end, 10));
+    assert(end == token + size);
+
+    it = last;
+    return res;
+  }
+
+  sexpr string() {
+    const char* first = ++it;
+    bool escaped = false;
+
+    while((it = scan::find_quote(it, source.last)) != source.last &&
+          *it == '\\') {
+      escaped = true;
+      if(++it == source.last) break;
+      ++it;
+    }
+
+    if(it == source.last) error(first - 1, "unterminated string");
+
+    std::string value;
+    if(escaped) {
+      value.reserve(it - first);
+      for(const char* c = first; c != it; ++c) {
+        if(*c == '\\') ++c;
+        value += *c;
+      }
+    } else {
+      value.assign(first, it);
+    }
+
+    ++it;
+    return sexpr(std::move(value));
+  }
+
+  symbol sym() {
+    const char* first = it;
+    while(peek(it) == ALPHA || peek(it) == DIGIT) ++it;
+    return symbol(first, it - first);
+  }
+
+  sexpr list() {
+    const char* first = it++;
+    const std::size_t start = stack.size();
+
+    while(true) {
+      skip();
+      if(it == source.last) error(first, "unterminated list");
+      if(*it == ')') break;
+
+      stack.push_back(expr());
+    }
+
+    ++it;
+
+    sexpr::list items;
+    while(stack.size() > start) {
+      items = std::move(stack.back()) %= std::move(items);
+      stack.pop_back();
+    }
+
+    return items;
+  }
+
+  sexpr atom_or_list() {
+    if(starts_number(it)) {
+      sexpr res = number();
+      delimiter();
+      return res;
+    }
+
+    switch(peek(it)) {
+    case LPAREN: return list();
+    case QUOTE: return string();
+    case ALPHA: {
+      sexpr res = sym();
+      delimiter();
+      return res;
+    }
+    case RPAREN: error(it, "unexpected closing parenthesis");
+    default: error(it, "unexpected character");
+    }
+  }
+
+  // note: whitespaces may appear before attribute dots but not after
+  sexpr attributes(const char* first, const sexpr& arg) {
+    const char* dot = it;
+    while(peek(dot) == SPACE) ++dot;
+
+    if(peek(dot) != DOT) return arg;
+    if(peek(dot + 1) != ALPHA) {
+      if(dot == it) error(dot + 1, "attribute name expected");
+      return arg;
+    }
+
+    it = dot + 1;
+    const symbol name = sym();
+    delimiter();
+
+    sexpr res = attrib{arg, name};
+    res.source = {first, it};
+    return attributes(first, res);
+  }
+  
+public:
+  reader(parser::range source): source(source), it(source.first) { }
+
+  sexpr expr() {
+    const char* first = it;
+
+    sexpr res = atom_or_list();
+    res.source = {first, it};
+
+    return attributes(first, res);
+  }
+
+  bool done() {
+    skip();
+    return it == source.last;
+  }
+};
+
+}
+
+
+void sexpr::read(parser::range source, const std::function<void(sexpr)>& cont) {
+  reader self(source);
+  while(!self.done()) {
+    cont(self.expr());
+  }
+}
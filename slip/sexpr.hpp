@@ -7,6 +7,8 @@
 #include "list.hpp"
 #include "fix.hpp"
 
+#include <functional>
+
 template<class T>
 struct Attrib {
   T arg;
@@ -48,7 +50,11 @@ struct sexpr: fix<Sexpr, sexpr> {
 
   parser::range source;
   
-  static parser::monad<sexpr> parse();
+  static parser::rule<sexpr> parse();
+
+  // single-pass reader for a sequence of sexprs, calling cont on each in
+  // turn. source must outlive results.
+  static void read(parser::range source, const std::function<void(sexpr)>& cont);
 };
 
 
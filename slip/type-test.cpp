@@ -0,0 +1,98 @@
+#include "sexpr.hpp"
+#include "ast.hpp"
+#include "type.hpp"
+
+#include <gtest/gtest.h>
+
+// type scheme of each top-level form, inferred in order in a fresh context
+static std::vector<std::string> infer(std::string source) {
+  const auto ctx = type::make_context();
+
+  std::vector<std::string> res;
+  sexpr::read(source, [&](sexpr s) {
+    match(ast::check_toplevel(s),
+          [&](ast::def self) {
+            const std::vector<ast::def> defs = {self};
+            res.push_back(type::infer(ctx, defs)[0].show());
+          },
+          [&](ast::expr self) {
+            res.push_back(type::infer(ctx, self).show());
+          });
+  });
+
+  return res;
+}
+
+
+static std::string error(std::string source) {
+  try {
+    infer(source);
+  } catch(std::runtime_error& e) {
+    return e.what();
+  }
+
+  return {};
+}
+
+
+static bool contains(std::string what, std::string part) {
+  return what.find(part) != std::string::npos;
+}
+
+
+TEST(type, let_polymorphism) {
+  EXPECT_EQ(infer("(fn (x) x)")[0], "'a -> 'a");
+  EXPECT_EQ(infer("(fn (f) (fn (x) (f (f x))))")[0],
+            "('a -> 'a) -> ('a -> 'a)");
+
+  // let-bound functions are generalized
+  EXPECT_EQ(infer("(let ((id (fn (x) x))) (record (a (id 1)) (b (id true))))")[0],
+            "record ((a int) ((b bool) empty))");
+
+  // ... lambda-bound ones are not
+  EXPECT_TRUE(contains(error("(fn (f) (let ((g (fn (x) (f x)))) "
+                             "(record (a (g 1)) (b (g true)))))"),
+                       "cannot unify"));
+
+  // definitions are generalized too
+  EXPECT_EQ(infer("(def id (fn (x) x))"
+                  "(record (a (id 1)) (b (id true)))"),
+            std::vector<std::string>({"'a -> 'a",
+                                      "record ((a int) ((b bool) empty))"}));
+}
+
+
+TEST(type, records) {
+  EXPECT_EQ(infer("(let ((r (record (a 1) (b true)))) r.b)")[0], "bool");
+
+  // projections on unknown records leave the row open
+  EXPECT_EQ(infer("(fn (r) r.a)")[0], "(record ((a 'a) 'b...)) -> 'a");
+  EXPECT_EQ(infer("(fn (r) (add r.a 1))")[0], "(record ((a int) 'a...)) -> int");
+
+  // missing field
+  EXPECT_TRUE(contains(error("(let ((r (record (a 1)))) r.b)"), "r.b"));
+}
+
+
+// note: the union-find engine rejects self-application, which the
+// substitution engine used to accept
+TEST(type, occurs_check) {
+  const std::string what = error("(fn (x) (x x))");
+  EXPECT_TRUE(contains(what, "when typing expression (x x)")) << what;
+}
+
+
+TEST(type, errors) {
+  EXPECT_TRUE(contains(error("(foo 1)"), "unbound variable: \"foo\""));
+  EXPECT_TRUE(contains(error("(add 1 true)"), "cannot unify"));
+
+  // failed inference leaves the context usable
+  const std::string source = "(add 1 true) (fn (x) (add x 1))";
+  
+  std::vector<ast::expr> exprs;
+  sexpr::read(source, [&](sexpr s) { exprs.push_back(ast::check(s)); });
+  
+  const auto ctx = type::make_context();
+  EXPECT_THROW(type::infer(ctx, exprs[0]), std::runtime_error);
+  EXPECT_EQ(type::infer(ctx, exprs[1]).show(), "int -> int");
+}
@@ -1,15 +1,15 @@
 #include "type.hpp"
 #include "ast.hpp"
-#include "either.hpp"
-#include "unit.hpp"
 #include "hamt.hpp"
 #include "common.hpp"
 
-#include <functional>
-#include <stack>
 #include <sstream>
 #include <algorithm>
-#include <sstream>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <mutex>
 
 #include "sexpr.hpp"
 
@@ -68,23 +68,23 @@ struct type_error: std::runtime_error {
 // kinds
 ////////////////////////////////////////////////////////////////////////////////
 
+// note: kind constructors are hash-consed
 kind kind::operator>>=(kind other) const {
-  return ctor{*this, other};
+  using key_type = std::pair<std::size_t, std::size_t>;
+  static std::map<key_type, kind> table;
+  static std::mutex mutex;
+
+  const std::lock_guard<std::mutex> lock(mutex);
+  
+  const key_type key = {id(), other.id()};
+  const auto it = table.find(key);
+  if(it != table.end()) return it->second;
+
+  return table.emplace(key, ctor{*this, other}).first->second;
 }
 
 bool kind::operator==(kind other) const {
-    if(type() != other.type()) {
-      return false;
-    }
-    
-    return match(*this,
-                 [&](ctor lhs) {
-                   return std::tie(lhs.from, lhs.to) ==
-                     std::tie(other.get<ctor>().from, other.get<ctor>().to);
-                 },
-                 [&](kind_constant lhs) {
-                   return lhs == other.get<kind_constant>();
-                 });
+  return id() == other.id();
 }
 
 std::string kind::show() const {
@@ -103,6 +103,90 @@ struct kind_error: std::runtime_error {
   kind_error(std::string what): std::runtime_error("kind error: " + what) { }
 };
 
+
+////////////////////////////////////////////////////////////////////////////////
+// hash-consing
+////////////////////////////////////////////////////////////////////////////////
+
+// ground type applications (without type variables) are hash-consed per
+// thread: structurally equal ones built on the same thread share storage, so
+// that equality is mostly a pointer comparison. applications with variables
+// are left alone: variables are fresh, so these are almost never shared and
+// would only fill the table. the table is swept as it grows, releasing
+// applications only referenced by the table itself.
+class interned {
+  using key_type = std::pair<std::size_t, std::size_t>;
+
+  struct hash {
+    std::size_t operator()(const key_type& key) const {
+      const std::uint64_t h = key.first * 0x9e3779b97f4a7c15ull ^
+        key.second * 0xc2b2ae3d27d4eb4full;
+      return h ^ (h >> 32);
+    }
+  };
+
+  std::unordered_map<key_type, mono, hash> table;
+  std::size_t limit = 1 << 10;
+
+  static key_type key(const app& self) {
+    return {self.ctor.id(), self.arg.id()};
+  }
+
+  // type constant or interned application
+  bool ground(const mono& self) const {
+    if(self.cast<type_constant>()) return true;
+    
+    const auto app = self.cast<type::app>();
+    if(!app) return false;
+
+    const auto it = table.find(key(*app));
+    return it != table.end() && it->second.id() == self.id();
+  }
+  
+  void sweep() {
+    std::vector<key_type> todo;
+    for(const auto& it: table) {
+      if(it.second.use_count() == 1) todo.push_back(it.first);
+    }
+
+    while(todo.size()) {
+      const auto it = table.find(todo.back());
+      todo.pop_back();
+
+      if(it == table.end() || it->second.use_count() > 1) continue;
+
+      // children may only be referenced by the table once released
+      const app self = it->second.get<app>();
+      table.erase(it);
+
+      if(auto ctor = self.ctor.cast<app>()) todo.push_back(key(*ctor));
+      if(auto arg = self.arg.cast<app>()) todo.push_back(key(*arg));
+    }
+
+    // note: keep sweeps linear in the number of applications interned
+    limit = std::max(limit, 2 * table.size());
+  }
+  
+public:
+  static interned& instance() {
+    static thread_local interned instance;
+    return instance;
+  }
+
+  mono operator()(mono ctor, mono arg) {
+    if(!ground(ctor) || !ground(arg)) return app{ctor, arg};
+    
+    const key_type key = {ctor.id(), arg.id()};
+    const auto it = table.find(key);
+    if(it != table.end()) return it->second;
+
+    if(table.size() >= limit) sweep();
+    
+    return table.emplace(key, app{ctor, arg}).first->second;
+  }
+};
+
+
 ////////////////////////////////////////////////////////////////////////////////
 mono mono::operator>>=(mono to) const {
   return func(*this)(to);
@@ -116,7 +200,7 @@ mono mono::operator()(mono arg) const {
                                     ", found: " + arg.kind().show());
                  }
                  
-                 return app{*this, arg};
+                 return interned::instance()(*this, arg);
                },
                [](auto) -> mono {
                  assert(false);
@@ -174,15 +258,14 @@ std::string mono::show(repr_type repr) const {
 }
 
 
+// note: only walks the constructor spine
 struct kind mono::kind() const {
-  return cata(*this, [](Mono<struct kind> self) {
-    return match(self,
-                 [](type_constant self) { return self->kind; },
-                 [](var self) { return self->kind; },
-                 [](App<struct kind> self) {
-                   return self.ctor.get<ctor>().to;
-                 });
-  });
+  return match(*this,
+               [](type_constant self) { return self->kind; },
+               [](var self) { return self->kind; },
+               [](app self) {
+                 return self.ctor.kind().get<ctor>().to;
+               });
 }
 
 
@@ -208,21 +291,14 @@ list<var> mono::vars() const {
 }
 
 
+// note: ground applications are hash-consed, others are compared structurally
 bool mono::operator==(mono other) const {
-  if(this->type() != other.type()) {
-    return false;
-  }
+  if(id() == other.id()) return true;
 
-  return match(*this,
-               [&](var self) { return self == other.get<var>(); },
-               [&](type_constant self) {
-                 return self == other.get<type_constant>();
-               },
-               [&](app self) {
-                 return self.ctor == other.get<app>().ctor
-                   && self.arg == other.get<app>().arg;
-               });
+  const auto lhs = cast<app>();
+  const auto rhs = other.cast<app>();
   
+  return lhs && rhs && lhs->ctor == rhs->ctor && lhs->arg == rhs->arg;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -303,31 +379,120 @@ static std::string show(mono self) {
 // substitutions
 ////////////////////////////////////////////////////////////////////////////////
 
+// type variables are bound in place, union-find style. during transactions,
+// bindings and depth updates are logged on a trail so that failed alternatives
+// can be undone.
 class substitution {
-  using table_type = hamt::map<const var_info*, mono>;
-  table_type table;
+  struct entry {
+    type::var var;
+    std::shared_ptr<const mono> binding;
+    std::size_t depth;
+  };
 
-  substitution(table_type table): table(table) { }
+  std::vector<entry> trail;
+  std::size_t transactions = 0;
+  
+  void save(var a) {
+    if(transactions) trail.push_back({a, a->binding, a->depth});
+  }
+  
 public:
-  substitution() = default;
+  static substitution& current() {
+    static thread_local substitution instance;
+    return instance;
+  }
+
+  // record mutations while alive, so that they can be undone
+  class transaction {
+    substitution& sub;
+    const std::size_t mark;
+  public:
+    transaction(substitution& sub): sub(sub), mark(sub.trail.size()) {
+      ++sub.transactions;
+    }
+
+    ~transaction() {
+      // outermost transaction: mutations can no longer be undone
+      if(!--sub.transactions) sub.trail.clear();
+    }
+
+    // undo mutations since transaction start
+    void undo() {
+      while(sub.trail.size() > mark) {
+        entry& last = sub.trail.back();
+        last.var->binding = std::move(last.binding);
+        last.var->depth = last.depth;
+        sub.trail.pop_back();
+      }
+    }
+  };
+  
+  void link(var a, mono ty) {
+    save(a);
+    a->binding = std::make_shared<const mono>(std::move(ty));
+  }
+
+  void upgrade(var a, std::size_t depth) {
+    save(a);
+    a->depth = depth;
+  }
+
+  // representative type, with path compression
+  mono find(mono ty) {
+    const auto self = ty.cast<var>();
+    if(!self || !(*self)->binding) return ty;
+
+    const mono res = find(*(*self)->binding);
+    if(res.id() != (*self)->binding->id()) {
+      link(*self, res);
+    }
+    
+    return res;
+  }
+
+  // rebuild ty with representatives and unbound variables mapped through func,
+  // sharing unchanged subterms
+  template<class Func>
+  mono map(mono source, const Func& func) {
+    const mono ty = find(source);
+    return match(ty,
+                 [&](var self) -> mono { return func(self); },
+                 [&](app self) -> mono {
+                   const mono ctor = map(self.ctor, func);
+                   const mono arg = map(self.arg, func);
+                   if(ctor.id() == self.ctor.id() && arg.id() == self.arg.id()) {
+                     return ty;
+                   }
+                   
+                   return interned::instance()(ctor, arg);
+                 },
+                 [&](type_constant) { return ty; });
+  }
   
-  substitution link(var a, mono ty) const {
-    // TODO compress var => var
-    return {table.set(a.get(), std::move(ty))};
+  mono operator()(mono ty) {
+    return map(ty, [](var self) -> mono { return self; });
   }
+
+  // source type and its resolution, by source identity
+  using cache_type = std::unordered_map<std::size_t, std::pair<mono, mono>>;
   
-  mono operator()(mono ty) const {
-    return cata(ty, [&](Mono<mono> self) {
-      return match(self,
-                   [&](var self) -> mono {
-                     if(auto res = table.find(self.get())) {
-                       // keep substituting
-                       return (*this)(*res);
-                     }
-                     return self;
-                   },
-                   [](auto self) -> mono { return self; });                   
-    });
+  // resolve applications memoized through cache, for many types sharing
+  // subterms
+  mono operator()(mono source, cache_type& cache) {
+    const auto self = source.cast<app>();
+    if(!self) return (*this)(source);
+    
+    const auto it = cache.find(source.id());
+    if(it != cache.end()) return it->second.second;
+
+    const mono ctor = (*this)(self->ctor, cache);
+    const mono arg = (*this)(self->arg, cache);
+    
+    const mono res = ctor.id() == self->ctor.id() && arg.id() == self->arg.id() ?
+      source : interned::instance()(ctor, arg);
+    
+    cache.emplace(source.id(), std::make_pair(source, res));
+    return res;
   }
 
 };
@@ -346,46 +511,47 @@ struct context {
   }
   
   mono instantiate(poly p) const {
-    const substitution sub =
-        foldr(p.bound(), substitution{}, [&](var a, substitution sub) {
-          return sub.link(a, fresh(a->kind));
-        });
+    std::map<var, mono> table;
+    for(var a: p.bound()) {
+      table.emplace(a, fresh(a->kind));
+    }
+
+    // monomorphic: nothing to rename
+    if(table.empty()) return p.body();
 
-    return sub(p.body());
+    return substitution::current().map(p.body(), [&](var a) -> mono {
+      const auto it = table.find(a);
+      if(it != table.end()) return it->second;
+      return a;
+    });
   };
 
 
-  // quantify unbound variables
-  list<var> quantify(list<var> vars) const {
-    return foldr(vars, list<var>{}, [&](var a, list<var> rest) {
+  // level-based generalization: unbound variables not bound in some enclosing
+  // scope are quantified, and replaced with fresh variables just in case
+  poly generalize(mono ty) const {
+    std::map<var, var> table;
+    std::vector<var> foralls;
+    
+    const mono body = substitution::current().map(ty, [&](var a) -> mono {
       if(a->depth < depth) {
         // bound somewhere in enclosing scope
-        return rest;
-      } else {
-        // can be generalized (TODO assert it's not in locals just in case)
-        // assert(a->depth == depth);
-        return a %= rest;
+        return a;
       }
-    });
-  }
-
 
-  // note: m must be fully substituted
-  poly generalize(mono ty) const {
-    const auto foralls = quantify(ty.vars());
+      const auto it = table.find(a);
+      if(it != table.end()) return it->second;
 
-    // replace quantified variables with fresh variables just in case
-    substitution sub;
-    
-    const auto freshes = map(foralls, [&](var a) {
-      const auto res = fresh(a->kind);
-      sub = sub.link(a, res);
+      const var res = fresh(a->kind);
+      table.emplace(a, res);
+      foralls.push_back(res);
       return res;
     });
 
-    return foldr(freshes, poly(sub(ty)), [](var a, poly p) -> poly {
-      return forall{a, p};
-    });
+    return foldr(make_list(foralls.begin(), foralls.end()), poly(body),
+                 [](var a, poly p) -> poly {
+                   return forall{a, p};
+                 });
   }
 
   context scope() const {
@@ -398,346 +564,264 @@ struct context {
 };
 
 
-
-
 ////////////////////////////////////////////////////////////////////////////////
-// inference monad
+// inference state
 ////////////////////////////////////////////////////////////////////////////////
 
+// note: the substitution lives in type variables themselves
 struct state {
   context ctx;
-  substitution sub;
   hamt::array<mono> types;
 };
 
-template<class T>
-struct success {
-  using value_type = T;
-  T value;
-  struct state state;
-};
-
-template<class T>
-static success<T> make_success(T value, state s) {
-  return {value, s};
-}
 
+// inference errors, from innermost to outermost typing context
+struct failure {
+  std::vector<std::string> stack;
 
-using call_stack = std::stack<std::string>;
+  failure(std::string what): stack{what} { }
+};
 
-template<class T>
-using result = either<call_stack, success<T>>;
 
-template<class T>
-using monad = std::function<result<T>(state)>;
+// try func, fallback to alt with state and bindings rolled back
+template<class Func, class Alt>
+static auto attempt(state& s, const Func& func, const Alt& alt) -> decltype(func()) {
+  const state saved = s;
 
-template<class M>
-using value = typename std::result_of<M(state)>::type::value_type::value_type;
+  {
+    substitution::transaction tx(substitution::current());
+    try {
+      return func();
+    } catch(failure&) {
+      tx.undo();
+      s = saved;
+    }
+  }
 
-template<class T>
-static auto pure(T value) {
-  return [value](state s) -> result<T> {
-    return make_success(value, s);
-  };
+  return alt();
 }
 
-template<class M, class Func, class T=value<M>>
-static auto bind(M self, Func func) {
-  return [=](state s) {
-    return self(s) >>= [&](const success<T>& self) {
-      return func(self.value)(self.state);
-    };
-  };
-}
 
-template<class M, class Func, class T=value<M>>
-static auto operator>>=(M self, Func func) {
-  return bind(self, func);
-}
+// run func in a nested scope: bindings are kept, context is restored
+template<class Func>
+static auto scope(state& s, const Func& func) -> decltype(func()) {
+  const context outer = s.ctx;
+  s.ctx = outer.scope();
 
+  struct restore {
+    state& s;
+    const context& outer;
+    ~restore() { s.ctx = outer; }
+  } lock{s, outer};
 
-template<class LHS, class RHS, class L=value<LHS>, class R=value<RHS>>
-static auto operator>>(LHS lhs, RHS rhs) {
-  return lhs >>= [=](auto&&) { return rhs; };
+  return func();
 }
 
 
-template<class MA, class Func, class A=value<MA>>
-static auto map(MA self, Func func) {
-  return self >>= [=](A value) {
-    return pure(func(value));
-  };
-}
-
-template<class MA, class Func, class A=value<MA>>
-static auto operator|=(MA self, Func func) {
-  return map(self, func);
+// add typing context to errors raised by func
+template<class Lazy, class Func>
+static auto with_context(const Lazy& lazy, const Func& func) -> decltype(func()) {
+  try {
+    return func();
+  } catch(failure& error) {
+    error.stack.push_back(lazy());
+    throw;
+  }
 }
 
 
-template<class MA, class MB, class A=value<MA>, class B=value<MB>>
-static auto coprod(MA ma, MB mb) {
-  return [=](state s) {
-    if(auto res = ma(s)) {
-      return res;
-    }
-    
-    return mb(s);
-  };
-}
+// occurs check, and lower depth of variables in ty to that of target. returns
+// false when target occurs in ty.
+static bool upgrade(substitution& sub, mono ty, var target) {
+  return match(sub.find(ty),
+               [&](var self) {
+                 if(self == target) return false;
 
+                 if(self->depth > target->depth) {
+                   debug("upgrade:", show(self), "to depth", target->depth);
+                   sub.upgrade(self, target->depth);
+                 }
 
-template<class MA, class MB, class A=value<MA>, class B=value<MB>>
-static auto operator|(MA ma, MB mb) {
-  return coprod(ma, mb);
+                 return true;
+               },
+               [&](app self) {
+                 return upgrade(sub, self.ctor, target) &&
+                   upgrade(sub, self.arg, target);
+               },
+               [](type_constant) { return true; });
 }
 
 
-template<class M, class T=value<M>>
-static monad<list<value<M>>> sequence(list<M> items) {
-  if(!items) {
-    return pure(list<T>{});
-  } else return items->head >>= [=](T head) {
-    return sequence(items->tail) >>= [=](list<T> tail) {
-      return pure(head %= tail);
-    };
-  };
+static void upgrade(mono ty, var target) {
+  substitution& sub = substitution::current();
+  if(!upgrade(sub, ty, target)) {
+    const mono self = sub(ty);
+    const auto repr = label(self.vars());
+    throw failure("type variable " + quote(mono(target).show(repr)) +
+                  " occurs in type " + quote(self.show(repr)));
+  }
 }
 
-////////////////////////////////////////////////////////////////////////////////
 
-template<class T>
-static auto fail(std::string what) {
-  return [what](state) -> result<T> {
-    call_stack res;
-    res.push(what);
-    return res;
-  };
+static void link(var from, mono to) {
+  debug("> link:", show(from), "==", show(to));
+  substitution::current().link(from, to);
 }
 
 
-static auto upgrade(mono ty, var target) {
-  const std::size_t max = target->depth;
-  return [=](state s) -> result<unit> {
-    const auto vars = ty.vars();
-    for(auto v: vars) {
-      if(v == target) {
-        const auto repr = label(vars);
-        return fail<unit>("type variable " + quote(mono(target).show(repr)) +
-                          " occurs in type " + quote(ty.show(repr)))(s);
-      }
-      
-      if(v->depth > max) {
-        const mono target = var(max, v->kind);
-        debug("upgrade:", show(v), "==", show(target));
-        s.sub = s.sub.link(v, target);
-      }
-    }
-    
-    return make_success(unit{}, s);
-  };
-}
-
+static poly find(const state& s, symbol name) {
+  if(auto poly = s.ctx.locals.find(name)) {
+    return *poly;
+  }
 
-static auto link(var from, mono to) {
-  return [=](state s) -> result<unit> {
-    debug("> link:", show(from), "==", show(to));
-    
-    s.sub = s.sub.link(from, to);
-    return make_success(unit{}, s);
-  };
+  throw failure("unbound variable: " + quote(name));
 }
 
-static auto substitute(mono ty) {
-  return [=](state s) -> result<mono> {
-    return make_success(s.sub(ty), s);
-  };
+
+static void decorate(state& s, ast::expr e, mono t) {
+  s.types = s.types.set(e.id(), std::move(t));
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// unification
+////////////////////////////////////////////////////////////////////////////////
 
-template<class M, class T=value<M>>
-static auto scope(M m) {
-  return [m=std::move(m)](state s) -> result<T> {
+static void unify(state& s, mono lhs, mono rhs);
 
-    state inner = s;
-    inner.ctx = s.ctx.scope();
 
-    // update substitution from inner scope, drop context
-    return m(inner) >>= [=](success<T> self) -> result<T> {
-      self.state.ctx = s.ctx;
-      return make_success(self.value, self.state);
-    };
-  };
-}
+// row extension type constructor ::: * -> @ -> @
+static mono ext(symbol name);
 
-static auto def(symbol name, poly p) {
-  return [=](state s) -> result<unit> {
-    s.ctx.def(name, p);         // FIXME return new context?
-    return make_success(unit{}, s);
-  };
-};
 
-static auto generalize(mono ty) {
-  return [=](state s) -> result<poly> {
-    return make_success(s.ctx.generalize(ty), s);
-  };
-}
+static std::string cannot_unify(mono lhs_repr, mono rhs_repr) {
+  substitution& sub = substitution::current();
+  const mono lhs = sub(lhs_repr);
+  const mono rhs = sub(rhs_repr);
 
+  repr_type repr;
+  repr = label(lhs.vars(), std::move(repr));
+  repr = label(rhs.vars(), std::move(repr));
 
-static auto fresh(kind k=term) {
-  return [=](state s) -> result<var> {
-    return make_success(s.ctx.fresh(k), s);
-  };
+  return "cannot unify types " + quote(lhs.show(repr)) +
+    " and " + quote(rhs.show(repr));
 }
 
 
-static auto find(symbol name) {
-  return [=](state s) -> result<poly> {
-    if(auto poly = s.ctx.locals.find(name)) {
-      return make_success(*poly, s);
-    }
-    
-    return fail<poly>("unbound variable: " + quote(name))(s);
-  };
-};
+static app app_match(mono ty) {
+  const mono self = substitution::current().find(ty);
+  if(auto res = self.cast<app>()) return *res;
 
-static auto instantiate(poly p) {
-  return [=](state s) -> result<mono> {
-    return make_success(s.ctx.instantiate(p), s);
-  };
-};
+  throw failure("not a type application");
+}
 
 
-static auto decorate(ast::expr e, mono t) {
-  return [=](state s) -> result<unit> {
-    s.types = s.types.set(e.id(), mono(t));
-    return make_success(unit{}, s);
-  };
+static type_constant type_constant_match(mono ty) {
+  if(auto res = ty.cast<type_constant>()) return *res;
+
+  throw failure("not a type constant");
 }
 
 
-template<class Lazy,
-         class M,
-         class T=value<M>>
-static auto with_context(Lazy lazy, M m) {
-  return [=](state s) {
-    return match(m(s),
-                 [](success<T> self) -> result<T> { return self; },
-                 [=](call_stack error) -> result<T> {
-                   error.push(lazy());
-                   return error;
-                 });
-  };
+// row extension: ext(name)(arg)(tail)
+struct extension {
+  symbol name;
+  mono arg;
+  mono tail;
 };
 
-////////////////////////////////////////////////////////////////////////////////
-// unification
-////////////////////////////////////////////////////////////////////////////////
+static extension row_match(app outer) {
+  const app inner = app_match(outer.ctor);
+  const type_constant ctor = type_constant_match(inner.ctor);
 
-static monad<unit> unify(mono lhs, mono rhs);
-static monad<unit> unify_vars(mono lhs, mono rhs);
+  // TODO check that kind is correct
+  return {ctor->name, inner.arg, outer.arg};
+}
 
-static monad<unit> unify_app_terms(app lhs, app rhs);
-static monad<unit> unify_app_rows(app lhs, app rhs);
 
+// TODO nicer errors
+static void unify_app_rows(state& s, app lhs, app rhs) {
+  const extension lext = row_match(lhs);
+  const extension rext = row_match(rhs);
+
+  if(lext.name == rext.name) {
+    // labels match: unify value types
+    unify(s, lext.arg, rext.arg);
+    unify(s, lext.tail, rext.tail);
+  } else {
+    // labels mismatch: look for labels in each tails
+    const mono ldummy = s.ctx.fresh(row);
+    const mono rdummy = s.ctx.fresh(row);
+
+    unify(s, lext.tail, ext(rext.name)(rext.arg)(rdummy));
+    unify(s, rext.tail, ext(lext.name)(lext.arg)(ldummy));
+    // TODO proceed with tails?
+  }
+}
 
 
-static const auto app_match = [](mono ty, auto cont) {
-  return match(ty,
-               [&](app self) {
-                 return cont(self.ctor, self.arg);
-               },
-               [&](auto) {
-                 return fail<unit>("not a type application");
-               });
-};
+static void unify_app_terms(state& s, app lhs, app rhs) {
+  unify(s, lhs.ctor, rhs.ctor);
+  unify(s, lhs.arg, rhs.arg);
+}
 
-static const auto type_constant_match = [](mono ty, auto cont) {
-  return match(ty,
-               [&](type_constant self) {
-                 return cont(self);
-               },
-               [&](auto) {
-                 return fail<unit>("not a type constant");
-               });
-};
 
+// note: lhs/rhs must be representatives
+static void unify_vars(mono lhs, mono rhs) {
+  assert(lhs.kind() == rhs.kind());
 
-static const auto row_match = [](mono ty, auto cont) {
-  return app_match(ty, [&](mono outer, mono tail) {
-    return app_match(outer, [&](mono ctor, mono arg) {
-      return type_constant_match(ctor, [&](type_constant ctor) {
-        // TODO check that kind is correct
-        return cont(ctor->name, arg, tail);
-      });
-    });      
-  });
-};
+  const auto lvar = lhs.cast<var>();
+  const auto rvar = rhs.cast<var>();
 
-// row extension type constructor ::: * -> @ -> @
-static mono ext(symbol name);
+  // both variables
+  if(lvar && rvar) {
+    if(*lvar == *rvar) return;
 
+    // link deepest variable to the other one
+    if((*lvar)->depth < (*rvar)->depth) {
+      return link(*rvar, *lvar);
+    }
 
-static monad<unit> unify_sub(mono lhs, mono rhs) {
-  return substitute(lhs) >>= [=](mono lhs) {
-    return substitute(rhs) >>= [=](mono rhs) {
-      return unify(lhs, rhs);
-    };
-  };
+    return link(*lvar, *rvar);
+  } else if(lvar) {
+    upgrade(rhs, *lvar);
+    return link(*lvar, rhs);
+  } else if(rvar) {
+    upgrade(lhs, *rvar);
+    return link(*rvar, lhs);
+  }
+
+  throw failure(cannot_unify(lhs, rhs));
 }
 
 
-// TODO nicer errors
-static monad<unit> unify_app_rows(app lhs, app rhs) {
-  return row_match(lhs, [&](symbol lattr, mono lty, mono ltail) -> monad<unit> {
-    return row_match(rhs, [&](symbol rattr, mono rty, mono rtail) -> monad<unit> {
-      if(lattr == rattr) {
-        // labels match: unify value types
-        return unify(lty, rty) >> unify_sub(ltail, rtail);
-      } else {
-        // labels mismatch: look for labels in each tails
-        return fresh(row) >>= [=](mono ldummy) {
-          return fresh(row) >>= [=](mono rdummy) {
-            return unify(ltail, ext(rattr)(rty)(rdummy)) >>
-                   unify_sub(rtail, ext(lattr)(lty)(ldummy));
-            // TODO proceed with tails?
-          };
-        };
-      }        
-    });
-  });
-}
+static void unify(state& s, mono lhs_type, mono rhs_type) {
+  substitution& sub = substitution::current();
+  const mono lhs = sub.find(lhs_type);
+  const mono rhs = sub.find(rhs_type);
 
-// note: lhs/rhs must be fully substituted
-static monad<unit> unify(mono lhs, mono rhs) {
+  // note: ground types are hash-consed, other types are unified structurally
+  if(lhs.id() == rhs.id()) return;
+  
   if(lhs.kind() != rhs.kind()) {
-    repr_type repr;
-    repr = label(lhs.vars(), std::move(repr));
-    repr = label(rhs.vars(), std::move(repr));  
-    
-    return fail<unit>("cannot unify types " + quote(lhs.show(repr)) +
-                      " and " + quote(rhs.show(repr)));
+    throw failure(cannot_unify(lhs, rhs));
   }
 
-  const auto trace = [=](state s) -> result<unit> {
-    debug("unifying:", show(lhs), "==", show(rhs));
-    return make_success(unit{}, s);
-  };
-  
+  debug("unifying:", show(lhs), "==", show(rhs));
+
   const auto kind = lhs.kind();
 
   const auto lapp = lhs.cast<app>();
   const auto rapp = rhs.cast<app>();
-  
+
   // both applications
   if(lapp && rapp) {
     if(kind == row) {
-      return trace >> unify_app_rows(*lapp, *rapp);
+      return unify_app_rows(s, *lapp, *rapp);
     }
 
-    return trace >> unify_app_terms(*lapp, *rapp);
-  }    
+    return unify_app_terms(s, *lapp, *rapp);
+  }
 
   const auto lcst = lhs.cast<type_constant>();
   const auto rcst = rhs.cast<type_constant>();
@@ -745,88 +829,55 @@ static monad<unit> unify(mono lhs, mono rhs) {
   // both constants
   if(lcst && rcst) {
     if(*lcst == *rcst) {
-      return trace >> pure(unit{});
+      return;
     }
   }
-  
+
   // variables
-  return trace >> unify_vars(lhs, rhs);
+  return unify_vars(lhs, rhs);
 }
 
 
-static monad<unit> unify_vars(mono lhs, mono rhs) {
-   assert(lhs.kind() == rhs.kind());
-  
-  const auto lvar = lhs.cast<var>();
-  const auto rvar = rhs.cast<var>();  
-  
-  // both variables
-  if(lvar && rvar) {
-    const var target(std::min((*lvar)->depth,
-                              (*rvar)->depth), lhs.kind());
-    // TODO create target *inside* monad?
-    return link(*lvar, target) >> link(*rvar, target);
-  } else if(lvar) {
-    return link(*lvar, rhs) >> upgrade(rhs, *lvar);
-  } else if(rvar) {
-    return link(*rvar, lhs) >> upgrade(lhs, *rvar);    
-  }
-
-  repr_type repr;
-  repr = label(lhs.vars(), std::move(repr));
-  repr = label(rhs.vars(), std::move(repr));  
-  
-  return fail<unit>("cannot unify types " + quote(lhs.show(repr)) +
-                    " and " + quote(rhs.show(repr)));  
-}
-
+////////////////////////////////////////////////////////////////////////////////
+static mono infer(state& s, ast::expr e);
 
-static monad<unit> unify_app_terms(app lhs, app rhs) {
-  return unify(lhs.ctor, rhs.ctor) >> unify_sub(lhs.arg, rhs.arg);
+static mono infer(state& s, ast::lit self) {
+  return match(self,
+               [](long) { return integer; },
+               [](double) { return number; },
+               [](std::string) { return string; },
+               [](bool) { return boolean; });
 };
 
 
-
-
-////////////////////////////////////////////////////////////////////////////////
-static monad<mono> infer(ast::expr e);
-
-static monad<mono> infer(ast::lit self) {
-  return pure(match(self,
-                    [](long) { return integer; },
-                    [](double) { return number; },
-                    [](std::string) { return string; },
-                    [](bool) { return boolean; }));
+static mono infer(state& s, ast::var self) {
+  return s.ctx.instantiate(find(s, self.name));
 };
 
 
-static monad<mono> infer(ast::var self) {
-  return find(self.name) >>= [](poly p) {
-    return instantiate(p) >>= substitute;
-  };
+// function type: from -> to
+struct arrow {
+  mono from;
+  mono to;
 };
 
-template<class Cont>
-static auto funmatch(mono t, Cont cont) {
-  return fresh() >>= [=](mono from) {
-    return fresh() >>= [=](mono to) {
-      // note: from/to need substitution
-      return unify(from >>= to, t) >> cont(from, to);
-    };
-  };
+static arrow funmatch(state& s, mono t) {
+  // note: from/to need substitution
+  const arrow res = {s.ctx.fresh(), s.ctx.fresh()};
+  unify(s, res.from >>= res.to, t);
+  return res;
 }
 
 
-static monad<mono> check_type(mono type) {
-  // note: type must be fully substituted
-  return (fresh() >>= [=](mono arg) {
-    return unify(ty(arg), type) >> substitute(arg);
-  }) | funmatch(type, [=](mono from, mono to) {
-    return (substitute(from) >>= check_type) >>= [=](mono from) {
-      return (substitute(to) >>= check_type) >>= [=](mono to) {
-        return pure(to);
-      };
-    };
+static mono check_type(state& s, mono type) {
+  return attempt(s, [&] {
+    const mono arg = s.ctx.fresh();
+    unify(s, ty(arg), type);
+    return arg;
+  }, [&] {
+    const arrow self = funmatch(s, type);
+    check_type(s, self.from);
+    return check_type(s, self.to);
   });
 }
 
@@ -839,7 +890,7 @@ static auto map_row(mono row, Func func) -> list<Result> {
                  const app ctor = self.ctor.get<app>();
                  const mono arg = ctor.arg;
                  const symbol name = ctor.ctor.get<type_constant>()->name;
-                 
+
                  return func(name, arg) %= map_row(tail, func);
                },
                [](type_constant self) {
@@ -855,347 +906,263 @@ static auto map_row(mono row, Func func) -> list<Result> {
 };
 
 
-
-//   return infer(self.def) >>= [=](mono def) {
-//     return fresh(row) >>= [=](mono row) {
-//       return unify(def, record(row)) >> substitute(row) >>= [=](mono row) {
-//         return sequence(map_row(row, [](symbol name, mono arg) {
-//           return check_type(arg) |= [=](mono arg) {
-//             return ext(name)(arg);
-//           };
-//         })) |= [](list<mono> ctors) {
-//           const mono def = ty(record(foldr(ctors, empty, [](mono ctor, mono tail) {
-//             return ctor(tail);
-//           })));
-
-//           // TODO we should probably prevent bound type variables
-
-//           // TODO hence we should also accept parametric expressions like
-//           // (type foo (fn (a) (record (bar (list a)))))
-
-//           // TODO 
-          
-//           return def;
-          
-//         };
-//       };
-//     };
-//   };
-// }
-
-
-
-static monad<poly> infer(ast::arg self) {
+static poly infer(state& s, ast::arg self) {
   return match(self,
-               [](symbol self) -> monad<poly> {
-                 return fresh() |= [](var res) -> poly {
-                   return mono(res);
-                 };
-               }, 
-               [](ast::annot self) -> monad<poly> {
-                 return fresh() >>= [=](mono body) {
-                   return scope(fresh(tag) >>= [=](var label) {
-                     const mono annot = box(label)(body);
-                     return infer(self.type) >>= [=](mono reified) {
-                       return check_type(reified) >>= [=](mono type) {
-                         return unify(annot, type) >> substitute(annot) >>=
-                                generalize;
-                       };
-                     };
-                   });
-                 };
+               [&](symbol self) -> poly {
+                 return mono(s.ctx.fresh());
+               },
+               [&](ast::annot self) -> poly {
+                 const mono body = s.ctx.fresh();
+                 return scope(s, [&] {
+                   const mono label = s.ctx.fresh(tag);
+                   const mono annot = box(label)(body);
+                   const mono reified = infer(s, self.type);
+                   const mono type = check_type(s, reified);
+                   unify(s, annot, type);
+                   return s.ctx.generalize(annot);
+                 });
                });
 }
 
 
+template<class Body>
+static mono infer_abs(state& s, ast::arg arg, const Body& body) {
+  const poly from = infer(s, arg);
+  const mono to = scope(s, [&] {
+    s.ctx.def(arg.name(), from);
+    return body();
+  });
 
-static monad<mono> infer_abs(ast::arg arg, monad<mono> body) {
-  return infer(arg) >>= [=](poly from) {
-    return scope(def(arg.name(), from) >> body) >>= [=](mono to) {
-      return instantiate(from) >>= [=](mono from) {
-        return substitute(from >>= to);
-      };
-    };
-  };
+  return s.ctx.instantiate(from) >>= to;
 }
 
-static monad<mono> infer(ast::abs self) {
-  // TODO handle nullary apps  
-  return foldr(self.args, infer(self.body), infer_abs);
-};
 
+template<class Body>
+static mono infer_abs(state& s, list<ast::arg> args, const Body& body) {
+  if(!args) return body();
 
+  return infer_abs(s, args->head, [&] {
+    return infer_abs(s, args->tail, body);
+  });
+}
 
 
+static mono infer(state& s, ast::abs self) {
+  // TODO handle nullary apps
+  return infer_abs(s, self.args, [&] { return infer(s, self.body); });
+};
 
 
-static monad<type_constant> constructor(mono ty) {
-  return match(ty,
-               [](type_constant self) -> monad<type_constant> {
-                 return pure(self);
-               },
+static type_constant constructor(mono ty) {
+  return match(substitution::current().find(ty),
+               [](type_constant self) { return self; },
                [](app self) { return constructor(self.ctor); },
-               [](var self) -> monad<type_constant> {
-                 return fail<type_constant>("type constructor is not a constant");
+               [](var self) -> type_constant {
+                 throw failure("type constructor is not a constant");
                });
 }
 
-static monad<mono> check_annot(mono offered) {
+
+static mono check_annot(state& s, mono offered) {
   // match annotated type
-  return fresh(tag) >>= [=](mono label) {
-    return fresh() >>= [=](mono body) {
-      return ((unify(box(label)(body), offered) >> substitute(label)) >>= generalize)
-        // check whether label is generalized
-        >>= [=](poly label) {
-          return match(label,
-                       [=](forall) -> monad<mono> {
-                         // label is generalizable: either type is used-provided
-                         // or has no sharing through context
-                         return substitute(body);
-                       },
-                       [](mono) -> monad<mono> { 
-                         // type has sharing without type annotation, cannot open
-                         return fail<mono>("cannot open type");
-                       });
-        };
-    };
-  };
+  const mono label = s.ctx.fresh(tag);
+  const mono body = s.ctx.fresh();
+
+  unify(s, box(label)(body), offered);
+
+  // check whether label is generalized
+  return match(s.ctx.generalize(label),
+               [&](forall) -> mono {
+                 // label is generalizable: either type is used-provided or
+                 // has no sharing through context
+                 return body;
+               },
+               [](mono) -> mono {
+                 // type has sharing without type annotation, cannot open
+                 throw failure("cannot open type");
+               });
 };
 
 
 // try to open type
-static monad<mono> open(mono offered) {
-  return check_annot(offered) >>= [=](mono offered) {
-    // TODO find a way to put opening type in box instead
-    return constructor(offered) >>= [=](type_constant ctor) {
-      return instantiate(ctor->open(ctor)) >>= [=](mono open) {
-        return fresh() >>= [=](mono res) {
-          return unify(offered >>= res, open) >> substitute(res);
-        };
-      };
-    };
-  };
+static mono open(state& s, mono offered) {
+  const mono checked = check_annot(s, offered);
+
+  // TODO find a way to put opening type in box instead
+  const type_constant ctor = constructor(checked);
+  const mono opened = s.ctx.instantiate(ctor->open(ctor));
+  const mono res = s.ctx.fresh();
+
+  unify(s, checked >>= res, opened);
+  return res;
 };
 
 
-static monad<unit> subsume(mono requested, mono offered) {
+static void subsume(state& s, mono requested, mono offered) {
   // try standard unification, fallback to opening offered type if possible
-  return unify(requested, offered) | (open(offered) >>= [=](mono opened) {
-    debug("opened", show(offered), "as", show(opened));    
-    return unify(requested, opened);
+  attempt(s, [&] {
+    unify(s, requested, offered);
+  }, [&] {
+    const mono opened = open(s, offered);
+    debug("opened", show(offered), "as", show(opened));
+    unify(s, requested, opened);
   });
 }
 
 
-static monad<mono> infer_app(monad<mono> func, ast::expr arg) {
-  return func >>= [=](mono func) {
-    return infer(arg) >>= [=](mono off) {
-      return substitute(func) >>= [=](mono func) {
-        return funmatch(func, [=](mono req, mono ret) {
-          return substitute(req) >>= [=](mono req) {
-            return subsume(req, off) >> substitute(ret);
-          };
-        });
-      };
-    };
-  };
+static mono infer_app(state& s, mono func, ast::expr arg) {
+  const mono off = infer(s, arg);
+  const arrow self = funmatch(s, func);
+
+  subsume(s, self.from, off);
+  return self.to;
 }
-  
 
 
-static monad<mono> infer(ast::app self) {
-  return foldl(infer(self.func), self.args, infer_app);
+static mono infer(state& s, ast::app self) {
+  return foldl(infer(s, self.func), self.args, [&](mono func, ast::expr arg) {
+    return infer_app(s, func, arg);
+  });
 };
 
 
+// row type for definitions, type-checking values if needed
+static mono infer_defs(state& s, list<ast::def> defs, bool check) {
+  if(!defs) return empty;
 
-static monad<mono> infer_def(ast::def def, monad<mono> tail) {
-  return (infer(def.value) >>= check_type) >>= [=](mono type) {
-    return tail |= [=](mono tail) {
-      return ext(def.name)(type)(tail);
-    };
-  };
+  const mono value = infer(s, defs->head.value);
+  const mono type = check ? check_type(s, value) : value;
+
+  return ext(defs->head.name)(type)(infer_defs(s, defs->tail, check));
 }
 
+
 static mono module(ast::module_type type) {
   switch(type) {
   case ast::STRUCT: return record;
-  case ast::UNION: return sum;    
+  case ast::UNION: return sum;
   }
 }
 
-template<class Init, class Func>
-static Init foldr(mono t, Init init, Func func) {
-  // note: func should substitute `from` type
-  return funmatch(t, [=](mono from, mono to) -> Init {
-    return func(from, foldr(to, init, func));
-  }) | init;
-}
-                    
-
-static monad<mono> make_module(mono sig) {
-  // // infer constructor kind
-  // const monad<list<mono>> init = pure(list<mono>());
-  // return foldr(sig, init, [=](mono head, monad<list<kind>> tail) {
-  //   return (substitute(head) >>= infer_param) >>= [=](mono head) {
-  //     return tail >>= [=](list<kind> tail) {
-  //       return pure(head.kind() >>= tail);
-  //     };
-  //   };
-  // }) >>= [=](list<kind> k) {
-  //   // create constructor and apply it
-  //   const mono ctor = type_constant("module", k);
-  //   const monad<mono> init = pure(ctor);
-    
-  //   return foldr(sig, init, [=](mono head, monad<mono> tail) {
-      
-  // };
+
+static mono make_module(state& s, mono sig) {
+  // TODO infer constructor kind from signature, create constructor and
+  // apply it
+  throw failure("unimplemented: module constructors");
 };
 
 
-static monad<mono> infer(ast::module self) {
-  const monad<mono> init = pure(empty);
-  const monad<mono> defs = foldr(self.defs, init, infer_def) |= [=](mono row) {
-    return ty(module(self.type)(row));
-  };
-  
-  return foldr(self.sig.args, defs, infer_abs) >>= make_module;
+static mono infer(state& s, ast::module self) {
+  const mono sig = infer_abs(s, self.sig.args, [&] {
+    return ty(module(self.type)(infer_defs(s, self.defs, true)));
+  });
+
+  return make_module(s, sig);
 };
 
 
+static mono infer(state& s, ast::cond self) {
+  const mono pred = infer(s, self.pred);
+  unify(s, pred, boolean);
 
-static monad<mono> infer(ast::cond self) {
-  return infer(self.pred) >>= [=](mono pred) {
-    return (unify(pred, boolean) >> infer(self.conseq)) >>= [=](mono conseq) {
-      return infer(self.alt) >>= [=](mono alt) {
-        return unify(conseq, alt) >> substitute(conseq);
-      };
-    };
-  };
+  const mono conseq = infer(s, self.conseq);
+  const mono alt = infer(s, self.alt);
+  unify(s, conseq, alt);
+
+  return conseq;
 }
 
 
-static monad<mono> infer(ast::record self) {
-  const monad<mono> init = pure(empty);
-  return foldr(self.attrs, init,
-               [](ast::def self, monad<mono> tail) -> monad<mono> {
-    return infer(self.value) >>= [=](mono ty) {
-      return tail |= [=](mono rows) -> mono {
-        return ext(self.name)(ty)(rows);
-      };
-    };
-  }) |= [](mono rows) {
-    return record(rows);
-  };
+static mono infer(state& s, ast::record self) {
+  return record(infer_defs(s, self.attrs, false));
 }
 
 
-
-static monad<mono> infer(ast::let self) {
+// mutually recursive definitions: monomorphic while being inferred, then
+// generalized in current scope
+template<class Defs>
+static void infer_rec(state& s, const Defs& defs) {
   // assign fresh vars to defs
-  const auto create_vars = sequence(map(self.defs, [](ast::def) {
-    return fresh();
-  }));
-
-  // push let scope, create vars
-  return scope(create_vars >>= [=](auto vars) {
+  std::vector<var> vars;
+  for(ast::def def: defs) {
+    vars.push_back(s.ctx.fresh());
+  }
 
+  scope(s, [&] {
     // populate defs scope (monomorphic)
-    const auto populate_defs =
-      sequence(zip(self.defs, vars, [](ast::def self, var a) {
-        return def(self.name, mono(a));
-      }));
+    auto it = vars.begin();
+    for(ast::def def: defs) {
+      s.ctx.def(def.name, mono(*it++));
+    }
 
     // infer + unify defs with vars
-    const auto infer_defs =
-      sequence(zip(self.defs, vars, [](ast::def self, var a) {
-        return infer(self.value) >>= [=](mono ty) {
-          return substitute(a) >>= [=](mono a) {
-            // TODO detect useless definitions
-            return unify(a, ty);
-          };
-        };
-      }));
-
-    // generalize vars + populate body scope (polymorphic)
-    const auto populate_body =
-      sequence(zip(self.defs, vars, [](ast::def self, var a) {
-        return substitute(a) >>= [=](mono ty) {
-          return generalize(ty) >>= [=](poly p) {
-            return def(self.name, p);
-          };
-        };
-      }));
-    
-    return scope(populate_defs >> infer_defs) >>
-      populate_body >> infer(self.body);
+    it = vars.begin();
+    for(ast::def def: defs) {
+      // TODO detect useless definitions
+      const mono ty = infer(s, def.value);
+      unify(s, *it++, ty);
+    }
+  });
+
+  // generalize vars + populate scope (polymorphic)
+  auto it = vars.begin();
+  for(ast::def def: defs) {
+    s.ctx.def(def.name, s.ctx.generalize(*it++));
+  }
+}
+
+
+static mono infer(state& s, ast::let self) {
+  // push let scope
+  return scope(s, [&] {
+    infer_rec(s, self.defs);
+    return infer(s, self.body);
   });
 };
 
-static auto infer_choice(mono res) {
-  return [=](ast::choice self, monad<mono> tail) -> monad<mono> {
-    return infer_abs(self.arg, infer(self.value)) >>= [=](mono sig) {
-      return fresh() >>= [=](mono arg) {
-        return substitute(res) >>= [=](mono res) {
-          return unify(arg >>= res, sig) >> substitute(arg) >>= [=](mono arg) {
-            // note: tail still needs substitution
-            return tail |= [=](mono tail) {
-              return ext(self.name)(arg)(tail);
-            };
-          };
-        };
-      };
-    };
-  };
+
+static mono infer_choices(state& s, list<ast::choice> choices, mono res) {
+  if(!choices) return empty;
+
+  const ast::choice& self = choices->head;
+  const mono sig = infer_abs(s, self.arg, [&] { return infer(s, self.value); });
+  const mono arg = s.ctx.fresh();
+
+  unify(s, arg >>= res, sig);
+  return ext(self.name)(arg)(infer_choices(s, choices->tail, res));
 }
 
-static monad<mono> infer(ast::pattern self) {
-  return infer(self.arg) >>= [=](mono arg) {  
-    return fresh() >>= [=](mono res) {
-      const monad<mono> init = pure(empty);
-      return (foldr(self.choices, init, infer_choice(res)) >>= substitute)
-        >>= [=](mono row) {
-          return substitute(arg) >>= [=](mono arg) {
-            return unify(arg, sum(row)) >> substitute(res);
-          };
-        };
-      };
-  };
+
+static mono infer(state& s, ast::pattern self) {
+  const mono arg = infer(s, self.arg);
+  const mono res = s.ctx.fresh();
+  const mono row = infer_choices(s, self.choices, res);
+
+  unify(s, arg, sum(row));
+  return res;
 }
 
-// static monad<mono> infer(ast::open self) {
-//   // attempt to extract ctor info
-//   return infer(self.arg) >>= [=](mono arg) {
-//     return constructor(arg) >>= [=](type_constant ctor) -> monad<mono> {
-
-//       if(!ctor->open) {
-//         // TODO use some default opening scheme instead?
-//         return fail<mono>("type " + quote(arg.show()) + " cannot be opened");
-//       }
-
-//       // instantiate open type and unify with arg
-//       return instantiate(ctor->open(ctor)) >>= [=](mono open) {
-//         return fresh() >>= [=](mono result) {
-//           return unify(arg >>= result, open) >> substitute(result);
-//         };
-//       };
-//     };
-//   };
-// }
 
 // row extension type constructor ::: * -> @ -> @
 static mono ext(symbol name) {
-  static std::map<symbol, type_constant> table;
+  // note: threads look up their own copy first
+  static thread_local std::map<symbol, type_constant> local;
   
-  const auto it = table.find(name);
-  if(it != table.end()) return it->second;
-
-  type_constant result(name, term >>= row >>= row);
+  const auto cached = local.find(name);
+  if(cached != local.end()) return cached->second;
+  
+  static std::map<symbol, type_constant> table;
+  static std::mutex mutex;
 
-  // cache
-  table.emplace(name, result);
+  const std::lock_guard<std::mutex> lock(mutex);
   
-  return result;  
+  auto it = table.find(name);
+  if(it == table.end()) {
+    it = table.emplace(name, type_constant(name, term >>= row >>= row)).first;
+  }
+
+  local.emplace(name, it->second);
+  return it->second;
 }
 
 
@@ -1203,41 +1170,36 @@ static mono ext(symbol name) {
 static poly proj(symbol name) {
   const var a(0ul, term), rho(0ul, row);
   const mono body = record(ext(name)(a)(rho)) >>= a;
-  
+
   return forall{a, forall{rho, body}};
 };
 
 
 
-static monad<mono> infer(ast::attr self) {
-  return infer_app(instantiate(proj(self.name)), self.arg);
+static mono infer(state& s, ast::attr self) {
+  return infer_app(s, s.ctx.instantiate(proj(self.name)), self.arg);
 };
 
+
 template<class T>
-static monad<mono> infer(T) {
-  return fail<mono>("unimplemented: " + std::string(typeid(T).name()));
+static mono infer(state& s, T) {
+  throw failure("unimplemented: " + std::string(typeid(T).name()));
 }
 
 
-monad<mono> infer(ast::expr e) {
-  return with_context([=] { 
+static mono infer(state& s, ast::expr e) {
+  return with_context([&] {
     return "when typing expression " + std::string(e.source->source.first,
                                                    e.source->source.last);
-  },  match(e, [=](auto self) -> monad<mono> {
-      return infer(self) >>= [=](mono result) {
-        return decorate(e, result) >> pure(result);
-      };
-    }));
-}
-
+  }, [&] {
+    const mono result = match(e, [&](auto self) -> mono {
+      return infer(s, self);
+    });
 
-// static monad<mono> infer(ast::expr e) {
-//   return cata(e, [](ast::Expr<monad<mono>> self) -> monad<mono> {
-//       return match(self, [](auto self) {
-//         return infer(self);
-//       });
-//     });
-// }
+    decorate(s, e, result);
+    return result;
+  });
+}
 
 
 
@@ -1312,37 +1274,117 @@ std::shared_ptr<context> make_context() {
 
 
 
+const poly* lookup(const context& ctx, symbol name) {
+  return ctx.locals.find(name);
+}
+
+
+std::shared_ptr<context> extend(const context& ctx,
+                                const std::map<symbol, poly>& defs) {
+  auto res = std::make_shared<context>(ctx);
+  define(*res, defs);
+  return res;
+}
+
+
+void define(context& ctx, const std::map<symbol, poly>& defs) {
+  for(const auto& it: defs) {
+    ctx.def(it.first, it.second);
+  }
+}
+
+
+mono constant(symbol name, struct kind kind) {
+  static const std::map<symbol, mono> builtins = {
+    {"->", func},
+    {"bool", boolean}, {"int", integer}, {"num", number}, {"str", string},
+    {"record", record}, {"sum", sum}, {"empty", empty},
+    {"box", box}, {"list", lst}, {"type", ty},
+  };
+
+  const auto it = builtins.find(name);
+  if(it != builtins.end() && it->second.kind() == kind) {
+    return it->second;
+  }
+
+  // row labels
+  if(kind == (term >>= row >>= row)) {
+    return ext(name);
+  }
+
+  throw std::runtime_error("unknown type constant: " + quote(name));
+}
+
+
+// inference errors, outermost first
+static std::runtime_error report(const failure& error) {
+  std::stringstream ss;
+  for(auto it = error.stack.rbegin(); it != error.stack.rend(); ++it) {
+    if(it != error.stack.rbegin()) {
+      ss << '\n';
+    }
+
+    ss << *it;
+  }
+
+  return std::runtime_error(ss.str());
+}
+
+
+// store substituted expression types
+static void store(const state& s, hamt::array<mono>* types) {
+  if(!types) return;
+
+  substitution& sub = substitution::current();
+  substitution::cache_type cache;
+  s.types.iter([&](std::size_t i, mono t) {
+    *types = types->set(i, sub(t, cache));
+  });
+}
+
+
 poly infer(std::shared_ptr<context> ctx, const ast::expr& e, hamt::array<mono>* types) {
-  substitution sub;
-  state s = {*ctx, sub};
-  
-  const mono ty = match(infer(e)(s),
-                        [=](success<mono> self) {
-                          // update context/types
-                          *ctx = self.state.ctx;
-                          
-                          if(types) {
-                            // store substituted types
-                            self.state.types.iter([&](std::size_t i, mono t) {
-                              *types = types->set(i, self.state.sub(t));
-                            });
-                          }
-                          
-                          return self.value;
-                        },
-                        [](call_stack error) -> mono {
-                          std::stringstream ss;
-                          while(!error.empty()) {
-                            ss << error.top();
-                            error.pop();
-                            if(!error.empty()) {
-                              ss << '\n';
-                            }
-                          }
-                          throw std::runtime_error(ss.str());
-                        });
-  
-  return ctx->generalize(ty);
+  substitution& sub = substitution::current();
+  state s = {*ctx};
+
+  // note: failed inference needs no rollback since the top-level context has
+  // no free type variables
+
+  try {
+    const mono ty = sub(infer(s, e));
+
+    // update context/types
+    *ctx = s.ctx;
+    store(s, types);
+
+    return ctx->generalize(ty);
+  } catch(failure& error) {
+    throw report(error);
+  }
+}
+
+
+std::vector<poly> infer(std::shared_ptr<context> ctx,
+                        const std::vector<ast::def>& defs,
+                        hamt::array<mono>* types) {
+  state s = {*ctx};
+
+  try {
+    infer_rec(s, defs);
+
+    // update context/types
+    *ctx = s.ctx;
+    store(s, types);
+
+    std::vector<poly> res;
+    for(const ast::def& def: defs) {
+      res.push_back(*lookup(*ctx, def.name));
+    }
+    
+    return res;
+  } catch(failure& error) {
+    throw report(error);
+  }
 }
  
 } // namespace type
@@ -10,10 +10,14 @@
 #include "hamt.hpp"
 
 #include <map>
+#include <vector>
 #include <functional>
 
 namespace ast {
 struct expr;
+
+template<class E>
+struct Def;
 }
 
 namespace type {
@@ -67,9 +71,13 @@ struct type_constant_info {
 
 
 
+struct mono;
+
+// note: type variables are union-find nodes, mutated in place during inference
 struct var_info {
-  std::size_t depth;
+  mutable std::size_t depth;
   struct kind kind;
+  mutable std::shared_ptr<const mono> binding = {};
 };
 
 using var = shared<var_info>;
@@ -171,6 +179,24 @@ std::shared_ptr<context> make_context();
 poly infer(std::shared_ptr<context> ctx, const ast::expr&,
            hamt::array<mono>* types=nullptr);
 
+// mutually recursive definitions: ctx is extended with their type schemes
+std::vector<poly> infer(std::shared_ptr<context> ctx,
+                        const std::vector<ast::Def<ast::expr>>& defs,
+                        hamt::array<mono>* types=nullptr);
+
+// type scheme for name in context, if any
+const poly* lookup(const context& ctx, symbol name);
+
+// copy of ctx with additional type schemes
+std::shared_ptr<context> extend(const context& ctx,
+                                const std::map<symbol, poly>& defs);
+
+// add type schemes to ctx
+void define(context& ctx, const std::map<symbol, poly>& defs);
+
+// builtin type constant or row label with given name/kind
+mono constant(symbol name, struct kind kind);
+
 }
 
 
@@ -0,0 +1,387 @@
+#ifndef STACKMAP_HPP
+#define STACKMAP_HPP
+
+#include "vm.hpp"
+#include "as.hpp"
+#include "peephole.hpp"
+
+#include <map>
+#include <set>
+#include <vector>
+#include <stdexcept>
+
+// stack maps for precise closure collection: an abstract interpretation of a
+// listing computes, for each stack slot at each safepoint (calls and makec),
+// whether it holds an integer or a closure.
+namespace stackmap {
+
+using vm::integer;
+
+// slot type lattice
+enum type : unsigned char { NONE = 0, INT = 1, REF = 2, BOTH = INT | REF };
+
+using state = std::vector<unsigned char>;
+
+// safepoint stack maps keyed by code position
+using position_map = std::map<std::size_t, std::vector<bool>>;
+
+
+class analysis {
+  struct insn: peephole::insn {
+    // position and size in linked code
+    std::size_t pos, size;
+  };
+
+  std::vector<insn> source;
+  std::map<as::label, std::size_t> labels;
+
+  // generic opcodes
+  const vm::instr next = vm::next, jmp = vm::jmp, jnz = vm::jnz,
+                  push = vm::push, pop = vm::pop, dup = vm::dup,
+                  load = vm::load, store = vm::store, loadc = vm::loadc,
+                  call = vm::call, callc = vm::callc, makec = vm::makec,
+                  ret = vm::ret;
+
+  // binary operations/comparisons
+  std::set<vm::instr> arith;
+
+  // superinstructions (see peephole.hpp)
+  std::set<vm::instr> loadop, pushop, cjmp;
+
+  template<vm::binary_operation binop>
+  void operation() {
+    arith.insert(vm::op<binop>);
+    loadop.insert(vm::loadop<binop>);
+    pushop.insert(vm::pushop<binop>);
+  }
+
+  template<vm::binary_predicate pred>
+  void comparison() {
+    arith.insert(vm::cmp<pred>);
+    cjmp.insert(vm::cjmp<pred>);
+  }
+
+  struct function {
+    bool closure;
+
+    // argument types, keyed by (negative) frame offset
+    std::map<integer, unsigned char> params;
+
+    // captured types (closures)
+    std::map<integer, unsigned char> captures;
+
+    unsigned char result = NONE;
+  };
+
+  std::map<std::size_t, function> functions;
+
+  // all closures share parameters/result since callc targets are unknown
+  std::map<integer, unsigned char> closure_params;
+  unsigned char closure_result = NONE;
+
+  // slot types before each instruction
+  std::vector<state> states;
+  std::vector<bool> reached;
+
+  bool changed = false;
+
+  void join(unsigned char& dst, unsigned char src) {
+    if((dst | src) == dst) return;
+    dst |= src;
+    changed = true;
+  }
+
+  bool join(std::size_t i, const state& src) {
+    if(!reached[i]) {
+      reached[i] = true;
+      states[i] = src;
+      changed = true;
+      return true;
+    }
+
+    state& dst = states[i];
+    if(dst.size() != src.size()) {
+      throw std::runtime_error("inconsistent stack depth");
+    }
+
+    bool result = false;
+    for(std::size_t k = 0; k < src.size(); ++k) {
+      if((dst[k] | src[k]) != dst[k]) {
+        dst[k] |= src[k];
+        result = true;
+      }
+    }
+
+    changed |= result;
+    return result;
+  }
+
+  std::size_t target(const as::line& addr) const {
+    if(addr.kind != as::line::ADDR) {
+      throw std::runtime_error("expected address operand");
+    }
+
+    const auto it = labels.find(addr.value.addr);
+    if(it == labels.end()) throw std::runtime_error("unknown label");
+    return it->second;
+  }
+
+  static integer literal(const insn& self, std::size_t i) {
+    if(i >= self.args.size() || self.args[i].kind != as::line::DATA) {
+      throw std::runtime_error("expected literal operand");
+    }
+
+    return self.args[i].value.data.value;
+  }
+
+  function& enter(std::size_t entry, bool closure) {
+    const auto it = functions.find(entry);
+    if(it != functions.end()) {
+      if(it->second.closure != closure) {
+        throw std::runtime_error("function used both directly and as closure");
+      }
+
+      return it->second;
+    }
+
+    changed = true;
+
+    function& result = functions[entry];
+    result.closure = closure;
+    return result;
+  }
+
+  unsigned char param(const function& self, integer index) const {
+    if(self.closure && index == -1) return REF;
+
+    const auto& params = self.closure ? closure_params : self.params;
+    const auto it = params.find(index);
+    return it == params.end() ? static_cast<unsigned char>(NONE) :
+      it->second;
+  }
+
+  // propagate slot types through the function starting at entry
+  void analyze(std::size_t entry) {
+    std::vector<bool> visited(source.size());
+    std::vector<std::size_t> todo = {entry};
+    join(entry, {});
+
+    while(todo.size()) {
+      const std::size_t i = todo.back();
+      todo.pop_back();
+      visited[i] = true;
+
+      // note: functions may be added during analysis
+      function& self = functions.at(entry);
+      const insn& code = source[i];
+      const vm::instr op = code.op;
+
+      state s = states[i];
+      const integer d = s.size();
+
+      const auto underflow = [&](integer n) {
+        if(d < n) throw std::runtime_error("stack underflow");
+      };
+
+      const auto succ = [&](std::size_t j, const state& s) {
+        if(j >= source.size()) throw std::runtime_error("falling off code");
+        if(join(j, s) || !visited[j]) todo.push_back(j);
+      };
+
+      if(op == next) {
+        succ(i + 1, s);
+      } else if(op == push) {
+        s.push_back(INT);
+        succ(i + 1, s);
+      } else if(op == pop) {
+        underflow(1);
+        s.pop_back();
+        succ(i + 1, s);
+      } else if(op == dup) {
+        underflow(1);
+        s.push_back(s.back());
+        succ(i + 1, s);
+      } else if(op == load) {
+        const integer index = literal(code, 0);
+        if(index >= d) throw std::runtime_error("load out of frame");
+        s.push_back(index < 0 ? param(self, index) : s[index]);
+        succ(i + 1, s);
+      } else if(op == store) {
+        const integer index = literal(code, 0);
+        underflow(1);
+        if(index < 0 || index >= d - 1) {
+          throw std::runtime_error("store out of frame");
+        }
+
+        s[index] = s.back();
+        s.pop_back();
+        succ(i + 1, s);
+      } else if(op == loadc) {
+        if(!self.closure) throw std::runtime_error("loadc outside closure");
+        s.push_back(self.captures[literal(code, 0)]);
+        succ(i + 1, s);
+      } else if(arith.count(op)) {
+        underflow(2);
+        s.resize(d - 2);
+        s.push_back(INT);
+        succ(i + 1, s);
+      } else if(loadop.count(op)) {
+        s.push_back(INT);
+        succ(i + 1, s);
+      } else if(pushop.count(op)) {
+        underflow(1);
+        s.back() = INT;
+        succ(i + 1, s);
+      } else if(cjmp.count(op)) {
+        underflow(2);
+        s.resize(d - 2);
+        succ(i + 1, s);
+        succ(target(code.args.at(0)), s);
+      } else if(op == jmp) {
+        succ(target(code.args.at(0)), s);
+      } else if(op == jnz) {
+        underflow(1);
+        s.pop_back();
+        succ(i + 1, s);
+        succ(target(code.args.at(0)), s);
+      } else if(op == call) {
+        const integer argc = literal(code, 0);
+        underflow(argc);
+
+        function& callee = enter(target(code.args.at(1)), false);
+        for(integer k = 1; k <= argc; ++k) {
+          join(callee.params[-k], s[d - k]);
+        }
+
+        s.resize(d - argc);
+        s.push_back(callee.result);
+        succ(i + 1, s);
+      } else if(op == callc) {
+        // closure on top, then arguments
+        const integer argc = literal(code, 0);
+        underflow(std::max(argc, integer(1)));
+
+        // note: slot type may still be unknown before fixpoint
+        if(s.back() & INT) throw std::runtime_error("callc on non-closure");
+        for(integer k = 2; k <= argc; ++k) {
+          join(closure_params[-k], s[d - k]);
+        }
+
+        s.resize(d - argc);
+        s.push_back(closure_result);
+        succ(i + 1, s);
+      } else if(op == makec) {
+        const integer cap = literal(code, 1);
+        underflow(cap);
+
+        function& callee = enter(target(code.args.at(2)), true);
+        for(integer k = 0; k < cap; ++k) {
+          join(callee.captures[k], s[d - 1 - k]);
+        }
+
+        s.resize(d - cap);
+        s.push_back(REF);
+        succ(i + 1, s);
+      } else if(op == ret) {
+        underflow(1);
+        join(self.result, s.back());
+        if(self.closure) join(closure_result, s.back());
+      } else {
+        throw std::runtime_error("unsupported instruction");
+      }
+    }
+  }
+
+public:
+  analysis(const std::vector<as::line>& listing) {
+    operation<vm::add>();
+    operation<vm::sub>();
+    operation<vm::mul>();
+    operation<vm::div>();
+    operation<vm::mod>();
+
+    comparison<vm::eq>();
+    comparison<vm::ne>();
+    comparison<vm::le>();
+    comparison<vm::lt>();
+    comparison<vm::ge>();
+    comparison<vm::gt>();
+
+    // decode while keeping track of code positions
+    for(std::size_t pos = 0; pos < listing.size(); ++pos) {
+      const as::line& it = listing[pos];
+      if(it.kind == as::line::INSTR) {
+        insn self;
+        self.op = it.value.instr.op;
+        self.addr = it.value.instr.addr;
+        self.pos = pos;
+        self.size = 1;
+
+        source.push_back(self);
+        if(self.addr) labels.emplace(self.addr, source.size() - 1);
+      } else if(source.empty()) {
+        throw std::runtime_error("operand without instruction");
+      } else {
+        source.back().args.push_back(it);
+        ++source.back().size;
+      }
+    }
+
+    for(insn& it: source) {
+      static_cast<peephole::insn&>(it) = peephole::table::instance().decode(it);
+    }
+
+    states.resize(source.size());
+    reached.resize(source.size());
+  }
+
+  position_map operator()() {
+    if(source.empty()) return {};
+    enter(0, false);
+
+    do {
+      changed = false;
+
+      std::vector<std::size_t> entries;
+      for(const auto& it: functions) entries.push_back(it.first);
+      for(std::size_t entry: entries) analyze(entry);
+    } while(changed);
+
+    position_map result;
+    for(std::size_t i = 0; i < source.size(); ++i) {
+      const insn& self = source[i];
+      if(!reached[i]) continue;
+      if(self.op != call && self.op != callc && self.op != makec) continue;
+
+      std::vector<bool> map;
+      for(unsigned char slot: states[i]) {
+        if(slot == BOTH) throw std::runtime_error("ambiguous stack slot");
+        map.push_back(slot == REF);
+      }
+
+      // safepoint: instruction pointer sits on the last operand
+      result.emplace(self.pos + self.size - 1, std::move(map));
+    }
+
+    return result;
+  }
+};
+
+
+static position_map compute(const std::vector<as::line>& listing) {
+  return analysis(listing)();
+}
+
+// stack maps for linked code
+static vm::stack_map resolve(const position_map& maps, const vm::code* prog) {
+  vm::stack_map result;
+  for(const auto& it: maps) {
+    result.emplace(prog + it.first, it.second);
+  }
+
+  return result;
+}
+
+} // namespace stackmap
+
+#endif
@@ -0,0 +1,384 @@
+#ifndef CPP_STL_HPP
+#define CPP_STL_HPP
+
+#include "mmap.hpp"
+#include "task.hpp"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <algorithm>
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+
+// stl meshes: binary files are mapped and viewed in place, ascii files are
+// parsed
+namespace stl {
+
+#pragma pack(push, 1)
+struct vec3 {
+  float x, y, z;
+};
+
+// binary record, little-endian
+struct triangle {
+  vec3 normal;
+  vec3 vertices[3];
+  std::uint16_t attr;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(vec3) == 12, "size error");
+static_assert(sizeof(triangle) == 50, "size error");
+
+static constexpr std::size_t header_size = 80;
+static constexpr std::size_t offset = header_size + sizeof(std::uint32_t);
+
+namespace detail {
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static constexpr bool swap = true;
+#else
+static constexpr bool swap = false;
+#endif
+
+template<class T>
+static T swapped(T value) {
+  if(!swap) return value;
+
+  char bytes[sizeof(T)];
+  std::memcpy(bytes, &value, sizeof(T));
+  std::reverse(bytes, bytes + sizeof(T));
+  std::memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+static vec3 swapped(vec3 self) {
+  return {swapped(self.x), swapped(self.y), swapped(self.z)};
+}
+
+// between host and file byte order
+static triangle swapped(triangle self) {
+  if(!swap) return self;
+
+  return {swapped(self.normal),
+          {swapped(self.vertices[0]), swapped(self.vertices[1]),
+           swapped(self.vertices[2])},
+          swapped(self.attr)};
+}
+
+
+// ascii stl: whitespace-separated tokens. slow path, no need for speed here.
+class scanner {
+  const char* first;
+  const char* last;
+
+  std::runtime_error error(std::string what) const {
+    return std::runtime_error("stl: " + what + " near: " +
+                              std::string(first, std::min(first + 32, last)));
+  }
+
+public:
+  scanner(const char* first, const char* last): first(first), last(last) { }
+
+  bool done() {
+    while(first != last && std::isspace(*first)) ++first;
+    return first == last;
+  }
+
+  std::string token() {
+    done();
+    const char* start = first;
+    while(first != last && !std::isspace(*first)) ++first;
+    return {start, first};
+  }
+
+  // rest of line
+  std::string line() {
+    while(first != last && (*first == ' ' || *first == '\t')) ++first;
+    const char* start = first;
+    while(first != last && *first != '\n' && *first != '\r') ++first;
+    return {start, first};
+  }
+
+  void expect(const char* keyword) {
+    if(token() != keyword) {
+      throw error(std::string("expected ") + keyword);
+    }
+  }
+
+  float number() {
+    // note: mapped files are not null-terminated
+    const std::string value = token();
+    char* end;
+    const float res = std::strtof(value.c_str(), &end);
+    if(value.empty() || *end) throw error("expected number");
+    return res;
+  }
+
+  vec3 vector() {
+    const float x = number();
+    const float y = number();
+    return {x, y, number()};
+  }
+};
+
+}
+
+
+class file {
+  std::unique_ptr<mapped_file> contents;
+
+  // ascii triangles
+  std::vector<triangle> parsed;
+
+  const triangle* first = nullptr;
+  const triangle* last = nullptr;
+
+  static bool binary(const mapped_file& contents) {
+    if(contents.size() < offset) return false;
+
+    std::uint32_t count;
+    std::memcpy(&count, contents.begin() + header_size, sizeof(count));
+
+    return contents.size() ==
+      offset + std::size_t(detail::swapped(count)) * sizeof(triangle);
+  }
+
+  void parse() {
+    detail::scanner in(contents->begin(), contents->end());
+
+    in.expect("solid");
+    name = in.line();
+
+    while(true) {
+      const std::string keyword = in.token();
+      if(keyword == "endsolid") break;
+      if(keyword != "facet") throw std::runtime_error("stl: expected facet");
+
+      triangle t = {};
+
+      in.expect("normal");
+      t.normal = in.vector();
+
+      in.expect("outer");
+      in.expect("loop");
+      for(vec3& v: t.vertices) {
+        in.expect("vertex");
+        v = in.vector();
+      }
+      in.expect("endloop");
+      in.expect("endfacet");
+
+      parsed.push_back(detail::swapped(t));
+    }
+
+    first = parsed.data();
+    last = first + parsed.size();
+  }
+
+public:
+  // binary header, or ascii solid name
+  std::string name;
+
+  file(std::string filename): contents(new mapped_file(filename)) {
+    if(binary(*contents)) {
+      const char* header = contents->begin();
+      name.assign(header, std::find(header, header + header_size, '\0'));
+
+      // note: packed records, no alignment requirement
+      first = reinterpret_cast<const triangle*>(contents->begin() + offset);
+      last = reinterpret_cast<const triangle*>(contents->end());
+    } else {
+      parse();
+    }
+  }
+
+  // raw records in file byte order (little-endian)
+  const triangle* begin() const { return first; }
+  const triangle* end() const { return last; }
+
+  std::size_t size() const { return last - first; }
+
+  // record in host byte order
+  triangle operator[](std::size_t i) const { return detail::swapped(first[i]); }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// vertex deduplication
+////////////////////////////////////////////////////////////////////////////////
+
+struct indexed {
+  std::vector<vec3> vertices;
+
+  // 3 per triangle
+  std::vector<std::uint32_t> indices;
+};
+
+
+namespace detail {
+
+// bitwise position key, with signed zeros identified
+struct key {
+  std::uint32_t bits[3];
+
+  key(vec3 v) {
+    const float coords[] = {v.x, v.y, v.z};
+    for(std::size_t i = 0; i < 3; ++i) {
+      const float value = coords[i] == 0 ? 0.0f : coords[i];
+      std::memcpy(&bits[i], &value, sizeof(float));
+    }
+  }
+
+  bool operator==(const key& other) const {
+    return std::equal(bits, bits + 3, other.bits);
+  }
+
+  struct hash {
+    std::size_t operator()(const key& self) const {
+      std::uint64_t h = 0xcbf29ce484222325ull;
+      for(std::uint32_t b: self.bits) {
+        h = (h ^ b) * 0x100000001b3ull;
+      }
+
+      return h ^ (h >> 29);
+    }
+  };
+};
+
+}
+
+
+// deduplicate vertices with identical positions. corners are partitioned by
+// hash into a fixed number of shards so that the result does not depend on
+// the number of threads, then shards are deduplicated in parallel.
+static indexed index(const file& self, pool& pool) {
+  static constexpr std::size_t shards = 64;
+
+  const std::size_t corners = 3 * self.size();
+  if(corners / 3 >= std::uint32_t(-1) / 3) {
+    throw std::runtime_error("stl: too many triangles");
+  }
+
+  const auto position = [&](std::size_t i) {
+    return detail::swapped(self.begin()[i / 3].vertices[i % 3]);
+  };
+
+  const auto shard = [](const detail::key& k) {
+    return detail::key::hash()(k) % shards;
+  };
+
+  // shard sizes per chunk of corners
+  const std::size_t chunks = std::max<std::size_t>(pool.size(), 1);
+  const auto chunk = [&](std::size_t i) { return corners * i / chunks; };
+
+  std::vector<std::size_t> counts(chunks * shards + 1);
+  pool.split(std::size_t(0), chunks, [&](std::size_t c) {
+    for(std::size_t i = chunk(c), n = chunk(c + 1); i < n; ++i) {
+      ++counts[1 + c * shards + shard(position(i))];
+    }
+  }).get();
+
+  // shard-major prefix sums: shard corners are contiguous, in corner order
+  std::vector<std::size_t> starts(chunks * shards);
+  std::vector<std::size_t> bounds(shards + 1);
+
+  std::size_t total = 0;
+  for(std::size_t s = 0; s < shards; ++s) {
+    bounds[s] = total;
+    for(std::size_t c = 0; c < chunks; ++c) {
+      starts[c * shards + s] = total;
+      total += counts[1 + c * shards + s];
+    }
+  }
+  bounds[shards] = total;
+
+  std::vector<std::uint32_t> sorted(corners);
+  pool.split(std::size_t(0), chunks, [&](std::size_t c) {
+    std::size_t* at = starts.data() + c * shards;
+    for(std::size_t i = chunk(c), n = chunk(c + 1); i < n; ++i) {
+      sorted[at[shard(position(i))]++] = i;
+    }
+  }).get();
+
+  // deduplicate shards, numbering vertices locally
+  indexed res;
+  res.indices.resize(corners);
+
+  std::vector<std::vector<vec3>> unique(shards);
+  pool.split(std::size_t(0), shards, [&](std::size_t s) {
+    std::unordered_map<detail::key, std::uint32_t, detail::key::hash> table;
+
+    for(std::size_t j = bounds[s]; j < bounds[s + 1]; ++j) {
+      const std::uint32_t i = sorted[j];
+      const vec3 p = position(i);
+
+      const auto it = table.emplace(p, unique[s].size());
+      if(it.second) unique[s].push_back(p);
+
+      res.indices[i] = it.first->second;
+    }
+  }).get();
+
+  // global numbering
+  std::vector<std::size_t> offsets(shards + 1);
+  for(std::size_t s = 0; s < shards; ++s) {
+    offsets[s + 1] = offsets[s] + unique[s].size();
+  }
+
+  res.vertices.resize(offsets[shards]);
+  pool.split(std::size_t(0), shards, [&](std::size_t s) {
+    std::copy(unique[s].begin(), unique[s].end(),
+              res.vertices.begin() + offsets[s]);
+
+    for(std::size_t j = bounds[s]; j < bounds[s + 1]; ++j) {
+      res.indices[sorted[j]] += offsets[s];
+    }
+  }).get();
+
+  return res;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// writer
+////////////////////////////////////////////////////////////////////////////////
+
+// binary stl from host-order triangles, as a single write
+template<class Iterator>
+static void write(std::string filename, std::string name,
+                  Iterator first, Iterator last) {
+  const std::size_t count = std::distance(first, last);
+  if(count > std::uint32_t(-1)) {
+    throw std::runtime_error("stl: too many triangles");
+  }
+
+  std::vector<char> buffer(offset + count * sizeof(triangle));
+
+  std::memcpy(buffer.data(), name.data(), std::min(name.size(), header_size));
+
+  const std::uint32_t size = detail::swapped(std::uint32_t(count));
+  std::memcpy(buffer.data() + header_size, &size, sizeof(size));
+
+  char* out = buffer.data() + offset;
+  for(Iterator it = first; it != last; ++it, out += sizeof(triangle)) {
+    const triangle t = detail::swapped(triangle(*it));
+    std::memcpy(out, &t, sizeof(triangle));
+  }
+
+  std::ofstream file(filename, std::ios::binary);
+  if(!file.write(buffer.data(), buffer.size())) {
+    throw std::runtime_error("stl: cannot write " + filename);
+  }
+}
+
+}
+
+#endif
@@ -1,31 +1,219 @@
 #ifndef SYMBOL_HPP
 #define SYMBOL_HPP
 
-#include <set>
 #include <string>
 #include <ostream>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+
+// concurrent intern table: open addressing over immutable entries, with
+// lock-free lookup/insertion. entry storage comes from thread-local arenas and
+// is never released. growth is serialized: the table being migrated has its
+// empty slots marked as moved, so that late insertions retry in the new one.
+class symbol_table {
+public:
+  struct entry {
+    std::size_t hash;
+    std::size_t size;
+    char data[1];
+  };
+
+private:
+  struct table {
+    const std::size_t capacity;
+    std::unique_ptr<std::atomic<const entry*>[]> slots;
+
+    table(std::size_t capacity):
+      capacity(capacity),
+      slots(new std::atomic<const entry*>[capacity]) {
+      for(std::size_t i = 0; i < capacity; ++i) slots[i] = nullptr;
+    }
+  };
+
+  static const entry* moved() {
+    static const entry sentinel = {};
+    return &sentinel;
+  }
+
+  std::atomic<table*> current;
+  std::atomic<std::size_t> count;
+
+  // serializes growth, retired tables are kept for concurrent readers
+  std::mutex mutex;
+  std::vector<std::unique_ptr<table>> tables;
+
+  // thread-local bump allocation of entries
+  class arena {
+    static constexpr std::size_t chunk = 1 << 16;
+    char* first = nullptr;
+    char* last = nullptr;
+    char* prev = nullptr;
+
+  public:
+    char* allocate(std::size_t size) {
+      size = (size + alignof(entry) - 1) & ~(alignof(entry) - 1);
+      if(std::size_t(last - first) < size) {
+        // note: chunks are never released
+        const std::size_t length = std::max(size, chunk);
+        first = static_cast<char*>(::operator new(length));
+        last = first + length;
+      }
+
+      prev = first;
+      first += size;
+      return prev;
+    }
+
+    // release last allocation
+    void rollback(const void* ptr) {
+      if(ptr == prev) first = prev;
+    }
+  };
+
+  static arena& local() {
+    static thread_local arena instance;
+    return instance;
+  }
+
+  // fnv-1a
+  static std::size_t digest(const char* data, std::size_t size) {
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    for(std::size_t i = 0; i < size; ++i) {
+      h = (h ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ull;
+    }
+
+    return h;
+  }
+
+  static bool equal(const entry* e, std::size_t hash, const char* data,
+                    std::size_t size) {
+    return e->hash == hash && e->size == size &&
+      std::memcmp(e->data, data, size) == 0;
+  }
+
+  symbol_table(): current(nullptr), count(0) {
+    tables.emplace_back(new table(1 << 10));
+    current = tables.back().get();
+  }
+
+  // copy entries to a table twice as large, then publish it
+  void grow(table* old) {
+    const std::lock_guard<std::mutex> lock(mutex);
+    if(current != old) return;
+
+    std::unique_ptr<table> res(new table(2 * old->capacity));
+    for(std::size_t i = 0; i < old->capacity; ++i) {
+      const entry* e = nullptr;
+      if(old->slots[i].compare_exchange_strong(e, moved())) continue;
+
+      std::size_t j = e->hash & (res->capacity - 1);
+      while(res->slots[j].load(std::memory_order_relaxed)) {
+        j = (j + 1) & (res->capacity - 1);
+      }
+
+      res->slots[j].store(e, std::memory_order_relaxed);
+    }
+
+    current = res.get();
+    tables.emplace_back(std::move(res));
+  }
+
+  // wait for migration to complete
+  void wait() {
+    const std::lock_guard<std::mutex> lock(mutex);
+  }
+
+public:
+  static symbol_table& instance() {
+    static symbol_table instance;
+    return instance;
+  }
+
+  const entry* intern(const char* data, std::size_t size) {
+    const std::size_t hash = digest(data, size);
+    entry* created = nullptr;
+
+    while(true) {
+      table* t = current;
+      const std::size_t mask = t->capacity - 1;
+
+      std::size_t i = hash & mask;
+      for(std::size_t probes = 0; probes < t->capacity; ++probes) {
+        const entry* e = t->slots[i].load(std::memory_order_acquire);
+        if(e == moved()) break;
+
+        if(!e) {
+          if(!created) {
+            created = reinterpret_cast<entry*>(
+              local().allocate(offsetof(entry, data) + size + 1));
+            created->hash = hash;
+            created->size = size;
+            std::memcpy(created->data, data, size);
+            created->data[size] = 0;
+          }
+
+          if(t->slots[i].compare_exchange_strong(e, created,
+                                                 std::memory_order_acq_rel)) {
+            if(2 * ++count > t->capacity) grow(t);
+            return created;
+          }
+
+          // lost a race: e is the new slot value
+          if(e == moved()) break;
+        }
+
+        if(equal(e, hash, data, size)) {
+          if(created) local().rollback(created);
+          return e;
+        }
+
+        i = (i + 1) & mask;
+      }
+
+      // table is being migrated
+      wait();
+    }
+  }
+};
+
 
 struct symbol {
   const char* repr;
-  symbol(const char* repr): symbol(std::string(repr)) { }
-  
-  explicit symbol(std::string repr) {
-    static std::set<std::string> table;
-    this->repr = table.emplace(repr).first->c_str();
-  }
+
+  symbol(const char* repr): symbol(repr, std::strlen(repr)) { }
+
+  explicit symbol(const std::string& repr): symbol(repr.data(), repr.size()) { }
+
+  symbol(const char* data, std::size_t size):
+    repr(symbol_table::instance().intern(data, size)->data) { }
+
+  // precomputed hash
+  std::size_t hash() const { return info()->hash; }
+  std::size_t size() const { return info()->size; }
 
   friend std::ostream& operator<<(std::ostream& out, symbol self) {
-    return out << self.repr;
+    return out.write(self.repr, self.size());
   }
 
   bool operator<(symbol other) const { return repr < other.repr; }
   bool operator==(symbol other) const { return repr == other.repr; }
 
   static symbol unique(const char* prefix) {
-    static std::size_t counter = 0;
+    static std::atomic<std::size_t> counter(0);
     return symbol(prefix + std::to_string(counter++));
   };
-  
+
+private:
+  const symbol_table::entry* info() const {
+    return reinterpret_cast<const symbol_table::entry*>(
+      repr - offsetof(symbol_table::entry, data));
+  }
 };
 
 #endif
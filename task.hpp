@@ -65,7 +65,8 @@ public:
   };
 
 
-  bool try_push(task_type task) {
+  // note: task is only moved from on success
+  bool try_push(task_type& task) {
     {
       const auto lock = this->try_lock();
       if(!lock) return false;
@@ -106,7 +107,8 @@ class pool {
       
       // try stealing work from someone else's queue (starting from our own)
       // instead of waiting for work
-      for(std::size_t j = 0, n = size(); j < n; ++j) {
+      // note: threads may still be starting, queues are not
+      for(std::size_t j = 0, n = queues.size(); j < n; ++j) {
         if(queues[(i + j) % n].try_pop(task)) break;
       }
 
@@ -154,7 +156,7 @@ public:
 
     // try pushing on a queue that is not locked to avoid contention
     for(std::size_t i = 0, n = factor * size(); i < n; ++i) {
-      if(queues[(next + i) % size()].try_push(std::move(task))) {
+      if(queues[(next + i) % size()].try_push(task)) {
         return;
       }
     }
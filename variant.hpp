@@ -81,6 +81,7 @@ public:
 
     std::size_t type() const { return storage->index; }
     std::size_t id() const { return std::size_t(storage.get()); }
+    long use_count() const { return storage.use_count(); }
 };
 
 
@@ -1,5 +1,7 @@
 #include "vm.hpp"
 #include "as.hpp"
+#include "peephole.hpp"
+#include "timer.hpp"
 
 #include <vector>
 #include <set>
@@ -7,18 +9,74 @@
 
 #include <iostream>
 
+static as::line lit(vm::integer value) { return vm::word(value); }
+
+static std::vector<as::line> fib(vm::integer n) {
+  const as::label fib = as::make_label("fib");
+  const as::label base = as::make_label("base");
+
+  return {
+    // main
+    vm::push, lit(n),
+    vm::call, lit(1), fib,
+    vm::ret,
+
+    // fib
+    {fib, vm::load}, lit(-1),
+    vm::push, lit(2),
+    vm::cmp<vm::lt>,
+    vm::jnz, base,
+
+    vm::next,
+    vm::push, lit(1),
+    vm::load, lit(-1),
+    vm::op<vm::sub>,
+    vm::call, lit(1), fib,
+
+    vm::push, lit(2),
+    vm::load, lit(-1),
+    vm::op<vm::sub>,
+    vm::call, lit(1), fib,
+
+    vm::op<vm::add>,
+    vm::ret,
+
+    {base, vm::load}, lit(-1),
+    vm::ret,
+  };
+}
 
-extern std::vector<as::line> fib;
 
 int main(int, char**) {
   static constexpr std::size_t size = 1024;
   static vm::word stack[size];
 
-  const auto prog = as::link(fib);
-  std::cout << vm::eval(prog.data(), stack).value << std::endl;
-  
+  // profile a small run
+  vm::profile profile;
+  {
+    const auto prog = as::link(fib(10));
+    const vm::profile::scope lock(profile);
+    vm::eval(prog.data(), stack);
+  }
+
+  peephole::optimizer opt({&profile});
+  const auto listing = fib(32);
+  const auto optimized = opt(listing);
+
+  std::clog << "removed: " << opt.info.removed
+            << ", fused: " << opt.info.fused
+            << ", specialized: " << opt.info.specialized << std::endl;
+
+  for(const auto& it: {listing, optimized}) {
+    const auto prog = as::link(it);
+    vm::integer result;
+    const double duration = with_time([&] {
+      result = vm::eval(prog.data(), stack).value;
+    });
+
+    std::cout << "size: " << prog.size() << ", result: " << result
+              << ", time: " << duration << std::endl;
+  }
+
   return 0;
 }
- 
- 
- 
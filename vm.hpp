@@ -5,6 +5,14 @@
 #include <cassert>
 
 #include <iostream>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <new>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
 
 namespace vm {
 
@@ -40,6 +48,9 @@ struct frame {
   word* fp;
   word* sp;
 
+  // calling frame (for stack walking)
+  const frame* caller;
+
   friend std::ostream& operator<<(std::ostream& out, const frame& self) {
     for(const word* it = self.fp; it != self.sp; ++it) {
       out << it - self.fp << "\t" << it->value << '\n';
@@ -114,8 +125,104 @@ static integer mod(integer lhs, integer rhs) { return lhs % rhs; }
   
   
 
+// optional instruction (pair) frequency profile, recorded by run when installed
+struct profile {
+  using pair_type = std::pair<instr, instr>;
+  std::map<pair_type, std::size_t> pairs;
+  std::map<instr, std::size_t> counts;
+
+  // backward jump targets (loop headers) and call targets
+  std::map<const code*, std::size_t> loops;
+  std::map<const code*, std::size_t> calls;
+
+  // currently installed profile (if any)
+  static profile*& current() {
+    static profile* instance = nullptr;
+    return instance;
+  }
+
+  std::size_t count(instr first, instr second) const {
+    const auto it = pairs.find({first, second});
+    if(it == pairs.end()) return 0;
+    return it->second;
+  }
+
+  void run(frame* callee) {
+    ++calls[callee->ip];
+
+    instr prev = nullptr;
+    while(const instr op = callee->ip->op) {
+      if(prev) ++pairs[{prev, op}];
+      ++counts[op];
+      prev = op;
+
+      const code* ip = callee->ip;
+      (*op)(callee);
+      if(callee->ip <= ip) ++loops[callee->ip];
+    }
+  }
+
+  // install profile for the current scope
+  struct scope {
+    profile* const prev;
+    scope(profile& self): prev(current()) { current() = &self; }
+    ~scope() { current() = prev; }
+  };
+};
+
+
+// thrown by calls exceeding the installed limits
+struct overflow: std::runtime_error {
+  overflow(): std::runtime_error("vm stack overflow") { }
+};
+
+
+// optional call limits, checked by calls when installed: calls must leave
+// enough stack for their frames, and recurse on the native stack so their
+// depth is bounded too. note: calls from jit code are not checked
+struct limits {
+  // last valid stack pointer at calls
+  const word* end;
+
+  // remaining call depth
+  std::size_t depth;
+
+  // currently installed limits (if any)
+  static limits*& current() {
+    static limits* instance = nullptr;
+    return instance;
+  }
+
+  // install limits for the current scope
+  struct scope {
+    limits* const prev;
+    scope(limits& self): prev(current()) { current() = &self; }
+    ~scope() { current() = prev; }
+  };
+
+  // check a call from stack pointer sp for its duration
+  struct guard {
+    limits* const self;
+
+    guard(const word* sp): self(current()) {
+      if(!self) return;
+      if(sp > self->end || !self->depth) throw overflow();
+      --self->depth;
+    }
+
+    ~guard() {
+      if(self) ++self->depth;
+    }
+  };
+};
+
+
 // run []
 static void run(frame* callee) {
+  if(profile* prof = profile::current()) {
+    return prof->run(callee);
+  }
+
   while(callee->ip->op) {
     (*callee->ip->op)(callee);
   }
@@ -124,9 +231,12 @@ static void run(frame* callee) {
 
 static void call(frame* caller, std::size_t argc) {
   const code* addr = fetch_addr(caller);
-  frame callee{addr, caller->sp, caller->sp};
+  frame callee{addr, caller->sp, caller->sp, caller};
   
-  run(&callee);
+  {
+    const limits::guard guard(caller->sp);
+    run(&callee);
+  }
   
   // replace args with result
   caller->sp[-argc] = callee.sp[-1];
@@ -185,13 +295,56 @@ static void load(frame* caller) {
   load(caller, index);
 }
 
+
+// store [offset]
+static void store(frame* caller) {
+  const integer index = fetch_lit(caller);
+  caller->fp[index] = *(--caller->sp);
+  next(caller);
+}
   
 static const instr ret = {0};
 
 
+////////////////////////////////////////////////////////////////////////////////
+// superinstructions (see peephole.hpp)
+
+// loadop [first, second]: load [first]; load [second]; op<binop>
+template<binary_operation binop>
+static void loadop(frame* caller) {
+  const integer first = fetch_lit(caller);
+  const integer second = fetch_lit(caller);
+
+  *caller->sp++ = binop(caller->fp[second].value, caller->fp[first].value);
+  next(caller);
+}
+
+// pushop [word]: push [word]; op<binop>
+template<binary_operation binop>
+static void pushop(frame* caller) {
+  const integer lhs = fetch_lit(caller);
+  caller->sp[-1] = binop(lhs, caller->sp[-1].value);
+  next(caller);
+}
+
+// cjmp [offset]: cmp<pred>; jnz [offset]
+template<binary_predicate pred>
+static void cjmp(frame* caller) {
+  const auto rhs = (--caller->sp)->value;
+  const auto lhs = (--caller->sp)->value;
+
+  if(pred(lhs, rhs)) {
+    jmp(caller);
+  } else {
+    next(caller);
+    next(caller);
+  }
+}
+
+
 // toplevel eval
 static word eval(const code* prog, word* stack) {
-  frame init{prog, stack, stack};
+  frame init{prog, stack, stack, nullptr};
   run(&init);
   return stack[0];
 }
@@ -204,48 +357,286 @@ static void debug(frame* caller) {
 
 ////////////////////////////////////////////////////////////////////////////////  
 // closure business
-struct gc {
-  gc** prev;
-  gc* next;
-  
-  static gc* first;
-  
-  gc(): prev(&first), next(first) {
-    first->prev = &next;
-    first = this;
-  }
-  
-  virtual ~gc() {
-    next->prev = prev;      
-    *prev = next;
-  }
 
-};
-  
-struct closure: gc {
+// closures store their captured words inline, right after the header
+struct closure {
   const code* impl;
-  const std::size_t argc;
-  const word* data;
+  std::uint32_t argc;
+  std::uint16_t cap;
+
+  // space/mark flags
+  std::uint8_t old;
+  std::uint8_t marked;
+
+  // bit i is set when capture i holds a closure
+  std::uint64_t refs;
+  static constexpr std::size_t max_cap = 64;
+
+  // forwarding pointer during nursery evacuation
+  closure* forward;
 
-  closure(const code* impl,
-          std::size_t argc,          
-          const word* data):
+  closure(const code* impl, std::size_t argc, std::size_t cap):
     impl(impl),
     argc(argc),
-    data(data) { }
-  
-  ~closure() {
-    delete [] data;
+    cap(cap),
+    old(false),
+    marked(false),
+    refs(0),
+    forward(nullptr) { }
+
+  word* data() { return reinterpret_cast<word*>(this + 1); }
+  const word* data() const { return reinterpret_cast<const word*>(this + 1); }
+
+  static std::size_t size(std::size_t cap) {
+    return sizeof(closure) + cap * sizeof(word);
+  }
+
+  // unmanaged allocation: never freed, so memory grows with every closure
+  // made outside of a heap scope (e.g. by backends without stack maps).
+  static closure* make(const code* impl, std::size_t argc, std::size_t cap) {
+    if(cap > max_cap) throw std::runtime_error("closure: too many captures");
+    return new (::operator new(size(cap))) closure(impl, argc, cap);
   }
 };
 
+static_assert(sizeof(closure) % sizeof(word) == 0, "closure alignment");
+
+
+// slots holding closures at each safepoint (call sites and makec), keyed by
+// instruction pointer during the safepoint. see stackmap.hpp.
+using stack_map = std::unordered_map<const code*, std::vector<bool>>;
+
+
+// generational closure heap: closures are bump-allocated in a nursery, whose
+// survivors are promoted (copied) to an old space on minor collections. roots
+// are found precisely by walking frames and using stack maps. since closures
+// are immutable, old closures never point to young ones and no remembered set
+// is needed.
+class heap {
+  const stack_map& maps;
+
+  std::unique_ptr<word[]> nursery;
+  char* const start;
+  char* const end;
+  char* top;
+
+  std::vector<closure*> old;
+  std::size_t old_bytes = 0;
+  std::size_t old_limit;
+
+  // promoted closures whose captures remain to be scanned
+  std::vector<closure*> scan;
+
+  // iterate over root slots holding closures
+  template<class Func>
+  void roots(const frame* self, Func func) const {
+    for(const frame* it = self; it; it = it->caller) {
+      const auto map = maps.find(it->ip);
+      if(map == maps.end()) throw std::runtime_error("missing stack map");
+
+      const std::size_t depth = it->sp - it->fp;
+      assert(map->second.size() >= depth);
+
+      for(std::size_t i = 0; i < depth; ++i) {
+        if(map->second[i]) func(it->fp[i]);
+      }
+    }
+  }
+
+  template<class Func>
+  static void captures(closure* self, Func func) {
+    for(std::size_t i = 0; i < self->cap; ++i) {
+      if(self->refs & (std::uint64_t(1) << i)) func(self->data()[i]);
+    }
+  }
+
+  bool young(const closure* self) const {
+    const char* ptr = reinterpret_cast<const char*>(self);
+    return ptr >= start && ptr < end;
+  }
+
+  closure* promote(const closure* self) {
+    const std::size_t size = closure::size(self->cap);
+
+    closure* result = static_cast<closure*>(::operator new(size));
+    std::memcpy(static_cast<void*>(result), self, size);
+    result->old = true;
+
+    old.push_back(result);
+    old_bytes += size;
+    ++info.promoted;
+
+    return result;
+  }
+
+  void evacuate(word& ref) {
+    closure* self = const_cast<closure*>(ref.func);
+    if(!self || !young(self)) return;
+
+    if(!self->forward) {
+      self->forward = promote(self);
+      scan.push_back(self->forward);
+    }
+
+    ref.func = self->forward;
+  }
+
+  closure* allocate_old(std::size_t size) {
+    closure* result = static_cast<closure*>(::operator new(size));
+    old.push_back(result);
+    old_bytes += size;
+    return result;
+  }
+
+public:
+  struct stats {
+    std::size_t allocated = 0;
+    std::size_t promoted = 0;
+    std::size_t minor = 0;
+    std::size_t major = 0;
+  } info;
+
+  heap(const stack_map& maps, std::size_t nursery_size = 1 << 20,
+       std::size_t old_limit = 1 << 22):
+    maps(maps),
+    nursery(new word[nursery_size / sizeof(word)]),
+    start(reinterpret_cast<char*>(nursery.get())),
+    end(start + nursery_size / sizeof(word) * sizeof(word)),
+    top(start),
+    old_limit(old_limit) { }
+
+  heap(const heap&) = delete;
+
+  ~heap() {
+    for(closure* it: old) ::operator delete(it);
+  }
+
+  // currently installed heap (if any)
+  static heap*& current() {
+    static heap* instance = nullptr;
+    return instance;
+  }
+
+  // install heap for the current scope
+  struct scope {
+    heap* const prev;
+    scope(heap& self): prev(current()) { current() = &self; }
+    ~scope() { current() = prev; }
+  };
+
+  // evacuate live nursery closures to old space
+  void minor(const frame* self) {
+    ++info.minor;
+
+    roots(self, [&](word& ref) { evacuate(ref); });
+    while(scan.size()) {
+      closure* it = scan.back();
+      scan.pop_back();
+      captures(it, [&](word& ref) { evacuate(ref); });
+    }
+
+    top = start;
+
+    if(old_bytes > old_limit) {
+      major(self);
+      old_limit = std::max(old_limit, 2 * old_bytes);
+    }
+  }
+
+  // full collection
+  void collect(const frame* self) {
+    minor(self);
+    major(self);
+  }
+
+private:
+  // mark & sweep old space. nursery must be empty.
+  void major(const frame* self) {
+    ++info.major;
+
+    // note: unmanaged closures (see closure::make) are traversed too, but
+    // only old space is swept: their marks are reset separately
+    std::vector<closure*> stack, unmanaged;
+    const auto mark = [&](word& ref) {
+      closure* it = const_cast<closure*>(ref.func);
+      if(!it || it->marked) return;
+      it->marked = true;
+      stack.push_back(it);
+
+      // note: the nursery is empty, so closures outside old space are unmanaged
+      if(!it->old) unmanaged.push_back(it);
+    };
+
+    roots(self, mark);
+    while(stack.size()) {
+      closure* it = stack.back();
+      stack.pop_back();
+      captures(it, mark);
+    }
+
+    old.erase(std::remove_if(old.begin(), old.end(), [&](closure* it) {
+      if(it->marked) {
+        it->marked = false;
+        return false;
+      }
+
+      old_bytes -= closure::size(it->cap);
+      ::operator delete(it);
+      return true;
+    }), old.end());
+
+    for(closure* it: unmanaged) it->marked = false;
+  }
+
+public:
+  // allocate a closure capturing cap words from the top of the caller stack.
+  // captures are filled by the caller after allocation, since a collection
+  // may update the stack.
+  closure* allocate(frame* caller, const code* impl, std::size_t argc,
+                    std::size_t cap) {
+    if(cap > closure::max_cap) {
+      throw std::runtime_error("closure: too many captures");
+    }
+
+    const auto map = maps.find(caller->ip);
+    if(map == maps.end()) throw std::runtime_error("missing stack map");
+
+    const std::size_t size = closure::size(cap);
+    ++info.allocated;
+
+    void* ptr;
+    if(size > std::size_t(end - start) / 4) {
+      // large closures go straight to old space, whose closures must not point
+      // to young ones
+      minor(caller);
+      ptr = allocate_old(size);
+    } else {
+      if(top + size > end) minor(caller);
+      ptr = top;
+      top += size;
+    }
+
+    closure* result = new (ptr) closure(impl, argc, cap);
+    result->old = !young(result);
+
+    const std::size_t depth = caller->sp - caller->fp;
+    for(std::size_t i = 0; i < cap; ++i) {
+      if(map->second[depth - 1 - i]) result->refs |= std::uint64_t(1) << i;
+    }
+
+    return result;
+  }
+};
 
 
 static void callc(frame* caller, std::size_t argc) {
   const closure* func = caller->sp[-1].func;
-  frame callee{func->impl, caller->sp, caller->sp};
+  frame callee{func->impl, caller->sp, caller->sp, caller};
   
-  run(&callee);
+  {
+    const limits::guard guard(caller->sp);
+    run(&callee);
+  }
   
   // replace args with result
   caller->sp[-argc] = callee.sp[-1];
@@ -272,7 +663,7 @@ static void callc(frame* caller) {
 
 static void loadc(frame* caller, std::size_t index) {
   const closure* func = caller->fp[-1].func;
-  *(caller->sp++) = func->data[index];
+  *(caller->sp++) = func->data()[index];
 
   next(caller);  
 }
@@ -293,13 +684,17 @@ static void loadc(frame* caller) {
 
 static void makec(frame* caller, std::size_t argc, std::size_t cap) {
   const code* addr = fetch_addr(caller);
-  
-  word* data = new word[cap];
+
+  heap* managed = heap::current();
+  closure* result = managed ? managed->allocate(caller, addr, argc, cap)
+                            : closure::make(addr, argc, cap);
+
+  word* data = result->data();
   for(std::size_t i = 0; i < cap; ++i) {
     data[i] = *(--caller->sp);
   }
 
-  *caller->sp++ = new closure(addr, argc, data);
+  *caller->sp++ = result;
   next(caller);
 }
 